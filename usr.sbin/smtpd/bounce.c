@@ -386,7 +386,12 @@ bounce_next_message(struct bounce_session *s)
 	TAILQ_REMOVE(&pending, msg, entry);
 	SPLAY_REMOVE(bounce_message_tree, &messages, msg);
 
-	if ((fd = queue_message_fd_r(msg->msgid)) == -1) {
+	/* only a failure report asking for the full message needs the body */
+	if (msg->bounce.type == B_FAILED && msg->bounce.dsn_ret == DSN_RETFULL)
+		fd = queue_message_fd_r(msg->msgid);
+	else
+		fd = queue_message_fd_r_headers(msg->msgid);
+	if (fd == -1) {
 		bounce_delivery(msg, IMSG_QUEUE_DELIVERY_TEMPFAIL,
 		    "Could not open message fd");
 		goto again;
@@ -605,6 +610,7 @@ bounce_delivery(struct bounce_message *msg, int delivery, const char *status)
 {
 	struct bounce_envelope	*be;
 	struct envelope		 evp;
+	struct scheduler_info	 si;
 	size_t			 n;
 	const char		*f;
 
@@ -618,8 +624,9 @@ bounce_delivery(struct bounce_message *msg, int delivery, const char *status)
 			evp.lasttry = msg->timeout;
 			envelope_set_errormsg(&evp, "%s", status);
 			queue_envelope_update(&evp);
+			scheduler_info(&si, &evp);
 			m_create(p_scheduler, delivery, 0, 0, -1);
-			m_add_envelope(p_scheduler, &evp);
+			m_add_scheduler_info(p_scheduler, &si);
 			m_close(p_scheduler);
 		} else {
 			m_create(p_scheduler, delivery, 0, 0, -1);
@@ -29,42 +29,299 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "smtpd.h"
 
-#define	BUFFER_SIZE	16364
+/*
+ * Compressed files start with a small header naming the algorithm, so
+ * that the configured one can change without making older files
+ * unreadable.  Files written before the header existed are plain gzip
+ * streams and files that are not compressed at all are passed through,
+ * as gzread() used to do.
+ */
+#define	COMPRESS_MAGIC_SIZE	4
+#define	COMPRESS_HEADER_SIZE	(COMPRESS_MAGIC_SIZE + 1)
+#define	COMPRESS_STORED		0
+
+/* bodies whose samples do not shrink by a tenth are stored as is */
+#define	COMPRESS_SAMPLES	4
+#define	COMPRESS_SAMPLE_SIZE	16384
+#define	COMPRESS_SAMPLE_RATIO	90
+
+struct compress_stream {
+	struct compress_backend	*backend;
+	void			*ctx;
+	enum compress_mode	 mode;
+	uint8_t			 header[COMPRESS_HEADER_SIZE];
+	size_t			 nheader;
+	int			 started;
+};
+
+static int compress_stream_start(struct compress_stream *,
+    int (*)(void *, const void *, size_t), void *);
+static struct compress_algo *compress_algo_lookup(uint8_t);
+static int compress_is_gzip(const void *, size_t);
 
 extern struct compress_backend compress_gzip;
+#ifdef HAVE_ZSTD
+extern struct compress_backend compress_zstd;
+#endif
+#ifdef HAVE_LZ4
+extern struct compress_backend compress_lz4;
+#endif
+
+static const uint8_t	compress_magic[COMPRESS_MAGIC_SIZE] = { 0x00, 'C', 'M', 'P' };
+
+/* identifiers are stored in files and must never change */
+static struct compress_algo {
+	uint8_t			 id;
+	const char		*name;
+	struct compress_backend	*backend;
+} algos[] = {
+	{ 1,	"gzip",	&compress_gzip },
+#ifdef HAVE_ZSTD
+	{ 2,	"zstd",	&compress_zstd },
+#endif
+#ifdef HAVE_LZ4
+	{ 3,	"lz4",	&compress_lz4 },
+#endif
+	{ 0,	NULL,	NULL }
+};
+
+static struct compress_algo	*algo;
 
 struct compress_backend *
 compress_backend_lookup(const char *name)
 {
-	if (!strcmp(name, "gzip"))
-		return &compress_gzip;
+	struct compress_algo	*a;
+
+	for (a = algos; a->name; a++)
+		if (!strcmp(name, a->name))
+			return a->backend;
 
 	return NULL;
 }
 
+int
+compress_setup(const char *name, int level, const char *dictionary)
+{
+	for (algo = algos; algo->name; algo++)
+		if (!strcmp(name, algo->name))
+			break;
+	if (algo->name == NULL)
+		return 0;
+
+	env->sc_comp = algo->backend;
+	return (algo->backend->init(level, dictionary));
+}
+
+int
+compress_is_compressed(const void *buf, size_t len)
+{
+	if (compress_is_gzip(buf, len))
+		return 1;
+	return (len >= COMPRESS_HEADER_SIZE &&
+	    memcmp(buf, compress_magic, sizeof compress_magic) == 0);
+}
+
+/*
+ * Estimate whether a file is worth compressing by compressing a few
+ * samples spread over it.  Bodies made of already compressed data, such
+ * as large attachments, are then stored instead of being compressed for
+ * nothing.
+ */
+int
+compress_sample(int fd)
+{
+	struct stat	sb;
+	char		ibuf[COMPRESS_SAMPLE_SIZE];
+	char		obuf[COMPRESS_SAMPLE_SIZE * 2];	/* worst case bounds */
+	off_t		step;
+	size_t		i, in, out, n;
+	ssize_t		r;
+
+	if (fstat(fd, &sb) == -1)
+		return 1;
+	if (sb.st_size <= COMPRESS_SAMPLE_SIZE * COMPRESS_SAMPLES)
+		return 1;
+
+	step = sb.st_size / COMPRESS_SAMPLES;
+	for (i = 0, in = out = 0; i < COMPRESS_SAMPLES; i++) {
+		if ((r = pread(fd, ibuf, sizeof ibuf, i * step)) <= 0)
+			return 1;
+		n = env->sc_comp->compress_chunk(ibuf, r, obuf, sizeof obuf);
+		in += r;
+		out += n ? n : (size_t)r;
+	}
+
+	return (out * 100 < in * COMPRESS_SAMPLE_RATIO);
+}
+
 size_t
 compress_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
 {
-	return (env->sc_comp->compress_chunk(ib, ibsz, ob, obsz));
+	uint8_t	*p = ob;
+	size_t	 n;
+
+	if (obsz <= COMPRESS_HEADER_SIZE)
+		return 0;
+	memcpy(p, compress_magic, sizeof compress_magic);
+	p[sizeof compress_magic] = algo->id;
+
+	n = env->sc_comp->compress_chunk(ib, ibsz, p + COMPRESS_HEADER_SIZE,
+	    obsz - COMPRESS_HEADER_SIZE);
+	return (n ? n + COMPRESS_HEADER_SIZE : 0);
 }
 
 size_t
 uncompress_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
 {
-	return (env->sc_comp->uncompress_chunk(ib, ibsz, ob, obsz));
+	struct compress_algo	*a;
+	uint8_t			*p = ib;
+
+	if (compress_is_gzip(ib, ibsz))
+		return (compress_gzip.uncompress_chunk(ib, ibsz, ob, obsz));
+	if (!compress_is_compressed(ib, ibsz))
+		return 0;
+
+	p += COMPRESS_HEADER_SIZE;
+	ibsz -= COMPRESS_HEADER_SIZE;
+	if (p[-1] == COMPRESS_STORED) {
+		if (ibsz > obsz)
+			return 0;
+		memcpy(ob, p, ibsz);
+		return ibsz;
+	}
+	if ((a = compress_algo_lookup(p[-1])) == NULL)
+		return 0;
+	return (a->backend->uncompress_chunk(p, ibsz, ob, obsz));
+}
+
+void *
+compress_stream_new(enum compress_mode mode)
+{
+	struct compress_stream	*cs;
+
+	if ((cs = calloc(1, sizeof *cs)) == NULL)
+		return NULL;
+	cs->mode = mode;
+	if (mode == COMPRESS_DECODE)
+		return cs;
+
+	memcpy(cs->header, compress_magic, sizeof compress_magic);
+	cs->header[sizeof compress_magic] = COMPRESS_STORED;
+	cs->nheader = sizeof cs->header;
+	if (mode == COMPRESS_STORE)
+		return cs;
+
+	cs->header[sizeof compress_magic] = algo->id;
+	cs->backend = env->sc_comp;
+	if ((cs->ctx = cs->backend->stream_new(0)) == NULL) {
+		free(cs);
+		return NULL;
+	}
+	return cs;
 }
 
+/*
+ * Feed len bytes to the stream and pass the output to sink.  A NULL
+ * buffer finishes the stream.
+ */
 int
-compress_file(FILE *ifile, FILE *ofile)
+compress_stream_update(void *stream, const void *buf, size_t len,
+    int (*sink)(void *, const void *, size_t), void *arg)
 {
-	return (env->sc_comp->compress_file(ifile, ofile));
+	struct compress_stream	*cs = stream;
+	const uint8_t		*in = buf;
+	size_t			 n;
+
+	if (!cs->started) {
+		if (cs->mode == COMPRESS_DECODE && in) {
+			n = MIN(len, sizeof cs->header - cs->nheader);
+			memcpy(cs->header + cs->nheader, in, n);
+			cs->nheader += n;
+			in += n;
+			len -= n;
+			if (cs->nheader < sizeof cs->header)
+				return 1;
+		}
+		if (!compress_stream_start(cs, sink, arg))
+			return 0;
+	}
+
+	if (cs->ctx == NULL) {
+		if (in == NULL || len == 0)
+			return 1;
+		return sink(arg, in, len);
+	}
+	if (in && len == 0)
+		return 1;
+	return (cs->backend->stream_update(cs->ctx, in, len, sink, arg));
 }
 
-int
-uncompress_file(FILE *ifile, FILE *ofile)
+void
+compress_stream_free(void *stream)
+{
+	struct compress_stream	*cs = stream;
+
+	if (cs->ctx)
+		cs->backend->stream_free(cs->ctx);
+	free(cs);
+}
+
+static int
+compress_stream_start(struct compress_stream *cs,
+    int (*sink)(void *, const void *, size_t), void *arg)
 {
-	return (env->sc_comp->uncompress_file(ifile, ofile));
+	struct compress_algo	*a;
+	uint8_t			 id;
+
+	cs->started = 1;
+
+	if (cs->mode != COMPRESS_DECODE)
+		return (sink(arg, cs->header, cs->nheader));
+
+	/* headerless gzip stream, the header bytes are part of it */
+	if (compress_is_gzip(cs->header, cs->nheader)) {
+		cs->backend = &compress_gzip;
+		if ((cs->ctx = cs->backend->stream_new(1)) == NULL)
+			return 0;
+		return (cs->backend->stream_update(cs->ctx, cs->header,
+		    cs->nheader, sink, arg));
+	}
+
+	/* not compressed at all */
+	if (!compress_is_compressed(cs->header, cs->nheader))
+		return (cs->nheader == 0 ||
+		    sink(arg, cs->header, cs->nheader));
+
+	id = cs->header[sizeof compress_magic];
+	if (id == COMPRESS_STORED)
+		return 1;
+	if ((a = compress_algo_lookup(id)) == NULL)
+		return 0;
+	cs->backend = a->backend;
+	if ((cs->ctx = cs->backend->stream_new(1)) == NULL)
+		return 0;
+	return 1;
+}
+
+static struct compress_algo *
+compress_algo_lookup(uint8_t id)
+{
+	struct compress_algo	*a;
+
+	for (a = algos; a->name; a++)
+		if (a->id == id)
+			return a;
+	return NULL;
+}
+
+static int
+compress_is_gzip(const void *buf, size_t len)
+{
+	const uint8_t	*p = buf;
+
+	return (len >= 2 && p[0] == 0x1f && p[1] == 0x8b);
 }
@@ -34,24 +34,57 @@
 #include <zlib.h>
 
 #include "smtpd.h"
+#include "log.h"
 
 #define	GZIP_BUFFER_SIZE	16384
 
 
 static size_t	compress_gzip_chunk(void *, size_t, void *, size_t);
 static size_t	uncompress_gzip_chunk(void *, size_t, void *, size_t);
-static int	compress_gzip_file(FILE *, FILE *);
-static int	uncompress_gzip_file(FILE *, FILE *);
+static int	gzip_init(int, const char *);
+static void    *gzip_stream_new(int);
+static int	gzip_stream_update(void *, const void *, size_t,
+		    int (*)(void *, const void *, size_t), void *);
+static void	gzip_stream_free(void *);
+
+struct gzip_stream {
+	z_stream	strm;
+	int		inflate;
+	int		done;
+};
 
 
 struct compress_backend	compress_gzip = {
+	gzip_init,
+
 	compress_gzip_chunk,
 	uncompress_gzip_chunk,
 
-	compress_gzip_file,
-	uncompress_gzip_file,
+	gzip_stream_new,
+	gzip_stream_update,
+	gzip_stream_free,
 };
 
+static int	gzip_level = Z_DEFAULT_COMPRESSION;
+
+static int
+gzip_init(int level, const char *dictionary)
+{
+	if (dictionary) {
+		log_warnx("warn: gzip: compression dictionaries not supported");
+		return 0;
+	}
+	if (level) {
+		if (level < 1 || level > 9) {
+			log_warnx("warn: gzip: invalid compression level %d",
+			    level);
+			return 0;
+		}
+		gzip_level = level;
+	}
+	return 1;
+}
+
 static size_t
 compress_gzip_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
 {
@@ -64,7 +97,7 @@ compress_gzip_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
 	strm->zalloc = Z_NULL;
 	strm->zfree = Z_NULL;
 	strm->opaque = Z_NULL;
-	if (deflateInit2(strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+	if (deflateInit2(strm, gzip_level, Z_DEFLATED,
 		(15+16), 8, Z_DEFAULT_STRATEGY) != Z_OK)
 		goto end;
 
@@ -119,61 +152,87 @@ end:
 }
 
 
-static int
-compress_gzip_file(FILE *in, FILE *out)
+/*
+ * The streams produce and consume the same gzip format as gzwrite(), so
+ * messages queued before they existed remain readable.
+ */
+static void *
+gzip_stream_new(int uncompress)
 {
-	gzFile  gzf;
-	char  ibuf[GZIP_BUFFER_SIZE];
-	int  r;
-	int  ret = 0;
-
-	if (in == NULL || out == NULL)
-		return (0);
-
-	gzf = gzdopen(fileno(out), "wb");
-	if (gzf == NULL)
-		return (0);
-
-	while ((r = fread(ibuf, 1, GZIP_BUFFER_SIZE, in)) != 0) {
-		if (gzwrite(gzf, ibuf, r) != r)
-			goto end;
+	struct gzip_stream	*gs;
+	int			 r;
+
+	if ((gs = calloc(1, sizeof *gs)) == NULL)
+		return (NULL);
+
+	gs->inflate = uncompress;
+	if (uncompress)
+		r = inflateInit2(&gs->strm, (15+16));
+	else
+		r = deflateInit2(&gs->strm, gzip_level, Z_DEFLATED,
+		    (15+16), 8, Z_DEFAULT_STRATEGY);
+	if (r != Z_OK) {
+		free(gs);
+		return (NULL);
 	}
-	if (!feof(in))
-		goto end;
-
-	ret = 1;
-
-end:
-	gzclose(gzf);
-	return (ret);
+	return (gs);
 }
 
-
+/*
+ * Feed len bytes to the stream and pass the output to sink.  A NULL
+ * buffer finishes the stream; decompression fails if it was truncated.
+ */
 static int
-uncompress_gzip_file(FILE *in, FILE *out)
+gzip_stream_update(void *arg, const void *buf, size_t len,
+    int (*sink)(void *, const void *, size_t), void *sinkarg)
 {
-	gzFile  gzf;
-	char  obuf[GZIP_BUFFER_SIZE];
-	int  r;
-	int  ret = 0;
-
-	if (in == NULL || out == NULL)
-		return (0);
-
-	gzf = gzdopen(fileno(in), "r");
-	if (gzf == NULL)
-		return (0);
-
-	while ((r = gzread(gzf, obuf, sizeof(obuf))) > 0) {
-		if  (fwrite(obuf, r, 1, out) != 1)
-			goto end;
-	}
-	if (!gzeof(gzf))
-		goto end;
+	struct gzip_stream	*gs = arg;
+	unsigned char		 obuf[GZIP_BUFFER_SIZE];
+	int			 flush, r;
+
+	if (buf == NULL) {
+		if (gs->inflate)
+			return (gs->done);
+		flush = Z_FINISH;
+	} else
+		flush = Z_NO_FLUSH;
+
+	gs->strm.next_in = (unsigned char *)buf;
+	gs->strm.avail_in = len;
+	do {
+		gs->strm.next_out = obuf;
+		gs->strm.avail_out = sizeof obuf;
+		if (gs->inflate) {
+			if (gs->done)
+				/* trailing garbage */
+				return (gs->strm.avail_in == 0);
+			r = inflate(&gs->strm, Z_NO_FLUSH);
+			if (r == Z_STREAM_END)
+				gs->done = 1;
+			else if (r != Z_OK && r != Z_BUF_ERROR)
+				return (0);
+		} else {
+			r = deflate(&gs->strm, flush);
+			if (r == Z_STREAM_ERROR)
+				return (0);
+		}
+		if (sizeof obuf - gs->strm.avail_out &&
+		    !sink(sinkarg, obuf, sizeof obuf - gs->strm.avail_out))
+			return (0);
+	} while (gs->strm.avail_out == 0 || gs->strm.avail_in ||
+	    (flush == Z_FINISH && r != Z_STREAM_END));
+
+	return (1);
+}
 
-	ret = 1;
+static void
+gzip_stream_free(void *arg)
+{
+	struct gzip_stream	*gs = arg;
 
-end:
-	gzclose(gzf);
-	return (ret);
+	if (gs->inflate)
+		inflateEnd(&gs->strm);
+	else
+		deflateEnd(&gs->strm);
+	free(gs);
 }
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2026 The OpenSMTPD Project
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <imsg.h>
+#include <lz4frame.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+#define	LZ4_BUFFER_SIZE		16384
+
+static int	lz4_init(int, const char *);
+static size_t	compress_lz4_chunk(void *, size_t, void *, size_t);
+static size_t	uncompress_lz4_chunk(void *, size_t, void *, size_t);
+static void    *lz4_stream_new(int);
+static int	lz4_stream_update(void *, const void *, size_t,
+		    int (*)(void *, const void *, size_t), void *);
+static void	lz4_stream_free(void *);
+static void	lz4_preferences(LZ4F_preferences_t *);
+
+struct lz4_stream {
+	LZ4F_cctx	*cctx;
+	LZ4F_dctx	*dctx;
+	char		*obuf;
+	size_t		 obufsz;
+	int		 started;
+	int		 done;
+};
+
+struct compress_backend	compress_lz4 = {
+	lz4_init,
+
+	compress_lz4_chunk,
+	uncompress_lz4_chunk,
+
+	lz4_stream_new,
+	lz4_stream_update,
+	lz4_stream_free,
+};
+
+static int	lz4_level;
+
+static int
+lz4_init(int level, const char *dictionary)
+{
+	if (dictionary) {
+		log_warnx("warn: lz4: compression dictionaries not supported");
+		return 0;
+	}
+	if (level < 0 || level > LZ4F_compressionLevel_max()) {
+		log_warnx("warn: lz4: invalid compression level %d", level);
+		return 0;
+	}
+	lz4_level = level;
+	return 1;
+}
+
+static size_t
+compress_lz4_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
+{
+	LZ4F_preferences_t	prefs;
+	size_t			r;
+
+	lz4_preferences(&prefs);
+	if (obsz < LZ4F_compressFrameBound(ibsz, &prefs))
+		return 0;
+	r = LZ4F_compressFrame(ob, obsz, ib, ibsz, &prefs);
+
+	return (LZ4F_isError(r) ? 0 : r);
+}
+
+static size_t
+uncompress_lz4_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
+{
+	LZ4F_dctx	*dctx;
+	size_t		 isz, osz, r;
+
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+		return 0;
+	isz = ibsz;
+	osz = obsz;
+	r = LZ4F_decompress(dctx, ob, &osz, ib, &isz, NULL);
+	LZ4F_freeDecompressionContext(dctx);
+
+	/* the whole frame must have been decoded */
+	if (LZ4F_isError(r) || r != 0 || isz != ibsz)
+		return 0;
+	return osz;
+}
+
+static void *
+lz4_stream_new(int uncompress)
+{
+	struct lz4_stream	*ls;
+	LZ4F_preferences_t	 prefs;
+	size_t			 r;
+
+	if ((ls = calloc(1, sizeof *ls)) == NULL)
+		return NULL;
+
+	if (uncompress) {
+		r = LZ4F_createDecompressionContext(&ls->dctx, LZ4F_VERSION);
+		ls->obufsz = LZ4_BUFFER_SIZE;
+	} else {
+		r = LZ4F_createCompressionContext(&ls->cctx, LZ4F_VERSION);
+		lz4_preferences(&prefs);
+		ls->obufsz = LZ4F_compressBound(LZ4_BUFFER_SIZE, &prefs);
+		if (ls->obufsz < LZ4F_HEADER_SIZE_MAX)
+			ls->obufsz = LZ4F_HEADER_SIZE_MAX;
+	}
+	if (LZ4F_isError(r) || (ls->obuf = malloc(ls->obufsz)) == NULL) {
+		lz4_stream_free(ls);
+		return NULL;
+	}
+	return ls;
+}
+
+static int
+lz4_stream_update(void *arg, const void *buf, size_t len,
+    int (*sink)(void *, const void *, size_t), void *sinkarg)
+{
+	struct lz4_stream	*ls = arg;
+	LZ4F_preferences_t	 prefs;
+	const char		*in = buf;
+	size_t			 isz, osz, r;
+
+	if (ls->dctx) {
+		if (in == NULL)
+			return ls->done;
+		for (;;) {
+			if (ls->done)
+				/* trailing garbage */
+				return (len == 0);
+			isz = len;
+			osz = ls->obufsz;
+			r = LZ4F_decompress(ls->dctx, ls->obuf, &osz, in, &isz,
+			    NULL);
+			if (LZ4F_isError(r))
+				return 0;
+			if (r == 0)
+				ls->done = 1;
+			if (osz && !sink(sinkarg, ls->obuf, osz))
+				return 0;
+			in += isz;
+			len -= isz;
+			if (len == 0 && osz < ls->obufsz)
+				break;
+		}
+		return 1;
+	}
+
+	if (!ls->started) {
+		lz4_preferences(&prefs);
+		r = LZ4F_compressBegin(ls->cctx, ls->obuf, ls->obufsz, &prefs);
+		if (LZ4F_isError(r) || !sink(sinkarg, ls->obuf, r))
+			return 0;
+		ls->started = 1;
+	}
+
+	if (in == NULL) {
+		r = LZ4F_compressEnd(ls->cctx, ls->obuf, ls->obufsz, NULL);
+		if (LZ4F_isError(r))
+			return 0;
+		return (r == 0 || sink(sinkarg, ls->obuf, r));
+	}
+
+	while (len) {
+		isz = MIN(len, LZ4_BUFFER_SIZE);
+		r = LZ4F_compressUpdate(ls->cctx, ls->obuf, ls->obufsz, in, isz,
+		    NULL);
+		if (LZ4F_isError(r))
+			return 0;
+		if (r && !sink(sinkarg, ls->obuf, r))
+			return 0;
+		in += isz;
+		len -= isz;
+	}
+	return 1;
+}
+
+static void
+lz4_stream_free(void *arg)
+{
+	struct lz4_stream	*ls = arg;
+
+	if (ls->cctx)
+		LZ4F_freeCompressionContext(ls->cctx);
+	if (ls->dctx)
+		LZ4F_freeDecompressionContext(ls->dctx);
+	free(ls->obuf);
+	free(ls);
+}
+
+static void
+lz4_preferences(LZ4F_preferences_t *prefs)
+{
+	memset(prefs, 0, sizeof *prefs);
+	prefs->compressionLevel = lz4_level;
+	prefs->frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+}
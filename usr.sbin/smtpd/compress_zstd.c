@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2026 The OpenSMTPD Project
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <imsg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <zstd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+#define	ZSTD_BUFFER_SIZE	16384
+#define	ZSTD_DICTIONARY_MAX	(1024 * 1024)
+
+static int	zstd_init(int, const char *);
+static size_t	compress_zstd_chunk(void *, size_t, void *, size_t);
+static size_t	uncompress_zstd_chunk(void *, size_t, void *, size_t);
+static void    *zstd_stream_new(int);
+static int	zstd_stream_update(void *, const void *, size_t,
+		    int (*)(void *, const void *, size_t), void *);
+static void	zstd_stream_free(void *);
+static ZSTD_CCtx *zstd_cctx(void);
+static ZSTD_DCtx *zstd_dctx(void);
+
+struct zstd_stream {
+	ZSTD_CCtx	*cctx;
+	ZSTD_DCtx	*dctx;
+	int		 done;
+};
+
+struct compress_backend	compress_zstd = {
+	zstd_init,
+
+	compress_zstd_chunk,
+	uncompress_zstd_chunk,
+
+	zstd_stream_new,
+	zstd_stream_update,
+	zstd_stream_free,
+};
+
+static int		 zstd_level = ZSTD_CLEVEL_DEFAULT;
+
+/* shared read-only by all contexts, including those of worker threads */
+static ZSTD_CDict	*cdict;
+static ZSTD_DDict	*ddict;
+
+/*
+ * Messages mostly differ by their bodies, a dictionary trained on
+ * message headers lets small messages compress much better.  It must
+ * be kept for as long as messages compressed with it are queued.
+ */
+static int
+zstd_init(int level, const char *dictionary)
+{
+	struct stat	 sb;
+	FILE		*fp;
+	void		*buf;
+
+	if (level) {
+		if (level < 1 || level > ZSTD_maxCLevel()) {
+			log_warnx("warn: zstd: invalid compression level %d",
+			    level);
+			return 0;
+		}
+		zstd_level = level;
+	}
+
+	if (dictionary == NULL)
+		return 1;
+
+	if ((fp = fopen(dictionary, "r")) == NULL) {
+		log_warn("warn: zstd: %s", dictionary);
+		return 0;
+	}
+	if (fstat(fileno(fp), &sb) == -1 || sb.st_size == 0 ||
+	    sb.st_size > ZSTD_DICTIONARY_MAX) {
+		log_warnx("warn: zstd: %s: invalid dictionary", dictionary);
+		fclose(fp);
+		return 0;
+	}
+	buf = xmalloc(sb.st_size);
+	if (fread(buf, 1, sb.st_size, fp) != (size_t)sb.st_size) {
+		log_warnx("warn: zstd: %s: short read", dictionary);
+		free(buf);
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+
+	cdict = ZSTD_createCDict(buf, sb.st_size, zstd_level);
+	ddict = ZSTD_createDDict(buf, sb.st_size);
+	free(buf);
+	if (cdict == NULL || ddict == NULL) {
+		log_warnx("warn: zstd: %s: invalid dictionary", dictionary);
+		return 0;
+	}
+	log_debug("debug: zstd: using dictionary %s (id %u)", dictionary,
+	    ZSTD_getDictID_fromDDict(ddict));
+	return 1;
+}
+
+static size_t
+compress_zstd_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
+{
+	ZSTD_CCtx	*cctx;
+	size_t		 r;
+
+	if ((cctx = zstd_cctx()) == NULL)
+		return 0;
+	r = ZSTD_compress2(cctx, ob, obsz, ib, ibsz);
+	ZSTD_freeCCtx(cctx);
+
+	return (ZSTD_isError(r) ? 0 : r);
+}
+
+static size_t
+uncompress_zstd_chunk(void *ib, size_t ibsz, void *ob, size_t obsz)
+{
+	ZSTD_DCtx	*dctx;
+	size_t		 r;
+
+	if ((dctx = zstd_dctx()) == NULL)
+		return 0;
+	r = ZSTD_decompressDCtx(dctx, ob, obsz, ib, ibsz);
+	ZSTD_freeDCtx(dctx);
+
+	return (ZSTD_isError(r) ? 0 : r);
+}
+
+static void *
+zstd_stream_new(int uncompress)
+{
+	struct zstd_stream	*zs;
+
+	if ((zs = calloc(1, sizeof *zs)) == NULL)
+		return NULL;
+	if (uncompress)
+		zs->dctx = zstd_dctx();
+	else
+		zs->cctx = zstd_cctx();
+	if (zs->dctx == NULL && zs->cctx == NULL) {
+		free(zs);
+		return NULL;
+	}
+	return zs;
+}
+
+static int
+zstd_stream_update(void *arg, const void *buf, size_t len,
+    int (*sink)(void *, const void *, size_t), void *sinkarg)
+{
+	struct zstd_stream	*zs = arg;
+	char			 obuf[ZSTD_BUFFER_SIZE];
+	ZSTD_inBuffer		 in = { buf, len, 0 };
+	ZSTD_outBuffer		 out;
+	ZSTD_EndDirective	 end;
+	size_t			 r;
+
+	if (zs->dctx && buf == NULL)
+		return zs->done;
+
+	end = buf ? ZSTD_e_continue : ZSTD_e_end;
+	do {
+		out.dst = obuf;
+		out.size = sizeof obuf;
+		out.pos = 0;
+		if (zs->cctx)
+			r = ZSTD_compressStream2(zs->cctx, &out, &in, end);
+		else {
+			if (zs->done)
+				/* trailing garbage */
+				return (in.pos == in.size);
+			r = ZSTD_decompressStream(zs->dctx, &out, &in);
+			if (r == 0)
+				zs->done = 1;
+		}
+		if (ZSTD_isError(r))
+			return 0;
+		if (out.pos && !sink(sinkarg, obuf, out.pos))
+			return 0;
+	} while (in.pos < in.size || out.pos == out.size ||
+	    (end == ZSTD_e_end && r != 0));
+
+	return 1;
+}
+
+static void
+zstd_stream_free(void *arg)
+{
+	struct zstd_stream	*zs = arg;
+
+	ZSTD_freeCCtx(zs->cctx);
+	ZSTD_freeDCtx(zs->dctx);
+	free(zs);
+}
+
+static ZSTD_CCtx *
+zstd_cctx(void)
+{
+	ZSTD_CCtx	*cctx;
+
+	if ((cctx = ZSTD_createCCtx()) == NULL)
+		return NULL;
+	if (cdict)
+		ZSTD_CCtx_refCDict(cctx, cdict);
+	else
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+		    zstd_level);
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+	return cctx;
+}
+
+static ZSTD_DCtx *
+zstd_dctx(void)
+{
+	ZSTD_DCtx	*dctx;
+
+	if ((dctx = ZSTD_createDCtx()) == NULL)
+		return NULL;
+	if (ddict)
+		ZSTD_DCtx_refDDict(dctx, ddict);
+	return dctx;
+}
@@ -56,6 +56,9 @@ config_default(void)
 	conf->sc_subaddressing_delim = SUBADDRESSING_DELIMITER;
 	conf->sc_ttl = SMTPD_QUEUE_EXPIRY;
 	conf->sc_srs_ttl = SMTPD_QUEUE_EXPIRY / 86400;
+	conf->sc_queue_compress = "gzip";
+	conf->sc_queue_memory = DEFAULT_QUEUE_MEMORY;
+	conf->sc_queue_levels = 1;
 
 	conf->sc_mta_max_deferred = 100;
 	conf->sc_scheduler_max_inflight = 5000;
@@ -87,6 +90,7 @@ config_default(void)
 	conf->sc_filter_processes_dict = calloc(1, sizeof(*conf->sc_filter_processes_dict));
 	conf->sc_dispatcher_bounce = calloc(1, sizeof(*conf->sc_dispatcher_bounce));
 	conf->sc_filters_dict = calloc(1, sizeof(*conf->sc_filters_dict));
+	conf->sc_scheduler_classes = calloc(1, sizeof(*conf->sc_scheduler_classes));
 	limits = calloc(1, sizeof(*limits));
 
 	if (conf->sc_tables_dict == NULL	||
@@ -101,6 +105,7 @@ config_default(void)
 	    conf->sc_filter_processes_dict == NULL	||
 	    conf->sc_dispatcher_bounce == NULL	||
 	    conf->sc_filters_dict == NULL	||
+	    conf->sc_scheduler_classes == NULL	||
 	    limits == NULL)
 		goto error;
 
@@ -112,6 +117,7 @@ config_default(void)
 	dict_init(conf->sc_tables_dict);
 	dict_init(conf->sc_limits_dict);
 	dict_init(conf->sc_filter_processes_dict);
+	dict_init(conf->sc_scheduler_classes);
 
 	limit_mta_set_defaults(limits);
 
@@ -153,6 +159,7 @@ error:
 	free(conf->sc_filter_processes_dict);
 	free(conf->sc_dispatcher_bounce);
 	free(conf->sc_filters_dict);
+	free(conf->sc_scheduler_classes);
 	free(limits);
 	free(conf);
 	return NULL;
@@ -73,6 +73,7 @@ static uint64_t			connid = 0;
 static struct tree		ctl_conns;
 static struct tree		ctl_count;
 static struct stat_digest	digest;
+static struct queue_load_status	qload;
 
 #define	CONTROL_FD_RESERVE		5
 #define	CONTROL_MAXCONN_PER_CLIENT	32
@@ -120,6 +121,12 @@ control_imsg(struct mproc *p, struct imsg *imsg)
 		    NULL, 0);
 		return;
 
+	case IMSG_QUEUE_LOAD_STATUS:
+		if (imsg->hdr.len - IMSG_HEADER_SIZE != sizeof(qload))
+			fatalx("control: IMSG_QUEUE_LOAD_STATUS size mismatch");
+		memmove(&qload, imsg->data, sizeof(qload));
+		return;
+
 	case IMSG_STAT_INCREMENT:
 		m_msg(&m, imsg);
 		m_get_string(&m, &key);
@@ -689,8 +696,10 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		if (c->euid)
 			goto badcred;
 
-		m_compose(p, IMSG_CTL_SHOW_STATUS, 0, 0, -1, &env->sc_flags,
-		    sizeof(env->sc_flags));
+		m_create(p, IMSG_CTL_SHOW_STATUS, 0, 0, -1);
+		m_add(p, &env->sc_flags, sizeof(env->sc_flags));
+		m_add(p, &qload, sizeof(qload));
+		m_close(p);
 		return;
 
 	case IMSG_CTL_MTA_BLOCK:
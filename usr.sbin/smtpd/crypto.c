@@ -19,9 +19,10 @@
 #include "includes.h"
 
 #include <sys/types.h>
-#include <sys/stat.h>
 
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define	CRYPTO_BUFFER_SIZE	16384
@@ -33,12 +34,70 @@
 /* bump if we ever switch from aes-256-gcm to anything else */
 #define	API_VERSION    		1
 
+/*
+ * Files are written in fixed-size chunks, each sealed on its own, so
+ * that a reader can trust every chunk as soon as it has been read and
+ * can start anywhere in the file.  The header is:
+ *
+ *	version (1) | chunk size shift (1) | salt (32) | nonce prefix (7)
+ *
+ * and is authenticated with every chunk.  Chunks are sealed under a key
+ * of their own to the file, derived from the queue key and the random
+ * salt with HKDF-SHA256, so that nonces only need to be unique within a
+ * file.  The nonce of a chunk is the prefix, its index as a 32-bit
+ * big-endian number and a byte set on the last chunk only, so chunks
+ * can neither be reordered nor dropped.  Chunks are followed by their
+ * tag, the last one may be short or empty.
+ */
+#define	CHUNK_VERSION		2
+#define	CHUNK_SHIFT		16
+#define	CHUNK_SHIFT_MIN		10
+#define	CHUNK_SHIFT_MAX		24
+#define	CHUNK_SALT_SIZE		32
+#define	CHUNK_PREFIX_SIZE	7
+#define	CHUNK_HEADER_SIZE	(2 + CHUNK_SALT_SIZE + CHUNK_PREFIX_SIZE)
+#define	CHUNK_KEY_INFO		"smtpd queue file"
+
 
 int	crypto_setup(const char *, size_t);
 int	crypto_encrypt_file(FILE *, FILE *);
 int	crypto_decrypt_file(FILE *, FILE *);
 size_t	crypto_encrypt_buffer(const char *, size_t, char *, size_t);
 size_t	crypto_decrypt_buffer(const char *, size_t, char *, size_t);
+void   *crypto_stream_new(int);
+int	crypto_stream_update(void *, const void *, size_t,
+	    int (*)(void *, const void *, size_t), void *);
+int	crypto_stream_authenticated(void *);
+void	crypto_stream_free(void *);
+
+struct crypto_stream {
+	EVP_CIPHER_CTX	*ctx;
+	int		 decrypt;
+	int		 started;
+	uint8_t		 header[CHUNK_HEADER_SIZE];	/* or 1 + IV_SIZE */
+	size_t		 nheader;
+
+	/* whole file format */
+	uint8_t		 tag[GCM_TAG_SIZE];
+	size_t		 ntag;
+
+	/* chunked format */
+	uint8_t		 key[KEY_SIZE];
+	uint8_t		*chunk;
+	size_t		 nchunk;
+	size_t		 chunksize;
+	uint8_t		*obuf;
+	uint32_t	 index;
+};
+
+static int	crypto_file(FILE *, FILE *, int);
+static int	crypto_file_sink(void *, const void *, size_t);
+static int	crypto_stream_start(struct crypto_stream *);
+static int	crypto_stream_key(struct crypto_stream *);
+static int	crypto_stream_chunk(struct crypto_stream *, int,
+		    int (*)(void *, const void *, size_t), void *);
+static int	crypto_stream_cipher(struct crypto_stream *, const uint8_t *,
+		    size_t, int (*)(void *, const void *, size_t), void *);
 
 static struct crypto_ctx {
 	unsigned char  		key[KEY_SIZE];
@@ -61,155 +120,48 @@ crypto_setup(const char *key, size_t len)
 int
 crypto_encrypt_file(FILE * in, FILE * out)
 {
-	EVP_CIPHER_CTX	*ctx;
-	uint8_t		ibuf[CRYPTO_BUFFER_SIZE];
-	uint8_t		obuf[CRYPTO_BUFFER_SIZE];
-	uint8_t		iv[IV_SIZE];
-	uint8_t		tag[GCM_TAG_SIZE];
-	uint8_t		version = API_VERSION;
-	size_t		r;
-	int		len;
-	int		ret = 0;
-	struct stat	sb;
-
-	/* XXX - Do NOT encrypt files bigger than 64GB */
-	if (fstat(fileno(in), &sb) == -1)
-		return 0;
-	if (sb.st_size >= 0x1000000000LL)
-		return 0;
-
-	/* prepend version byte*/
-	if (fwrite(&version, 1, sizeof version, out) != sizeof version)
-		return 0;
-
-	/* generate and prepend IV */
-	memset(iv, 0, sizeof iv);
-	arc4random_buf(iv, sizeof iv);
-	if (fwrite(iv, 1, sizeof iv, out) != sizeof iv)
-		return 0;
-
-	ctx = EVP_CIPHER_CTX_new();
-	if (ctx == NULL)
-		return 0;
-
-	EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, cp.key, iv);
-
-	/* encrypt until end of file */
-	while ((r = fread(ibuf, 1, CRYPTO_BUFFER_SIZE, in)) != 0) {
-		if (!EVP_EncryptUpdate(ctx, obuf, &len, ibuf, r))
-			goto end;
-		if (len && fwrite(obuf, len, 1, out) != 1)
-			goto end;
-	}
-	if (!feof(in))
-		goto end;
-
-	/* finalize and write last chunk if any */
-	if (!EVP_EncryptFinal_ex(ctx, obuf, &len))
-		goto end;
-	if (len && fwrite(obuf, len, 1, out) != 1)
-		goto end;
-
-	/* get and append tag */
-	EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, sizeof tag, tag);
-	if (fwrite(tag, sizeof tag, 1, out) != 1)
-		goto end;
-
-	fflush(out);
-	ret = 1;
-
-end:
-	EVP_CIPHER_CTX_free(ctx);
-	return ret;
+	return crypto_file(in, out, 0);
 }
 
 int
 crypto_decrypt_file(FILE * in, FILE * out)
 {
-	EVP_CIPHER_CTX	*ctx;
-	uint8_t		ibuf[CRYPTO_BUFFER_SIZE];
-	uint8_t		obuf[CRYPTO_BUFFER_SIZE];
-	uint8_t		iv[IV_SIZE];
-	uint8_t		tag[GCM_TAG_SIZE];
-	uint8_t		version;
-	size_t		r;
-	off_t		sz;
-	int		len;
-	int		ret = 0;
-	struct stat	sb;
-
-	/* input file too small to be an encrypted file */
-	if (fstat(fileno(in), &sb) == -1)
-		return 0;
-	if (sb.st_size <= (off_t) (sizeof version + sizeof tag + sizeof iv))
-		return 0;
-	sz = sb.st_size;
-
-	/* extract tag */
-	if (fseek(in, -sizeof(tag), SEEK_END) == -1)
-		return 0;
-	if ((r = fread(tag, 1, sizeof tag, in)) != sizeof tag)
-		return 0;
-
-	if (fseek(in, 0, SEEK_SET) == -1)
-		return 0;
-
-	/* extract version */
-	if ((r = fread(&version, 1, sizeof version, in)) != sizeof version)
-		return 0;
-	if (version != API_VERSION)
-		return 0;
-
-	/* extract IV */
-	memset(iv, 0, sizeof iv);
-	if ((r = fread(iv, 1, sizeof iv, in)) != sizeof iv)
-		return 0;
+	return crypto_file(in, out, 1);
+}
 
-	/* real ciphertext length */
-	sz -= sizeof version;
-	sz -= sizeof iv;
-	sz -= sizeof tag;
+static int
+crypto_file(FILE *in, FILE *out, int decrypt)
+{
+	void	*cs;
+	uint8_t	 buf[CRYPTO_BUFFER_SIZE];
+	size_t	 r;
+	int	 ret = 0;
 
-	ctx = EVP_CIPHER_CTX_new();
-	if (ctx == NULL)
+	if ((cs = crypto_stream_new(decrypt)) == NULL)
 		return 0;
 
-	EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, cp.key, iv);
-
-	/* set expected tag */
-	EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, sizeof tag, tag);
-
-	/* decrypt until end of ciphertext */
-	while (sz) {
-		if (sz > CRYPTO_BUFFER_SIZE)
-			r = fread(ibuf, 1, CRYPTO_BUFFER_SIZE, in);
-		else
-			r = fread(ibuf, 1, sz, in);
-		if (!r)
-			break;
-		if (!EVP_DecryptUpdate(ctx, obuf, &len, ibuf, r))
-			goto end;
-		if (len && fwrite(obuf, len, 1, out) != 1)
+	while ((r = fread(buf, 1, sizeof buf, in)) != 0)
+		if (!crypto_stream_update(cs, buf, r, crypto_file_sink, out))
 			goto end;
-		sz -= r;
-	}
 	if (ferror(in))
 		goto end;
-
-	/* finalize, write last chunk if any and perform authentication check */
-	if (!EVP_DecryptFinal_ex(ctx, obuf, &len))
-		goto end;
-	if (len && fwrite(obuf, len, 1, out) != 1)
+	if (!crypto_stream_update(cs, NULL, 0, crypto_file_sink, out))
 		goto end;
 
 	fflush(out);
 	ret = 1;
 
 end:
-	EVP_CIPHER_CTX_free(ctx);
+	crypto_stream_free(cs);
 	return ret;
 }
 
+static int
+crypto_file_sink(void *arg, const void *buf, size_t len)
+{
+	return (fwrite(buf, 1, len, arg) == len);
+}
+
 size_t
 crypto_encrypt_buffer(const char *in, size_t inlen, char *out, size_t outlen)
 {
@@ -321,6 +273,306 @@ end:
 	return ret;
 }
 
+/*
+ * Streams always write the chunked format, and read it as well as the
+ * whole file format of older queues, whose tag is only checked once the
+ * stream is finished.
+ */
+void *
+crypto_stream_new(int decrypt)
+{
+	struct crypto_stream	*cs;
+
+	if ((cs = calloc(1, sizeof *cs)) == NULL)
+		return NULL;
+	if ((cs->ctx = EVP_CIPHER_CTX_new()) == NULL) {
+		free(cs);
+		return NULL;
+	}
+	cs->decrypt = decrypt;
+
+	if (!decrypt) {
+		cs->header[0] = CHUNK_VERSION;
+		cs->header[1] = CHUNK_SHIFT;
+		arc4random_buf(cs->header + 2,
+		    CHUNK_SALT_SIZE + CHUNK_PREFIX_SIZE);
+		cs->nheader = CHUNK_HEADER_SIZE;
+		if (!crypto_stream_start(cs)) {
+			crypto_stream_free(cs);
+			return NULL;
+		}
+	}
+
+	return cs;
+}
+
+/*
+ * Feed len bytes to the stream and pass the output to sink.  A NULL
+ * buffer finishes the stream, sealing or checking the last chunk.
+ */
+int
+crypto_stream_update(void *arg, const void *buf, size_t len,
+    int (*sink)(void *, const void *, size_t), void *sinkarg)
+{
+	struct crypto_stream	*cs = arg;
+	const uint8_t		*in = buf;
+	uint8_t			 obuf[CRYPTO_BUFFER_SIZE];
+	size_t			 n, hlen, csize;
+	int			 olen;
+
+	if (!cs->decrypt) {
+		if (!cs->started) {
+			if (!sink(sinkarg, cs->header, cs->nheader))
+				return 0;
+			cs->started = 1;
+		}
+		if (in == NULL)
+			return crypto_stream_chunk(cs, 1, sink, sinkarg);
+		while (len) {
+			if (cs->nchunk == cs->chunksize &&
+			    !crypto_stream_chunk(cs, 0, sink, sinkarg))
+				return 0;
+			n = MIN(len, cs->chunksize - cs->nchunk);
+			memcpy(cs->chunk + cs->nchunk, in, n);
+			cs->nchunk += n;
+			in += n;
+			len -= n;
+		}
+		return 1;
+	}
+
+	/* version, then IV or chunk size and nonce prefix */
+	while (!cs->started && in && len) {
+		if (cs->nheader == 0)
+			hlen = 1;
+		else if (cs->header[0] == API_VERSION)
+			hlen = 1 + IV_SIZE;
+		else if (cs->header[0] == CHUNK_VERSION)
+			hlen = CHUNK_HEADER_SIZE;
+		else
+			return 0;
+		n = MIN(len, hlen - cs->nheader);
+		memcpy(cs->header + cs->nheader, in, n);
+		cs->nheader += n;
+		in += n;
+		len -= n;
+		if (cs->nheader > 1 && cs->nheader == hlen) {
+			if (!crypto_stream_start(cs))
+				return 0;
+			cs->started = 1;
+		}
+	}
+	if (!cs->started)
+		return (in != NULL);
+
+	if (cs->header[0] == CHUNK_VERSION) {
+		if (in == NULL)
+			return crypto_stream_chunk(cs, 1, sink, sinkarg);
+		csize = cs->chunksize + GCM_TAG_SIZE;
+		while (len) {
+			/* a full chunk followed by more data is not the last */
+			if (cs->nchunk == csize &&
+			    !crypto_stream_chunk(cs, 0, sink, sinkarg))
+				return 0;
+			n = MIN(len, csize - cs->nchunk);
+			memcpy(cs->chunk + cs->nchunk, in, n);
+			cs->nchunk += n;
+			in += n;
+			len -= n;
+		}
+		return 1;
+	}
+
+	if (in == NULL) {
+		if (cs->ntag != sizeof cs->tag)
+			return 0;
+		EVP_CIPHER_CTX_ctrl(cs->ctx, EVP_CTRL_GCM_SET_TAG,
+		    sizeof cs->tag, cs->tag);
+		if (!EVP_DecryptFinal_ex(cs->ctx, obuf, &olen))
+			return 0;
+		if (olen && !sink(sinkarg, obuf, olen))
+			return 0;
+		return 1;
+	}
+
+	/* the last bytes seen might be the tag, hold them back */
+	if (cs->ntag + len <= sizeof cs->tag) {
+		memcpy(cs->tag + cs->ntag, in, len);
+		cs->ntag += len;
+		return 1;
+	}
+	n = MIN(cs->ntag, cs->ntag + len - sizeof cs->tag);
+	if (n) {
+		if (!crypto_stream_cipher(cs, cs->tag, n, sink, sinkarg))
+			return 0;
+		memmove(cs->tag, cs->tag + n, cs->ntag - n);
+		cs->ntag -= n;
+	}
+	n = len - (sizeof cs->tag - cs->ntag);
+	if (!crypto_stream_cipher(cs, in, n, sink, sinkarg))
+		return 0;
+	memcpy(cs->tag + cs->ntag, in + n, len - n);
+	cs->ntag += len - n;
+
+	return 1;
+}
+
+/*
+ * Whether everything passed to the sink so far has been authenticated,
+ * in which case a reader may stop before the end of the file.
+ */
+int
+crypto_stream_authenticated(void *arg)
+{
+	struct crypto_stream	*cs = arg;
+
+	return (cs->started && cs->header[0] == CHUNK_VERSION);
+}
+
+void
+crypto_stream_free(void *arg)
+{
+	struct crypto_stream	*cs = arg;
+
+	EVP_CIPHER_CTX_free(cs->ctx);
+	free(cs->chunk);
+	free(cs->obuf);
+	explicit_bzero(cs, sizeof *cs);
+	free(cs);
+}
+
+static int
+crypto_stream_start(struct crypto_stream *cs)
+{
+	if (cs->header[0] == API_VERSION) {
+		EVP_DecryptInit_ex(cs->ctx, EVP_aes_256_gcm(), NULL, cp.key,
+		    cs->header + 1);
+		return 1;
+	}
+
+	if (cs->header[0] != CHUNK_VERSION ||
+	    cs->header[1] < CHUNK_SHIFT_MIN || cs->header[1] > CHUNK_SHIFT_MAX)
+		return 0;
+	cs->chunksize = (size_t)1 << cs->header[1];
+	if (!crypto_stream_key(cs))
+		return 0;
+	if ((cs->chunk = malloc(cs->chunksize + GCM_TAG_SIZE)) == NULL)
+		return 0;
+	if ((cs->obuf = malloc(cs->chunksize + GCM_TAG_SIZE)) == NULL)
+		return 0;
+	if (cs->decrypt)
+		return EVP_DecryptInit_ex(cs->ctx, EVP_aes_256_gcm(), NULL,
+		    NULL, NULL);
+	return EVP_EncryptInit_ex(cs->ctx, EVP_aes_256_gcm(), NULL, NULL,
+	    NULL);
+}
+
+/*
+ * HKDF-SHA256 (RFC 5869) of the queue key with the salt of the header,
+ * a single block of output being enough for the key.
+ */
+static int
+crypto_stream_key(struct crypto_stream *cs)
+{
+	uint8_t		prk[EVP_MAX_MD_SIZE];
+	uint8_t		info[sizeof(CHUNK_KEY_INFO)];
+	unsigned int	len;
+	int		ret = 0;
+
+	if (HMAC(EVP_sha256(), cs->header + 2, CHUNK_SALT_SIZE, cp.key,
+	    sizeof cp.key, prk, &len) == NULL)
+		goto end;
+
+	/* the info string, with the block counter in place of its NUL */
+	memcpy(info, CHUNK_KEY_INFO, sizeof info);
+	info[sizeof info - 1] = 1;
+	if (HMAC(EVP_sha256(), prk, len, info, sizeof info, cs->key,
+	    &len) == NULL || len != sizeof cs->key)
+		goto end;
+	ret = 1;
+
+end:
+	explicit_bzero(prk, sizeof prk);
+	return ret;
+}
+
+/* seal or open the buffered chunk */
+static int
+crypto_stream_chunk(struct crypto_stream *cs, int last,
+    int (*sink)(void *, const void *, size_t), void *sinkarg)
+{
+	uint8_t		nonce[IV_SIZE];
+	size_t		len;
+	int		olen, flen;
+
+	if (cs->index == UINT32_MAX)
+		return 0;
+
+	memcpy(nonce, cs->header + 2 + CHUNK_SALT_SIZE, CHUNK_PREFIX_SIZE);
+	nonce[7] = cs->index >> 24;
+	nonce[8] = cs->index >> 16;
+	nonce[9] = cs->index >> 8;
+	nonce[10] = cs->index;
+	nonce[11] = last;
+
+	if (cs->decrypt) {
+		if (cs->nchunk < GCM_TAG_SIZE)
+			return 0;
+		len = cs->nchunk - GCM_TAG_SIZE;
+		if (!EVP_DecryptInit_ex(cs->ctx, NULL, NULL, cs->key, nonce))
+			return 0;
+		if (!EVP_DecryptUpdate(cs->ctx, NULL, &olen, cs->header,
+		    CHUNK_HEADER_SIZE))
+			return 0;
+		if (!EVP_DecryptUpdate(cs->ctx, cs->obuf, &olen, cs->chunk,
+		    len))
+			return 0;
+		EVP_CIPHER_CTX_ctrl(cs->ctx, EVP_CTRL_GCM_SET_TAG,
+		    GCM_TAG_SIZE, cs->chunk + len);
+		if (!EVP_DecryptFinal_ex(cs->ctx, cs->obuf + olen, &flen))
+			return 0;
+	} else {
+		len = cs->nchunk;
+		if (!EVP_EncryptInit_ex(cs->ctx, NULL, NULL, cs->key, nonce))
+			return 0;
+		if (!EVP_EncryptUpdate(cs->ctx, NULL, &olen, cs->header,
+		    CHUNK_HEADER_SIZE))
+			return 0;
+		if (!EVP_EncryptUpdate(cs->ctx, cs->obuf, &olen, cs->chunk,
+		    len))
+			return 0;
+		if (!EVP_EncryptFinal_ex(cs->ctx, cs->obuf + olen, &flen))
+			return 0;
+		EVP_CIPHER_CTX_ctrl(cs->ctx, EVP_CTRL_GCM_GET_TAG,
+		    GCM_TAG_SIZE, cs->obuf + olen + flen);
+		flen += GCM_TAG_SIZE;
+	}
+
+	cs->index++;
+	cs->nchunk = 0;
+	return (olen + flen == 0 || sink(sinkarg, cs->obuf, olen + flen));
+}
+
+static int
+crypto_stream_cipher(struct crypto_stream *cs, const uint8_t *in, size_t len,
+    int (*sink)(void *, const void *, size_t), void *sinkarg)
+{
+	uint8_t		obuf[CRYPTO_BUFFER_SIZE];
+	size_t		n;
+	int		olen;
+
+	while (len) {
+		n = MIN(len, sizeof obuf);
+		if (!EVP_DecryptUpdate(cs->ctx, obuf, &olen, in, n))
+			return 0;
+		if (olen && !sink(sinkarg, obuf, olen))
+			return 0;
+		in += n;
+		len -= n;
+	}
+	return 1;
+}
+
 #if 0
 int
 main(int argc, char *argv[])
@@ -20,31 +20,42 @@
 #include "includes.h"
 
 #include <sys/types.h>
-#include <sys/tree.h>
 
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "dict.h"
 #include "log.h"
 
+/*
+ * Each entry is a single allocation holding the data, the key and its
+ * hash, so keys handed out by the dict stay valid as long as the entry.
+ * The dict keeps the entries packed in the slots array and finds them
+ * through an open-addressing index of slot numbers plus one, 0 marking
+ * a free bucket.  The index is kept at most half full, and both arrays
+ * are released when the dict empties.
+ */
+#define DICT_MINSIZE	16
+
 struct dictentry {
-	SPLAY_ENTRY(dictentry)	entry;
-	const char	       *key;
 	void		       *data;
+	uint32_t		hash;
+	char			key[];
 };
 
-static int dictentry_cmp(struct dictentry *, struct dictentry *);
-
-SPLAY_PROTOTYPE(_dict, dictentry, entry, dictentry_cmp);
+static uint32_t dict_hash(const char *);
+static size_t dict_lookup(struct dict *, const char *, uint32_t);
+static void dict_resize(struct dict *, size_t);
+static void dict_link(struct dict *, struct dictentry *);
+static struct dictentry *dict_unlink(struct dict *, size_t);
+static void dict_sort(struct dict *);
+static int dictentry_cmp(const void *, const void *);
 
 int
 dict_check(struct dict *d, const char *k)
 {
-	struct dictentry	key;
-
-	key.key = k;
-	return (SPLAY_FIND(_dict, &d->dict, &key) != NULL);
+	return (dict_lookup(d, k, dict_hash(k)) != d->size);
 }
 
 static inline struct dictentry *
@@ -52,14 +63,13 @@ dict_alloc(const char *k, void *data)
 {
 	struct dictentry	*e;
 	size_t			 s = strlen(k) + 1;
-	void			*t;
 
 	if ((e = malloc(sizeof(*e) + s)) == NULL)
 		return NULL;
 
-	e->key = t = (char*)(e) + sizeof(*e);
 	e->data = data;
-	memmove(t, k, s);
+	e->hash = dict_hash(k);
+	memmove(e->key, k, s);
 
 	return (e);
 }
@@ -67,17 +77,17 @@ dict_alloc(const char *k, void *data)
 void *
 dict_set(struct dict *d, const char *k, void *data)
 {
-	struct dictentry	*entry, key;
+	struct dictentry	*entry;
 	char			*old;
+	size_t			 i;
 
-	key.key = k;
-	if ((entry = SPLAY_FIND(_dict, &d->dict, &key)) == NULL) {
+	if ((i = dict_lookup(d, k, dict_hash(k))) == d->size) {
 		if ((entry = dict_alloc(k, data)) == NULL)
 			fatal("dict_set: malloc");
-		SPLAY_INSERT(_dict, &d->dict, entry);
+		dict_link(d, entry);
 		old = NULL;
-		d->count += 1;
 	} else {
+		entry = d->slots[d->index[i] - 1];
 		old = entry->data;
 		entry->data = data;
 	}
@@ -92,49 +102,46 @@ dict_xset(struct dict *d, const char * k, void *data)
 
 	if ((entry = dict_alloc(k, data)) == NULL)
 		fatal("dict_xset: malloc");
-	if (SPLAY_INSERT(_dict, &d->dict, entry))
+	if (dict_lookup(d, k, entry->hash) != d->size)
 		fatalx("dict_xset(%p, %s)", d, k);
-	d->count += 1;
+	dict_link(d, entry);
 }
 
 void *
 dict_get(struct dict *d, const char *k)
 {
-	struct dictentry	key, *entry;
+	size_t	i;
 
-	key.key = k;
-	if ((entry = SPLAY_FIND(_dict, &d->dict, &key)) == NULL)
+	if ((i = dict_lookup(d, k, dict_hash(k))) == d->size)
 		return (NULL);
 
-	return (entry->data);
+	return (d->slots[d->index[i] - 1]->data);
 }
 
 void *
 dict_xget(struct dict *d, const char *k)
 {
-	struct dictentry	key, *entry;
+	size_t	i;
 
-	key.key = k;
-	if ((entry = SPLAY_FIND(_dict, &d->dict, &key)) == NULL)
+	if ((i = dict_lookup(d, k, dict_hash(k))) == d->size)
 		fatalx("dict_xget(%p, %s)", d, k);
 
-	return (entry->data);
+	return (d->slots[d->index[i] - 1]->data);
 }
 
 void *
 dict_pop(struct dict *d, const char *k)
 {
-	struct dictentry	key, *entry;
+	struct dictentry	*entry;
 	void			*data;
+	size_t			 i;
 
-	key.key = k;
-	if ((entry = SPLAY_FIND(_dict, &d->dict, &key)) == NULL)
+	if ((i = dict_lookup(d, k, dict_hash(k))) == d->size)
 		return (NULL);
 
+	entry = dict_unlink(d, i);
 	data = entry->data;
-	SPLAY_REMOVE(_dict, &d->dict, entry);
 	free(entry);
-	d->count -= 1;
 
 	return (data);
 }
@@ -142,17 +149,16 @@ dict_pop(struct dict *d, const char *k)
 void *
 dict_xpop(struct dict *d, const char *k)
 {
-	struct dictentry	key, *entry;
+	struct dictentry	*entry;
 	void			*data;
+	size_t			 i;
 
-	key.key = k;
-	if ((entry = SPLAY_FIND(_dict, &d->dict, &key)) == NULL)
+	if ((i = dict_lookup(d, k, dict_hash(k))) == d->size)
 		fatalx("dict_xpop(%p, %s)", d, k);
 
+	entry = dict_unlink(d, i);
 	data = entry->data;
-	SPLAY_REMOVE(_dict, &d->dict, entry);
 	free(entry);
-	d->count -= 1;
 
 	return (data);
 }
@@ -162,14 +168,14 @@ dict_poproot(struct dict *d, void **data)
 {
 	struct dictentry	*entry;
 
-	entry = SPLAY_ROOT(&d->dict);
-	if (entry == NULL)
+	/* the last slot can go without moving anything */
+	if (d->count == 0)
 		return (0);
+	entry = d->slots[d->count - 1];
+	dict_unlink(d, dict_lookup(d, entry->key, entry->hash));
 	if (data)
 		*data = entry->data;
-	SPLAY_REMOVE(_dict, &d->dict, entry);
 	free(entry);
-	d->count -= 1;
 
 	return (1);
 }
@@ -179,9 +185,9 @@ dict_root(struct dict *d, const char **k, void **data)
 {
 	struct dictentry	*entry;
 
-	entry = SPLAY_ROOT(&d->dict);
-	if (entry == NULL)
+	if (d->count == 0)
 		return (0);
+	entry = d->slots[d->count - 1];
 	if (k)
 		*k = entry->key;
 	if (data)
@@ -189,59 +195,71 @@ dict_root(struct dict *d, const char **k, void **data)
 	return (1);
 }
 
+/* Walk the entries in no particular order. */
 int
 dict_iter(struct dict *d, void **hdl, const char **k, void **data)
 {
-	struct dictentry *curr = *hdl;
-
-	if (curr == NULL)
-		curr = SPLAY_MIN(_dict, &d->dict);
-	else
-		curr = SPLAY_NEXT(_dict, &d->dict, curr);
-
-	if (curr) {
-		*hdl = curr;
-		if (k)
-			*k = curr->key;
-		if (data)
-			*data = curr->data;
-		return (1);
-	}
+	struct dictentry	*curr;
+	uintptr_t		 next;
+
+	/* the handle holds the number of the next slot */
+	next = (uintptr_t)*hdl;
+	if (next >= d->count)
+		return (0);
 
-	return (0);
+	curr = d->slots[next];
+	*hdl = (void *)(next + 1);
+	if (k)
+		*k = curr->key;
+	if (data)
+		*data = curr->data;
+	return (1);
+}
+
+/* Walk the entries by ascending key. */
+int
+dict_iter_sorted(struct dict *d, void **hdl, const char **k, void **data)
+{
+	return (dict_iterfrom(d, hdl, NULL, k, data));
 }
 
 int
 dict_iterfrom(struct dict *d, void **hdl, const char *kfrom, const char **k,
     void **data)
 {
-	struct dictentry *curr = *hdl, key;
-
-	if (curr == NULL) {
-		if (kfrom == NULL)
-			curr = SPLAY_MIN(_dict, &d->dict);
-		else {
-			key.key = kfrom;
-			curr = SPLAY_FIND(_dict, &d->dict, &key);
-			if (curr == NULL) {
-				SPLAY_INSERT(_dict, &d->dict, &key);
-				curr = SPLAY_NEXT(_dict, &d->dict, &key);
-				SPLAY_REMOVE(_dict, &d->dict, &key);
-			}
+	struct dictentry	*curr;
+	uintptr_t		 next;
+	size_t			 lo, hi, mid;
+
+	if (d->count == 0)
+		return (0);
+	if (d->sorted == NULL)
+		dict_sort(d);
+
+	/* the handle holds the position of the next entry in the view */
+	next = (uintptr_t)*hdl;
+	if (next == 0 && kfrom) {
+		lo = 0;
+		hi = d->count;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (strcmp(d->sorted[mid]->key, kfrom) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
 		}
-	} else
-		curr = SPLAY_NEXT(_dict, &d->dict, curr);
-
-	if (curr) {
-		*hdl = curr;
-		if (k)
-			*k = curr->key;
-		if (data)
-			*data = curr->data;
-		return (1);
+		next = lo;
 	}
+	if (next >= d->count)
+		return (0);
 
-	return (0);
+	curr = d->sorted[next];
+	*hdl = (void *)(next + 1);
+	if (k)
+		*k = curr->key;
+	if (data)
+		*data = curr->data;
+	return (1);
 }
 
 void
@@ -249,20 +267,160 @@ dict_merge(struct dict *dst, struct dict *src)
 {
 	struct dictentry	*entry;
 
-	while (!SPLAY_EMPTY(&src->dict)) {
-		entry = SPLAY_ROOT(&src->dict);
-		SPLAY_REMOVE(_dict, &src->dict, entry);
-		if (SPLAY_INSERT(_dict, &dst->dict, entry))
+	while (src->count) {
+		entry = src->slots[src->count - 1];
+		dict_unlink(src, dict_lookup(src, entry->key, entry->hash));
+		if (dict_lookup(dst, entry->key, entry->hash) != dst->size)
 			fatalx("dict_merge: duplicate");
+		dict_link(dst, entry);
 	}
-	dst->count += src->count;
-	src->count = 0;
 }
 
-static int
-dictentry_cmp(struct dictentry *a, struct dictentry *b)
+/* FNV-1a */
+static uint32_t
+dict_hash(const char *k)
+{
+	uint32_t	h = 2166136261U;
+
+	for (; *k; k++) {
+		h ^= (unsigned char)*k;
+		h *= 16777619U;
+	}
+
+	return (h);
+}
+
+/* Return the index bucket for k, or d->size if it is not there. */
+static size_t
+dict_lookup(struct dict *d, const char *k, uint32_t h)
+{
+	struct dictentry	*e;
+	size_t			 i;
+
+	if (d->count == 0)
+		return (d->size);
+
+	for (i = h & (d->size - 1); d->index[i]; i = (i + 1) & (d->size - 1)) {
+		e = d->slots[d->index[i] - 1];
+		if (e->hash == h && strcmp(e->key, k) == 0)
+			return (i);
+	}
+
+	return (d->size);
+}
+
+static void
+dict_resize(struct dict *d, size_t size)
 {
-	return strcmp(a->key, b->key);
+	struct dictentry	**slots;
+	size_t			  n, i;
+
+	if (size == 0) {
+		free(d->slots);
+		free(d->index);
+		d->slots = NULL;
+		d->index = NULL;
+		d->size = 0;
+		return;
+	}
+
+	if (size > UINT32_MAX)
+		fatalx("dict_resize: too many entries");
+	if ((slots = reallocarray(d->slots, size / 2, sizeof *slots)) == NULL)
+		fatal("dict_resize: reallocarray");
+	d->slots = slots;
+	free(d->index);
+	if ((d->index = calloc(size, sizeof *d->index)) == NULL)
+		fatal("dict_resize: calloc");
+	d->size = size;
+
+	for (n = 0; n < d->count; n++) {
+		for (i = d->slots[n]->hash & (size - 1); d->index[i];
+		    i = (i + 1) & (size - 1))
+			;
+		d->index[i] = n + 1;
+	}
 }
 
-SPLAY_GENERATE(_dict, dictentry, entry, dictentry_cmp);
+static void
+dict_link(struct dict *d, struct dictentry *e)
+{
+	size_t	i;
+
+	free(d->sorted);
+	d->sorted = NULL;
+
+	if (d->count == d->size / 2)
+		dict_resize(d, d->size ? d->size * 2 : DICT_MINSIZE);
+
+	d->slots[d->count] = e;
+	d->count += 1;
+
+	for (i = e->hash & (d->size - 1); d->index[i];
+	    i = (i + 1) & (d->size - 1))
+		;
+	d->index[i] = d->count;
+}
+
+/*
+ * Free the index bucket, shifting back the entries of its probe chain,
+ * and fill the slot hole with the last slot.
+ */
+static struct dictentry *
+dict_unlink(struct dict *d, size_t i)
+{
+	struct dictentry	*e;
+	size_t			 mask, n, j, k;
+
+	free(d->sorted);
+	d->sorted = NULL;
+
+	mask = d->size - 1;
+	n = d->index[i] - 1;
+	e = d->slots[n];
+
+	for (j = (i + 1) & mask; d->index[j]; j = (j + 1) & mask) {
+		k = d->slots[d->index[j] - 1]->hash & mask;
+		/* leave entries whose home lies in (i, j] */
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		d->index[i] = d->index[j];
+		i = j;
+	}
+	d->index[i] = 0;
+
+	d->count -= 1;
+	if (n != d->count) {
+		for (j = d->slots[d->count]->hash & mask;
+		    d->index[j] != d->count + 1; j = (j + 1) & mask)
+			;
+		d->index[j] = n + 1;
+		d->slots[n] = d->slots[d->count];
+	}
+
+	if (d->count == 0)
+		dict_resize(d, 0);
+	else if (d->size > DICT_MINSIZE && d->count < d->size / 8)
+		dict_resize(d, d->size / 2);
+
+	return (e);
+}
+
+static void
+dict_sort(struct dict *d)
+{
+	if ((d->sorted = reallocarray(NULL, d->count, sizeof *d->sorted))
+	    == NULL)
+		fatal("dict_sort: reallocarray");
+	memcpy(d->sorted, d->slots, d->count * sizeof *d->sorted);
+	qsort(d->sorted, d->count, sizeof *d->sorted, dictentry_cmp);
+}
+
+static int
+dictentry_cmp(const void *a, const void *b)
+{
+	const struct dictentry	*e1 = *(struct dictentry * const *)a;
+	const struct dictentry	*e2 = *(struct dictentry * const *)b;
+
+	return strcmp(e1->key, e2->key);
+}
@@ -20,17 +20,25 @@
 #ifndef	_DICT_H_
 #define	_DICT_H_
 
-SPLAY_HEAD(_dict, dictentry);
+struct dictentry;
 
+/*
+ * Dicts are hash maps.  Walking them in key order goes through a sorted
+ * view, built on demand and dropped when an entry is added or removed.
+ */
 struct dict {
-	struct _dict	dict;
-	size_t		count;
+	size_t			 count;
+	struct dictentry	**slots;
+	uint32_t		*index;
+	size_t			 size;
+	struct dictentry	**sorted;
 };
 
 
 /* dict.c */
-#define dict_init(d) do { SPLAY_INIT(&((d)->dict)); (d)->count = 0; } while(0)
-#define dict_empty(d) SPLAY_EMPTY(&((d)->dict))
+#define dict_init(d) do { (d)->count = 0; (d)->slots = NULL;		\
+	(d)->index = NULL; (d)->size = 0; (d)->sorted = NULL; } while(0)
+#define dict_empty(d) ((d)->count == 0)
 #define dict_count(d) ((d)->count)
 int dict_check(struct dict *, const char *);
 void *dict_set(struct dict *, const char *, void *);
@@ -42,6 +50,7 @@ void *dict_xpop(struct dict *, const char *);
 int dict_poproot(struct dict *, void **);
 int dict_root(struct dict *, const char **, void **);
 int dict_iter(struct dict *, void **, const char **, void **);
+int dict_iter_sorted(struct dict *, void **, const char **, void **);
 int dict_iterfrom(struct dict *, void **, const char *, const char **, void **);
 void dict_merge(struct dict *, struct dict *);
 
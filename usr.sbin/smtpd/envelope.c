@@ -38,6 +38,18 @@
 static int envelope_ascii_load(struct envelope *, struct dict *);
 static void envelope_ascii_dump(const struct envelope *, char **, size_t *,
     const char *);
+static int envelope_binary_load(struct envelope *, const char *, size_t);
+static int ascii_load_sockaddr(struct sockaddr_storage *, char *);
+
+/*
+ * Binary envelopes start with a fixed-size header holding the numeric
+ * fields at fixed offsets, followed by the string fields, each prefixed
+ * with its length.  The leading NUL byte keeps the format unambiguous
+ * with ASCII, gzipped and encrypted envelopes.
+ */
+static const char	envelope_binary_magic[4] = { 0x00, 'E', 'V', 'P' };
+
+#define	EVP_BIN_HDRSIZE		72
 
 void
 envelope_set_errormsg(struct envelope *e, char *fmt, ...)
@@ -124,6 +136,9 @@ envelope_load_buffer(struct envelope *ep, const char *ibuf, size_t buflen)
 	long long	 version;
 	int		 ret = 0;
 
+	if (envelope_is_binary(ibuf, buflen))
+		return (envelope_binary_load(ep, ibuf, buflen));
+
 	dict_init(&d);
 	if (!envelope_buffer_to_dict(&d, ibuf, buflen)) {
 		log_debug("debug: cannot parse envelope to dict");
@@ -141,7 +156,8 @@ envelope_load_buffer(struct envelope *ep, const char *ibuf, size_t buflen)
 		goto end;
 	}
 
-	if (version != SMTPD_ENVELOPE_VERSION) {
+	if (version != SMTPD_ENVELOPE_VERSION &&
+	    version != SMTPD_ENVELOPE_VERSION_ASCII) {
 		log_debug("debug: bad envelope version %lld", version);
 		goto end;
 	}
@@ -210,6 +226,238 @@ envelope_dump_buffer(const struct envelope *ep, char *dest, size_t len)
 	return (dest - p);
 }
 
+int
+envelope_is_binary(const char *buf, size_t len)
+{
+	if (len < sizeof envelope_binary_magic)
+		return (0);
+
+	return (memcmp(buf, envelope_binary_magic,
+	    sizeof envelope_binary_magic) == 0);
+}
+
+static void
+binary_dump_uint(char *p, uint64_t v, size_t width)
+{
+	while (width--) {
+		p[width] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+static uint64_t
+binary_load_uint(const char *p, size_t width)
+{
+	uint64_t	v = 0;
+	size_t		i;
+
+	for (i = 0; i < width; i++)
+		v = (v << 8) | (uint8_t)p[i];
+	return (v);
+}
+
+static void
+binary_dump_string(char **dest, size_t *len, const char *src)
+{
+	size_t	l;
+
+	if (*dest == NULL)
+		return;
+
+	l = strlen(src);
+	if (l > 0xffff || l + 2 > *len) {
+		*dest = NULL;
+		return;
+	}
+	binary_dump_uint(*dest, l, 2);
+	memcpy(*dest + 2, src, l);
+	*dest += l + 2;
+	*len -= l + 2;
+}
+
+static int
+binary_load_string(const char **buf, size_t *len, char *dest, size_t destlen)
+{
+	size_t	l;
+
+	if (*len < 2)
+		return (0);
+	l = binary_load_uint(*buf, 2);
+	if (l + 2 > *len || l >= destlen)
+		return (0);
+	memcpy(dest, *buf + 2, l);
+	dest[l] = '\0';
+	*buf += l + 2;
+	*len -= l + 2;
+	return (1);
+}
+
+/*
+ * Dump the envelope in the compact binary format used for on-disk
+ * storage and for delivery batches.  The ASCII format is kept for other
+ * imsgs and for display.
+ */
+int
+envelope_dump_binary(const struct envelope *ep, char *dest, size_t len)
+{
+	char	*p = dest;
+
+	if (len < EVP_BIN_HDRSIZE)
+		return (0);
+
+	switch (ep->type) {
+	case D_MDA:
+	case D_MTA:
+	case D_BOUNCE:
+		break;
+	default:
+		return (0);
+	}
+
+	memset(dest, 0, EVP_BIN_HDRSIZE);
+	memcpy(dest, envelope_binary_magic, sizeof envelope_binary_magic);
+	binary_dump_uint(dest + 4, SMTPD_ENVELOPE_VERSION, 4);
+	binary_dump_uint(dest + 8, ep->type, 1);
+	binary_dump_uint(dest + 9, ep->dsn_notify, 1);
+	binary_dump_uint(dest + 10, ep->dsn_ret, 1);
+	binary_dump_uint(dest + 11, ep->esc_class, 1);
+	binary_dump_uint(dest + 12, ep->esc_class ? ep->esc_code : 0, 1);
+	binary_dump_uint(dest + 13, ep->agent.bounce.type, 1);
+	binary_dump_uint(dest + 14, ep->retry, 2);
+	binary_dump_uint(dest + 16,
+	    ep->flags & (EF_AUTHENTICATED|EF_BOUNCE|EF_INTERNAL), 4);
+	binary_dump_uint(dest + 24, ep->creation, 8);
+	binary_dump_uint(dest + 32, ep->ttl, 8);
+	binary_dump_uint(dest + 40, ep->lasttry, 8);
+	binary_dump_uint(dest + 48, ep->lastbounce, 8);
+	binary_dump_uint(dest + 56, ep->agent.bounce.delay, 8);
+	binary_dump_uint(dest + 64, ep->agent.bounce.ttl, 8);
+	dest += EVP_BIN_HDRSIZE;
+	len -= EVP_BIN_HDRSIZE;
+
+	binary_dump_string(&dest, &len, ep->dispatcher);
+	binary_dump_string(&dest, &len, ep->tag);
+	binary_dump_string(&dest, &len, ep->smtpname);
+	binary_dump_string(&dest, &len, ep->helo);
+	binary_dump_string(&dest, &len, ep->hostname);
+	binary_dump_string(&dest, &len, ep->username);
+	binary_dump_string(&dest, &len, ep->errorline);
+	binary_dump_string(&dest, &len, ss_to_text(&ep->ss));
+	binary_dump_string(&dest, &len, ep->sender.user);
+	binary_dump_string(&dest, &len, ep->sender.domain);
+	binary_dump_string(&dest, &len, ep->rcpt.user);
+	binary_dump_string(&dest, &len, ep->rcpt.domain);
+	binary_dump_string(&dest, &len, ep->dest.user);
+	binary_dump_string(&dest, &len, ep->dest.domain);
+	binary_dump_string(&dest, &len, ep->dsn_envid);
+	binary_dump_string(&dest, &len, ep->dsn_orcpt);
+	binary_dump_string(&dest, &len, ep->mda_exec);
+	binary_dump_string(&dest, &len, ep->mda_subaddress);
+	binary_dump_string(&dest, &len, ep->mda_user);
+
+	if (dest == NULL)
+		return (0);
+
+	return (dest - p);
+}
+
+static int
+envelope_binary_load(struct envelope *ep, const char *buf, size_t len)
+{
+	char		sa[HOST_NAME_MAX+1];
+	uint32_t	version;
+
+	if (len < EVP_BIN_HDRSIZE) {
+		log_debug("debug: truncated binary envelope");
+		return (0);
+	}
+
+	version = binary_load_uint(buf + 4, 4);
+	if (version != SMTPD_ENVELOPE_VERSION) {
+		log_debug("debug: bad envelope version %u", version);
+		return (0);
+	}
+
+	memset(ep, 0, sizeof *ep);
+	ep->type = binary_load_uint(buf + 8, 1);
+	ep->dsn_notify = binary_load_uint(buf + 9, 1);
+	ep->dsn_ret = binary_load_uint(buf + 10, 1);
+	ep->esc_class = binary_load_uint(buf + 11, 1);
+	ep->esc_code = binary_load_uint(buf + 12, 1);
+	ep->agent.bounce.type = binary_load_uint(buf + 13, 1);
+	ep->retry = binary_load_uint(buf + 14, 2);
+	ep->flags = binary_load_uint(buf + 16, 4);
+	ep->creation = binary_load_uint(buf + 24, 8);
+	ep->ttl = binary_load_uint(buf + 32, 8);
+	ep->lasttry = binary_load_uint(buf + 40, 8);
+	ep->lastbounce = binary_load_uint(buf + 48, 8);
+	ep->agent.bounce.delay = binary_load_uint(buf + 56, 8);
+	ep->agent.bounce.ttl = binary_load_uint(buf + 64, 8);
+	buf += EVP_BIN_HDRSIZE;
+	len -= EVP_BIN_HDRSIZE;
+
+	switch (ep->type) {
+	case D_MDA:
+	case D_MTA:
+	case D_BOUNCE:
+		break;
+	default:
+		goto err;
+	}
+	if (ep->flags & ~(EF_AUTHENTICATED|EF_BOUNCE|EF_INTERNAL))
+		goto err;
+
+	if (!binary_load_string(&buf, &len, ep->dispatcher,
+	    sizeof ep->dispatcher) ||
+	    !binary_load_string(&buf, &len, ep->tag, sizeof ep->tag) ||
+	    !binary_load_string(&buf, &len, ep->smtpname,
+	    sizeof ep->smtpname) ||
+	    !binary_load_string(&buf, &len, ep->helo, sizeof ep->helo) ||
+	    !binary_load_string(&buf, &len, ep->hostname,
+	    sizeof ep->hostname) ||
+	    !binary_load_string(&buf, &len, ep->username,
+	    sizeof ep->username) ||
+	    !binary_load_string(&buf, &len, ep->errorline,
+	    sizeof ep->errorline) ||
+	    !binary_load_string(&buf, &len, sa, sizeof sa) ||
+	    !binary_load_string(&buf, &len, ep->sender.user,
+	    sizeof ep->sender.user) ||
+	    !binary_load_string(&buf, &len, ep->sender.domain,
+	    sizeof ep->sender.domain) ||
+	    !binary_load_string(&buf, &len, ep->rcpt.user,
+	    sizeof ep->rcpt.user) ||
+	    !binary_load_string(&buf, &len, ep->rcpt.domain,
+	    sizeof ep->rcpt.domain) ||
+	    !binary_load_string(&buf, &len, ep->dest.user,
+	    sizeof ep->dest.user) ||
+	    !binary_load_string(&buf, &len, ep->dest.domain,
+	    sizeof ep->dest.domain) ||
+	    !binary_load_string(&buf, &len, ep->dsn_envid,
+	    sizeof ep->dsn_envid) ||
+	    !binary_load_string(&buf, &len, ep->dsn_orcpt,
+	    sizeof ep->dsn_orcpt) ||
+	    !binary_load_string(&buf, &len, ep->mda_exec,
+	    sizeof ep->mda_exec) ||
+	    !binary_load_string(&buf, &len, ep->mda_subaddress,
+	    sizeof ep->mda_subaddress) ||
+	    !binary_load_string(&buf, &len, ep->mda_user,
+	    sizeof ep->mda_user))
+		goto err;
+
+	if (len != 0)
+		goto err;
+
+	if (!ascii_load_sockaddr(&ep->ss, sa))
+		goto err;
+
+	ep->version = SMTPD_ENVELOPE_VERSION;
+	return (1);
+
+err:
+	log_warnx("envelope: invalid binary envelope");
+	return (0);
+}
+
 static int
 ascii_load_uint8(uint8_t *dest, char *buf)
 {
@@ -64,6 +64,9 @@ limit_mta_set_defaults(struct mta_limits *limits)
 	limits->task_hiwat = 50;
 	limits->task_lowat = 30;
 	limits->task_release = 10;
+
+	limits->prewarm_sessions = 1;
+	limits->prewarm_keepalive = 240;
 }
 
 int
@@ -115,6 +118,11 @@ limit_mta_set(struct mta_limits *limits, const char *key, int64_t value)
 	else if (!strcmp(key, "task-release"))
 		limits->task_release = value;
 
+	else if (!strcmp(key, "prewarm-sessions"))
+		limits->prewarm_sessions = value;
+	else if (!strcmp(key, "prewarm-keepalive"))
+		limits->prewarm_keepalive = value;
+
 	else
 		return (0);
 
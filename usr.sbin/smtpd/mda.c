@@ -96,6 +96,7 @@ static void mda_done(struct mda_session *);
 static void mda_fail(struct mda_user *, int, const char *,
     enum enhanced_status_code);
 static void mda_drain(void);
+static void mda_enqueue(const struct envelope *);
 static void mda_log(const struct mda_envelope *, const char *, const char *);
 static void mda_queue_ok(uint64_t);
 static void mda_queue_tempfail(uint64_t, const char *,
@@ -166,41 +167,11 @@ mda_imsg(struct mproc *p, struct imsg *imsg)
 
 	case IMSG_QUEUE_DELIVER:
 		m_msg(&m, imsg);
-		m_get_envelope(&m, &evp);
-		m_end(&m);
-
-		u = mda_user(&evp);
-
-		if (u->evpcount >= env->sc_mda_task_hiwat) {
-			if (!(u->flags & USER_ONHOLD)) {
-				log_debug("debug: mda: hiwat reached for "
-				    "user \"%s\": holding envelopes",
-				    mda_user_to_text(u));
-				u->flags |= USER_ONHOLD;
-			}
-		}
-
-		if (u->flags & USER_ONHOLD) {
-			u->flags |= USER_HOLDQ;
-			m_create(p_queue, IMSG_MDA_DELIVERY_HOLD,
-			    0, 0, -1);
-			m_add_evpid(p_queue, evp.id);
-			m_add_id(p_queue, u->id);
-			m_close(p_queue);
-			return;
-		}
-
-		e = mda_envelope(u->id, &evp);
-		TAILQ_INSERT_TAIL(&u->envelopes, e, entry);
-		u->evpcount += 1;
-		stat_increment("mda.pending", 1);
-
-		if (!(u->flags & USER_RUNNABLE) &&
-		    !(u->flags & USER_WAITINFO)) {
-			u->flags |= USER_RUNNABLE;
-			TAILQ_INSERT_TAIL(&runnable, u, entry_runnable);
+		while (!m_is_eom(&m)) {
+			m_get_envelope_binary(&m, &evp);
+			mda_enqueue(&evp);
 		}
-
+		m_end(&m);
 		mda_drain();
 		return;
 
@@ -639,6 +610,44 @@ mda_drain(void)
 	}
 }
 
+static void
+mda_enqueue(const struct envelope *evp)
+{
+	struct mda_user		*u;
+	struct mda_envelope	*e;
+
+	u = mda_user(evp);
+
+	if (u->evpcount >= env->sc_mda_task_hiwat) {
+		if (!(u->flags & USER_ONHOLD)) {
+			log_debug("debug: mda: hiwat reached for "
+			    "user \"%s\": holding envelopes",
+			    mda_user_to_text(u));
+			u->flags |= USER_ONHOLD;
+		}
+	}
+
+	if (u->flags & USER_ONHOLD) {
+		u->flags |= USER_HOLDQ;
+		m_create(p_queue, IMSG_MDA_DELIVERY_HOLD, 0, 0, -1);
+		m_add_evpid(p_queue, evp->id);
+		m_add_id(p_queue, u->id);
+		m_close(p_queue);
+		return;
+	}
+
+	e = mda_envelope(u->id, evp);
+	TAILQ_INSERT_TAIL(&u->envelopes, e, entry);
+	u->evpcount += 1;
+	stat_increment("mda.pending", 1);
+
+	if (!(u->flags & USER_RUNNABLE) &&
+	    !(u->flags & USER_WAITINFO)) {
+		u->flags |= USER_RUNNABLE;
+		TAILQ_INSERT_TAIL(&runnable, u, entry_runnable);
+	}
+}
+
 static void
 mda_done(struct mda_session *s)
 {
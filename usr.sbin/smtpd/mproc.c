@@ -501,6 +501,12 @@ m_add_envelope(struct mproc *m, const struct envelope *evp)
 	m_add_string(m, buf);
 }
 
+void
+m_add_scheduler_info(struct mproc *m, const struct scheduler_info *si)
+{
+	m_add(m, si, sizeof(*si));
+}
+
 void
 m_add_params(struct mproc *m, struct dict *d)
 {
@@ -641,6 +647,29 @@ m_get_envelope(struct msg *m, struct envelope *evp)
 	evp->id = evpid;
 }
 
+void
+m_get_envelope_binary(struct msg *m, struct envelope *evp)
+{
+	uint64_t	 evpid;
+	const void	*buf;
+	size_t		 sz;
+
+	m_get_evpid(m, &evpid);
+	m_get_data(m, &buf, &sz);
+	if (buf == NULL)
+		fatalx("empty envelope buffer");
+
+	if (!envelope_load_buffer(evp, buf, sz))
+		fatalx("failed to retrieve envelope");
+	evp->id = evpid;
+}
+
+void
+m_get_scheduler_info(struct msg *m, struct scheduler_info *si)
+{
+	m_get(m, si, sizeof(*si));
+}
+
 void
 m_get_params(struct msg *m, struct dict *d)
 {
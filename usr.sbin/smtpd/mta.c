@@ -57,8 +57,16 @@
 #define DELAY_ROUTE_BASE	15
 #define DELAY_ROUTE_MAX		3600
 
+#define DELAY_PREWARM		30
+
+#define DELAY_SMARTHOST_BASE	30
+#define DELAY_SMARTHOST_MAX	1800
+#define DELAY_SMARTHOST_PROBE	300
+#define SMARTHOST_EXPIRE_DELAY	3600
+
 #define RELAY_ONHOLD		0x01
 #define RELAY_HOLDQ		0x02
+#define RELAY_PREWARM		0x04
 
 static void mta_setup_dispatcher(struct dispatcher *);
 static void mta_handle_envelope(struct envelope *, const char *);
@@ -78,6 +86,8 @@ static void mta_route_enable(struct mta_route *);
 static void mta_route_disable(struct mta_route *, int, int);
 static void mta_drain(struct mta_relay *);
 static void mta_delivery_flush_event(int, short, void *);
+static void mta_prewarm_event(int, short, void *);
+static int mta_prewarm_cmp(const void *, const void *);
 static void mta_flush(struct mta_relay *, int, const char *);
 static struct mta_route *mta_find_route(struct mta_connector *, time_t, int*,
     time_t*, struct mta_mx **);
@@ -142,6 +152,31 @@ int mta_is_blocked(struct mta_source *, char *);
 static int mta_block_cmp(const struct mta_block *, const struct mta_block *);
 SPLAY_PROTOTYPE(mta_block_tree, mta_block, entry, mta_block_cmp);
 
+/*
+ * Delivery results per source address and destination domain, used to
+ * steer connections away from sources that a destination is throttling.
+ */
+#define	SRCSTAT_EXPIRE_DELAY	(4 * 3600)
+#define	SRCSTAT_DECAY_DELAY	600
+#define	SRCSTAT_LOW		50
+struct mta_srcstat {
+	SPLAY_ENTRY(mta_srcstat) entry;
+	struct mta_source	*source;
+	char			*domain;
+	size_t			 ok;
+	size_t			 tempfail;
+	time_t			 lastdecay;
+	struct runq_job		*runq;
+};
+
+SPLAY_HEAD(mta_srcstat_tree, mta_srcstat);
+static struct mta_srcstat *mta_srcstat(struct mta_source *, const char *, int);
+static void mta_srcstat_decay(struct mta_srcstat *, time_t);
+static int mta_srcstat_score(struct mta_source *, const char *);
+static int mta_srcstat_cmp(const struct mta_srcstat *,
+    const struct mta_srcstat *);
+SPLAY_PROTOTYPE(mta_srcstat_tree, mta_srcstat, entry, mta_srcstat_cmp);
+
 /*
  * This function is not publicy exported because it is a hack until libtls
  * has a proper privsep setup
@@ -154,6 +189,7 @@ static struct mta_host_tree		hosts;
 static struct mta_source_tree		sources;
 static struct mta_route_tree		routes;
 static struct mta_block_tree		blocks;
+static struct mta_srcstat_tree		srcstats;
 
 static struct tree wait_mx;
 static struct tree wait_preference;
@@ -162,11 +198,13 @@ static struct tree wait_smarthost;
 static struct tree wait_source;
 static struct tree flush_evp;
 static struct event ev_flush_evp;
+static struct event ev_prewarm;
 
 static struct runq *runq_relay;
 static struct runq *runq_connector;
 static struct runq *runq_route;
 static struct runq *runq_hoststat;
+static struct runq *runq_srcstat;
 
 static time_t	max_seen_conndelay_route;
 static time_t	max_seen_discdelay_route;
@@ -177,6 +215,7 @@ struct hoststat {
 	time_t			 tm;
 	char			 error[LINE_MAX];
 	struct tree		 deferred;
+	struct runq_job		*runq;
 };
 static struct dict hoststat;
 
@@ -186,6 +225,31 @@ void mta_hoststat_uncache(const char *, uint64_t);
 void mta_hoststat_reschedule(const char *);
 static void mta_hoststat_remove_entry(struct hoststat *);
 
+/*
+ * Upstream relays learned from "relay host" tables.  Entries are shared
+ * by all tables listing the same relay and are never released.
+ */
+struct mta_smarthost {
+	char			*name;
+	int			 weight;
+#define SMARTHOST_PROBE		0x01
+	int			 flags;
+	size_t			 ntask;
+	size_t			 nconn;
+	int			 nfail;
+	time_t			 lastseen;
+	time_t			 lastprobe;
+	time_t			 downuntil;
+};
+static struct dict smarthosts;
+static struct dict smarthost_pools;
+
+static int mta_smarthost_key(char *, size_t, const char *, int *);
+static const char *mta_smarthost_select(const char *, const char *);
+static struct mta_smarthost *mta_smarthost_lookup(const char *);
+static void mta_smarthost_fail(struct mta_smarthost *);
+static void mta_smarthost_ok(struct mta_smarthost *);
+
 void
 mta_imsg(struct mproc *p, struct imsg *imsg)
 {
@@ -214,9 +278,11 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 	switch (imsg->hdr.type) {
 	case IMSG_QUEUE_TRANSFER:
 		m_msg(&m, imsg);
-		m_get_envelope(&m, &evp);
+		while (!m_is_eom(&m)) {
+			m_get_envelope_binary(&m, &evp);
+			mta_handle_envelope(&evp, NULL);
+		}
 		m_end(&m);
-		mta_handle_envelope(&evp, NULL);
 		return;
 
 	case IMSG_MTA_OPEN_MESSAGE:
@@ -338,7 +404,7 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 			if (route->flags & ROUTE_DISABLED) {
 				log_info("smtp-out: Enabling route %s per admin request",
 				    mta_route_to_text(route));
-				if (!runq_cancel(runq_route, route)) {
+				if (!runq_job_cancel(runq_route, &route->runq)) {
 					log_warnx("warn: route not on runq");
 					fatalx("exiting");
 				}
@@ -382,7 +448,7 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 
 	case IMSG_CTL_MTA_SHOW_ROUTES:
 		SPLAY_FOREACH(route, mta_route_tree, &routes) {
-			v = runq_pending(runq_route, route, &t);
+			v = runq_job_pending(route->runq, &t);
 			(void)snprintf(buf, sizeof(buf),
 			    "%llu. %s %c%c%c%c nconn=%zu nerror=%d penalty=%d timeout=%s",
 			    (unsigned long long)route->id,
@@ -557,12 +623,15 @@ mta_setup_dispatcher(struct dispatcher *dispatcher)
 void
 mta_postprivdrop(void)
 {
+	struct timeval	tv;
+
 	SPLAY_INIT(&relays);
 	SPLAY_INIT(&domains);
 	SPLAY_INIT(&hosts);
 	SPLAY_INIT(&sources);
 	SPLAY_INIT(&routes);
 	SPLAY_INIT(&blocks);
+	SPLAY_INIT(&srcstats);
 
 	tree_init(&wait_secret);
 	tree_init(&wait_smarthost);
@@ -571,13 +640,23 @@ mta_postprivdrop(void)
 	tree_init(&wait_source);
 	tree_init(&flush_evp);
 	dict_init(&hoststat);
+	dict_init(&smarthosts);
+	dict_init(&smarthost_pools);
 
 	evtimer_set(&ev_flush_evp, mta_delivery_flush_event, NULL);
 
+	if (env->sc_mta_prewarm) {
+		tv.tv_sec = DELAY_PREWARM;
+		tv.tv_usec = 0;
+		evtimer_set(&ev_prewarm, mta_prewarm_event, NULL);
+		evtimer_add(&ev_prewarm, &tv);
+	}
+
 	runq_init(&runq_relay, mta_on_timeout);
 	runq_init(&runq_connector, mta_on_timeout);
 	runq_init(&runq_route, mta_on_timeout);
 	runq_init(&runq_hoststat, mta_on_timeout);
+	runq_init(&runq_srcstat, mta_on_timeout);
 }
 
 
@@ -599,9 +678,34 @@ mta_source_error(struct mta_relay *relay, struct mta_route *route, const char *e
 	c->flags |= CONNECTOR_ERROR_SOURCE;
 }
 
+/*
+ * Account the outcome of a transaction on the given route.
+ */
+void
+mta_source_delivery(struct mta_relay *relay, struct mta_route *route,
+    int delivery, size_t n)
+{
+	struct mta_srcstat	*ss;
+
+	if (delivery != IMSG_MTA_DELIVERY_OK &&
+	    delivery != IMSG_MTA_DELIVERY_TEMPFAIL)
+		return;
+
+	ss = mta_srcstat(route->src, relay->domain->name, 1);
+	mta_srcstat_decay(ss, time(NULL));
+	if (delivery == IMSG_MTA_DELIVERY_OK)
+		ss->ok += n;
+	else
+		ss->tempfail += n;
+
+	runq_job_schedule(runq_srcstat, SRCSTAT_EXPIRE_DELAY, ss, &ss->runq);
+}
+
 void
 mta_route_error(struct mta_relay *relay, struct mta_route *route)
 {
+	if (relay->smarthost)
+		mta_smarthost_fail(relay->smarthost);
 #if 0
 	route->nerror += 1;
 
@@ -624,6 +728,9 @@ mta_route_ok(struct mta_relay *relay, struct mta_route *route)
 	log_debug("debug: mta-routing: route %s is now valid.",
 	    mta_route_to_text(route));
 
+	if (relay->smarthost)
+		mta_smarthost_ok(relay->smarthost);
+
 	route->nerror = 0;
 	route->flags &= ~ROUTE_NEW;
 
@@ -654,9 +761,15 @@ mta_route_collect(struct mta_relay *relay, struct mta_route *route)
 	route->dst->nconn -= 1;
 	route->lastdisc = time(NULL);
 
+	if (relay->smarthost)
+		relay->smarthost->nconn -= 1;
+
 	/* First connection failed */
-	if (route->flags & ROUTE_NEW)
+	if (route->flags & ROUTE_NEW) {
 		mta_route_disable(route, 1, ROUTE_DISABLED_NET);
+		if (relay->smarthost)
+			mta_smarthost_fail(relay->smarthost);
+	}
 
 	c = mta_connector(relay, route->src);
 	c->nconn -= 1;
@@ -673,6 +786,8 @@ mta_route_next_task(struct mta_relay *relay, struct mta_route *route)
 	if ((task = TAILQ_FIRST(&relay->tasks))) {
 		TAILQ_REMOVE(&relay->tasks, task, entry);
 		relay->ntask -= 1;
+		if (relay->smarthost)
+			relay->smarthost->ntask -= 1;
 		task->relay = NULL;
 
 		/* When the number of tasks is down to lowat, query some evp */
@@ -706,6 +821,7 @@ mta_handle_envelope(struct envelope *evp, const char *smarthost)
 	struct mta_relay	*relay;
 	struct mta_task		*task;
 	struct mta_envelope	*e;
+	struct mta_smarthost	*sh;
 	struct dispatcher	*dispatcher;
 	struct mailaddr		 maddr;
 	struct relayhost	 relayh;
@@ -717,6 +833,11 @@ mta_handle_envelope(struct envelope *evp, const char *smarthost)
 		return;
 	}
 
+	/* Pick the best upstream among those known for this table. */
+	if (smarthost && !dispatcher->u.remote.smarthost_domain)
+		smarthost = mta_smarthost_select(dispatcher->u.remote.smarthost,
+		    smarthost);
+
 	memset(&relayh, 0, sizeof(relayh));
 	relayh.tls = RELAY_TLS_OPPORTUNISTIC;
 	if (smarthost && !text_to_relayhost(&relayh, smarthost)) {
@@ -758,6 +879,13 @@ mta_handle_envelope(struct envelope *evp, const char *smarthost)
 	}
 
 	relay = mta_relay(evp, &relayh);
+	relay->activity += 1;
+
+	if (smarthost && !dispatcher->u.remote.smarthost_domain &&
+	    relay->smarthost == NULL && relay->ntask == 0 && relay->nconn == 0 &&
+	    (sh = mta_smarthost_lookup(smarthost)) != NULL)
+		relay->smarthost = sh;
+
 	/* ignore if we don't know the limits yet */
 	if (relay->limits &&
 	    relay->ntask >= (size_t)relay->limits->task_hiwat) {
@@ -792,6 +920,8 @@ mta_handle_envelope(struct envelope *evp, const char *smarthost)
 		TAILQ_INIT(&task->envelopes);
 		task->relay = relay;
 		relay->ntask += 1;
+		if (relay->smarthost)
+			relay->smarthost->ntask += 1;
 		TAILQ_INSERT_TAIL(&relay->tasks, task, entry);
 		task->msgid = evpid_to_msgid(evp->id);
 		if (evp->sender.user[0] || evp->sender.domain[0])
@@ -839,10 +969,103 @@ mta_handle_envelope(struct envelope *evp, const char *smarthost)
 
 	stat_increment("mta.envelope", 1);
 
+	/* Hand the task to an idle session right away if there is one. */
+	if (relay->nconn_ready)
+		mta_session_kick(relay);
+
 	mta_drain(relay);
 	mta_relay_unref(relay); /* from here */
 }
 
+/*
+ * Periodically rank the relays by recent activity and keep a few
+ * established sessions around for the busiest ones, so that the next
+ * envelope does not pay for the DNS, connect, TLS and EHLO round-trips.
+ */
+static void
+mta_prewarm_event(int fd, short event, void *arg)
+{
+	struct mta_relay	*r, **hot;
+	struct mta_connector	*c;
+	struct timeval		 tv;
+	void			*iter;
+	size_t			 i, n;
+
+	n = 0;
+	SPLAY_FOREACH(r, mta_relay_tree, &relays)
+		n++;
+
+	hot = NULL;
+	if (n)
+		hot = xcalloc(n, sizeof(*hot));
+
+	n = 0;
+	SPLAY_FOREACH(r, mta_relay_tree, &relays) {
+		r->score = r->score / 2 + r->activity;
+		r->activity = 0;
+		mta_relay_ref(r);
+		hot[n++] = r;
+	}
+
+	qsort(hot, n, sizeof(*hot), mta_prewarm_cmp);
+
+	for (i = 0; i < n; i++) {
+		r = hot[i];
+		r->prewarm = 0;
+		if (i < env->sc_mta_prewarm && r->score && r->fail == 0 &&
+		    r->limits && tree_count(&r->connectors))
+			r->prewarm = r->limits->prewarm_sessions;
+
+		if (r->prewarm && !(r->state & RELAY_PREWARM)) {
+			log_debug("debug: mta: prewarming %s",
+			    mta_relay_to_text(r));
+			r->state |= RELAY_PREWARM;
+			mta_relay_ref(r);
+			stat_increment("mta.relay.prewarm", 1);
+		}
+		else if (r->prewarm == 0 && r->state & RELAY_PREWARM) {
+			log_debug("debug: mta: no longer prewarming %s",
+			    mta_relay_to_text(r));
+			r->state &= ~RELAY_PREWARM;
+			mta_relay_unref(r); /* from above */
+			stat_decrement("mta.relay.prewarm", 1);
+		}
+
+		if (r->prewarm == 0 || r->nconn >= r->prewarm)
+			continue;
+
+		iter = NULL;
+		while (tree_iter(&r->connectors, &iter, NULL, (void **)&c)) {
+			if (c->flags & CONNECTOR_ERROR)
+				continue;
+			mta_connect(c);
+			if (r->nconn >= r->prewarm)
+				break;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		mta_relay_unref(hot[i]); /* from here */
+	free(hot);
+
+	tv.tv_sec = DELAY_PREWARM;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_prewarm, &tv);
+}
+
+static int
+mta_prewarm_cmp(const void *a, const void *b)
+{
+	const struct mta_relay	*ra = *(struct mta_relay * const *)a;
+	const struct mta_relay	*rb = *(struct mta_relay * const *)b;
+
+	if (ra->score > rb->score)
+		return (-1);
+	if (ra->score < rb->score)
+		return (1);
+	return (0);
+}
+
 static void
 mta_delivery_flush_event(int fd, short event, void *arg)
 {
@@ -1198,6 +1421,10 @@ mta_on_source(struct mta_relay *relay, struct mta_source *source)
 			relay->sourceloop = 0;
 		else
 			delay = DELAY_CHECK_SOURCE_FAST;
+		/* look for a better source soon if this one is throttled */
+		if (delay == DELAY_CHECK_SOURCE_SLOW &&
+		    mta_srcstat_score(source, relay->domain->name) < SRCSTAT_LOW)
+			delay = DELAY_CHECK_SOURCE;
 		mta_source_unref(source); /* from constructor */
 	}
 	else {
@@ -1244,7 +1471,8 @@ mta_connect(struct mta_connector *c)
 	struct mta_route	*route;
 	struct mta_mx		*mx;
 	struct mta_limits	*l = c->relay->limits;
-	int			 limits;
+	size_t			 maxconn;
+	int			 limits, score;
 	time_t			 nextconn, now;
 
 	/* toggle the block flag */
@@ -1265,19 +1493,20 @@ mta_connect(struct mta_connector *c)
 
 	if (c->flags & CONNECTOR_WAIT) {
 		log_debug("debug: mta: cancelling connector timeout");
-		runq_cancel(runq_connector, c);
+		runq_job_cancel(runq_connector, &c->runq);
 		c->flags &= ~CONNECTOR_WAIT;
 	}
 
-	/* No job. */
-	if (c->relay->ntask == 0) {
+	/* No job, and no need to keep the relay warm. */
+	if (c->relay->ntask == 0 && c->relay->nconn >= c->relay->prewarm) {
 		log_debug("debug: mta: no task for connector");
 		return;
 	}
 
 	/* Do not create more connections than necessary */
-	if ((c->relay->nconn_ready >= c->relay->ntask) ||
-	    (c->relay->nconn > 2 && c->relay->nconn >= c->relay->ntask / 2)) {
+	if (c->relay->nconn >= c->relay->prewarm &&
+	    ((c->relay->nconn_ready >= c->relay->ntask) ||
+	    (c->relay->nconn > 2 && c->relay->nconn >= c->relay->ntask / 2))) {
 		log_debug("debug: mta: enough connections already");
 		return;
 	}
@@ -1313,7 +1542,18 @@ mta_connect(struct mta_connector *c)
 		    (unsigned long long) c->lastconn + l->conndelay_connector - now);
 		nextconn = c->lastconn + l->conndelay_connector;
 	}
-	if (c->nconn >= l->maxconn_per_connector) {
+	/*
+	 * Scale the connector limit down if the destination has been
+	 * deferring mails sent from this source lately.
+	 */
+	maxconn = l->maxconn_per_connector;
+	score = mta_srcstat_score(c->source, c->relay->domain->name);
+	if (score < 100) {
+		maxconn = maxconn * score / 100;
+		if (maxconn == 0)
+			maxconn = 1;
+	}
+	if (c->nconn >= maxconn) {
 		log_debug("debug: mta: hit connector limit");
 		limits |= CONNECTOR_LIMIT_CONN;
 	}
@@ -1357,7 +1597,7 @@ mta_connect(struct mta_connector *c)
 		    mta_connector_to_text(c),
 		    (unsigned long long) nextconn - time(NULL));
 		c->flags |= CONNECTOR_WAIT;
-		runq_schedule_at(runq_connector, nextconn, c);
+		runq_job_schedule_at(runq_connector, nextconn, c, &c->runq);
 		return;
 	}
 
@@ -1377,6 +1617,8 @@ mta_connect(struct mta_connector *c)
 	route->src->lastconn = c->lastconn;
 	route->dst->nconn += 1;
 	route->dst->lastconn = c->lastconn;
+	if (c->relay->smarthost)
+		c->relay->smarthost->nconn += 1;
 
 	mta_session(c->relay, route, mx->mxname);	/* this never fails synchronously */
 	mta_relay_ref(c->relay);
@@ -1391,6 +1633,7 @@ mta_on_timeout(struct runq *runq, void *arg)
 	struct mta_relay	*relay = arg;
 	struct mta_route	*route = arg;
 	struct hoststat		*hs = arg;
+	struct mta_srcstat	*ss = arg;
 
 	if (runq == runq_relay) {
 		log_debug("debug: mta: ... timeout for %s",
@@ -1416,6 +1659,12 @@ mta_on_timeout(struct runq *runq, void *arg)
 		mta_hoststat_remove_entry(hs);
 		free(hs);
 	}
+	else if (runq == runq_srcstat) {
+		SPLAY_REMOVE(mta_srcstat_tree, &srcstats, ss);
+		mta_source_unref(ss->source);
+		free(ss->domain);
+		free(ss);
+	}
 }
 
 static void
@@ -1436,12 +1685,12 @@ mta_route_disable(struct mta_route *route, int penalty, int reason)
 	    mta_route_to_text(route), delay);
 
 	if (route->flags & ROUTE_DISABLED)
-		runq_cancel(runq_route, route);
+		runq_job_cancel(runq_route, &route->runq);
 	else
 		mta_route_ref(route);
 
 	route->flags |= reason & ROUTE_DISABLED;
-	runq_schedule(runq_route, delay, route);
+	runq_job_schedule(runq_route, delay, route, &route->runq);
 }
 
 static void
@@ -1534,7 +1783,7 @@ mta_drain(struct mta_relay *r)
 		log_debug("debug: mta: scheduling relay %s in %llus...",
 		    mta_relay_to_text(r),
 		    (unsigned long long) r->nextsource - time(NULL));
-		runq_schedule_at(runq_relay, r->nextsource, r);
+		runq_job_schedule_at(runq_relay, r->nextsource, r, &r->runq);
 		r->status |= RELAY_WAIT_CONNECTOR;
 		mta_relay_ref(r);
 	}
@@ -1591,6 +1840,11 @@ mta_flush(struct mta_relay *relay, int fail, const char *error)
 
 	stat_decrement("mta.task", relay->ntask);
 	stat_decrement("mta.envelope", n);
+	if (relay->smarthost) {
+		relay->smarthost->ntask -= relay->ntask;
+		if (fail == IMSG_MTA_DELIVERY_TEMPFAIL)
+			mta_smarthost_fail(relay->smarthost);
+	}
 	relay->ntask = 0;
 
 	/* release all waiting envelopes for the relay */
@@ -1853,6 +2107,7 @@ mta_relay(struct envelope *e, struct relayhost *relayh)
 	if ((r = SPLAY_FIND(mta_relay_tree, &relays, &key)) == NULL) {
 		r = xcalloc(1, sizeof *r);
 		TAILQ_INIT(&r->tasks);
+		TAILQ_INIT(&r->idle);
 		r->id = generate_uid();
 		r->dispatcher = dispatcher;
 		r->tls = key.tls;
@@ -2038,18 +2293,20 @@ mta_relay_show(struct mta_relay *r, struct mproc *p, uint32_t id, time_t t)
 	SHOWSTATUS(RELAY_WAIT_CONNECTOR, "connector");
 #undef SHOWSTATUS
 
-	if (runq_pending(runq_relay, r, &to))
+	if (runq_job_pending(r->runq, &to))
 		(void)snprintf(dur, sizeof(dur), "%s", duration_to_text(to - t));
 	else
 		(void)strlcpy(dur, "-", sizeof(dur));
 
-	(void)snprintf(buf, sizeof(buf), "%s refcount=%d ntask=%zu nconn=%zu lastconn=%s timeout=%s wait=%s%s",
+	(void)snprintf(buf, sizeof(buf), "%s refcount=%d ntask=%zu nconn=%zu lastconn=%s timeout=%s score=%zu prewarm=%zu wait=%s%s",
 	    mta_relay_to_text(r),
 	    r->refcount,
 	    r->ntask,
 	    r->nconn,
 	    r->lastconn ? duration_to_text(t - r->lastconn) : "-",
 	    dur,
+	    r->score,
+	    r->prewarm,
 	    flags,
 	    (r->state & RELAY_ONHOLD) ? "ONHOLD" : "");
 	m_compose(p, IMSG_CTL_MTA_SHOW_RELAYS, id, 0, -1, buf, strlen(buf) + 1);
@@ -2057,7 +2314,7 @@ mta_relay_show(struct mta_relay *r, struct mproc *p, uint32_t id, time_t t)
 	iter = NULL;
 	while (tree_iter(&r->connectors, &iter, NULL, (void **)&c)) {
 
-		if (runq_pending(runq_connector, c, &to))
+		if (runq_job_pending(c->runq, &to))
 			(void)snprintf(dur, sizeof(dur), "%s", duration_to_text(to - t));
 		else
 			(void)strlcpy(dur, "-", sizeof(dur));
@@ -2091,12 +2348,13 @@ mta_relay_show(struct mta_relay *r, struct mproc *p, uint32_t id, time_t t)
 #undef SHOWFLAG
 
 		(void)snprintf(buf, sizeof(buf),
-		    "  connector %s refcount=%d nconn=%zu lastconn=%s timeout=%s flags=%s",
+		    "  connector %s refcount=%d nconn=%zu lastconn=%s timeout=%s score=%d flags=%s",
 		    mta_source_to_text(c->source),
 		    c->refcount,
 		    c->nconn,
 		    c->lastconn ? duration_to_text(t - c->lastconn) : "-",
 		    dur,
+		    mta_srcstat_score(c->source, r->domain->name),
 		    flags);
 		m_compose(p, IMSG_CTL_MTA_SHOW_RELAYS, id, 0, -1, buf,
 		    strlen(buf) + 1);
@@ -2420,7 +2678,7 @@ mta_connector_free(struct mta_connector *c)
 	if (c->flags & CONNECTOR_WAIT) {
 		log_debug("debug: mta: cancelling timeout for %s",
 		    mta_connector_to_text(c));
-		runq_cancel(runq_connector, c);
+		runq_job_cancel(runq_connector, &c->runq);
 	}
 	mta_source_unref(c->source); /* from constructor */
 	free(c);
@@ -2465,7 +2723,7 @@ mta_route(struct mta_source *src, struct mta_host *dst)
 		log_debug("debug: mta: mta_route_ref(): cancelling runq for route %s",
 		    mta_route_to_text(r));
 		r->flags &= ~(ROUTE_RUNQ | ROUTE_KEEPALIVE);
-		runq_cancel(runq_route, r);
+		runq_job_cancel(runq_route, &r->runq);
 		r->refcount--; /* from mta_route_unref() */
 	}
 
@@ -2520,7 +2778,7 @@ mta_route_unref(struct mta_route *r)
 
 	if (sched > now) {
 		r->flags |= ROUTE_RUNQ;
-		runq_schedule_at(runq_route, sched, r);
+		runq_job_schedule_at(runq_route, sched, r, &r->runq);
 		r->refcount++;
 		return;
 	}
@@ -2637,6 +2895,80 @@ mta_block_cmp(const struct mta_block *a, const struct mta_block *b)
 
 SPLAY_GENERATE(mta_block_tree, mta_block, entry, mta_block_cmp);
 
+static struct mta_srcstat *
+mta_srcstat(struct mta_source *src, const char *domain, int create)
+{
+	struct mta_srcstat	 key, *ss;
+
+	key.source = src;
+	key.domain = (char *)domain;
+	ss = SPLAY_FIND(mta_srcstat_tree, &srcstats, &key);
+	if (ss || !create)
+		return (ss);
+
+	ss = xcalloc(1, sizeof(*ss));
+	ss->source = src;
+	mta_source_ref(src);
+	ss->domain = xstrdup(domain);
+	ss->lastdecay = time(NULL);
+	SPLAY_INSERT(mta_srcstat_tree, &srcstats, ss);
+	runq_job_schedule(runq_srcstat, SRCSTAT_EXPIRE_DELAY, ss, &ss->runq);
+
+	return (ss);
+}
+
+/*
+ * Halve the counters for every elapsed decay period, so that the
+ * score reflects how the destination treats the source lately.
+ */
+static void
+mta_srcstat_decay(struct mta_srcstat *ss, time_t now)
+{
+	time_t	n;
+
+	n = (now - ss->lastdecay) / SRCSTAT_DECAY_DELAY;
+	if (n <= 0)
+		return;
+	if (n >= (time_t)(sizeof(size_t) * 8)) {
+		ss->ok = 0;
+		ss->tempfail = 0;
+	}
+	else {
+		ss->ok >>= n;
+		ss->tempfail >>= n;
+	}
+	ss->lastdecay += n * SRCSTAT_DECAY_DELAY;
+}
+
+/*
+ * Return the percentage of recent transactions from this source that
+ * were not deferred by the destination, or 100 if nothing is known.
+ */
+static int
+mta_srcstat_score(struct mta_source *src, const char *domain)
+{
+	struct mta_srcstat	*ss;
+
+	if ((ss = mta_srcstat(src, domain, 0)) == NULL)
+		return (100);
+
+	mta_srcstat_decay(ss, time(NULL));
+
+	return ((ss->ok + 1) * 100 / (ss->ok + ss->tempfail + 1));
+}
+
+static int
+mta_srcstat_cmp(const struct mta_srcstat *a, const struct mta_srcstat *b)
+{
+	if (a->source < b->source)
+		return (-1);
+	if (a->source > b->source)
+		return (1);
+	return (strcasecmp(a->domain, b->domain));
+}
+
+SPLAY_GENERATE(mta_srcstat_tree, mta_srcstat, entry, mta_srcstat_cmp);
+
 
 
 /* hoststat errors are not critical, we do best effort */
@@ -2654,15 +2986,13 @@ mta_hoststat_update(const char *host, const char *error)
 		if ((hs = calloc(1, sizeof *hs)) == NULL)
 			return;
 		tree_init(&hs->deferred);
-		runq_schedule(runq_hoststat, HOSTSTAT_EXPIRE_DELAY, hs);
 	}
 	(void)strlcpy(hs->name, buf, sizeof hs->name);
 	(void)strlcpy(hs->error, error, sizeof hs->error);
 	hs->tm = time(NULL);
 	dict_set(&hoststat, buf, hs);
 
-	runq_cancel(runq_hoststat, hs);
-	runq_schedule(runq_hoststat, HOSTSTAT_EXPIRE_DELAY, hs);
+	runq_job_schedule(runq_hoststat, HOSTSTAT_EXPIRE_DELAY, hs, &hs->runq);
 }
 
 void
@@ -2726,5 +3056,148 @@ mta_hoststat_remove_entry(struct hoststat *hs)
 	while (tree_poproot(&hs->deferred, NULL, NULL))
 		;
 	dict_pop(&hoststat, hs->name);
-	runq_cancel(runq_hoststat, hs);
+	runq_job_cancel(runq_hoststat, &hs->runq);
+}
+
+static int
+mta_smarthost_key(char *buf, size_t len, const char *name, int *weight)
+{
+	struct relayhost	relayh;
+	int			n;
+
+	memset(&relayh, 0, sizeof(relayh));
+	if (!text_to_relayhost(&relayh, name))
+		return (0);
+
+	n = snprintf(buf, len, "%d:%d:%s:%d:%s", relayh.tls, relayh.flags,
+	    relayh.hostname, relayh.port, relayh.authlabel);
+	if (n < 0 || (size_t)n >= len)
+		return (0);
+	if (weight)
+		*weight = relayh.weight;
+
+	return (1);
+}
+
+static struct mta_smarthost *
+mta_smarthost_lookup(const char *name)
+{
+	char	key[LINE_MAX];
+
+	if (!mta_smarthost_key(key, sizeof key, name, NULL))
+		return (NULL);
+
+	return (dict_get(&smarthosts, key));
+}
+
+/*
+ * Record the relay host returned by the table, and choose among the
+ * known hosts of that table the one with the lowest load with regard
+ * to its weight, skipping the hosts that are currently marked down.
+ */
+static const char *
+mta_smarthost_select(const char *table, const char *fetched)
+{
+	struct mta_smarthost	*sh, *best;
+	struct dict		*pool;
+	const char		*k;
+	char			 key[LINE_MAX];
+	void			*iter;
+	time_t			 now;
+	int			 weight;
+
+	/* let the caller report the error */
+	if (!mta_smarthost_key(key, sizeof key, fetched, &weight))
+		return (fetched);
+
+	now = time(NULL);
+
+	if ((pool = dict_get(&smarthost_pools, table)) == NULL) {
+		pool = xcalloc(1, sizeof(*pool));
+		dict_init(pool);
+		dict_xset(&smarthost_pools, table, pool);
+	}
+
+	if ((sh = dict_get(&smarthosts, key)) == NULL) {
+		sh = xcalloc(1, sizeof(*sh));
+		sh->name = xstrdup(fetched);
+		dict_xset(&smarthosts, key, sh);
+		stat_increment("mta.smarthost", 1);
+	}
+	if (!dict_check(pool, key))
+		dict_xset(pool, key, sh);
+	sh->weight = weight;
+	sh->lastseen = now;
+
+	best = NULL;
+	iter = NULL;
+	while (dict_iter(pool, &iter, &k, (void **)&sh)) {
+		/* no longer returned by the table */
+		if (sh->lastseen + SMARTHOST_EXPIRE_DELAY < now)
+			continue;
+		if (sh->nfail) {
+			if (sh->downuntil > now)
+				continue;
+			/* only let one probe through at a time */
+			if (sh->flags & SMARTHOST_PROBE &&
+			    sh->lastprobe + DELAY_SMARTHOST_PROBE > now)
+				continue;
+		}
+		if (best == NULL ||
+		    (sh->ntask + sh->nconn) * (size_t)best->weight <
+		    (best->ntask + best->nconn) * (size_t)sh->weight)
+			best = sh;
+	}
+
+	if (best == NULL) {
+		log_debug("debug: mta: all smarthosts down for table %s, "
+		    "using %s", table, fetched);
+		return (fetched);
+	}
+
+	if (best->nfail) {
+		log_info("smtp-out: Probing smarthost %s", best->name);
+		best->flags |= SMARTHOST_PROBE;
+		best->lastprobe = now;
+	}
+
+	return (best->name);
+}
+
+static void
+mta_smarthost_fail(struct mta_smarthost *sh)
+{
+	time_t	now, delay;
+
+	now = time(NULL);
+	if (sh->downuntil > now)
+		return;
+
+	sh->nfail += 1;
+	sh->flags &= ~SMARTHOST_PROBE;
+
+	delay = DELAY_SMARTHOST_BASE;
+	if (sh->nfail > 1)
+		delay <<= (sh->nfail > 8) ? 7 : sh->nfail - 1;
+	if (delay > DELAY_SMARTHOST_MAX)
+		delay = DELAY_SMARTHOST_MAX;
+	sh->downuntil = now + delay;
+
+	if (sh->nfail == 1)
+		stat_increment("mta.smarthost.down", 1);
+	log_info("smtp-out: Disabling smarthost %s for %llus",
+	    sh->name, (unsigned long long)delay);
+}
+
+static void
+mta_smarthost_ok(struct mta_smarthost *sh)
+{
+	if (sh->nfail == 0)
+		return;
+
+	log_info("smtp-out: Enabling smarthost %s", sh->name);
+	stat_decrement("mta.smarthost.down", 1);
+	sh->nfail = 0;
+	sh->downuntil = 0;
+	sh->flags &= ~SMARTHOST_PROBE;
 }
@@ -81,6 +81,7 @@ enum mta_state {
 #define MTA_WAIT		0x1000
 #define MTA_HANGON		0x2000
 #define MTA_RECONN		0x4000
+#define MTA_IDLE		0x8000
 
 #define MTA_EXT_STARTTLS	0x01
 #define MTA_EXT_PIPELINING	0x02
@@ -99,6 +100,7 @@ struct mta_session {
 	char			*username;
 
 	int			 flags;
+	TAILQ_ENTRY(mta_session) entry;	/* on relay idle list */
 
 	int			 attempt;
 	int			 use_smtps;
@@ -371,6 +373,25 @@ mta_tree_pop(struct tree *wait, uint64_t reqid)
 	return (s);
 }
 
+/*
+ * Wake up an idle session on the given relay so that it picks up
+ * a newly queued task without waiting for the next hangon tick.
+ */
+void
+mta_session_kick(struct mta_relay *relay)
+{
+	struct mta_session	*s;
+
+	if ((s = TAILQ_FIRST(&relay->idle)) == NULL)
+		return;
+
+	log_debug("debug: mta: %p: waking up idle session", s);
+	runq_cancel(hangon, s);
+	TAILQ_REMOVE(&relay->idle, s, entry);
+	s->flags &= ~(MTA_HANGON | MTA_IDLE);
+	mta_enter_state(s, MTA_READY);
+}
+
 static void
 mta_free(struct mta_session *s)
 {
@@ -388,6 +409,8 @@ mta_free(struct mta_session *s)
 		log_debug("debug: mta: %p: cancelling hangon timer", s);
 		runq_cancel(hangon, s);
 	}
+	if (s->flags & MTA_IDLE)
+		TAILQ_REMOVE(&s->relay->idle, s, entry);
 
 	if (s->io)
 		io_free(s->io);
@@ -429,7 +452,9 @@ mta_on_timeout(struct runq *runq, void *arg)
 
 	log_debug("mta: timeout for session hangon");
 
-	s->flags &= ~MTA_HANGON;
+	if (s->flags & MTA_IDLE)
+		TAILQ_REMOVE(&s->relay->idle, s, entry);
+	s->flags &= ~(MTA_HANGON | MTA_IDLE);
 	s->hangon++;
 
 	mta_enter_state(s, MTA_READY);
@@ -741,6 +766,26 @@ again:
 			log_debug("debug: mta: %p: no task for relay %s",
 			    s, mta_relay_to_text(s->relay));
 
+			/*
+			 * Prewarmed session: stay around, and issue a RSET
+			 * from time to time so that the remote end does not
+			 * drop us for being idle.
+			 */
+			if (s->relay->nconn <= s->relay->prewarm) {
+				if (s->hangon >=
+				    s->relay->limits->prewarm_keepalive) {
+					log_debug("debug: mta: %p: refreshing "
+					    "prewarmed session", s);
+					s->hangon = 0;
+					mta_enter_state(s, MTA_RSET);
+					break;
+				}
+				s->flags |= MTA_HANGON | MTA_IDLE;
+				TAILQ_INSERT_TAIL(&s->relay->idle, s, entry);
+				runq_schedule(hangon, 1, s);
+				break;
+			}
+
 			if (s->relay->nconn > 1 ||
 			    s->hangon >= s->relay->limits->sessdelay_keepalive) {
 				mta_enter_state(s, MTA_QUIT);
@@ -750,7 +795,8 @@ again:
 			log_debug("mta: debug: last connection: hanging on for %llds",
 			    (long long)(s->relay->limits->sessdelay_keepalive -
 			    s->hangon));
-			s->flags |= MTA_HANGON;
+			s->flags |= MTA_HANGON | MTA_IDLE;
+			TAILQ_INSERT_TAIL(&s->relay->idle, s, entry);
 			runq_schedule(hangon, 1, s);
 			break;
 		}
@@ -1481,6 +1527,9 @@ mta_flush_task(struct mta_session *s, int delivery, const char *error, size_t co
 	while ((e = TAILQ_FIRST(&s->task->envelopes))) {
 
 		if (count && n == count) {
+			if (s->state != MTA_READY)
+				mta_source_delivery(s->relay, s->route,
+				    delivery, n);
 			stat_decrement("mta.envelope", n);
 			return;
 		}
@@ -1517,6 +1566,10 @@ mta_flush_task(struct mta_session *s, int delivery, const char *error, size_t co
 		n++;
 	}
 
+	/* local failures before the transaction do not count */
+	if (s->state != MTA_READY)
+		mta_source_delivery(s->relay, s->route, delivery, n);
+
 	free(s->task->sender);
 	free(s->task);
 	s->task = NULL;
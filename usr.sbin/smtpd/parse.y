@@ -102,6 +102,7 @@ struct table		*table = NULL;
 struct mta_limits	*limits;
 static struct pki	*pki;
 static struct ca	*sca;
+static struct scheduler_class *sclass;
 
 struct dispatcher	*dsp;
 struct rule		*rule;
@@ -178,28 +179,28 @@ typedef struct {
 %}
 
 %token	ACTION ADMD ALIAS ANY ARROW AUTH AUTH_OPTIONAL
-%token	BACKUP BOUNCE BYPASS
-%token	CA CERT CHAIN CHROOT CIPHERS COMMIT COMPRESSION CONNECT
-%token	DATA DATA_LINE DHE DISCONNECT DOMAIN
+%token	BACKUP BOUNCE BUNDLE BYPASS
+%token	CA CERT CHAIN CHROOT CIPHERS CLASS COMMIT COMPRESSION CONNECT
+%token	DATA DATA_LINE DHE DICTIONARY DISCONNECT DOMAIN
 %token	EHLO ENABLE ENCRYPTION ERROR EXPAND_ONLY 
-%token	FCRDNS FILTER FOR FORWARD_ONLY FROM
+%token	FAIR_QUEUE FCRDNS FILTER FOR FORWARD_ONLY FROM
 %token	GROUP
 %token	HELO HELO_SRC HOST HOSTNAME HOSTNAMES
-%token	INCLUDE INET4 INET6
+%token	INCLUDE INET4 INET6 INTERACTIVE
 %token	JUNK
 %token	KEY
-%token	LIMIT LISTEN LMTP LOCAL
-%token	MAIL_FROM MAILDIR MASK_SRC MASQUERADE MATCH MAX_MESSAGE_SIZE MAX_DEFERRED MBOX MDA MTA MX
+%token	LEVEL LEVELS LIMIT LISTEN LMTP LOCAL
+%token	MAIL_FROM MAILDIR MASK_SRC MASQUERADE MATCH MAX_MESSAGE_SIZE MAX_DEFERRED MBOX MDA MEMORY MTA MX
 %token	NO_DSN NO_VERIFY NOOP
 %token	ON
-%token	PHASE PKI PORT PROC PROC_EXEC PROTOCOLS PROXY_V2
+%token	PHASE PKI PORT PREWARM PROC PROC_EXEC PROTOCOLS PROXY_V2
 %token	QUEUE QUIT
 %token	RCPT_TO RDNS RECIPIENT RECEIVEDAUTH REGEX RELAY REJECT REPORT REWRITE RSET
 %token	SCHEDULER SENDER SENDERS SMTP SMTP_IN SMTP_OUT SMTPS SOCKET SRC SRS SUB_ADDR_DELIM
 %token	TABLE TAG TAGGED TLS TLS_REQUIRE TTL
 %token	USER USERBASE
 %token	VERIFY VIRTUAL
-%token	WARN_INTERVAL WRAPPER
+%token	WARN_INTERVAL WEIGHT WRAPPER
 
 %token	<v.string>	STRING
 %token  <v.number>	NUMBER
@@ -381,6 +382,13 @@ mta:
 MTA MAX_DEFERRED NUMBER  {
 	conf->sc_mta_max_deferred = $3;
 }
+| MTA PREWARM NUMBER {
+	if ($3 < 0) {
+		yyerror("invalid prewarm value: %" PRId64, $3);
+		YYERROR;
+	}
+	conf->sc_mta_prewarm = $3;
+}
 | MTA LIMIT FOR DOMAIN STRING {
 	struct mta_limits	*d;
 
@@ -502,8 +510,56 @@ proc_params_opt proc_params
 ;
 
 
+queue_compression_opt:
+LEVEL NUMBER {
+	if (conf->sc_queue_compress_level) {
+		yyerror("compression level already specified");
+		YYERROR;
+	}
+	if ($2 <= 0 || $2 > INT_MAX) {
+		yyerror("invalid compression level: %" PRId64, $2);
+		YYERROR;
+	}
+	conf->sc_queue_compress_level = $2;
+}
+| DICTIONARY STRING {
+	if (conf->sc_queue_compress_dict) {
+		yyerror("compression dictionary already specified");
+		free($2);
+		YYERROR;
+	}
+	conf->sc_queue_compress_dict = $2;
+}
+;
+
+queue_compression_opts:
+queue_compression_opt queue_compression_opts
+| /* empty */
+;
+
 queue:
-QUEUE COMPRESSION {
+QUEUE BUNDLE {
+	conf->sc_queue_flags |= QUEUE_BUNDLE;
+}
+| QUEUE COMPRESSION queue_compression_opts {
+	if (conf->sc_queue_compress_dict) {
+		yyerror("compression dictionary requires zstd");
+		YYERROR;
+	}
+	conf->sc_queue_flags |= QUEUE_COMPRESSION;
+}
+| QUEUE COMPRESSION STRING queue_compression_opts {
+	if (compress_backend_lookup($3) == NULL) {
+		yyerror("unsupported queue compression: %s", $3);
+		free($3);
+		YYERROR;
+	}
+	if (conf->sc_queue_compress_dict && strcmp($3, "zstd")) {
+		yyerror("compression dictionary requires zstd");
+		free($3);
+		YYERROR;
+	}
+	conf->sc_queue_compress = $3;
 	conf->sc_queue_flags |= QUEUE_COMPRESSION;
 }
 | QUEUE ENCRYPTION {
@@ -518,6 +574,16 @@ QUEUE COMPRESSION {
 		conf->sc_queue_key = $3;
 	conf->sc_queue_flags |= QUEUE_ENCRYPTION;
 }
+| QUEUE LEVELS NUMBER {
+	if ($3 < 1 || $3 > QUEUE_LEVELS_MAX) {
+		yyerror("invalid queue levels: %" PRId64, $3);
+		YYERROR;
+	}
+	conf->sc_queue_levels = $3;
+}
+| QUEUE MEMORY size {
+	conf->sc_queue_memory = $3;
+}
 | QUEUE TTL STRING {
 	conf->sc_ttl = delaytonum($3);
 	if (conf->sc_ttl == -1) {
@@ -530,8 +596,64 @@ QUEUE COMPRESSION {
 ;
 
 
+scheduler_class_opt:
+WEIGHT NUMBER {
+	if ($2 < 1 || $2 > UINT16_MAX) {
+		yyerror("invalid scheduler class weight: %" PRId64, $2);
+		YYERROR;
+	}
+	sclass->weight = $2;
+}
+| INTERACTIVE {
+	sclass->interactive = 1;
+}
+;
+
+scheduler_class_opts:
+scheduler_class_opt scheduler_class_opts
+| /* empty */
+;
+
 scheduler:
 SCHEDULER LIMIT limits_scheduler
+| SCHEDULER FAIR_QUEUE STRING {
+	if (strcmp($3, "dispatcher") == 0)
+		conf->sc_scheduler_class_key = SCHEDULER_CLASS_DISPATCHER;
+	else if (strcmp($3, "sender-domain") == 0)
+		conf->sc_scheduler_class_key = SCHEDULER_CLASS_SENDER_DOMAIN;
+	else {
+		yyerror("invalid fair-queue key: %s", $3);
+		free($3);
+		YYERROR;
+	}
+	free($3);
+}
+| SCHEDULER FAIR_QUEUE TAG {
+	conf->sc_scheduler_class_key = SCHEDULER_CLASS_TAG;
+}
+| SCHEDULER CLASS STRING {
+	if ($3[0] == '\0') {
+		yyerror("scheduler class name is empty");
+		free($3);
+		YYERROR;
+	}
+	if (strlen($3) >= SMTPD_CLASS_SIZE) {
+		yyerror("scheduler class name too long: %s", $3);
+		free($3);
+		YYERROR;
+	}
+	if (dict_check(conf->sc_scheduler_classes, $3)) {
+		yyerror("scheduler class already declared: %s", $3);
+		free($3);
+		YYERROR;
+	}
+	sclass = xcalloc(1, sizeof *sclass);
+	sclass->weight = 1;
+	dict_xset(conf->sc_scheduler_classes, $3, sclass);
+	free($3);
+} scheduler_class_opts {
+	sclass = NULL;
+}
 ;
 
 
@@ -2666,23 +2788,27 @@ lookup(char *s)
 		{ "auth-optional",     	AUTH_OPTIONAL },
 		{ "backup",		BACKUP },
 		{ "bounce",		BOUNCE },
+		{ "bundle",		BUNDLE },
 		{ "bypass",		BYPASS },
 		{ "ca",			CA },
 		{ "cert",		CERT },
 		{ "chain",		CHAIN },
 		{ "chroot",		CHROOT },
 		{ "ciphers",		CIPHERS },
+		{ "class",		CLASS },
 		{ "commit",		COMMIT },
 		{ "compression",	COMPRESSION },
 		{ "connect",		CONNECT },
 		{ "data",		DATA },
 		{ "data-line",		DATA_LINE },
 		{ "dhe",		DHE },
+		{ "dictionary",		DICTIONARY },
 		{ "disconnect",		DISCONNECT },
 		{ "domain",		DOMAIN },
 		{ "ehlo",		EHLO },
 		{ "encryption",		ENCRYPTION },
 		{ "expand-only",      	EXPAND_ONLY },
+		{ "fair-queue",		FAIR_QUEUE },
 		{ "fcrdns",		FCRDNS },
 		{ "filter",		FILTER },
 		{ "for",		FOR },
@@ -2697,8 +2823,11 @@ lookup(char *s)
 		{ "include",		INCLUDE },
 		{ "inet4",		INET4 },
 		{ "inet6",		INET6 },
+		{ "interactive",	INTERACTIVE },
 		{ "junk",		JUNK },
 		{ "key",		KEY },
+		{ "level",		LEVEL },
+		{ "levels",		LEVELS },
 		{ "limit",		LIMIT },
 		{ "listen",		LISTEN },
 		{ "lmtp",		LMTP },
@@ -2712,6 +2841,7 @@ lookup(char *s)
 		{ "max-message-size",  	MAX_MESSAGE_SIZE },
 		{ "mbox",		MBOX },
 		{ "mda",		MDA },
+		{ "memory",		MEMORY },
 		{ "mta",		MTA },
 		{ "mx",			MX },
 		{ "no-dsn",		NO_DSN },
@@ -2721,6 +2851,7 @@ lookup(char *s)
 		{ "phase",		PHASE },
 		{ "pki",		PKI },
 		{ "port",		PORT },
+		{ "prewarm",		PREWARM },
 		{ "proc",		PROC },
 		{ "proc-exec",		PROC_EXEC },
 		{ "protocols",		PROTOCOLS },
@@ -2758,6 +2889,7 @@ lookup(char *s)
 		{ "verify",		VERIFY },
 		{ "virtual",		VIRTUAL },
 		{ "warn-interval",	WARN_INTERVAL },
+		{ "weight",		WEIGHT },
 		{ "wrapper",		WRAPPER },
 	};
 	const struct keywords	*p;
@@ -41,29 +41,132 @@
 #include "smtpd.h"
 #include "log.h"
 
+struct queue_commit {
+	TAILQ_ENTRY(queue_commit)	 entry;
+	struct mproc			*p;
+	uint64_t			 reqid;
+	uint32_t			 msgid;
+};
+
+/*
+ * Envelopes requested together by the scheduler are loaded before being
+ * passed to the dispatcher in as few messages as possible, in binary
+ * form.
+ */
+#define	QUEUE_DELIVERY_MAX	(MAX_IMSGSIZE - IMSG_HEADER_SIZE)
+
+struct queue_delivery {
+	int				 type;
+	size_t				 pending;
+	size_t				 count;
+	struct envelope			*evps;
+};
+
+/*
+ * At startup the scheduler is first fed from the checkpoint, so that
+ * deliveries resume right away.  The queue is then walked to send the
+ * envelopes the checkpoint missed and to drop those it lists but which
+ * are gone.  Without a checkpoint, only the walk happens.
+ *
+ * Envelopes are passed as arrays of scheduler_info, together with the
+ * messages whose envelopes have all been sent and the envelopes to
+ * suspend or remove.  At most QUEUE_LOAD_WINDOW batches wait for the
+ * scheduler to acknowledge them.
+ */
+#define	QUEUE_LOAD_STEP		1024
+#define	QUEUE_LOAD_WINDOW	8
+#define	QUEUE_LOAD_IDS		64
+#define	QUEUE_LOAD_RECORDS						\
+	((MAX_IMSGSIZE - IMSG_HEADER_SIZE - 4 * sizeof(size_t) -	\
+	QUEUE_LOAD_IDS * (sizeof(uint32_t) + 2 * sizeof(uint64_t))) /	\
+	sizeof(struct scheduler_info))
+
+#define	QUEUE_LOAD_SEEN		0x01
+#define	QUEUE_LOAD_SUSPENDED	0x02
+
+enum queue_load_phase {
+	LOAD_CHECKPOINT,
+	LOAD_SUSPEND,
+	LOAD_WALK,
+	LOAD_RECONCILE,
+};
+
+struct queue_load {
+	struct event			 ev;
+	enum queue_load_phase		 phase;
+	struct checkpoint_reader	*reader;
+
+	struct scheduler_info		 si[QUEUE_LOAD_RECORDS];
+	size_t				 nsi;
+	uint32_t			 commits[QUEUE_LOAD_IDS];
+	size_t				 ncommits;
+	uint64_t			 suspends[QUEUE_LOAD_IDS];
+	size_t				 nsuspends;
+	uint64_t			 removes[QUEUE_LOAD_IDS];
+	size_t				 nremoves;
+	uint32_t			 msgid;
+
+	/* envelopes restored from the checkpoint, sorted */
+	uint64_t			*known;
+	uint8_t				*flags;
+	size_t				 nknown;
+	size_t				 aknown;
+	size_t				 cursor;
+
+	size_t				 inflight;
+	int				 paused;
+	time_t				 reported;
+	struct queue_load_status	 status;
+};
+
 static void queue_imsg(struct mproc *, struct imsg *);
-static void queue_timeout(int, short, void *);
+static void queue_load(int, short, void *);
+static int queue_load_step(void);
+static void queue_load_add(struct scheduler_info *);
+static void queue_load_known(uint64_t, int);
+static uint8_t *queue_load_lookup(uint64_t);
+static void queue_load_commit(void);
+static void queue_load_suspend(uint64_t);
+static void queue_load_remove(uint64_t);
+static void queue_load_flush(void);
+static void queue_load_done(void);
+static void queue_load_report(void);
 static void queue_bounce(struct envelope *, struct delivery_bounce *);
 static void queue_shutdown(void);
 static void queue_log(const struct envelope *, const char *, const char *);
 static void queue_msgid_walk(int, short, void *);
-
+static void queue_commit_done(uint32_t, int, void *);
+static void queue_commit_reply(struct queue_commit *, int);
+static void queue_commit_defer(struct queue_commit *);
+static void queue_commit_flush(int, short, void *);
+static void queue_update_done(struct envelope *, int, void *);
+static void queue_tempfail_done(struct envelope *, int, void *);
+static void queue_delivery_loaded(uint64_t, struct envelope *, void *);
+static void queue_delivery_flush(struct queue_delivery *);
+static void queue_load_failed(uint64_t);
+
+static TAILQ_HEAD(, queue_commit)	commits;
+static struct event			ev_commit;
+static struct queue_load		qload;
 
 static void
 queue_imsg(struct mproc *p, struct imsg *imsg)
 {
 	struct delivery_bounce	 bounce;
 	struct msg_walkinfo	*wi;
+	struct queue_commit	*qc;
+	struct queue_delivery	*qd;
 	struct timeval		 tv;
 	struct bounce_req_msg	*req_bounce;
+	struct scheduler_info	 si;
 	struct envelope		 evp;
 	struct msg		 m;
 	const char		*reason;
 	uint64_t		 reqid, evpid, holdq;
 	uint32_t		 msgid;
 	time_t			 nexttry;
-	size_t			 n_evp;
-	int			 fd, mta_ext, ret, v, flags, code;
+	size_t			 n_evp, n;
+	int			 fd, mta_ext, ret, v, flags, code, suspend;
 
 	if (imsg == NULL)
 		queue_shutdown();
@@ -95,6 +198,7 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		m_end(&m);
 
 		queue_message_delete(msgid);
+		checkpoint_rollback(msgid);
 
 		m_create(p_scheduler, IMSG_QUEUE_MESSAGE_ROLLBACK,
 		    0, 0, -1);
@@ -108,19 +212,20 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		m_get_msgid(&m, &msgid);
 		m_end(&m);
 
-		ret = queue_message_commit(msgid);
-
-		m_create(p, IMSG_SMTP_MESSAGE_COMMIT, 0, 0, -1);
-		m_add_id(p, reqid);
-		m_add_int(p, (ret == 0) ? 0 : 1);
-		m_close(p);
+		qc = xcalloc(1, sizeof *qc);
+		qc->p = p;
+		qc->reqid = reqid;
+		qc->msgid = msgid;
 
-		if (ret) {
-			m_create(p_scheduler, IMSG_QUEUE_MESSAGE_COMMIT,
-			    0, 0, -1);
-			m_add_msgid(p_scheduler, msgid);
-			m_close(p_scheduler);
+		if (!queue_message_group_commit()) {
+			queue_message_commit_async(msgid, queue_commit_done, qc);
+			return;
 		}
+
+		if (queue_message_commit(msgid))
+			queue_commit_defer(qc);
+		else
+			queue_commit_reply(qc, 0);
 		return;
 
 	case IMSG_SMTP_MESSAGE_OPEN:
@@ -163,9 +268,11 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		}
 		m_close(p_dispatcher);
 		if (ret) {
+			scheduler_info(&si, &evp);
+			checkpoint_stage(&si);
 			m_create(p_scheduler,
 			    IMSG_QUEUE_ENVELOPE_SUBMIT, 0, 0, -1);
-			m_add_envelope(p_scheduler, &evp);
+			m_add_scheduler_info(p_scheduler, &si);
 			m_close(p_scheduler);
 		}
 		return;
@@ -195,6 +302,7 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 
 		queue_log(&evp, "Remove", "Removed by administrator");
 		queue_envelope_delete(evpid);
+		checkpoint_delete(evpid);
 		return;
 
 	case IMSG_SCHED_ENVELOPE_EXPIRE:
@@ -217,6 +325,7 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		queue_bounce(&evp, &bounce);
 		queue_log(&evp, "Expire", "Envelope expired");
 		queue_envelope_delete(evpid);
+		checkpoint_delete(evpid);
 		return;
 
 	case IMSG_SCHED_ENVELOPE_BOUNCE:
@@ -234,51 +343,67 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		}
 		queue_bounce(&evp, &req_bounce->bounce);
 		evp.lastbounce = req_bounce->timestamp;
-		if (!queue_envelope_update(&evp))
-			log_warnx("warn: could not update envelope %016"PRIx64, evpid);
+		queue_envelope_update_async(&evp, queue_update_done, NULL);
+		scheduler_info(&si, &evp);
+		checkpoint_update(&si);
 		return;
 
-	case IMSG_SCHED_ENVELOPE_DELIVER:
+	case IMSG_SCHED_ENVELOPE_LOADED:
+		qload.inflight--;
+		if (qload.paused && qload.inflight < QUEUE_LOAD_WINDOW) {
+			qload.paused = 0;
+			tv.tv_sec = 0;
+			tv.tv_usec = 0;
+			evtimer_add(&qload.ev, &tv);
+		}
+		return;
+
+	case IMSG_SCHED_ENVELOPE_SUSPEND:
 		m_msg(&m, imsg);
-		m_get_evpid(&m, &evpid);
-		m_end(&m);
-		if (queue_envelope_load(evpid, &evp) == 0) {
-			log_warnx("queue: deliver: failed to load envelope");
-			m_create(p_scheduler, IMSG_QUEUE_ENVELOPE_REMOVE, 0, 0, -1);
-			m_add_evpid(p_scheduler, evpid);
-			m_add_u32(p_scheduler, 1); /* in-flight */
-			m_close(p_scheduler);
-			return;
+		m_get_int(&m, &suspend);
+		m_get_size(&m, &n);
+		while (n--) {
+			m_get_evpid(&m, &evpid);
+			checkpoint_suspend(evpid, suspend);
 		}
-		evp.lasttry = time(NULL);
-		m_create(p_dispatcher, IMSG_QUEUE_DELIVER, 0, 0, -1);
-		m_add_envelope(p_dispatcher, &evp);
-		m_close(p_dispatcher);
+		m_end(&m);
 		return;
 
-	case IMSG_SCHED_ENVELOPE_INJECT:
+	case IMSG_SCHED_ENVELOPE_PREFETCH:
 		m_msg(&m, imsg);
-		m_get_evpid(&m, &evpid);
+		m_get_size(&m, &n);
+		while (n--) {
+			m_get_evpid(&m, &evpid);
+			queue_envelope_prefetch(evpid);
+		}
 		m_end(&m);
-		bounce_add(evpid);
 		return;
 
+	case IMSG_SCHED_ENVELOPE_DELIVER:
 	case IMSG_SCHED_ENVELOPE_TRANSFER:
+		m_msg(&m, imsg);
+		m_get_size(&m, &n);
+		if (n == 0)
+			fatalx("queue: empty delivery batch");
+		qd = xcalloc(1, sizeof *qd);
+		qd->type = imsg->hdr.type == IMSG_SCHED_ENVELOPE_DELIVER ?
+		    IMSG_QUEUE_DELIVER : IMSG_QUEUE_TRANSFER;
+		qd->evps = xcalloc(n, sizeof *qd->evps);
+		qd->pending = n;
+		/* the last load may complete the batch and free it */
+		while (n--) {
+			m_get_evpid(&m, &evpid);
+			queue_envelope_load_async(evpid, queue_delivery_loaded,
+			    qd);
+		}
+		m_end(&m);
+		return;
+
+	case IMSG_SCHED_ENVELOPE_INJECT:
 		m_msg(&m, imsg);
 		m_get_evpid(&m, &evpid);
 		m_end(&m);
-		if (queue_envelope_load(evpid, &evp) == 0) {
-			log_warnx("queue: failed to load envelope");
-			m_create(p_scheduler, IMSG_QUEUE_ENVELOPE_REMOVE, 0, 0, -1);
-			m_add_evpid(p_scheduler, evpid);
-			m_add_u32(p_scheduler, 1); /* in-flight */
-			m_close(p_scheduler);
-			return;
-		}
-		evp.lasttry = time(NULL);
-		m_create(p_dispatcher, IMSG_QUEUE_TRANSFER, 0, 0, -1);
-		m_add_envelope(p_dispatcher, &evp);
-		m_close(p_dispatcher);
+		bounce_add(evpid);
 		return;
 
 	case IMSG_CTL_LIST_ENVELOPES:
@@ -337,6 +462,7 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		if (imsg->hdr.type == IMSG_MTA_DELIVERY_OK)
 			m_get_int(&m, &mta_ext);
 		m_end(&m);
+		queue_message_unref(evpid_to_msgid(evpid));
 		if (queue_envelope_load(evpid, &evp) == 0) {
 			log_warn("queue: dsn: failed to load envelope");
 			return;
@@ -354,6 +480,7 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 			}
 		}
 		queue_envelope_delete(evpid);
+		checkpoint_delete(evpid);
 		m_create(p_scheduler, IMSG_QUEUE_DELIVERY_OK, 0, 0, -1);
 		m_add_evpid(p_scheduler, evpid);
 		m_close(p_scheduler);
@@ -366,6 +493,7 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		m_get_string(&m, &reason);
 		m_get_int(&m, &code);
 		m_end(&m);
+		queue_message_unref(evpid_to_msgid(evpid));
 		if (queue_envelope_load(evpid, &evp) == 0) {
 			log_warnx("queue: tempfail: failed to load envelope");
 			m_create(p_scheduler, IMSG_QUEUE_ENVELOPE_REMOVE, 0, 0, -1);
@@ -378,11 +506,7 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		envelope_set_esc_class(&evp, ESC_STATUS_TEMPFAIL);
 		envelope_set_esc_code(&evp, code);
 		evp.retry++;
-		if (!queue_envelope_update(&evp))
-			log_warnx("warn: could not update envelope %016"PRIx64, evpid);
-		m_create(p_scheduler, IMSG_QUEUE_DELIVERY_TEMPFAIL, 0, 0, -1);
-		m_add_envelope(p_scheduler, &evp);
-		m_close(p_scheduler);
+		queue_envelope_update_async(&evp, queue_tempfail_done, NULL);
 		return;
 
 	case IMSG_MDA_DELIVERY_PERMFAIL:
@@ -392,6 +516,7 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		m_get_string(&m, &reason);
 		m_get_int(&m, &code);
 		m_end(&m);
+		queue_message_unref(evpid_to_msgid(evpid));
 		if (queue_envelope_load(evpid, &evp) == 0) {
 			log_warnx("queue: permfail: failed to load envelope");
 			m_create(p_scheduler, IMSG_QUEUE_ENVELOPE_REMOVE, 0, 0, -1);
@@ -406,6 +531,7 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		envelope_set_esc_code(&evp, code);
 		queue_bounce(&evp, &bounce);
 		queue_envelope_delete(evpid);
+		checkpoint_delete(evpid);
 		m_create(p_scheduler, IMSG_QUEUE_DELIVERY_PERMFAIL, 0, 0, -1);
 		m_add_evpid(p_scheduler, evpid);
 		m_close(p_scheduler);
@@ -416,6 +542,7 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		m_msg(&m, imsg);
 		m_get_evpid(&m, &evpid);
 		m_end(&m);
+		queue_message_unref(evpid_to_msgid(evpid));
 		if (queue_envelope_load(evpid, &evp) == 0) {
 			log_warnx("queue: loop: failed to load envelope");
 			m_create(p_scheduler, IMSG_QUEUE_ENVELOPE_REMOVE, 0, 0, -1);
@@ -430,6 +557,7 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 		bounce.type = B_FAILED;
 		queue_bounce(&evp, &bounce);
 		queue_envelope_delete(evp.id);
+		checkpoint_delete(evp.id);
 		m_create(p_scheduler, IMSG_QUEUE_DELIVERY_LOOP, 0, 0, -1);
 		m_add_evpid(p_scheduler, evp.id);
 		m_close(p_scheduler);
@@ -437,6 +565,9 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 
 	case IMSG_MTA_DELIVERY_HOLD:
 	case IMSG_MDA_DELIVERY_HOLD:
+		m_msg(&m, imsg);
+		m_get_evpid(&m, &evpid);
+		queue_message_unref(evpid_to_msgid(evpid));
 		imsg->hdr.type = IMSG_QUEUE_HOLDQ_HOLD;
 		m_forward(p_scheduler, imsg);
 		return;
@@ -497,9 +628,10 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 			return;
 		}
 
+		scheduler_info(&si, &evp);
 		m_create(p_scheduler, IMSG_QUEUE_DISCOVER_EVPID,
 		    0, 0, -1);
-		m_add_envelope(p_scheduler, &evp);
+		m_add_scheduler_info(p_scheduler, &si);
 		m_close(p_scheduler);
 
 		m_create(p_scheduler, IMSG_QUEUE_DISCOVER_MSGID,
@@ -533,6 +665,7 @@ static void
 queue_msgid_walk(int fd, short event, void *arg)
 {
 	struct envelope		 evp;
+	struct scheduler_info	 si;
 	struct timeval		 tv;
 	struct msg_walkinfo	*wi = arg;
 	int			 r;
@@ -554,8 +687,9 @@ queue_msgid_walk(int fd, short event, void *arg)
 	}
 
 	if (r) {
+		scheduler_info(&si, &evp);
 		m_create(p_scheduler, IMSG_QUEUE_DISCOVER_EVPID, 0, 0, -1);
-		m_add_envelope(p_scheduler, &evp);
+		m_add_scheduler_info(p_scheduler, &si);
 		m_close(p_scheduler);
 		wi->n_evp += 1;
 	}
@@ -569,7 +703,8 @@ queue_msgid_walk(int fd, short event, void *arg)
 static void
 queue_bounce(struct envelope *e, struct delivery_bounce *d)
 {
-	struct envelope	b;
+	struct scheduler_info	si;
+	struct envelope		b;
 
 	b = *e;
 	b.type = D_BOUNCE;
@@ -597,8 +732,11 @@ queue_bounce(struct envelope *e, struct delivery_bounce *d)
 		log_debug("debug: queue: bouncing evp:%016" PRIx64
 		    " as evp:%016" PRIx64, e->id, b.id);
 
+		scheduler_info(&si, &b);
+		checkpoint_update(&si);
+
 		m_create(p_scheduler, IMSG_QUEUE_ENVELOPE_SUBMIT, 0, 0, -1);
-		m_add_envelope(p_scheduler, &b);
+		m_add_scheduler_info(p_scheduler, &si);
 		m_close(p_scheduler);
 
 		m_create(p_scheduler, IMSG_QUEUE_MESSAGE_COMMIT, 0, 0, -1);
@@ -609,6 +747,151 @@ queue_bounce(struct envelope *e, struct delivery_bounce *d)
 	}
 }
 
+static void
+queue_commit_done(uint32_t msgid, int ret, void *arg)
+{
+	queue_commit_reply(arg, ret);
+}
+
+static void
+queue_commit_reply(struct queue_commit *qc, int ret)
+{
+	m_create(qc->p, IMSG_SMTP_MESSAGE_COMMIT, 0, 0, -1);
+	m_add_id(qc->p, qc->reqid);
+	m_add_int(qc->p, (ret == 0) ? 0 : 1);
+	m_close(qc->p);
+
+	if (ret) {
+		checkpoint_commit(qc->msgid);
+		m_create(p_scheduler, IMSG_QUEUE_MESSAGE_COMMIT, 0, 0, -1);
+		m_add_msgid(p_scheduler, qc->msgid);
+		m_close(p_scheduler);
+	} else
+		checkpoint_rollback(qc->msgid);
+	free(qc);
+}
+
+/*
+ * Commits received in the same event loop iteration are acknowledged
+ * together once the backend has made all of them durable.
+ */
+static void
+queue_commit_defer(struct queue_commit *qc)
+{
+	struct timeval		 tv;
+
+	TAILQ_INSERT_TAIL(&commits, qc, entry);
+
+	if (!evtimer_pending(&ev_commit, NULL)) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		evtimer_add(&ev_commit, &tv);
+	}
+}
+
+static void
+queue_commit_flush(int fd, short event, void *arg)
+{
+	struct queue_commit	*qc;
+	int			 ret;
+
+	ret = queue_message_sync();
+
+	while ((qc = TAILQ_FIRST(&commits))) {
+		TAILQ_REMOVE(&commits, qc, entry);
+		if (!ret)
+			queue_message_delete(qc->msgid);
+		queue_commit_reply(qc, ret);
+	}
+}
+
+static void
+queue_update_done(struct envelope *evp, int ret, void *arg)
+{
+	if (!ret)
+		log_warnx("warn: could not update envelope %016"PRIx64,
+		    evp->id);
+}
+
+static void
+queue_tempfail_done(struct envelope *evp, int ret, void *arg)
+{
+	struct scheduler_info	si;
+
+	queue_update_done(evp, ret, arg);
+
+	scheduler_info(&si, evp);
+	checkpoint_update(&si);
+
+	m_create(p_scheduler, IMSG_QUEUE_DELIVERY_TEMPFAIL, 0, 0, -1);
+	m_add_scheduler_info(p_scheduler, &si);
+	m_close(p_scheduler);
+}
+
+static void
+queue_delivery_loaded(uint64_t evpid, struct envelope *evp, void *arg)
+{
+	struct queue_delivery	*qd = arg;
+
+	if (evp == NULL) {
+		log_warnx("queue: %s: failed to load envelope",
+		    qd->type == IMSG_QUEUE_DELIVER ? "deliver" : "transfer");
+		queue_load_failed(evpid);
+	}
+	else {
+		evp->lasttry = time(NULL);
+		qd->evps[qd->count++] = *evp;
+	}
+
+	if (--qd->pending)
+		return;
+
+	queue_delivery_flush(qd);
+	free(qd->evps);
+	free(qd);
+}
+
+static void
+queue_delivery_flush(struct queue_delivery *qd)
+{
+	char	buf[sizeof(struct envelope)];
+	size_t	i, len, need, size = 0;
+
+	for (i = 0; i < qd->count; i++) {
+		len = envelope_dump_binary(&qd->evps[i], buf, sizeof buf);
+		if (len == 0) {
+			log_warnx("warn: queue: failed to dump envelope "
+			    "%016" PRIx64, qd->evps[i].id);
+			queue_load_failed(qd->evps[i].id);
+			continue;
+		}
+
+		/* evpid, then data length and envelope */
+		need = sizeof(uint64_t) + sizeof(size_t) + len;
+		if (size && size + need > QUEUE_DELIVERY_MAX) {
+			m_close(p_dispatcher);
+			size = 0;
+		}
+		if (size == 0)
+			m_create(p_dispatcher, qd->type, 0, 0, -1);
+		m_add_evpid(p_dispatcher, qd->evps[i].id);
+		m_add_data(p_dispatcher, buf, len);
+		size += need;
+		queue_message_ref(evpid_to_msgid(qd->evps[i].id));
+	}
+	if (size)
+		m_close(p_dispatcher);
+}
+
+static void
+queue_load_failed(uint64_t evpid)
+{
+	m_create(p_scheduler, IMSG_QUEUE_ENVELOPE_REMOVE, 0, 0, -1);
+	m_add_evpid(p_scheduler, evpid);
+	m_add_u32(p_scheduler, 1); /* in-flight */
+	m_close(p_scheduler);
+}
+
 static void
 queue_shutdown(void)
 {
@@ -622,7 +905,6 @@ queue(void)
 {
 	struct passwd	*pw;
 	struct timeval	 tv;
-	struct event	 ev_qload;
 
 	purge_config(PURGE_EVERYTHING & ~PURGE_DISPATCHERS);
 
@@ -631,7 +913,8 @@ queue(void)
 			fatalx("unknown user " SMTPD_USER);
 
 	env->sc_queue_flags |= QUEUE_EVPCACHE;
-	env->sc_queue_evpcache_size = 1024;
+	env->sc_queue_evpcache_size = 4 * 1024 * 1024;
+	env->sc_queue_msgcache_size = 64 * 1024 * 1024;
 
 	if (chroot(PATH_SPOOL) == -1)
 		fatal("queue: chroot");
@@ -641,7 +924,8 @@ queue(void)
 	config_process(PROC_QUEUE);
 
 	if (env->sc_queue_flags & QUEUE_COMPRESSION)
-		log_info("queue: queue compression enabled");
+		log_info("queue: queue compression enabled (%s)",
+		    env->sc_queue_compress);
 
 	if (env->sc_queue_key) {
 		if (!crypto_setup(env->sc_queue_key, strlen(env->sc_queue_key)))
@@ -668,11 +952,20 @@ queue(void)
 	config_peer(PROC_SCHEDULER);
 	config_peer(PROC_DISPATCHER);
 
+	TAILQ_INIT(&commits);
+	evtimer_set(&ev_commit, queue_commit_flush, NULL);
+
+	if (strcmp(backend_queue, "ram") && strcmp(backend_queue, "null") &&
+	    checkpoint_init())
+		qload.reader = checkpoint_reader_open();
+
 	/* setup queue loading task */
-	evtimer_set(&ev_qload, queue_timeout, &ev_qload);
+	qload.phase = qload.reader ? LOAD_CHECKPOINT : LOAD_WALK;
+	qload.status.start = time(NULL);
+	evtimer_set(&qload.ev, queue_load, NULL);
 	tv.tv_sec = 0;
-	tv.tv_usec = 10;
-	evtimer_add(&ev_qload, &tv);
+	tv.tv_usec = 0;
+	evtimer_add(&qload.ev, &tv);
 
 #if HAVE_PLEDGE
 	if (pledge("stdio rpath wpath cpath flock recvfd sendfd", NULL) == -1)
@@ -686,42 +979,258 @@ queue(void)
 }
 
 static void
-queue_timeout(int fd, short event, void *p)
+queue_load(int fd, short event, void *p)
 {
-	static uint32_t	 msgid = 0;
-	struct envelope	 evp;
-	struct event	*ev = p;
 	struct timeval	 tv;
-	int		 r;
+	size_t		 n;
 
-	r = queue_envelope_walk(&evp);
-	if (r == -1) {
-		if (msgid) {
-			m_create(p_scheduler, IMSG_QUEUE_MESSAGE_COMMIT,
-			    0, 0, -1);
-			m_add_msgid(p_scheduler, msgid);
-			m_close(p_scheduler);
+	for (n = 0; n < QUEUE_LOAD_STEP; n++) {
+		if (qload.inflight >= QUEUE_LOAD_WINDOW) {
+			/* resumed when the scheduler catches up */
+			qload.paused = 1;
+			queue_load_report();
+			return;
 		}
-		log_debug("debug: queue: done loading queue into scheduler");
-		return;
+		if (!queue_load_step())
+			return;
 	}
 
-	if (r) {
-		if (msgid && evpid_to_msgid(evp.id) != msgid) {
-			m_create(p_scheduler, IMSG_QUEUE_MESSAGE_COMMIT,
-			    0, 0, -1);
-			m_add_msgid(p_scheduler, msgid);
-			m_close(p_scheduler);
+	queue_load_report();
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	evtimer_add(&qload.ev, &tv);
+}
+
+static int
+queue_load_step(void)
+{
+	struct scheduler_info	 si;
+	struct envelope		 evp;
+	uint8_t			*flags;
+	int			 r, suspended;
+
+	switch (qload.phase) {
+	case LOAD_CHECKPOINT:
+		r = checkpoint_reader_next(qload.reader, &si, &suspended);
+		if (r == 1) {
+			queue_load_known(si.evpid, suspended);
+			queue_load_add(&si);
+			qload.status.restored++;
+			return (1);
 		}
-		msgid = evpid_to_msgid(evp.id);
-		m_create(p_scheduler, IMSG_QUEUE_ENVELOPE_SUBMIT, 0, 0, -1);
-		m_add_envelope(p_scheduler, &evp);
-		m_close(p_scheduler);
+		checkpoint_reader_close(qload.reader);
+		qload.reader = NULL;
+		queue_load_commit();
+		qload.status.state = QUEUE_LOAD_VALIDATING;
+		log_info("info: queue: restored %zu envelopes from checkpoint "
+		    "in %s", qload.status.restored,
+		    duration_to_text(time(NULL) - qload.status.start));
+		qload.phase = LOAD_SUSPEND;
+		qload.cursor = 0;
+		return (1);
+
+	case LOAD_SUSPEND:
+		while (qload.cursor < qload.nknown &&
+		    !(qload.flags[qload.cursor] & QUEUE_LOAD_SUSPENDED))
+			qload.cursor++;
+		if (qload.cursor == qload.nknown) {
+			qload.phase = LOAD_WALK;
+			return (1);
+		}
+		queue_load_suspend(qload.known[qload.cursor++]);
+		return (1);
+
+	case LOAD_WALK:
+		r = queue_envelope_walk(&evp);
+		if (r == -1) {
+			queue_load_commit();
+			qload.phase = LOAD_RECONCILE;
+			qload.cursor = 0;
+			return (1);
+		}
+		if (r == 0)
+			return (1);
+		if ((flags = queue_load_lookup(evp.id)) != NULL) {
+			*flags |= QUEUE_LOAD_SEEN;
+			return (1);
+		}
+		scheduler_info(&si, &evp);
+		checkpoint_update(&si);
+		queue_load_add(&si);
+		return (1);
+
+	case LOAD_RECONCILE:
+		while (qload.cursor < qload.nknown &&
+		    (qload.flags[qload.cursor] & QUEUE_LOAD_SEEN))
+			qload.cursor++;
+		if (qload.cursor == qload.nknown) {
+			queue_load_done();
+			return (0);
+		}
+		si.evpid = qload.known[qload.cursor++];
+
+		/* not walked because it was updated since startup */
+		if (queue_envelope_load(si.evpid, &evp))
+			return (1);
+
+		log_debug("debug: queue: evp:%016" PRIx64 " gone since "
+		    "checkpoint", si.evpid);
+		checkpoint_delete(si.evpid);
+		queue_load_remove(si.evpid);
+		return (1);
 	}
 
-	tv.tv_sec = 0;
-	tv.tv_usec = 10;
-	evtimer_add(ev, &tv);
+	return (0);
+}
+
+static void
+queue_load_add(struct scheduler_info *si)
+{
+	uint32_t	msgid;
+
+	msgid = evpid_to_msgid(si->evpid);
+	if (qload.msgid && msgid != qload.msgid)
+		queue_load_commit();
+	qload.msgid = msgid;
+
+	if (qload.nsi == QUEUE_LOAD_RECORDS)
+		queue_load_flush();
+	qload.si[qload.nsi++] = *si;
+	qload.status.envelopes++;
+}
+
+static void
+queue_load_known(uint64_t evpid, int suspended)
+{
+	size_t	 alloc;
+	void	*tmp;
+
+	if (qload.nknown == qload.aknown) {
+		alloc = qload.aknown ? qload.aknown * 2 : 1024;
+		if ((tmp = reallocarray(qload.known, alloc,
+		    sizeof *qload.known)) == NULL)
+			fatal("queue_load_known: reallocarray");
+		qload.known = tmp;
+		if ((tmp = reallocarray(qload.flags, alloc,
+		    sizeof *qload.flags)) == NULL)
+			fatal("queue_load_known: reallocarray");
+		qload.flags = tmp;
+		qload.aknown = alloc;
+	}
+	qload.known[qload.nknown] = evpid;
+	qload.flags[qload.nknown] = suspended ? QUEUE_LOAD_SUSPENDED : 0;
+	qload.nknown++;
+}
+
+static uint8_t *
+queue_load_lookup(uint64_t evpid)
+{
+	size_t	lo, hi, mid;
+
+	lo = 0;
+	hi = qload.nknown;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (qload.known[mid] == evpid)
+			return (&qload.flags[mid]);
+		if (qload.known[mid] < evpid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (NULL);
+}
+
+/* all envelopes of the current message have been added */
+static void
+queue_load_commit(void)
+{
+	if (qload.msgid == 0)
+		return;
+	if (qload.ncommits == QUEUE_LOAD_IDS)
+		queue_load_flush();
+	qload.commits[qload.ncommits++] = qload.msgid;
+	qload.msgid = 0;
+}
+
+static void
+queue_load_suspend(uint64_t evpid)
+{
+	if (qload.nsuspends == QUEUE_LOAD_IDS)
+		queue_load_flush();
+	qload.suspends[qload.nsuspends++] = evpid;
+}
+
+static void
+queue_load_remove(uint64_t evpid)
+{
+	if (qload.nremoves == QUEUE_LOAD_IDS)
+		queue_load_flush();
+	qload.removes[qload.nremoves++] = evpid;
+}
+
+static void
+queue_load_flush(void)
+{
+	size_t	i;
+
+	if (qload.nsi == 0 && qload.ncommits == 0 &&
+	    qload.nsuspends == 0 && qload.nremoves == 0)
+		return;
+
+	m_create(p_scheduler, IMSG_QUEUE_ENVELOPE_LOAD, 0, 0, -1);
+	m_add_data(p_scheduler, qload.si, qload.nsi * sizeof(qload.si[0]));
+	m_add_size(p_scheduler, qload.ncommits);
+	for (i = 0; i < qload.ncommits; i++)
+		m_add_msgid(p_scheduler, qload.commits[i]);
+	m_add_size(p_scheduler, qload.nsuspends);
+	for (i = 0; i < qload.nsuspends; i++)
+		m_add_evpid(p_scheduler, qload.suspends[i]);
+	m_add_size(p_scheduler, qload.nremoves);
+	for (i = 0; i < qload.nremoves; i++)
+		m_add_evpid(p_scheduler, qload.removes[i]);
+	m_close(p_scheduler);
+
+	qload.nsi = 0;
+	qload.ncommits = 0;
+	qload.nsuspends = 0;
+	qload.nremoves = 0;
+	qload.inflight++;
+}
+
+static void
+queue_load_done(void)
+{
+	queue_load_flush();
+
+	free(qload.known);
+	free(qload.flags);
+	qload.known = NULL;
+	qload.flags = NULL;
+	qload.nknown = qload.aknown = 0;
+
+	qload.status.state = QUEUE_LOAD_DONE;
+	qload.status.end = time(NULL);
+	queue_load_report();
+	log_info("info: queue: loaded %zu envelopes in %s",
+	    qload.status.envelopes,
+	    duration_to_text(qload.status.end - qload.status.start));
+	log_debug("debug: queue: done loading queue into scheduler");
+}
+
+static void
+queue_load_report(void)
+{
+	time_t	now;
+
+	now = time(NULL);
+	if (qload.status.state != QUEUE_LOAD_DONE && now == qload.reported)
+		return;
+	qload.reported = now;
+
+	m_compose(p_control, IMSG_QUEUE_LOAD_STATUS, 0, 0, -1,
+	    &qload.status, sizeof(qload.status));
 }
 
 static void
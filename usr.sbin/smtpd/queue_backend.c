@@ -41,25 +41,174 @@
 static const char* envelope_validate(struct envelope *);
 
 extern struct queue_backend	queue_backend_fs;
+extern struct queue_backend	queue_backend_log;
 extern struct queue_backend	queue_backend_null;
 extern struct queue_backend	queue_backend_proc;
 extern struct queue_backend	queue_backend_ram;
+extern struct queue_backend	queue_backend_tiered;
 
 static void queue_envelope_cache_add(struct envelope *);
+static int queue_envelope_cache_get(uint64_t, struct envelope *);
 static void queue_envelope_cache_update(struct envelope *);
 static void queue_envelope_cache_del(uint64_t evpid);
+static void queue_envelope_cache_evict(void);
 
-TAILQ_HEAD(evplst, envelope);
+/*
+ * The envelope cache follows the 2Q policy.  Envelopes seen once go to
+ * a small FIFO, and only those requested again after being pushed out
+ * of it (remembered by id in the ghost list) enter the main LRU.  A walk
+ * over the whole queue therefore cannot flush the working set.  Entries
+ * hold the compact binary form of the envelope, the budget is in bytes.
+ */
+#define EVPCACHE_A1IN		0
+#define EVPCACHE_AM		1
+#define EVPCACHE_A1IN_RATIO	4	/* a1in gets 1/4 of the budget */
+#define EVPCACHE_GHOST_SIZE	1024	/* one ghost per 1k of budget */
+
+struct evpcache_entry {
+	TAILQ_ENTRY(evpcache_entry)	 entry;
+	uint64_t			 id;
+	int				 list;
+	size_t				 len;
+	char				*buf;
+};
+
+struct evpcache_ghost {
+	TAILQ_ENTRY(evpcache_ghost)	 entry;
+	uint64_t			 id;
+};
+
+TAILQ_HEAD(evplst, evpcache_entry);
+TAILQ_HEAD(ghostlst, evpcache_ghost);
 
 static struct tree		evpcache_tree;
-static struct evplst		evpcache_list;
+static struct evplst		evpcache_list[2];
+static size_t			evpcache_bytes[2];
+static struct tree		evpcache_ghosts;
+static struct ghostlst		evpcache_ghost_list;
+
+/*
+ * With compression or encryption, the plaintext of a message being
+ * delivered is kept so that each open does not decode it all over again.
+ * The copy stays linked in the temporary directory and every open gets
+ * a descriptor of its own, hence an offset of its own.  Envelopes hold a
+ * reference while they are out at the dispatcher and the last one to
+ * come back drops the copy.  Past the budget, which is in bytes, copies
+ * are dropped from the least recently opened.
+ */
+struct msgcache_entry {
+	TAILQ_ENTRY(msgcache_entry)	 entry;
+	uint32_t			 msgid;
+	int				 refs;
+	int				 cached;
+	size_t				 size;
+};
+
+TAILQ_HEAD(msglst, msgcache_entry);
+
+static struct tree		msgcache_tree;
+static struct msglst		msgcache_list;
+static size_t			msgcache_bytes;
+
 static struct queue_backend	*backend;
+static int			threaded;
+
+struct queue_commit_job {
+	uint32_t	 msgid;
+	int		 ret;
+	void		(*cb)(uint32_t, int, void *);
+	void		*arg;
+};
+
+struct queue_update_job {
+	struct envelope		 evp;
+	char			*buf;
+	size_t			 len;
+	int			 ret;
+	int			 delete;
+	void			(*cb)(struct envelope *, int, void *);
+	void			*arg;
+	struct queue_update_job	*next;
+};
+
+/* evpid -> in-flight update, later updates are chained behind it */
+static struct tree		updates;
+
+struct queue_load_waiter {
+	void				(*cb)(uint64_t, struct envelope *,
+					    void *);
+	void				*arg;
+	struct queue_load_waiter	*next;
+};
+
+struct queue_prefetch_job {
+	uint64_t			 evpid;
+	char				*buf;
+	int				 len;
+	int				 stale;
+	struct queue_load_waiter	*waiters;
+};
+
+/* evpid -> envelope being read ahead of a scheduler request */
+static struct tree		prefetches;
+
+/*
+ * Compression and encryption of message files are applied as a chain of
+ * streams in a single pass: compress then encrypt when committing,
+ * decrypt then uncompress when opening.
+ */
+#define QUEUE_TRANSFORM_BUFSIZE	16384
+
+struct queue_transform;
+
+struct queue_transform_stage {
+	struct queue_transform	*qt;
+	size_t			 idx;
+	void			*ctx;
+	int			(*update)(void *, const void *, size_t,
+				    int (*)(void *, const void *, size_t),
+				    void *);
+	void			(*free)(void *);
+};
+
+struct queue_transform {
+	struct queue_transform_stage	 stages[2];
+	size_t				 nstages;
+	void				*crypto;
+	FILE				*out;
+
+	/* stop once the end of the headers has been written */
+	int				 headers;
+	int				 bol;
+	int				 done;
+};
+
+static int queue_message_decode(uint32_t, int);
+static int queue_message_cache_path(uint32_t, char *, size_t);
+static int queue_message_cache_open(uint32_t);
+static int queue_message_cache_create(uint32_t);
+static void queue_message_cache_add(uint32_t, int);
+static void queue_message_cache_drop(struct msgcache_entry *);
+static void queue_message_cache_del(uint32_t);
+static int queue_message_transform(FILE *, FILE *, int, int);
+static int queue_transform_feed(struct queue_transform *, size_t,
+    const void *, size_t);
+static int queue_transform_sink(void *, const void *, size_t);
+
+static void queue_message_commit_work(void *);
+static void queue_message_commit_done(void *);
+static void queue_envelope_update_work(void *);
+static void queue_envelope_update_done(void *);
+static void queue_envelope_prefetch_work(void *);
+static void queue_envelope_prefetch_done(void *);
+static void queue_envelope_prefetch_stale(uint64_t);
 
 static int (*handler_close)(void);
 static int (*handler_message_create)(uint32_t *);
 static int (*handler_message_commit)(uint32_t, const char*);
 static int (*handler_message_delete)(uint32_t);
 static int (*handler_message_fd_r)(uint32_t);
+static int (*handler_message_sync)(void);
 static int (*handler_envelope_create)(uint32_t, const char *, size_t, uint64_t *);
 static int (*handler_envelope_delete)(uint64_t);
 static int (*handler_envelope_update)(uint64_t, const char *, size_t);
@@ -122,15 +271,26 @@ queue_init(const char *name, int server)
 	if (gr == NULL)
 		fatalx("unknown group %s", SMTPD_QUEUE_GROUP);
 
-	tree_init(&evpcache_tree);
-	TAILQ_INIT(&evpcache_list);
+	tree_init_ordered(&evpcache_tree);
+	TAILQ_INIT(&evpcache_list[EVPCACHE_A1IN]);
+	TAILQ_INIT(&evpcache_list[EVPCACHE_AM]);
+	tree_init(&evpcache_ghosts);
+	TAILQ_INIT(&evpcache_ghost_list);
+	tree_init(&msgcache_tree);
+	TAILQ_INIT(&msgcache_list);
+	tree_init(&updates);
+	tree_init(&prefetches);
 
 	if (!strcmp(name, "fs"))
 		backend = &queue_backend_fs;
+	else if (!strcmp(name, "log"))
+		backend = &queue_backend_log;
 	else if (!strcmp(name, "null"))
 		backend = &queue_backend_null;
 	else if (!strcmp(name, "ram"))
 		backend = &queue_backend_ram;
+	else if (!strcmp(name, "tiered"))
+		backend = &queue_backend_tiered;
 	else
 		backend = &queue_backend_proc;
 
@@ -146,6 +306,8 @@ queue_init(const char *name, int server)
 
 		if (ckdir(PATH_SPOOL PATH_TEMPORARY, 0700, pwq->pw_uid, 0, 1) == 0)
 			fatalx("error in purge directory setup");
+		if (ckdir(PATH_SPOOL PATH_CHECKPOINT, 0700, pwq->pw_uid, 0, 1) == 0)
+			fatalx("error in checkpoint directory setup");
 	}
 
 	r = backend->init(pwq, server, name);
@@ -196,6 +358,8 @@ queue_message_delete(uint32_t msgid)
 	queue_message_path(msgid, msgpath, sizeof(msgpath));
 	unlink(msgpath);
 
+	queue_message_cache_del(msgid);
+
 	/* remove remaining envelopes from the cache if any (on rollback) */
 	evpid = msgid_to_evpid(msgid);
 	for (;;) {
@@ -219,62 +383,40 @@ queue_message_commit(uint32_t msgid)
 	int	r;
 	char	msgpath[PATH_MAX];
 	char	tmppath[PATH_MAX];
+	char	*path;
 	FILE	*ifp = NULL;
 	FILE	*ofp = NULL;
 
 	profile_enter("queue_message_commit");
 
 	queue_message_path(msgid, msgpath, sizeof(msgpath));
+	path = msgpath;
 
-	if (env->sc_queue_flags & QUEUE_COMPRESSION) {
-		bsnprintf(tmppath, sizeof tmppath, "%s.comp", msgpath);
+	if (env->sc_queue_flags & (QUEUE_COMPRESSION|QUEUE_ENCRYPTION)) {
+		bsnprintf(tmppath, sizeof tmppath, "%s.tmp", msgpath);
 		ifp = fopen(msgpath, "r");
-		ofp = fopen(tmppath, "w+");
+		ofp = fopen(tmppath, "w");
 		if (ifp == NULL || ofp == NULL)
 			goto err;
-		if (!compress_file(ifp, ofp))
+		if (!queue_message_transform(ifp, ofp, 0, 0))
 			goto err;
 		fclose(ifp);
-		fclose(ofp);
 		ifp = NULL;
+		r = safe_fclose(ofp);
 		ofp = NULL;
-
-		if (rename(tmppath, msgpath) == -1) {
-			if (errno == ENOSPC)
-				return (0);
-			unlink(tmppath);
-			log_warn("rename");
-			return (0);
-		}
-	}
-
-	if (env->sc_queue_flags & QUEUE_ENCRYPTION) {
-		bsnprintf(tmppath, sizeof tmppath, "%s.enc", msgpath);
-		ifp = fopen(msgpath, "r");
-		ofp = fopen(tmppath, "w+");
-		if (ifp == NULL || ofp == NULL)
-			goto err;
-		if (!crypto_encrypt_file(ifp, ofp))
+		if (!r)
 			goto err;
-		fclose(ifp);
-		fclose(ofp);
-		ifp = NULL;
-		ofp = NULL;
 
-		if (rename(tmppath, msgpath) == -1) {
-			if (errno == ENOSPC)
-				return (0);
-			unlink(tmppath);
-			log_warn("rename");
-			return (0);
-		}
+		/* the backend takes the transformed file in place */
+		unlink(msgpath);
+		path = tmppath;
 	}
 
-	r = handler_message_commit(msgid, msgpath);
+	r = handler_message_commit(msgid, path);
 	profile_leave();
 
 	/* in case it's not done by the backend */
-	unlink(msgpath);
+	unlink(path);
 
 	log_trace(TRACE_QUEUE,
 	    "queue-backend: queue_message_commit(%08"PRIx32") -> %d",
@@ -287,16 +429,107 @@ err:
 		fclose(ifp);
 	if (ofp)
 		fclose(ofp);
+	unlink(tmppath);
+	profile_leave();
 	return 0;
 }
 
+/*
+ * Backends that defer durability of commits to a single sync per batch
+ * register a sync handler.  The caller must not acknowledge the commits
+ * until queue_message_sync() has succeeded.
+ */
+int
+queue_message_group_commit(void)
+{
+	return (handler_message_sync != NULL);
+}
+
+int
+queue_message_sync(void)
+{
+	int	r;
+
+	if (handler_message_sync == NULL)
+		return (1);
+
+	profile_enter("queue_message_sync");
+	r = handler_message_sync();
+	profile_leave();
+
+	log_trace(TRACE_QUEUE, "queue-backend: queue_message_sync() -> %d", r);
+
+	return (r);
+}
+
+/*
+ * Run the commit in a worker thread if the backend allows it, the
+ * callback is called from the event loop either way.
+ */
+void
+queue_message_commit_async(uint32_t msgid, void (*cb)(uint32_t, int, void *),
+    void *arg)
+{
+	struct queue_commit_job	*job;
+
+	if (!threaded) {
+		cb(msgid, queue_message_commit(msgid), arg);
+		return;
+	}
+
+	job = xcalloc(1, sizeof *job);
+	job->msgid = msgid;
+	job->cb = cb;
+	job->arg = arg;
+	queue_io_submit(queue_message_commit_work, queue_message_commit_done,
+	    job);
+}
+
+static void
+queue_message_commit_work(void *arg)
+{
+	struct queue_commit_job	*job = arg;
+
+	job->ret = queue_message_commit(job->msgid);
+}
+
+static void
+queue_message_commit_done(void *arg)
+{
+	struct queue_commit_job	*job = arg;
+
+	job->cb(job->msgid, job->ret, job->arg);
+	free(job);
+}
+
 int
 queue_message_fd_r(uint32_t msgid)
+{
+	return queue_message_decode(msgid, 0);
+}
+
+/*
+ * Same as queue_message_fd_r() but the message may be cut right after
+ * the headers, which spares reading and decoding the whole body when
+ * every chunk read so far is known to be authentic.
+ */
+int
+queue_message_fd_r_headers(uint32_t msgid)
+{
+	return queue_message_decode(msgid, 1);
+}
+
+static int
+queue_message_decode(uint32_t msgid, int headers)
 {
 	int	fdin = -1, fdout = -1, fd = -1;
 	FILE	*ifp = NULL;
 	FILE	*ofp = NULL;
 
+	if (env->sc_queue_flags & (QUEUE_COMPRESSION|QUEUE_ENCRYPTION) &&
+	    (fd = queue_message_cache_open(msgid)) != -1)
+		return (fd);
+
 	profile_enter("queue_message_fd_r");
 	fdin = handler_message_fd_r(msgid);
 	profile_leave();
@@ -307,51 +540,45 @@ queue_message_fd_r(uint32_t msgid)
 	if (fdin == -1)
 		return (-1);
 
-	if (env->sc_queue_flags & QUEUE_ENCRYPTION) {
-		if ((fdout = mktmpfile()) == -1)
-			goto err;
-		if ((fd = dup(fdout)) == -1)
-			goto err;
-		if ((ifp = fdopen(fdin, "r")) == NULL)
-			goto err;
-		fdin = fd;
-		fd = -1;
-		if ((ofp = fdopen(fdout, "w+")) == NULL)
-			goto err;
-
-		if (!crypto_decrypt_file(ifp, ofp))
-			goto err;
-
-		fclose(ifp);
-		ifp = NULL;
-		fclose(ofp);
+	if (!(env->sc_queue_flags & (QUEUE_COMPRESSION|QUEUE_ENCRYPTION)))
+		return (fdin);
+
+	/*
+	 * The plaintext is not handed out before what it was decoded from
+	 * has been authenticated, so it still goes through a temporary file.
+	 * A full decode for a message being delivered is kept for the next
+	 * open.
+	 */
+	if (headers || (fdout = queue_message_cache_create(msgid)) == -1)
+		fdout = mktmpfile();
+	if (fdout == -1)
+		goto err;
+	if ((fd = dup(fdout)) == -1)
+		goto err;
+	if ((ifp = fdopen(fdin, "r")) == NULL)
+		goto err;
+	fdin = -1;
+	if ((ofp = fdopen(fd, "w")) == NULL)
+		goto err;
+	fd = -1;
+
+	if (!queue_message_transform(ifp, ofp, 1, headers))
+		goto err;
+
+	fclose(ifp);
+	ifp = NULL;
+	if (!safe_fclose(ofp)) {
 		ofp = NULL;
-		lseek(fdin, SEEK_SET, 0);
+		goto err;
 	}
+	ofp = NULL;
+	if (lseek(fdout, 0, SEEK_SET) == -1)
+		goto err;
 
-	if (env->sc_queue_flags & QUEUE_COMPRESSION) {
-		if ((fdout = mktmpfile()) == -1)
-			goto err;
-		if ((fd = dup(fdout)) == -1)
-			goto err;
-		if ((ifp = fdopen(fdin, "r")) == NULL)
-			goto err;
-		fdin = fd;
-		fd = -1;
-		if ((ofp = fdopen(fdout, "w+")) == NULL)
-			goto err;
-
-		if (!uncompress_file(ifp, ofp))
-			goto err;
+	if (!headers)
+		queue_message_cache_add(msgid, fdout);
 
-		fclose(ifp);
-		ifp = NULL;
-		fclose(ofp);
-		ofp = NULL;
-		lseek(fdin, SEEK_SET, 0);
-	}
-
-	return (fdin);
+	return (fdout);
 
 err:
 	if (fd != -1)
@@ -364,9 +591,273 @@ err:
 		fclose(ifp);
 	if (ofp)
 		fclose(ofp);
+	if (!headers)
+		queue_message_cache_add(msgid, -1);
 	return -1;
 }
 
+static int
+queue_message_cache_path(uint32_t msgid, char *buf, size_t len)
+{
+	return bsnprintf(buf, len, "%s/%08"PRIx32".plain", PATH_TEMPORARY,
+	    msgid);
+}
+
+void
+queue_message_ref(uint32_t msgid)
+{
+	struct msgcache_entry	*e;
+
+	if (!(env->sc_queue_flags & (QUEUE_COMPRESSION|QUEUE_ENCRYPTION)))
+		return;
+
+	if ((e = tree_get(&msgcache_tree, msgid)) == NULL) {
+		e = xcalloc(1, sizeof *e);
+		e->msgid = msgid;
+		tree_xset(&msgcache_tree, msgid, e);
+	}
+	e->refs++;
+}
+
+void
+queue_message_unref(uint32_t msgid)
+{
+	struct msgcache_entry	*e;
+
+	if ((e = tree_get(&msgcache_tree, msgid)) == NULL)
+		return;
+	if (--e->refs)
+		return;
+
+	queue_message_cache_drop(e);
+	tree_xpop(&msgcache_tree, msgid);
+	free(e);
+}
+
+static int
+queue_message_cache_open(uint32_t msgid)
+{
+	struct msgcache_entry	*e;
+	char			 path[PATH_MAX];
+	int			 fd;
+
+	if ((e = tree_get(&msgcache_tree, msgid)) == NULL || !e->cached)
+		return (-1);
+
+	if (!queue_message_cache_path(msgid, path, sizeof(path)) ||
+	    (fd = open(path, O_RDONLY)) == -1) {
+		log_warn("warn: queue-backend: msgcache: open");
+		queue_message_cache_drop(e);
+		return (-1);
+	}
+
+	TAILQ_REMOVE(&msgcache_list, e, entry);
+	TAILQ_INSERT_TAIL(&msgcache_list, e, entry);
+	stat_increment("queue.msgcache.hit", 1);
+
+	return (fd);
+}
+
+/*
+ * Only a message with envelopes out at the dispatcher gets a copy, the
+ * others are opened once, by a bounce or not at all.
+ */
+static int
+queue_message_cache_create(uint32_t msgid)
+{
+	struct msgcache_entry	*e;
+	char			 path[PATH_MAX];
+	int			 fd;
+
+	if ((e = tree_get(&msgcache_tree, msgid)) == NULL)
+		return (-1);
+
+	stat_increment("queue.msgcache.missed", 1);
+
+	if (!queue_message_cache_path(msgid, path, sizeof(path)))
+		return (-1);
+	if ((fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0600)) == -1) {
+		log_warn("warn: queue-backend: msgcache: %s", path);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+/*
+ * Called once the decode is over, with -1 if it failed.  A descriptor
+ * that is not the cached copy is unlinked, a partial copy may be left
+ * behind in that case.
+ */
+static void
+queue_message_cache_add(uint32_t msgid, int fd)
+{
+	struct msgcache_entry	*e, *old;
+	struct stat		 sb;
+	char			 path[PATH_MAX];
+
+	if ((e = tree_get(&msgcache_tree, msgid)) == NULL || e->cached)
+		return;
+	if (!queue_message_cache_path(msgid, path, sizeof(path)))
+		return;
+
+	if (fd == -1 || fstat(fd, &sb) == -1 || sb.st_nlink == 0 ||
+	    (size_t)sb.st_size > env->sc_queue_msgcache_size) {
+		unlink(path);
+		return;
+	}
+
+	e->cached = 1;
+	e->size = sb.st_size;
+	TAILQ_INSERT_TAIL(&msgcache_list, e, entry);
+	msgcache_bytes += e->size;
+	stat_increment("queue.msgcache.size", 1);
+	stat_increment("queue.msgcache.bytes", e->size);
+
+	while (msgcache_bytes > env->sc_queue_msgcache_size) {
+		old = TAILQ_FIRST(&msgcache_list);
+		queue_message_cache_drop(old);
+		stat_increment("queue.msgcache.evicted", 1);
+	}
+}
+
+/* The entry stays as long as it is referenced, only the copy goes. */
+static void
+queue_message_cache_drop(struct msgcache_entry *e)
+{
+	char	path[PATH_MAX];
+
+	if (!e->cached)
+		return;
+
+	if (queue_message_cache_path(e->msgid, path, sizeof(path)))
+		unlink(path);
+
+	TAILQ_REMOVE(&msgcache_list, e, entry);
+	msgcache_bytes -= e->size;
+	stat_decrement("queue.msgcache.size", 1);
+	stat_decrement("queue.msgcache.bytes", e->size);
+	e->cached = 0;
+	e->size = 0;
+}
+
+static void
+queue_message_cache_del(uint32_t msgid)
+{
+	struct msgcache_entry	*e;
+
+	if ((e = tree_pop(&msgcache_tree, msgid)) == NULL)
+		return;
+
+	queue_message_cache_drop(e);
+	free(e);
+}
+
+static int
+queue_message_transform(FILE *in, FILE *out, int decode, int headers)
+{
+	struct queue_transform		 qt;
+	struct queue_transform_stage	*st;
+	char				 buf[QUEUE_TRANSFORM_BUFSIZE];
+	enum compress_mode		 mode;
+	size_t				 i, n;
+	int				 crypt, ret = 0;
+
+	memset(&qt, 0, sizeof qt);
+	qt.out = out;
+	qt.headers = headers;
+	qt.bol = 1;
+
+	for (i = 0; i < 2; i++) {
+		/* compress first when encoding, decrypt first when decoding */
+		crypt = (i == 0) == (decode != 0);
+		st = &qt.stages[qt.nstages];
+		if (crypt && (env->sc_queue_flags & QUEUE_ENCRYPTION)) {
+			st->ctx = crypto_stream_new(decode);
+			st->update = crypto_stream_update;
+			st->free = crypto_stream_free;
+			qt.crypto = st->ctx;
+		} else if (!crypt && (env->sc_queue_flags & QUEUE_COMPRESSION)) {
+			if (decode)
+				mode = COMPRESS_DECODE;
+			else if (compress_sample(fileno(in)))
+				mode = COMPRESS_ENCODE;
+			else
+				mode = COMPRESS_STORE;
+			st->ctx = compress_stream_new(mode);
+			st->update = compress_stream_update;
+			st->free = compress_stream_free;
+		} else
+			continue;
+		if (st->ctx == NULL)
+			goto end;
+		st->qt = &qt;
+		st->idx = qt.nstages++;
+	}
+
+	while ((n = fread(buf, 1, sizeof buf, in)) != 0) {
+		if (!queue_transform_feed(&qt, 0, buf, n))
+			goto end;
+		/* the rest needn't be read unless to check the tag */
+		if (qt.done && (qt.crypto == NULL ||
+		    crypto_stream_authenticated(qt.crypto))) {
+			ret = 1;
+			goto end;
+		}
+	}
+	if (ferror(in))
+		goto end;
+
+	/* finish each stage in turn, flushing into the next one */
+	for (i = 0; i < qt.nstages; i++) {
+		st = &qt.stages[i];
+		if (!st->update(st->ctx, NULL, 0, queue_transform_sink, st))
+			goto end;
+	}
+	ret = 1;
+
+end:
+	for (i = 0; i < qt.nstages; i++)
+		qt.stages[i].free(qt.stages[i].ctx);
+	return (ret);
+}
+
+static int
+queue_transform_feed(struct queue_transform *qt, size_t idx, const void *buf,
+    size_t len)
+{
+	struct queue_transform_stage	*st;
+	const char			*p;
+
+	if (idx == qt->nstages) {
+		if (qt->done)
+			return (1);
+		if (qt->headers) {
+			/* an empty line ends the headers */
+			for (p = buf; p < (const char *)buf + len; p++) {
+				if (*p == '\n' && qt->bol) {
+					len = p + 1 - (const char *)buf;
+					qt->done = 1;
+					break;
+				}
+				qt->bol = (*p == '\n');
+			}
+		}
+		return (fwrite(buf, 1, len, qt->out) == len);
+	}
+
+	st = &qt->stages[idx];
+	return (st->update(st->ctx, buf, len, queue_transform_sink, st));
+}
+
+static int
+queue_transform_sink(void *arg, const void *buf, size_t len)
+{
+	struct queue_transform_stage	*st = arg;
+
+	return (queue_transform_feed(st->qt, st->idx + 1, buf, len));
+}
+
 int
 queue_message_fd_rw(uint32_t msgid)
 {
@@ -388,7 +879,7 @@ queue_envelope_dump_buffer(struct envelope *ep, char *evpbuf, size_t evpbufsize)
 	char	encbuf[sizeof(struct envelope)];
 
 	evp = evpbuf;
-	evplen = envelope_dump_buffer(ep, evpbuf, evpbufsize);
+	evplen = envelope_dump_binary(ep, evpbuf, evpbufsize);
 	if (evplen == 0)
 		return (0);
 
@@ -448,45 +939,152 @@ queue_envelope_load_buffer(struct envelope *ep, char *evpbuf, size_t evpbufsize)
 static void
 queue_envelope_cache_add(struct envelope *e)
 {
-	struct envelope *cached;
+	struct evpcache_entry	*cached;
+	struct evpcache_ghost	*ghost;
+	char			 buf[sizeof(struct envelope)];
+	size_t			 len;
 
-	while (tree_count(&evpcache_tree) >= env->sc_queue_evpcache_size)
-		queue_envelope_cache_del(TAILQ_LAST(&evpcache_list, evplst)->id);
+	queue_envelope_cache_del(e->id);
+
+	if ((len = envelope_dump_binary(e, buf, sizeof buf)) == 0)
+		return;
+	if (len > env->sc_queue_evpcache_size)
+		return;
 
 	cached = xcalloc(1, sizeof *cached);
-	*cached = *e;
-	TAILQ_INSERT_HEAD(&evpcache_list, cached, entry);
+	cached->id = e->id;
+	cached->len = len;
+	cached->buf = xmemdup(buf, len);
+
+	/* recently pushed out of a1in, this one is worth keeping */
+	if ((ghost = tree_pop(&evpcache_ghosts, e->id)) != NULL) {
+		TAILQ_REMOVE(&evpcache_ghost_list, ghost, entry);
+		free(ghost);
+		cached->list = EVPCACHE_AM;
+	}
+	else
+		cached->list = EVPCACHE_A1IN;
+
+	TAILQ_INSERT_HEAD(&evpcache_list[cached->list], cached, entry);
+	evpcache_bytes[cached->list] += len;
 	tree_xset(&evpcache_tree, e->id, cached);
 	stat_increment("queue.evpcache.size", 1);
+	stat_increment("queue.evpcache.bytes", len);
+
+	queue_envelope_cache_evict();
+}
+
+static void
+queue_envelope_cache_evict(void)
+{
+	struct evpcache_entry	*cached;
+	struct evpcache_ghost	*ghost;
+	size_t			 max;
+
+	while (evpcache_bytes[EVPCACHE_A1IN] + evpcache_bytes[EVPCACHE_AM] >
+	    env->sc_queue_evpcache_size) {
+		if (evpcache_bytes[EVPCACHE_A1IN] >
+		    env->sc_queue_evpcache_size / EVPCACHE_A1IN_RATIO ||
+		    TAILQ_EMPTY(&evpcache_list[EVPCACHE_AM])) {
+			cached = TAILQ_LAST(&evpcache_list[EVPCACHE_A1IN],
+			    evplst);
+			ghost = xcalloc(1, sizeof *ghost);
+			ghost->id = cached->id;
+			queue_envelope_cache_del(cached->id);
+			if (tree_check(&evpcache_ghosts, ghost->id)) {
+				free(ghost);
+				continue;
+			}
+			tree_xset(&evpcache_ghosts, ghost->id, ghost);
+			TAILQ_INSERT_HEAD(&evpcache_ghost_list, ghost, entry);
+		}
+		else {
+			cached = TAILQ_LAST(&evpcache_list[EVPCACHE_AM],
+			    evplst);
+			queue_envelope_cache_del(cached->id);
+		}
+		stat_increment("queue.evpcache.evicted", 1);
+	}
+
+	max = env->sc_queue_evpcache_size / EVPCACHE_GHOST_SIZE;
+	while (tree_count(&evpcache_ghosts) > max) {
+		ghost = TAILQ_LAST(&evpcache_ghost_list, ghostlst);
+		TAILQ_REMOVE(&evpcache_ghost_list, ghost, entry);
+		tree_xpop(&evpcache_ghosts, ghost->id);
+		free(ghost);
+	}
+}
+
+static int
+queue_envelope_cache_get(uint64_t evpid, struct envelope *ep)
+{
+	struct evpcache_entry	*cached;
+
+	if ((cached = tree_get(&evpcache_tree, evpid)) == NULL)
+		return (0);
+
+	if (!envelope_load_buffer(ep, cached->buf, cached->len)) {
+		queue_envelope_cache_del(evpid);
+		return (0);
+	}
+	ep->id = evpid;
+
+	if (cached->list == EVPCACHE_AM) {
+		TAILQ_REMOVE(&evpcache_list[EVPCACHE_AM], cached, entry);
+		TAILQ_INSERT_HEAD(&evpcache_list[EVPCACHE_AM], cached, entry);
+	}
+
+	return (1);
 }
 
 static void
 queue_envelope_cache_update(struct envelope *e)
 {
-	struct envelope *cached;
+	struct evpcache_entry	*cached;
+	char			 buf[sizeof(struct envelope)];
+	size_t			 len;
 
 	if ((cached = tree_get(&evpcache_tree, e->id)) == NULL) {
 		queue_envelope_cache_add(e);
 		stat_increment("queue.evpcache.update.missed", 1);
-	} else {
-		TAILQ_REMOVE(&evpcache_list, cached, entry);
-		*cached = *e;
-		TAILQ_INSERT_HEAD(&evpcache_list, cached, entry);
-		stat_increment("queue.evpcache.update.hit", 1);
+		return;
+	}
+
+	if ((len = envelope_dump_binary(e, buf, sizeof buf)) == 0) {
+		queue_envelope_cache_del(e->id);
+		return;
 	}
+	free(cached->buf);
+	cached->buf = xmemdup(buf, len);
+	stat_decrement("queue.evpcache.bytes", cached->len);
+	stat_increment("queue.evpcache.bytes", len);
+	evpcache_bytes[cached->list] -= cached->len;
+	evpcache_bytes[cached->list] += len;
+	cached->len = len;
+
+	if (cached->list == EVPCACHE_AM) {
+		TAILQ_REMOVE(&evpcache_list[EVPCACHE_AM], cached, entry);
+		TAILQ_INSERT_HEAD(&evpcache_list[EVPCACHE_AM], cached, entry);
+	}
+	stat_increment("queue.evpcache.update.hit", 1);
+
+	queue_envelope_cache_evict();
 }
 
 static void
 queue_envelope_cache_del(uint64_t evpid)
 {
-	struct envelope *cached;
+	struct evpcache_entry	*cached;
 
 	if ((cached = tree_pop(&evpcache_tree, evpid)) == NULL)
 		return;
 
-	TAILQ_REMOVE(&evpcache_list, cached, entry);
-	free(cached);
+	TAILQ_REMOVE(&evpcache_list[cached->list], cached, entry);
+	evpcache_bytes[cached->list] -= cached->len;
 	stat_decrement("queue.evpcache.size", 1);
+	stat_decrement("queue.evpcache.bytes", cached->len);
+	free(cached->buf);
+	free(cached);
 }
 
 int
@@ -528,11 +1126,22 @@ queue_envelope_create(struct envelope *ep)
 int
 queue_envelope_delete(uint64_t evpid)
 {
-	int	r;
+	struct queue_update_job	*job;
+	int			 r;
 
 	if (env->sc_queue_flags & QUEUE_EVPCACHE)
 		queue_envelope_cache_del(evpid);
 
+	queue_envelope_prefetch_stale(evpid);
+
+	/* the update would recreate the file, delete once it is done */
+	if ((job = tree_get(&updates, evpid)) != NULL) {
+		while (job->next)
+			job = job->next;
+		job->delete = 1;
+		return (1);
+	}
+
 	profile_enter("queue_envelope_delete");
 	r = handler_envelope_delete(evpid);
 	profile_leave();
@@ -550,11 +1159,9 @@ queue_envelope_load(uint64_t evpid, struct envelope *ep)
 	const char	*e;
 	char		 evpbuf[sizeof(struct envelope)];
 	size_t		 evplen;
-	struct envelope	*cached;
 
 	if ((env->sc_queue_flags & QUEUE_EVPCACHE) &&
-	    (cached = tree_get(&evpcache_tree, evpid))) {
-		*ep = *cached;
+	    queue_envelope_cache_get(evpid, ep)) {
 		stat_increment("queue.evpcache.load.hit", 1);
 		return (1);
 	}
@@ -593,6 +1200,12 @@ queue_envelope_update(struct envelope *ep)
 	size_t	evplen;
 	int	r;
 
+	if (tree_check(&updates, ep->id)) {
+		queue_envelope_update_async(ep, NULL, NULL);
+		return (1);
+	}
+	queue_envelope_prefetch_stale(ep->id);
+
 	evplen = queue_envelope_dump_buffer(ep, evpbuf, sizeof evpbuf);
 	if (evplen == 0)
 		return (0);
@@ -611,6 +1224,195 @@ queue_envelope_update(struct envelope *ep)
 	return (r);
 }
 
+/*
+ * Write the envelope from a worker thread.  The cache is updated right
+ * away so that loads see the new version while the write is in flight,
+ * and updates to the same envelope are serialized.
+ */
+void
+queue_envelope_update_async(struct envelope *ep,
+    void (*cb)(struct envelope *, int, void *), void *arg)
+{
+	struct queue_update_job	*job, *prev;
+	char			 evpbuf[sizeof(struct envelope)];
+	size_t			 evplen;
+	int			 r;
+
+	if (!threaded) {
+		r = queue_envelope_update(ep);
+		if (cb)
+			cb(ep, r, arg);
+		return;
+	}
+
+	evplen = queue_envelope_dump_buffer(ep, evpbuf, sizeof evpbuf);
+	if (evplen == 0) {
+		if (cb)
+			cb(ep, 0, arg);
+		return;
+	}
+
+	queue_envelope_prefetch_stale(ep->id);
+
+	job = xcalloc(1, sizeof *job);
+	job->evp = *ep;
+	job->buf = xmemdup(evpbuf, evplen);
+	job->len = evplen;
+	job->cb = cb;
+	job->arg = arg;
+
+	if (env->sc_queue_flags & QUEUE_EVPCACHE)
+		queue_envelope_cache_update(ep);
+
+	if ((prev = tree_get(&updates, ep->id)) != NULL) {
+		while (prev->next)
+			prev = prev->next;
+		prev->next = job;
+		return;
+	}
+
+	tree_xset(&updates, ep->id, job);
+	queue_io_submit(queue_envelope_update_work, queue_envelope_update_done,
+	    job);
+}
+
+static void
+queue_envelope_update_work(void *arg)
+{
+	struct queue_update_job	*job = arg;
+
+	job->ret = handler_envelope_update(job->evp.id, job->buf, job->len);
+}
+
+static void
+queue_envelope_update_done(void *arg)
+{
+	struct queue_update_job	*job = arg;
+	uint64_t		 evpid = job->evp.id;
+
+	log_trace(TRACE_QUEUE,
+	    "queue-backend: queue_envelope_update_async(%016"PRIx64") -> %d",
+	    evpid, job->ret);
+
+	if (!job->ret && env->sc_queue_flags & QUEUE_EVPCACHE)
+		queue_envelope_cache_del(evpid);
+
+	tree_xpop(&updates, evpid);
+	if (job->next) {
+		tree_xset(&updates, evpid, job->next);
+		queue_io_submit(queue_envelope_update_work,
+		    queue_envelope_update_done, job->next);
+	}
+	else if (job->delete)
+		queue_envelope_delete(evpid);
+
+	if (job->cb)
+		job->cb(&job->evp, job->ret, job->arg);
+	free(job->buf);
+	free(job);
+}
+
+/*
+ * Hint from the scheduler that the envelope is about to be delivered.
+ * It is read by a worker thread and put in the cache, so that the
+ * request finds it there or waits for the read without blocking.
+ */
+void
+queue_envelope_prefetch(uint64_t evpid)
+{
+	struct queue_prefetch_job	*job;
+
+	if (!threaded || !(env->sc_queue_flags & QUEUE_EVPCACHE))
+		return;
+	if (tree_check(&evpcache_tree, evpid) ||
+	    tree_check(&prefetches, evpid) ||
+	    tree_check(&updates, evpid))
+		return;
+
+	job = xcalloc(1, sizeof *job);
+	job->evpid = evpid;
+	job->buf = xmalloc(sizeof(struct envelope));
+	tree_xset(&prefetches, evpid, job);
+	queue_io_submit(queue_envelope_prefetch_work,
+	    queue_envelope_prefetch_done, job);
+	stat_increment("queue.evpcache.prefetch", 1);
+}
+
+static void
+queue_envelope_prefetch_work(void *arg)
+{
+	struct queue_prefetch_job	*job = arg;
+
+	job->len = handler_envelope_load(job->evpid, job->buf,
+	    sizeof(struct envelope));
+}
+
+static void
+queue_envelope_prefetch_done(void *arg)
+{
+	struct queue_prefetch_job	*job = arg;
+	struct queue_load_waiter	*w;
+	struct envelope			 evp;
+	int				 r;
+
+	tree_xpop(&prefetches, job->evpid);
+
+	if (job->len > 0 && !job->stale &&
+	    !tree_check(&evpcache_tree, job->evpid) &&
+	    queue_envelope_load_buffer(&evp, job->buf, job->len) &&
+	    envelope_validate(&evp) == NULL) {
+		evp.id = job->evpid;
+		queue_envelope_cache_add(&evp);
+	}
+
+	while ((w = job->waiters) != NULL) {
+		job->waiters = w->next;
+		r = queue_envelope_load(job->evpid, &evp);
+		w->cb(job->evpid, r ? &evp : NULL, w->arg);
+		free(w);
+	}
+	free(job->buf);
+	free(job);
+}
+
+static void
+queue_envelope_prefetch_stale(uint64_t evpid)
+{
+	struct queue_prefetch_job	*job;
+
+	if ((job = tree_get(&prefetches, evpid)) != NULL)
+		job->stale = 1;
+}
+
+/*
+ * Load an envelope, waiting for a read in progress if it is being
+ * prefetched.  The callback gets NULL if the envelope could not be
+ * loaded.
+ */
+void
+queue_envelope_load_async(uint64_t evpid,
+    void (*cb)(uint64_t, struct envelope *, void *), void *arg)
+{
+	struct queue_prefetch_job	*job;
+	struct queue_load_waiter	*w, **wp;
+	struct envelope			 evp;
+
+	if ((job = tree_get(&prefetches, evpid)) != NULL) {
+		w = xcalloc(1, sizeof *w);
+		w->cb = cb;
+		w->arg = arg;
+		for (wp = &job->waiters; *wp; wp = &(*wp)->next)
+			;
+		*wp = w;
+		return;
+	}
+
+	if (queue_envelope_load(evpid, &evp))
+		cb(evpid, &evp, arg);
+	else
+		cb(evpid, NULL, arg);
+}
+
 int
 queue_message_walk(struct envelope *ep, uint32_t msgid, int *done, void **data)
 {
@@ -698,7 +1500,8 @@ queue_generate_evpid(uint32_t msgid)
 	uint32_t rnd;
 	uint64_t evpid;
 
-	while ((rnd = arc4random()) == 0)
+	/* the lowest ids number the slots of envelope bundles */
+	while ((rnd = arc4random()) <= QUEUE_BUNDLE_SLOTS)
 		;
 
 	evpid = msgid;
@@ -733,6 +1536,48 @@ envelope_validate(struct envelope *ep)
 	return NULL;
 }
 
+/*
+ * Hand the handlers registered so far over to a backend layered on top
+ * of another one.  They are reset, the caller registers its own and says
+ * again whether it may be called from the worker threads.
+ */
+void
+queue_api_layer(struct queue_api *api)
+{
+	api->close = handler_close;
+	api->message_create = handler_message_create;
+	api->message_commit = handler_message_commit;
+	api->message_delete = handler_message_delete;
+	api->message_fd_r = handler_message_fd_r;
+	api->message_sync = handler_message_sync;
+	api->envelope_create = handler_envelope_create;
+	api->envelope_delete = handler_envelope_delete;
+	api->envelope_update = handler_envelope_update;
+	api->envelope_load = handler_envelope_load;
+	api->envelope_walk = handler_envelope_walk;
+	api->message_walk = handler_message_walk;
+
+	handler_close = NULL;
+	handler_message_create = NULL;
+	handler_message_commit = NULL;
+	handler_message_delete = NULL;
+	handler_message_fd_r = NULL;
+	handler_message_sync = NULL;
+	handler_envelope_create = NULL;
+	handler_envelope_delete = NULL;
+	handler_envelope_update = NULL;
+	handler_envelope_load = NULL;
+	handler_envelope_walk = NULL;
+	handler_message_walk = NULL;
+	threaded = 0;
+}
+
+void
+queue_api_threaded(void)
+{
+	threaded = 1;
+}
+
 void
 queue_api_on_close(int(*cb)(void))
 {
@@ -763,6 +1608,12 @@ queue_api_on_message_fd_r(int(*cb)(uint32_t))
 	handler_message_fd_r = cb;
 }
 
+void
+queue_api_on_message_sync(int(*cb)(void))
+{
+	handler_message_sync = cb;
+}
+
 void
 queue_api_on_envelope_create(int(*cb)(uint32_t, const char *, size_t, uint64_t *))
 {
@@ -0,0 +1,810 @@
+/*
+ * Copyright (c) 2026 The OpenSMTPD Project
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Checkpoint of the scheduler state.
+ *
+ * Everything the scheduler knows about an envelope is derived from its
+ * scheduler_info and whether it is suspended.  The queue process keeps
+ * a copy of that on disk, so that after a restart the scheduler can be
+ * fed without reading every envelope first:
+ *
+ *   snapshot	records sorted by evpid, and the sequence number of the
+ *		last change log merged into them
+ *   changes.N	changes made since, appended as they happen
+ *
+ * A new log is started at each restart and each time the snapshot is
+ * rewritten.  Rewriting merges the snapshot with the changes in memory
+ * and runs in a worker thread.  Logs are only removed once a snapshot
+ * covering them is in place.
+ *
+ * Nothing here is synced on the fast path.  The checkpoint is a hint:
+ * the queue is still walked after it has been loaded, and envelopes it
+ * missed or still lists after they are gone are fixed up then.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <imsg.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+#define PATH_SNAPSHOT		PATH_CHECKPOINT "/snapshot"
+#define PATH_SNAPSHOT_TMP	PATH_CHECKPOINT "/snapshot.tmp"
+#define CHANGES_PREFIX		"changes."
+
+#define CKPT_MAGIC		0x434b5054	/* "CKPT" */
+#define CKPT_VERSION		1
+#define CKPT_BUFFER		256	/* changes written at once */
+#define CKPT_COMPACT		262144	/* changes kept before a rewrite */
+#define CKPT_INTERVAL		300	/* seconds between rewrites */
+
+#define CKPT_SUSPEND		0x01
+
+enum {
+	CKPT_PUT,
+	CKPT_DEL,
+	CKPT_FLAGS,
+};
+
+struct ckpt_header {
+	uint32_t		magic;
+	uint32_t		version;
+	uint32_t		recsize;
+	uint32_t		pad;
+	uint64_t		seq;
+	uint64_t		count;
+};
+
+struct ckpt_record {
+	struct scheduler_info	si;
+	uint32_t		flags;
+	uint32_t		pad;
+};
+
+struct ckpt_change {
+	uint32_t		op;
+	uint32_t		flags;
+	uint32_t		crc;
+	uint32_t		pad;
+	struct scheduler_info	si;
+};
+
+/* folded changes for one envelope */
+struct ckpt_entry {
+	struct scheduler_info	si;
+	int			has_si;
+	int			has_flags;
+	int			deleted;
+	uint32_t		flags;
+};
+
+/* envelopes of a message the scheduler has not committed yet */
+struct ckpt_stage {
+	struct scheduler_info	*si;
+	size_t			 count;
+	size_t			 alloc;
+};
+
+struct checkpoint_reader {
+	FILE			*fp;
+	uint64_t		 left;
+	struct ckpt_record	 rec;
+	int			 have_rec;
+	struct tree		*changes;
+	void			*iter;
+	uint64_t		 key;
+	struct ckpt_entry	*entry;
+	int			 have_entry;
+};
+
+struct ckpt_compact {
+	struct tree		 changes;
+	uint64_t		 seq;
+	size_t			 count;
+	int			 ret;
+};
+
+static int ckpt_replay(uint64_t);
+static void ckpt_apply(struct tree *, int, uint32_t, struct scheduler_info *);
+static void ckpt_fold(struct tree *, struct tree *);
+static void ckpt_free(struct tree *);
+static void ckpt_change(int, uint32_t, struct scheduler_info *);
+static void ckpt_flush(void);
+static void ckpt_flush_cb(int, short, void *);
+static void ckpt_timeout(int, short, void *);
+static int ckpt_open_log(void);
+static void ckpt_disable(void);
+static void ckpt_compact(void);
+static void ckpt_compact_work(void *);
+static void ckpt_compact_done(void *);
+static void ckpt_unlink_logs(uint64_t);
+static int ckpt_reader_init(struct checkpoint_reader *, struct tree *);
+static int ckpt_reader_next(struct checkpoint_reader *,
+    struct scheduler_info *, uint32_t *);
+
+static int			enabled;
+static int			compacting;
+static int			reading;
+static int			logfd = -1;
+static uint64_t			logseq;
+static struct tree		base;		/* replayed at startup */
+static struct tree		changes;	/* made since */
+static struct tree		staged;
+static struct ckpt_change	buffer[CKPT_BUFFER];
+static size_t			nbuffer;
+static struct event		ev_flush;
+static struct event		ev_compact;
+
+int
+checkpoint_init(void)
+{
+	struct ckpt_header	 hdr;
+	struct timeval		 tv;
+	struct dirent		*dp;
+	DIR			*dir;
+	FILE			*fp;
+	uint64_t		 seq, last, snapseq;
+	char			*end;
+
+	tree_init_ordered(&base);
+	tree_init(&changes);
+	tree_init(&staged);
+
+	snapseq = 0;
+	if ((fp = fopen(PATH_SNAPSHOT, "r")) != NULL) {
+		if (fread(&hdr, sizeof hdr, 1, fp) == 1 &&
+		    hdr.magic == CKPT_MAGIC && hdr.version == CKPT_VERSION &&
+		    hdr.recsize == sizeof(struct ckpt_record))
+			snapseq = hdr.seq;
+		fclose(fp);
+		if (snapseq == 0) {
+			/* start over, the logs cannot be used without it */
+			log_warnx("warn: checkpoint: invalid snapshot");
+			ckpt_disable();
+		}
+	}
+
+	if ((dir = opendir(PATH_CHECKPOINT)) == NULL) {
+		log_warn("warn: checkpoint: opendir");
+		return (0);
+	}
+
+	/* replay the logs not merged yet, oldest first */
+	last = snapseq;
+	for (;;) {
+		seq = 0;
+		rewinddir(dir);
+		while ((dp = readdir(dir)) != NULL) {
+			if (strncmp(dp->d_name, CHANGES_PREFIX,
+			    sizeof(CHANGES_PREFIX) - 1))
+				continue;
+			errno = 0;
+			seq = strtoull(dp->d_name + sizeof(CHANGES_PREFIX) - 1,
+			    &end, 10);
+			if (errno || *end || seq != last + 1)
+				continue;
+			break;
+		}
+		if (dp == NULL)
+			break;
+		if (!ckpt_replay(seq))
+			break;
+		last = seq;
+	}
+	closedir(dir);
+
+	logseq = last;
+	if (!ckpt_open_log())
+		return (0);
+
+	/* leftovers from before the snapshot was last rewritten */
+	ckpt_unlink_logs(snapseq);
+
+	evtimer_set(&ev_flush, ckpt_flush_cb, NULL);
+	evtimer_set(&ev_compact, ckpt_timeout, NULL);
+	tv.tv_sec = CKPT_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_compact, &tv);
+
+	enabled = 1;
+
+	log_debug("debug: checkpoint: snapshot %" PRIu64 ", %zu changes "
+	    "replayed", snapseq, tree_count(&base));
+
+	return (1);
+}
+
+/*
+ * Records of the checkpoint, sorted by evpid.  Changes made after
+ * checkpoint_init() are not visible to the reader.
+ */
+struct checkpoint_reader *
+checkpoint_reader_open(void)
+{
+	struct checkpoint_reader	*r;
+
+	if (!enabled)
+		return (NULL);
+
+	r = xcalloc(1, sizeof *r);
+	if (!ckpt_reader_init(r, &base) ||
+	    (r->fp == NULL && tree_empty(&base))) {
+		if (r->fp)
+			fclose(r->fp);
+		free(r);
+		return (NULL);
+	}
+	reading = 1;
+
+	return (r);
+}
+
+int
+checkpoint_reader_next(struct checkpoint_reader *r, struct scheduler_info *si,
+    int *suspended)
+{
+	uint32_t	flags;
+	int		ret;
+
+	if ((ret = ckpt_reader_next(r, si, &flags)) == 1)
+		*suspended = (flags & CKPT_SUSPEND) ? 1 : 0;
+	return (ret);
+}
+
+void
+checkpoint_reader_close(struct checkpoint_reader *r)
+{
+	if (r->fp)
+		fclose(r->fp);
+	free(r);
+	reading = 0;
+}
+
+void
+checkpoint_stage(struct scheduler_info *si)
+{
+	struct ckpt_stage	*stage;
+	uint32_t		 msgid;
+	size_t			 alloc;
+	void			*tmp;
+
+	if (!enabled)
+		return;
+
+	msgid = evpid_to_msgid(si->evpid);
+	if ((stage = tree_get(&staged, msgid)) == NULL) {
+		stage = xcalloc(1, sizeof *stage);
+		tree_xset(&staged, msgid, stage);
+	}
+	if (stage->count == stage->alloc) {
+		alloc = stage->alloc ? stage->alloc * 2 : 4;
+		if ((tmp = reallocarray(stage->si, alloc, sizeof *stage->si))
+		    == NULL)
+			fatal("checkpoint_stage: reallocarray");
+		stage->si = tmp;
+		stage->alloc = alloc;
+	}
+	stage->si[stage->count++] = *si;
+}
+
+void
+checkpoint_commit(uint32_t msgid)
+{
+	struct ckpt_stage	*stage;
+	size_t			 i;
+
+	if ((stage = tree_pop(&staged, msgid)) == NULL)
+		return;
+	for (i = 0; i < stage->count; i++)
+		ckpt_change(CKPT_PUT, 0, &stage->si[i]);
+	free(stage->si);
+	free(stage);
+}
+
+void
+checkpoint_rollback(uint32_t msgid)
+{
+	struct ckpt_stage	*stage;
+
+	if ((stage = tree_pop(&staged, msgid)) == NULL)
+		return;
+	free(stage->si);
+	free(stage);
+}
+
+void
+checkpoint_update(struct scheduler_info *si)
+{
+	ckpt_change(CKPT_PUT, 0, si);
+}
+
+void
+checkpoint_delete(uint64_t evpid)
+{
+	struct scheduler_info	si;
+
+	memset(&si, 0, sizeof si);
+	si.evpid = evpid;
+	ckpt_change(CKPT_DEL, 0, &si);
+}
+
+void
+checkpoint_suspend(uint64_t evpid, int suspend)
+{
+	struct scheduler_info	si;
+
+	memset(&si, 0, sizeof si);
+	si.evpid = evpid;
+	ckpt_change(CKPT_FLAGS, suspend ? CKPT_SUSPEND : 0, &si);
+}
+
+static void
+ckpt_change(int op, uint32_t flags, struct scheduler_info *si)
+{
+	struct ckpt_change	*c;
+	struct timeval		 tv;
+
+	if (!enabled)
+		return;
+
+	ckpt_apply(&changes, op, flags, si);
+
+	c = &buffer[nbuffer++];
+	memset(c, 0, sizeof *c);
+	c->op = op;
+	c->flags = flags;
+	c->si = *si;
+	c->crc = crc32(0, (const Bytef *)c, sizeof *c);
+
+	if (nbuffer == CKPT_BUFFER)
+		ckpt_flush();
+	else if (!evtimer_pending(&ev_flush, NULL)) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		evtimer_add(&ev_flush, &tv);
+	}
+
+	if (tree_count(&changes) >= CKPT_COMPACT)
+		ckpt_compact();
+}
+
+static void
+ckpt_flush(void)
+{
+	ssize_t	n;
+	size_t	len;
+
+	if (nbuffer == 0)
+		return;
+
+	len = nbuffer * sizeof buffer[0];
+	nbuffer = 0;
+
+	while ((n = write(logfd, buffer, len)) == -1 && errno == EINTR)
+		;
+	if (n == -1 || (size_t)n != len) {
+		log_warn("warn: checkpoint: write");
+		ckpt_disable();
+	}
+}
+
+static void
+ckpt_flush_cb(int fd, short event, void *arg)
+{
+	ckpt_flush();
+}
+
+static void
+ckpt_timeout(int fd, short event, void *arg)
+{
+	struct timeval	tv;
+
+	ckpt_compact();
+
+	tv.tv_sec = CKPT_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_compact, &tv);
+}
+
+static int
+ckpt_open_log(void)
+{
+	char	path[PATH_MAX];
+
+	if (logfd != -1)
+		close(logfd);
+
+	logseq += 1;
+	(void)snprintf(path, sizeof path, "%s/%s%" PRIu64, PATH_CHECKPOINT,
+	    CHANGES_PREFIX, logseq);
+	if ((logfd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0600))
+	    == -1) {
+		log_warn("warn: checkpoint: open: %s", path);
+		ckpt_disable();
+		return (0);
+	}
+	return (1);
+}
+
+/*
+ * On any error, drop the checkpoint altogether so that the next start
+ * goes through a full walk of the queue.
+ */
+static void
+ckpt_disable(void)
+{
+	if (enabled)
+		log_warnx("warn: checkpoint: disabled");
+	enabled = 0;
+	nbuffer = 0;
+	if (logfd != -1) {
+		close(logfd);
+		logfd = -1;
+	}
+	if (unlink(PATH_SNAPSHOT) == -1 && errno != ENOENT)
+		log_warn("warn: checkpoint: unlink");
+	ckpt_unlink_logs(UINT64_MAX);
+}
+
+static int
+ckpt_replay(uint64_t seq)
+{
+	struct ckpt_change	c;
+	char			path[PATH_MAX];
+	uint32_t		crc;
+	FILE			*fp;
+
+	(void)snprintf(path, sizeof path, "%s/%s%" PRIu64, PATH_CHECKPOINT,
+	    CHANGES_PREFIX, seq);
+	if ((fp = fopen(path, "r")) == NULL) {
+		log_warn("warn: checkpoint: fopen: %s", path);
+		return (0);
+	}
+
+	/* a torn write only loses the tail of the log */
+	while (fread(&c, sizeof c, 1, fp) == 1) {
+		crc = c.crc;
+		c.crc = 0;
+		if (crc != crc32(0, (const Bytef *)&c, sizeof c) ||
+		    c.op > CKPT_FLAGS) {
+			log_warnx("warn: checkpoint: %s: truncated", path);
+			break;
+		}
+		ckpt_apply(&base, c.op, c.flags, &c.si);
+	}
+	fclose(fp);
+
+	return (1);
+}
+
+static void
+ckpt_apply(struct tree *t, int op, uint32_t flags, struct scheduler_info *si)
+{
+	struct ckpt_entry	*e;
+
+	if ((e = tree_get(t, si->evpid)) == NULL) {
+		e = xcalloc(1, sizeof *e);
+		tree_xset(t, si->evpid, e);
+	}
+
+	switch (op) {
+	case CKPT_PUT:
+		e->si = *si;
+		e->has_si = 1;
+		e->deleted = 0;
+		break;
+	case CKPT_DEL:
+		e->has_si = 0;
+		e->has_flags = 0;
+		e->deleted = 1;
+		break;
+	case CKPT_FLAGS:
+		if (e->deleted)
+			break;
+		e->flags = flags;
+		e->has_flags = 1;
+		break;
+	}
+}
+
+/* fold the newer changes of src into dst, emptying src */
+static void
+ckpt_fold(struct tree *dst, struct tree *src)
+{
+	struct ckpt_entry	*e, *d;
+	uint64_t		 evpid;
+
+	while (tree_poproot(src, &evpid, (void **)&e)) {
+		if ((d = tree_get(dst, evpid)) == NULL) {
+			tree_xset(dst, evpid, e);
+			continue;
+		}
+		if (e->deleted) {
+			d->has_si = 0;
+			d->has_flags = 0;
+			d->deleted = 1;
+		}
+		if (e->has_si) {
+			d->si = e->si;
+			d->has_si = 1;
+			d->deleted = 0;
+		}
+		if (e->has_flags) {
+			d->flags = e->flags;
+			d->has_flags = 1;
+		}
+		free(e);
+	}
+}
+
+static void
+ckpt_free(struct tree *t)
+{
+	struct ckpt_entry	*e;
+
+	while (tree_poproot(t, NULL, (void **)&e))
+		free(e);
+}
+
+static void
+ckpt_compact(void)
+{
+	struct ckpt_compact	*job;
+
+	if (!enabled || compacting || reading)
+		return;
+	if (tree_empty(&base) && tree_empty(&changes))
+		return;
+
+	ckpt_flush();
+	if (!enabled)
+		return;
+
+	job = xcalloc(1, sizeof *job);
+	job->seq = logseq;
+	job->changes = base;
+	tree_init_ordered(&base);
+	ckpt_fold(&job->changes, &changes);
+
+	if (!ckpt_open_log()) {
+		ckpt_free(&job->changes);
+		free(job);
+		return;
+	}
+
+	compacting = 1;
+	queue_io_submit(ckpt_compact_work, ckpt_compact_done, job);
+}
+
+static void
+ckpt_compact_work(void *arg)
+{
+	struct ckpt_compact		*job = arg;
+	struct checkpoint_reader	 r;
+	struct ckpt_header		 hdr;
+	struct ckpt_record		 rec;
+	int				 dfd, ret;
+	FILE				*fp;
+
+	if (!ckpt_reader_init(&r, &job->changes))
+		return;
+
+	if ((fp = fopen(PATH_SNAPSHOT_TMP, "w")) == NULL) {
+		log_warn("warn: checkpoint: fopen: %s", PATH_SNAPSHOT_TMP);
+		goto done;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	if (fwrite(&hdr, sizeof hdr, 1, fp) != 1)
+		goto fail;
+
+	memset(&rec, 0, sizeof rec);
+	while ((ret = ckpt_reader_next(&r, &rec.si, &rec.flags)) == 1) {
+		if (fwrite(&rec, sizeof rec, 1, fp) != 1)
+			goto fail;
+		job->count++;
+	}
+	if (ret == -1)
+		goto fail;
+
+	hdr.magic = CKPT_MAGIC;
+	hdr.version = CKPT_VERSION;
+	hdr.recsize = sizeof rec;
+	hdr.seq = job->seq;
+	hdr.count = job->count;
+	if (fseeko(fp, 0, SEEK_SET) == -1 ||
+	    fwrite(&hdr, sizeof hdr, 1, fp) != 1 ||
+	    fflush(fp) != 0 ||
+	    fsync(fileno(fp)) == -1)
+		goto fail;
+	if (fclose(fp) != 0) {
+		fp = NULL;
+		goto fail;
+	}
+	fp = NULL;
+
+	if (rename(PATH_SNAPSHOT_TMP, PATH_SNAPSHOT) == -1)
+		goto fail;
+	if ((dfd = open(PATH_CHECKPOINT, O_RDONLY | O_DIRECTORY)) != -1) {
+		if (fsync(dfd) == -1)
+			log_warn("warn: checkpoint: fsync");
+		close(dfd);
+	}
+
+	ckpt_unlink_logs(job->seq);
+	job->ret = 1;
+	goto done;
+
+fail:
+	log_warn("warn: checkpoint: %s", PATH_SNAPSHOT_TMP);
+	if (fp)
+		fclose(fp);
+	unlink(PATH_SNAPSHOT_TMP);
+done:
+	if (r.fp)
+		fclose(r.fp);
+}
+
+static void
+ckpt_compact_done(void *arg)
+{
+	struct ckpt_compact	*job = arg;
+
+	compacting = 0;
+	if (job->ret)
+		log_debug("debug: checkpoint: snapshot %" PRIu64 " written, "
+		    "%zu envelopes", job->seq, job->count);
+	else
+		ckpt_disable();
+
+	ckpt_free(&job->changes);
+	free(job);
+}
+
+/* remove the logs up to seq, they are part of the snapshot */
+static void
+ckpt_unlink_logs(uint64_t seq)
+{
+	struct dirent	*dp;
+	DIR		*dir;
+	char		 path[PATH_MAX];
+	char		*end;
+	uint64_t	 n;
+
+	if ((dir = opendir(PATH_CHECKPOINT)) == NULL)
+		return;
+	while ((dp = readdir(dir)) != NULL) {
+		if (strncmp(dp->d_name, CHANGES_PREFIX,
+		    sizeof(CHANGES_PREFIX) - 1))
+			continue;
+		errno = 0;
+		n = strtoull(dp->d_name + sizeof(CHANGES_PREFIX) - 1, &end, 10);
+		if (errno || *end || n > seq)
+			continue;
+		(void)snprintf(path, sizeof path, "%s/%s", PATH_CHECKPOINT,
+		    dp->d_name);
+		if (unlink(path) == -1)
+			log_warn("warn: checkpoint: unlink: %s", path);
+	}
+	closedir(dir);
+}
+
+static int
+ckpt_reader_init(struct checkpoint_reader *r, struct tree *t)
+{
+	struct ckpt_header	hdr;
+	struct stat		sb;
+
+	memset(r, 0, sizeof *r);
+	r->changes = t;
+
+	if ((r->fp = fopen(PATH_SNAPSHOT, "r")) == NULL) {
+		if (errno == ENOENT)
+			return (1);
+		log_warn("warn: checkpoint: fopen: %s", PATH_SNAPSHOT);
+		return (0);
+	}
+
+	if (fstat(fileno(r->fp), &sb) == -1 ||
+	    fread(&hdr, sizeof hdr, 1, r->fp) != 1 ||
+	    hdr.magic != CKPT_MAGIC || hdr.version != CKPT_VERSION ||
+	    hdr.recsize != sizeof(struct ckpt_record) ||
+	    (uint64_t)sb.st_size != sizeof hdr + hdr.count * hdr.recsize) {
+		log_warnx("warn: checkpoint: invalid snapshot");
+		fclose(r->fp);
+		r->fp = NULL;
+		return (0);
+	}
+	r->left = hdr.count;
+
+	return (1);
+}
+
+/*
+ * Merge the snapshot with the changes, both sorted by evpid.
+ * Returns 1 for a record, 0 at the end and -1 on error.
+ */
+static int
+ckpt_reader_next(struct checkpoint_reader *r, struct scheduler_info *si,
+    uint32_t *flags)
+{
+	struct ckpt_entry	*e;
+
+	for (;;) {
+		if (!r->have_rec && r->left) {
+			if (fread(&r->rec, sizeof r->rec, 1, r->fp) != 1) {
+				log_warnx("warn: checkpoint: short snapshot");
+				return (-1);
+			}
+			r->left--;
+			r->have_rec = 1;
+		}
+		if (!r->have_entry)
+			r->have_entry = tree_iter(r->changes, &r->iter,
+			    &r->key, (void **)&r->entry);
+
+		if (!r->have_rec && !r->have_entry)
+			return (0);
+
+		if (r->have_rec &&
+		    (!r->have_entry || r->rec.si.evpid < r->key)) {
+			r->have_rec = 0;
+			*si = r->rec.si;
+			*flags = r->rec.flags;
+			return (1);
+		}
+
+		e = r->entry;
+		if (!r->have_rec || r->key < r->rec.si.evpid) {
+			/* change to an envelope not in the snapshot */
+			r->have_entry = 0;
+			if (!e->has_si)
+				continue;
+			*si = e->si;
+			*flags = e->has_flags ? e->flags : 0;
+			return (1);
+		}
+
+		/* same envelope */
+		r->have_rec = 0;
+		r->have_entry = 0;
+		if (e->deleted)
+			continue;
+		*si = e->has_si ? e->si : r->rec.si;
+		*flags = e->has_flags ? e->flags : r->rec.flags;
+		return (1);
+	}
+}
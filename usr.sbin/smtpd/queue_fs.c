@@ -32,38 +32,137 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <event.h>
 #include <fcntl.h>
 #include <fts.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "smtpd.h"
 #include "log.h"
 
 #define PATH_QUEUE		"/queue"
 #define PATH_INCOMING		"/incoming"
-#define PATH_EVPTMP		PATH_INCOMING "/envelope.tmp"
-#define PATH_MESSAGE		"/message"
+
+/* records the layouts messages may be found under */
+#define LAYOUT_FILE		"layout"
+#define LAYOUT(levels)		(1 << ((levels) - 1))
 
 /* percentage of remaining space / inodes required to accept new messages */
 #define	MINSPACE		5
 #define	MININODES		5
 
+/* directory entries looked at per event loop iteration when migrating */
+#define	MIGRATE_STEP		256
+
+/*
+ * Envelope updates are appended to a journal in each bucket, and only
+ * written back to the envelope files when a journal grows too large or
+ * gets too old.
+ */
+#define JOURNAL_FILE		"journal"
+#define JOURNAL_MAGIC		0x4a524e4c
+#define JOURNAL_MAX		(4 * 1024 * 1024)
+#define JOURNAL_INTERVAL	3600
+#define JOURNAL_CHECK		10
+
+/*
+ * With bundles, the envelopes of a message are stored in the fixed size
+ * slots of a single file.  The lower half of their id is the slot index
+ * plus one, queue_generate_evpid() never returns such ids.  Slots are
+ * only marked when their envelope is deleted.
+ */
+#define BUNDLE_MAGIC		0x45564253
+#define BUNDLE_SLOT		1024
+#define BUNDLE_DELETED		0x01
+#define BUNDLE_INDEX(evpid)	(((evpid) & 0xffffffff) - 1)
+#define BUNDLED(evpid)		(((evpid) & 0xffffffff) != 0 &&		\
+				((evpid) & 0xffffffff) <= QUEUE_BUNDLE_SLOTS)
+
+struct bundle_slot {
+	uint32_t	magic;
+	uint32_t	flags;
+	uint64_t	evpid;
+	int64_t		sec;		/* creation time */
+	uint32_t	nsec;
+	uint32_t	len;
+	uint32_t	crc;
+	uint32_t	reserved;
+	char		data[BUNDLE_SLOT - 40];
+};
+
 struct qwalk {
-	FTS	*fts;
-	int	 depth;
+	FTS			*fts;
+	FILE			*bundle;
+	struct bundle_slot	 slot;
+};
+
+struct mwalk {
+	DIR	*dir;
+	FILE	*bundle;
+};
+
+struct journal_header {
+	uint32_t	magic;
+	uint32_t	len;		/* 0 when the envelope is deleted */
+	uint64_t	evpid;
+	uint32_t	crc;
+	uint32_t	reserved;
+};
+
+struct journal_record {
+	off_t		off;
+	size_t		len;
+};
+
+struct journal {
+	pthread_mutex_t	 lock;
+	int		 fd;
+	off_t		 size;
+	struct tree	 records;
+	int		 compacting;
+	time_t		 compacted;
 };
 
 static int	fsqueue_check_space(void);
-static void	fsqueue_envelope_path(uint64_t, char *, size_t);
-static void	fsqueue_envelope_incoming_path(uint64_t, char *, size_t);
-static int	fsqueue_envelope_dump(char *, const char *, size_t, int, int);
-static void	fsqueue_message_path(uint32_t, char *, size_t);
-static void	fsqueue_message_incoming_path(uint32_t, char *, size_t);
+static void	fsqueue_message_name(uint32_t, int, char *, size_t);
+static int	fsqueue_openat(uint32_t, const char *, int, char *, size_t);
+static int	fsqueue_message_rmdir(int, int, const char *);
+static int	fsqueue_envelope_dump(int, const char *, const char *, size_t,
+		    int, int);
+static int	fsqueue_envelope_read(int, char *, size_t);
+static int	fsqueue_layout_load(void);
+static int	fsqueue_layout_save(int);
+static void	fsqueue_migrate(int, short, void *);
+static size_t	fsqueue_migrate_entry(int, const char *);
+static int	fsqueue_journal_open(struct journal *, unsigned int, int);
+static int	fsqueue_journal_write(struct journal *, uint64_t, const char *,
+		    size_t);
+static int	fsqueue_journal_load(uint64_t, char *, size_t);
+static void	fsqueue_journal_drop(struct journal *, uint64_t);
+static void	fsqueue_journal_replay(struct journal *, unsigned int);
+static void	fsqueue_journal_rewrite(struct journal *, unsigned int);
+static void	fsqueue_journal_timeout(int, short, void *);
+static void	fsqueue_compact_work(void *);
+static void	fsqueue_compact_done(void *);
+static int	fsqueue_bundle_append(int, uint32_t, int, const char *, size_t,
+		    uint64_t *);
+static void	fsqueue_bundle_close(uint32_t);
+static int	fsqueue_bundle_slot(uint64_t, int, struct bundle_slot *, int *);
+static int	fsqueue_bundle_load(uint64_t, char *, size_t);
+static int	fsqueue_bundle_update(uint64_t, const char *, size_t, int *);
+static int	fsqueue_bundle_delete(uint64_t);
+static int	fsqueue_bundle_next(FILE *, struct bundle_slot *);
+static int	fsqueue_bundle_copy(const struct bundle_slot *, char *, size_t);
+static uint32_t	fsqueue_bundle_crc(const struct bundle_slot *);
 static void    *fsqueue_qwalk_new(void);
 static int	fsqueue_qwalk(void *, uint64_t *);
 static void	fsqueue_qwalk_close(void *);
@@ -71,13 +170,47 @@ static void	fsqueue_qwalk_close(void *);
 struct tree evpcount;
 static struct timespec startup;
 
+/*
+ * Everything is looked up relative to these descriptors, opened before
+ * the chroot.  Messages are hashed in 256 buckets on the upper byte of
+ * their id and, with two levels, in 256 sub-buckets on the next byte.
+ */
+static int	queuefd = -1;
+static int	incomingfd = -1;
+static int	bucketfd[256];
+
+/* configured number of levels, and layouts found in the queue */
+static int	levels;
+static int	layouts;
+
+/* indexed like bucketfd, the records tree holds the latest updates */
+static struct journal	journals[256];
+static struct event	ev_journal;
+
+/* new envelopes go to bundles, the last one appended to is kept open */
+static int	bundles;
+static struct {
+	uint32_t	msgid;
+	int		fd;
+	size_t		slots;
+} bundle = { 0, -1, 0 };
+
+static struct {
+	struct event	 ev;
+	DIR		*dir;
+	int		 fd;
+	unsigned int	 bucket;
+	size_t		 moved;
+	size_t		 total;
+} migrate;
+
 #define REF	(int*)0xf00
 
 static int
 queue_fs_message_create(uint32_t *msgid)
 {
-	char		rootdir[PATH_MAX];
-	struct stat	sb;
+	char	name[16];
+	int	fd;
 
 	if (!fsqueue_check_space())
 		return 0;
@@ -86,9 +219,11 @@ again:
 	*msgid = queue_generate_msgid();
 
 	/* prevent possible collision later when moving to Q_QUEUE */
-	fsqueue_message_path(*msgid, rootdir, sizeof(rootdir));
-	if (stat(rootdir, &sb) != -1)
+	if ((fd = fsqueue_openat(*msgid, NULL, O_RDONLY | O_DIRECTORY,
+	    NULL, 0)) != -1) {
+		close(fd);
 		goto again;
+	}
 
 	/* we hit an unexpected error, temporarily fail */
 	if (errno != ENOENT) {
@@ -96,8 +231,8 @@ again:
 		return 0;
 	}
 
-	fsqueue_message_incoming_path(*msgid, rootdir, sizeof(rootdir));
-	if (mkdir(rootdir, 0700) == -1) {
+	(void)snprintf(name, sizeof(name), "%08x", *msgid);
+	if (mkdirat(incomingfd, name, 0700) == -1) {
 		if (errno == EEXIST)
 			goto again;
 
@@ -117,38 +252,32 @@ again:
 static int
 queue_fs_message_commit(uint32_t msgid, const char *path)
 {
-	char incomingdir[PATH_MAX];
-	char queuedir[PATH_MAX];
-	char msgdir[PATH_MAX];
-	char msgpath[PATH_MAX];
+	char	 name[32];
+	char	 dest[PATH_MAX];
+	char	*sep;
+	int	 fd = bucketfd[msgid >> 24];
 
 	/* before-first, move the message content in the incoming directory */
-	fsqueue_message_incoming_path(msgid, msgpath, sizeof(msgpath));
-	if (strlcat(msgpath, PATH_MESSAGE, sizeof(msgpath))
-	    >= sizeof(msgpath))
-		return (0);
-	if (rename(path, msgpath) == -1)
+	(void)snprintf(name, sizeof(name), "%08x/message", msgid);
+	if (renameat(AT_FDCWD, path, incomingfd, name) == -1)
 		return (0);
 
-	fsqueue_message_incoming_path(msgid, incomingdir, sizeof(incomingdir));
-	fsqueue_message_path(msgid, msgdir, sizeof(msgdir));
-	if (strlcpy(queuedir, msgdir, sizeof(queuedir))
-	    >= sizeof(queuedir))
-		return (0);
+	(void)snprintf(name, sizeof(name), "%08x", msgid);
+	fsqueue_message_name(msgid, levels, dest, sizeof(dest));
 
 	/* first attempt to rename */
-	if (rename(incomingdir, msgdir) == 0)
+	if (renameat(incomingfd, name, fd, dest) == 0)
 		return 1;
 	if (errno == ENOSPC)
 		return 0;
-	if (errno != ENOENT) {
+	if (errno != ENOENT || (sep = strchr(dest, '/')) == NULL) {
 		log_warn("warn: queue-fs: rename");
 		return 0;
 	}
 
-	/* create the bucket */
-	*strrchr(queuedir, '/') = '\0';
-	if (mkdir(queuedir, 0700) == -1) {
+	/* create the sub-bucket */
+	*sep = '\0';
+	if (mkdirat(fd, dest, 0700) == -1) {
 		if (errno == ENOSPC)
 			return 0;
 		if (errno != EEXIST) {
@@ -156,9 +285,10 @@ queue_fs_message_commit(uint32_t msgid, const char *path)
 			return 0;
 		}
 	}
+	*sep = '/';
 
 	/* rename */
-	if (rename(incomingdir, msgdir) == -1) {
+	if (renameat(incomingfd, name, fd, dest) == -1) {
 		if (errno == ENOSPC)
 			return 0;
 		log_warn("warn: queue-fs: rename");
@@ -172,14 +302,8 @@ static int
 queue_fs_message_fd_r(uint32_t msgid)
 {
 	int fd;
-	char path[PATH_MAX];
-
-	fsqueue_message_path(msgid, path, sizeof(path));
-	if (strlcat(path, PATH_MESSAGE, sizeof(path))
-	    >= sizeof(path))
-		return -1;
 
-	if ((fd = open(path, O_RDONLY)) == -1) {
+	if ((fd = fsqueue_openat(msgid, "message", O_RDONLY, NULL, 0)) == -1) {
 		log_warn("warn: queue-fs: open");
 		return -1;
 	}
@@ -190,15 +314,35 @@ queue_fs_message_fd_r(uint32_t msgid)
 static int
 queue_fs_message_delete(uint32_t msgid)
 {
-	char		path[PATH_MAX];
-	struct stat	sb;
+	struct journal	*j = &journals[msgid >> 24];
+	char		 name[PATH_MAX];
+	void		*iter;
+	uint64_t	 evpid;
+	int		 fd, parent;
+
+	fsqueue_bundle_close(msgid);
+
+	parent = incomingfd;
+	(void)snprintf(name, sizeof(name), "%08x", msgid);
+	if ((fd = openat(parent, name, O_RDONLY | O_DIRECTORY)) == -1 &&
+	    errno == ENOENT) {
+		parent = bucketfd[msgid >> 24];
+		fd = fsqueue_openat(msgid, NULL, O_RDONLY | O_DIRECTORY,
+		    name, sizeof(name));
+	}
 
-	fsqueue_message_incoming_path(msgid, path, sizeof(path));
-	if (stat(path, &sb) == -1)
-		fsqueue_message_path(msgid, path, sizeof(path));
+	if (fd == -1 || !fsqueue_message_rmdir(fd, parent, name))
+		log_warn("warn: queue-fs: rmdir");
 
-	if (rmtree(path, 0) == -1)
-		log_warn("warn: queue-fs: rmtree");
+	pthread_mutex_lock(&j->lock);
+	for (;;) {
+		iter = NULL;
+		if (!tree_iterfrom(&j->records, &iter, msgid_to_evpid(msgid),
+		    &evpid, NULL) || evpid_to_msgid(evpid) != msgid)
+			break;
+		fsqueue_journal_drop(j, evpid);
+	}
+	pthread_mutex_unlock(&j->lock);
 
 	tree_pop(&evpcount, msgid);
 
@@ -209,32 +353,39 @@ static int
 queue_fs_envelope_create(uint32_t msgid, const char *buf, size_t len,
     uint64_t *evpid)
 {
-	char		path[PATH_MAX];
-	int		queued = 0, i, r = 0, *n;
-	struct stat	sb;
+	char		name[32];
+	int		fd, i, incoming = 1, r = 0, *n;
 
 	if (msgid == 0) {
 		log_warnx("warn: queue-fs: msgid=0, evpid=%016"PRIx64, *evpid);
 		goto done;
 	}
 
-	fsqueue_message_incoming_path(msgid, path, sizeof(path));
-	if (stat(path, &sb) == -1)
-		queued = 1;
+	/* envelopes stay with the message in incoming/ until committed */
+	(void)snprintf(name, sizeof(name), "%08x", msgid);
+	if ((fd = openat(incomingfd, name, O_RDONLY | O_DIRECTORY)) == -1 &&
+	    errno == ENOENT) {
+		incoming = 0;
+		fd = fsqueue_openat(msgid, NULL, O_RDONLY | O_DIRECTORY,
+		    NULL, 0);
+	}
+	if (fd == -1) {
+		log_warn("warn: queue-fs: open");
+		goto done;
+	}
+
+	/* messages queued without bundles keep their envelopes in files */
+	if (bundles)
+		r = fsqueue_bundle_append(fd, msgid, incoming, buf, len, evpid);
 
-	for (i = 0; i < 20; i ++) {
+	for (i = 0; r == 0 && i < 20; i ++) {
 		*evpid = queue_generate_evpid(msgid);
-		if (queued)
-			fsqueue_envelope_path(*evpid, path, sizeof(path));
-		else
-			fsqueue_envelope_incoming_path(*evpid, path,
-			    sizeof(path));
-
-		if ((r = fsqueue_envelope_dump(path, buf, len, 0, 0)) != 0)
-			goto done;
+		(void)snprintf(name, sizeof(name), "%016" PRIx64, *evpid);
+		r = fsqueue_envelope_dump(fd, name, buf, len, 0, 0);
 	}
-	r = 0;
-	log_warnx("warn: queue-fs: could not allocate evpid");
+	close(fd);
+	if (r == 0)
+		log_warnx("warn: queue-fs: could not allocate evpid");
 
 done:
 	if (r) {
@@ -250,56 +401,73 @@ done:
 static int
 queue_fs_envelope_load(uint64_t evpid, char *buf, size_t len)
 {
-	char	 pathname[PATH_MAX];
-	FILE	*fp;
-	size_t	 r;
-
-	fsqueue_envelope_path(evpid, pathname, sizeof(pathname));
+	char	name[32];
+	int	r;
 
-	fp = fopen(pathname, "r");
-	if (fp == NULL) {
-		if (errno != ENOENT && errno != ENFILE)
-			log_warn("warn: queue-fs: fopen");
-		return 0;
-	}
+	if ((r = fsqueue_journal_load(evpid, buf, len)) != -1)
+		return (r);
+	if ((r = fsqueue_bundle_load(evpid, buf, len)) != -1)
+		return (r);
 
-	r = fread(buf, 1, len, fp);
-	if (r) {
-		if (r == len) {
-			log_warn("warn: queue-fs: too large");
-			r = 0;
-		}
-		else
-			buf[r] = '\0';
-	}
-	fclose(fp);
+	(void)snprintf(name, sizeof(name), "%016" PRIx64, evpid);
 
-	return (r);
+	return (fsqueue_envelope_read(fsqueue_openat(evpid_to_msgid(evpid),
+	    name, O_RDONLY, NULL, 0), buf, len));
 }
 
 static int
 queue_fs_envelope_update(uint64_t evpid, const char *buf, size_t len)
 {
-	char dest[PATH_MAX];
+	struct journal	*j = &journals[evpid_to_msgid(evpid) >> 24];
+	int		 r;
 
-	fsqueue_envelope_path(evpid, dest, sizeof(dest));
+	if (len == 0)
+		return (0);
+
+	pthread_mutex_lock(&j->lock);
+	r = fsqueue_journal_write(j, evpid, buf, len);
+	if (r && fsync(j->fd) == -1) {
+		log_warn("warn: queue-fs: fsync");
+		r = 0;
+	}
+	pthread_mutex_unlock(&j->lock);
 
-	return (fsqueue_envelope_dump(dest, buf, len, 1, 1));
+	return (r);
 }
 
 static int
 queue_fs_envelope_delete(uint64_t evpid)
 {
-	char		pathname[PATH_MAX];
-	uint32_t	msgid;
-	int		*n;
+	struct journal	*j;
+	char		 name[32];
+	uint32_t	 msgid;
+	int		 fd, r = -1, saved_errno, *n;
+
+	msgid = evpid_to_msgid(evpid);
+	j = &journals[msgid >> 24];
+	(void)snprintf(name, sizeof(name), "%016" PRIx64, evpid);
+
+	/* prevents a compaction from writing the envelope back */
+	pthread_mutex_lock(&j->lock);
+	if ((r = fsqueue_bundle_delete(evpid)) != -1)
+		r = r ? 0 : -1;
+	else if ((fd = fsqueue_openat(msgid, NULL, O_RDONLY | O_DIRECTORY,
+	    NULL, 0)) != -1) {
+		r = unlinkat(fd, name, 0);
+		saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+	}
+	if (r == 0 || errno == ENOENT)
+		fsqueue_journal_drop(j, evpid);
+	saved_errno = errno;
+	pthread_mutex_unlock(&j->lock);
+	errno = saved_errno;
 
-	fsqueue_envelope_path(evpid, pathname, sizeof(pathname));
-	if (unlink(pathname) == -1)
+	if (r == -1)
 		if (errno != ENOENT)
 			return 0;
 
-	msgid = evpid_to_msgid(evpid);
 	n = tree_pop(&evpcount, msgid);
 	n -= 1;
 
@@ -315,37 +483,69 @@ static int
 queue_fs_message_walk(uint64_t *evpid, char *buf, size_t len,
     uint32_t msgid, int *done, void **data)
 {
-	struct dirent	*dp;
-	DIR		*dir = *data;
-	char		 path[PATH_MAX];
-	char		 msgid_str[9];
-	char		*tmp;
-	int		 r, *n;
+	struct bundle_slot	 slot;
+	struct dirent		*dp;
+	struct mwalk		*w = *data;
+	DIR			*dir;
+	char			 msgid_str[9];
+	char			*tmp;
+	int			 fd, r, *n;
 
 	if (*done)
 		return (-1);
 
-	if (!bsnprintf(path, sizeof path, "%s/%02x/%08x",
-	    PATH_QUEUE, (msgid  & 0xff000000) >> 24, msgid))
-		fatalx("queue_fs_message_walk: path does not fit buffer");
-
-	if (dir == NULL) {
-		if ((dir = opendir(path)) == NULL) {
-			log_warn("warn: queue_fs: opendir: %s", path);
+	if (w == NULL) {
+		if ((fd = fsqueue_openat(msgid, NULL, O_RDONLY | O_DIRECTORY,
+		    NULL, 0)) == -1 || (dir = fdopendir(fd)) == NULL) {
+			log_warn("warn: queue_fs: opendir: %08x", msgid);
+			if (fd != -1)
+				close(fd);
 			*done = 1;
 			return (-1);
 		}
 
-		*data = dir;
+		w = xcalloc(1, sizeof(*w));
+		w->dir = dir;
+		*data = w;
+	}
+
+	while (w->bundle) {
+		if ((r = fsqueue_bundle_next(w->bundle, &slot)) == -1) {
+			fclose(w->bundle);
+			w->bundle = NULL;
+			break;
+		}
+		if (r == 0)
+			continue;
+
+		*evpid = slot.evpid;
+		memset(buf, 0, len);
+		if ((r = fsqueue_journal_load(*evpid, buf, len)) == -1)
+			r = fsqueue_bundle_copy(&slot, buf, len);
+		goto found;
 	}
 
 	(void)snprintf(msgid_str, sizeof msgid_str, "%08" PRIx32, msgid);
-	while ((dp = readdir(dir)) != NULL) {
+	while ((dp = readdir(w->dir)) != NULL) {
 #if defined(HAVE_STRUCT_DIR_D_TYPE)
 		if (dp->d_type != DT_REG)
 			continue;
 #endif
 
+		if (strcmp(dp->d_name, QUEUE_BUNDLE_FILE) == 0) {
+			if ((fd = openat(dirfd(w->dir), dp->d_name,
+			    O_RDONLY)) == -1 ||
+			    (w->bundle = fdopen(fd, "r")) == NULL) {
+				log_warn("warn: queue_fs: open: %08x/%s",
+				    msgid, dp->d_name);
+				if (fd != -1)
+					close(fd);
+				continue;
+			}
+			return (queue_fs_message_walk(evpid, buf, len, msgid,
+			    done, data));
+		}
+
 		/* ignore files other than envelopes */
 		if (strlen(dp->d_name) != 16 ||
 		    strncmp(dp->d_name, msgid_str, 8))
@@ -359,31 +559,39 @@ queue_fs_message_walk(uint64_t *evpid, char *buf, size_t len,
 		}
 
 		memset(buf, 0, len);
-		r = queue_fs_envelope_load(*evpid, buf, len);
-		if (r) {
-			n = tree_pop(&evpcount, msgid);
-			if (n == NULL)
-				n = REF;
-
-			n += 1;
-			tree_xset(&evpcount, msgid, n);
-		}
-
-		return (r);
+		if ((r = fsqueue_journal_load(*evpid, buf, len)) == -1)
+			r = fsqueue_envelope_read(openat(dirfd(w->dir),
+			    dp->d_name, O_RDONLY), buf, len);
+		goto found;
 	}
 
-	(void)closedir(dir);
+	(void)closedir(w->dir);
+	free(w);
+	*data = NULL;
 	*done = 1;
 	return (-1);
+
+found:
+	if (r) {
+		n = tree_pop(&evpcount, msgid);
+		if (n == NULL)
+			n = REF;
+
+		n += 1;
+		tree_xset(&evpcount, msgid, n);
+	}
+
+	return (r);
 }
 
 static int
 queue_fs_envelope_walk(uint64_t *evpid, char *buf, size_t len)
 {
-	static int	 done = 0;
-	static void	*hdl = NULL;
-	int		 r, *n;
-	uint32_t	 msgid;
+	static int		 done = 0;
+	static struct qwalk	*hdl = NULL;
+	struct timeval		 tv;
+	int			 r, *n;
+	uint32_t		 msgid;
 
 	if (done)
 		return (-1);
@@ -393,7 +601,10 @@ queue_fs_envelope_walk(uint64_t *evpid, char *buf, size_t len)
 
 	if (fsqueue_qwalk(hdl, evpid)) {
 		memset(buf, 0, len);
-		r = queue_fs_envelope_load(*evpid, buf, len);
+		if (hdl->bundle == NULL)
+			r = queue_fs_envelope_load(*evpid, buf, len);
+		else if ((r = fsqueue_journal_load(*evpid, buf, len)) == -1)
+			r = fsqueue_bundle_copy(&hdl->slot, buf, len);
 		if (r) {
 			msgid = evpid_to_msgid(*evpid);
 			n = tree_pop(&evpcount, msgid);
@@ -407,9 +618,116 @@ queue_fs_envelope_walk(uint64_t *evpid, char *buf, size_t len)
 
 	fsqueue_qwalk_close(hdl);
 	done = 1;
+
+	evtimer_set(&ev_journal, fsqueue_journal_timeout, NULL);
+	tv.tv_sec = JOURNAL_CHECK;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_journal, &tv);
+
+	/* messages can move once the walk no longer has to find them */
+	if (layouts != LAYOUT(levels)) {
+		log_info("info: queue-fs: migrating queue to %d level%s",
+		    levels, levels > 1 ? "s" : "");
+		evtimer_set(&migrate.ev, fsqueue_migrate, NULL);
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		evtimer_add(&migrate.ev, &tv);
+	}
+
 	return (-1);
 }
 
+/*
+ * The functions below let a backend layered over this one move messages
+ * in under ids it allocated itself.
+ */
+int
+queue_fs_message_exists(uint32_t msgid)
+{
+	int	fd;
+
+	if ((fd = fsqueue_openat(msgid, NULL, O_RDONLY | O_DIRECTORY,
+	    NULL, 0)) == -1)
+		return (errno != ENOENT);
+	close(fd);
+
+	return (1);
+}
+
+/*
+ * Build the message in the incoming directory and move it in the queue
+ * as a whole, as for a commit.  It only touches the filesystem and may
+ * be called from a worker thread, queue_fs_message_adopt() must then be
+ * called from the event loop.
+ */
+int
+queue_fs_message_import(uint32_t msgid, const char *path, size_t count,
+    const uint64_t *evpids, char * const *bufs, const size_t *lens)
+{
+	char	name[16];
+	char	evpname[32];
+	size_t	i;
+	int	fd;
+
+	(void)snprintf(name, sizeof(name), "%08x", msgid);
+	if (mkdirat(incomingfd, name, 0700) == -1) {
+		log_warn("warn: queue-fs: mkdir");
+		return (0);
+	}
+	if ((fd = openat(incomingfd, name, O_RDONLY | O_DIRECTORY)) == -1) {
+		log_warn("warn: queue-fs: open");
+		goto fail;
+	}
+
+	for (i = 0; i < count; i++) {
+		(void)snprintf(evpname, sizeof(evpname), "%016" PRIx64,
+		    evpids[i]);
+		if (!fsqueue_envelope_dump(fd, evpname, bufs[i], lens[i], 0, 1))
+			goto fail;
+	}
+	if (!queue_fs_message_commit(msgid, path))
+		goto fail;
+	close(fd);
+
+	return (1);
+
+fail:
+	if (fd == -1)
+		fd = openat(incomingfd, name, O_RDONLY | O_DIRECTORY);
+	if (fd == -1 || !fsqueue_message_rmdir(fd, incomingfd, name))
+		log_warn("warn: queue-fs: rmdir");
+	return (0);
+}
+
+void
+queue_fs_message_adopt(uint32_t msgid, size_t count)
+{
+	int	*n;
+
+	n = tree_pop(&evpcount, msgid);
+	if (n == NULL)
+		n = REF;
+	n += count;
+	tree_xset(&evpcount, msgid, n);
+}
+
+/*
+ * Read the next envelope of a bundle open as fp, for offline use.
+ * Return 0 for an empty slot and -1 at the end of the bundle.
+ */
+int
+queue_fs_bundle_next(FILE *fp, uint64_t *evpid, char *buf, size_t len)
+{
+	struct bundle_slot	slot;
+	int			r;
+
+	if ((r = fsqueue_bundle_next(fp, &slot)) != 1)
+		return (r);
+	*evpid = slot.evpid;
+
+	return (fsqueue_bundle_copy(&slot, buf, len));
+}
+
 static int
 fsqueue_check_space(void)
 {
@@ -418,11 +736,10 @@ fsqueue_check_space(void)
 	uint64_t	used;
 	uint64_t	total;
 
-	if (statfs(PATH_QUEUE, &buf) == -1) {
+	if (fstatfs(queuefd, &buf) == -1) {
 		log_warn("warn: queue-fs: statfs");
 		return 0;
 	}
-
 	/*
 	 * f_bfree and f_ffree is not set on all filesystems.
 	 * They could be signed or unsigned integers.
@@ -462,37 +779,131 @@ fsqueue_check_space(void)
 	return 1;
 }
 
+
+/*
+ * Name of a message directory relative to its bucket.
+ */
 static void
-fsqueue_envelope_path(uint64_t evpid, char *buf, size_t len)
+fsqueue_message_name(uint32_t msgid, int n, char *buf, size_t len)
 {
-	if (!bsnprintf(buf, len, "%s/%02x/%08x/%016" PRIx64,
-		PATH_QUEUE,
-		(evpid_to_msgid(evpid) & 0xff000000) >> 24,
-		evpid_to_msgid(evpid),
-		evpid))
-		fatalx("fsqueue_envelope_path: path does not fit buffer");
+	int	r;
+
+	if (n == 1)
+		r = bsnprintf(buf, len, "%08x", msgid);
+	else
+		r = bsnprintf(buf, len, "%02x/%08x",
+		    (msgid & 0xff0000) >> 16, msgid);
+	if (!r)
+		fatalx("fsqueue_message_name: name does not fit buffer");
 }
 
-static void
-fsqueue_envelope_incoming_path(uint64_t evpid, char *buf, size_t len)
+/*
+ * Open a message directory, or a file in it if given, and optionally
+ * return the name of the directory in its bucket.  While the queue is
+ * being migrated the message may be under either layout and may even
+ * move between two lookups, so the configured layout is tried again.
+ */
+static int
+fsqueue_openat(uint32_t msgid, const char *file, int flags, char *name,
+    size_t len)
+{
+	char	path[PATH_MAX];
+	int	tries[] = { levels, QUEUE_LEVELS_MAX + 1 - levels, levels };
+	int	fd, i;
+
+	if (bucketfd[msgid >> 24] == -1) {
+		errno = ENOENT;
+		return (-1);
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (i > 0 && layouts == LAYOUT(levels))
+			break;
+
+		fsqueue_message_name(msgid, tries[i], path, sizeof(path));
+		if (name)
+			(void)strlcpy(name, path, len);
+		if (file && (strlcat(path, "/", sizeof(path)) >= sizeof(path) ||
+		    strlcat(path, file, sizeof(path)) >= sizeof(path)))
+			fatalx("fsqueue_openat: path does not fit buffer");
+
+		fd = openat(bucketfd[msgid >> 24], path, flags);
+		if (fd != -1 || errno != ENOENT)
+			return (fd);
+	}
+
+	return (-1);
+}
+
+/*
+ * Remove the message directory open as fd, which is closed, and named
+ * name in parent.
+ */
+static int
+fsqueue_message_rmdir(int fd, int parent, const char *name)
 {
-	if (!bsnprintf(buf, len, "%s/%08x/%016" PRIx64,
-		PATH_INCOMING,
-		evpid_to_msgid(evpid),
-		evpid))
-		fatalx("fsqueue_envelope_incoming_path: path does not fit buffer");
+	struct dirent	*dp;
+	DIR		*dir;
+	int		 retry, saved_errno;
+
+	if ((dir = fdopendir(fd)) == NULL) {
+		close(fd);
+		return (0);
+	}
+
+	/* entries unlinked while reading may hide others, check again */
+	for (retry = 0; retry < 2; retry++) {
+		while ((dp = readdir(dir)) != NULL) {
+			if (strcmp(dp->d_name, ".") == 0 ||
+			    strcmp(dp->d_name, "..") == 0)
+				continue;
+			if (unlinkat(dirfd(dir), dp->d_name, 0) == -1 &&
+			    errno != ENOENT) {
+				saved_errno = errno;
+				closedir(dir);
+				errno = saved_errno;
+				return (0);
+			}
+		}
+		if (unlinkat(parent, name, AT_REMOVEDIR) == 0) {
+			closedir(dir);
+			return (1);
+		}
+		if (errno != ENOTEMPTY && errno != EEXIST)
+			break;
+		rewinddir(dir);
+	}
+
+	saved_errno = errno;
+	closedir(dir);
+	errno = saved_errno;
+	return (0);
 }
 
 static int
-fsqueue_envelope_dump(char *dest, const char *evpbuf, size_t evplen,
-    int do_atomic, int do_sync)
+fsqueue_envelope_dump(int dfd, const char *name, const char *evpbuf,
+    size_t evplen, int do_atomic, int do_sync)
 {
-	const char     *path = do_atomic ? PATH_EVPTMP : dest;
+	char		tmp[PATH_MAX];
+	const char     *path = name;
 	FILE	       *fp = NULL;
 	int		fd;
 	size_t		w;
 
-	if ((fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1) {
+	/*
+	 * Updates may run concurrently from the queue worker threads, use
+	 * a temporary file next to the envelope.  It is ignored by the
+	 * walkers and removed along with the message, or by the next update
+	 * if a crash left it behind.
+	 */
+	if (do_atomic) {
+		if (!bsnprintf(tmp, sizeof tmp, "%s.tmp", name))
+			return (0);
+		(void)unlinkat(dfd, tmp, 0);
+		path = tmp;
+	}
+
+	if ((fd = openat(dfd, path, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1) {
 		log_warn("warn: queue-fs: open");
 		goto tempfail;
 	}
@@ -523,7 +934,7 @@ fsqueue_envelope_dump(char *dest, const char *evpbuf, size_t evplen,
 	fp = NULL;
 	fd = -1;
 
-	if (do_atomic && rename(path, dest) == -1) {
+	if (do_atomic && renameat(dfd, path, dfd, name) == -1) {
 		log_warn("warn: queue-fs: rename");
 		goto tempfail;
 	}
@@ -534,91 +945,975 @@ tempfail:
 		fclose(fp);
 	else if (fd != -1)
 		close(fd);
-	if (unlink(path) == -1)
+	if (unlinkat(dfd, path, 0) == -1)
 		log_warn("warn: queue-fs: unlink");
 	return (0);
 }
 
-static void
-fsqueue_message_path(uint32_t msgid, char *buf, size_t len)
-{
-	if (!bsnprintf(buf, len, "%s/%02x/%08x",
-		PATH_QUEUE,
-		(msgid & 0xff000000) >> 24,
-		msgid))
-		fatalx("fsqueue_message_path: path does not fit buffer");
-}
-
-static void
-fsqueue_message_incoming_path(uint32_t msgid, char *buf, size_t len)
+/*
+ * Read an envelope from fd, which is closed, or fail if it could not be
+ * opened.
+ */
+static int
+fsqueue_envelope_read(int fd, char *buf, size_t len)
 {
-	if (!bsnprintf(buf, len, "%s/%08x",
-		PATH_INCOMING,
-		msgid))
-		fatalx("fsqueue_message_incoming_path: path does not fit buffer");
-}
+	FILE	*fp;
+	size_t	 r;
 
-static void *
-fsqueue_qwalk_new(void)
-{
-	char		 path[PATH_MAX];
-	char * const	 path_argv[] = { path, NULL };
-	struct qwalk	*q;
+	if (fd == -1) {
+		if (errno != ENOENT && errno != ENFILE)
+			log_warn("warn: queue-fs: open");
+		return 0;
+	}
 
-	q = xcalloc(1, sizeof(*q));
-	(void)strlcpy(path, PATH_QUEUE, sizeof(path));
-	q->fts = fts_open(path_argv,
-	    FTS_PHYSICAL | FTS_NOCHDIR, NULL);
+	if ((fp = fdopen(fd, "r")) == NULL) {
+		log_warn("warn: queue-fs: fdopen");
+		close(fd);
+		return 0;
+	}
 
-	if (q->fts == NULL)
-		fatal("fsqueue_qwalk_new: fts_open: %s", path);
+	r = fread(buf, 1, len, fp);
+	if (r) {
+		if (r == len) {
+			log_warn("warn: queue-fs: too large");
+			r = 0;
+		}
+		else
+			buf[r] = '\0';
+	}
+	fclose(fp);
 
-	return (q);
+	return (r);
 }
 
-static void
-fsqueue_qwalk_close(void *hdl)
+/*
+ * The layout file lists the number of levels of each layout messages
+ * may be found under.  It has more than one entry while the queue is
+ * migrated, even if the configuration changes again meanwhile, and
+ * a missing file stands for the original single level layout.
+ */
+static int
+fsqueue_layout_load(void)
 {
-	struct qwalk	*q = hdl;
+	FILE	*fp;
+	int	 fd, n, mask = 0;
 
-	fts_close(q->fts);
+	if ((fd = openat(queuefd, LAYOUT_FILE, O_RDONLY)) == -1) {
+		if (errno == ENOENT)
+			return (LAYOUT(1));
+		log_warn("warn: queue-fs: open: %s", LAYOUT_FILE);
+		return (LAYOUT(QUEUE_LEVELS_MAX + 1) - 1);
+	}
+	if ((fp = fdopen(fd, "r")) == NULL) {
+		log_warn("warn: queue-fs: fdopen");
+		close(fd);
+		return (LAYOUT(QUEUE_LEVELS_MAX + 1) - 1);
+	}
+	while (fscanf(fp, "%d", &n) == 1)
+		if (n >= 1 && n <= QUEUE_LEVELS_MAX)
+			mask |= LAYOUT(n);
+	fclose(fp);
 
-	free(q);
+	if (mask == 0) {
+		log_warnx("warn: queue-fs: invalid %s, looking for all layouts",
+		    LAYOUT_FILE);
+		mask = LAYOUT(QUEUE_LEVELS_MAX + 1) - 1;
+	}
+
+	return (mask);
 }
 
 static int
-fsqueue_qwalk(void *hdl, uint64_t *evpid)
+fsqueue_layout_save(int mask)
+{
+	FILE	*fp;
+	int	 fd, n;
+
+	if ((fd = openat(queuefd, LAYOUT_FILE ".tmp",
+	    O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+		log_warn("warn: queue-fs: open: %s", LAYOUT_FILE ".tmp");
+		return (0);
+	}
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		log_warn("warn: queue-fs: fdopen");
+		close(fd);
+		return (0);
+	}
+	for (n = 1; n <= QUEUE_LEVELS_MAX; n++)
+		if (mask & LAYOUT(n))
+			fprintf(fp, "%d\n", n);
+	if (fflush(fp) || fsync(fd)) {
+		log_warn("warn: queue-fs: %s", LAYOUT_FILE ".tmp");
+		fclose(fp);
+		return (0);
+	}
+	if (fclose(fp) != 0) {
+		log_warn("warn: queue-fs: fclose");
+		return (0);
+	}
+	if (renameat(queuefd, LAYOUT_FILE ".tmp", queuefd, LAYOUT_FILE) == -1) {
+		log_warn("warn: queue-fs: rename");
+		return (0);
+	}
+
+	return (1);
+}
+
+/*
+ * Move the messages left under another layout, a few at a time, until
+ * a pass over all buckets finds none.  New messages are always created
+ * under the configured layout and lookups try both in the meantime.
+ */
+static void
+fsqueue_migrate(int fd, short event, void *p)
+{
+	struct dirent	*dp;
+	struct timeval	 tv;
+	size_t		 n, moved;
+
+	for (n = 0; n < MIGRATE_STEP; n++) {
+		if (migrate.dir == NULL) {
+			if (migrate.bucket == nitems(bucketfd)) {
+				if (migrate.moved == 0)
+					break;
+				log_debug("debug: queue-fs: %zu messages moved, "
+				    "checking again", migrate.total);
+				migrate.bucket = 0;
+				migrate.moved = 0;
+			}
+			migrate.fd = bucketfd[migrate.bucket++];
+			if ((fd = openat(migrate.fd, ".",
+			    O_RDONLY | O_DIRECTORY)) == -1 ||
+			    (migrate.dir = fdopendir(fd)) == NULL) {
+				log_warn("warn: queue-fs: opendir");
+				if (fd != -1)
+					close(fd);
+			}
+			continue;
+		}
+
+		if ((dp = readdir(migrate.dir)) == NULL) {
+			closedir(migrate.dir);
+			migrate.dir = NULL;
+			continue;
+		}
+		moved = fsqueue_migrate_entry(migrate.fd, dp->d_name);
+		migrate.moved += moved;
+		migrate.total += moved;
+	}
+
+	if (n < MIGRATE_STEP) {
+		layouts = LAYOUT(levels);
+		(void)fsqueue_layout_save(layouts);
+		log_info("info: queue-fs: migration done, %zu message%s moved",
+		    migrate.total, migrate.total != 1 ? "s" : "");
+		return;
+	}
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	evtimer_add(&migrate.ev, &tv);
+}
+
+static size_t
+fsqueue_migrate_entry(int fd, const char *name)
+{
+	struct dirent	*dp;
+	DIR		*dir;
+	char		 dest[PATH_MAX];
+	char		*ep;
+	uint32_t	 msgid;
+	size_t		 n = 0;
+	int		 sub;
+
+	/* a message under a single level, move it in its sub-bucket */
+	if (levels == 2 && strlen(name) == 8) {
+		errno = 0;
+		msgid = strtoul(name, &ep, 16);
+		if (*ep != '\0' || errno)
+			return (0);
+
+		fsqueue_message_name(msgid, 2, dest, sizeof(dest));
+		if (renameat(fd, name, fd, dest) == -1 && errno == ENOENT) {
+			dest[2] = '\0';
+			if (mkdirat(fd, dest, 0700) == -1 && errno != EEXIST) {
+				log_warn("warn: queue-fs: mkdir");
+				return (0);
+			}
+			dest[2] = '/';
+			if (renameat(fd, name, fd, dest) == -1) {
+				log_warn("warn: queue-fs: rename");
+				return (0);
+			}
+		}
+		return (1);
+	}
+
+	/* a sub-bucket, move all its messages up */
+	if (levels == 1 && strlen(name) == 2 && strcmp(name, "..")) {
+		if ((sub = openat(fd, name, O_RDONLY | O_DIRECTORY)) == -1 ||
+		    (dir = fdopendir(sub)) == NULL) {
+			log_warn("warn: queue-fs: opendir");
+			if (sub != -1)
+				close(sub);
+			return (0);
+		}
+		while ((dp = readdir(dir)) != NULL) {
+			if (strlen(dp->d_name) != 8)
+				continue;
+			if (renameat(sub, dp->d_name, fd, dp->d_name) == -1) {
+				log_warn("warn: queue-fs: rename");
+				continue;
+			}
+			n++;
+		}
+		closedir(dir);
+
+		/* kept if anything else is left in there */
+		(void)unlinkat(fd, name, AT_REMOVEDIR);
+		return (n);
+	}
+
+	return (0);
+}
+
+/*
+ * Open the journal of a bucket, creating it if asked to.  Must be called
+ * with the journal locked.
+ */
+static int
+fsqueue_journal_open(struct journal *j, unsigned int bucket, int create)
+{
+	struct stat	sb;
+
+	if (j->fd != -1)
+		return (1);
+
+	if ((j->fd = openat(bucketfd[bucket], JOURNAL_FILE,
+	    O_RDWR | (create ? O_CREAT : 0), 0600)) == -1) {
+		if (errno != ENOENT || create)
+			log_warn("warn: queue-fs: open: %02x/%s", bucket,
+			    JOURNAL_FILE);
+		return (0);
+	}
+	if (fstat(j->fd, &sb) == -1) {
+		log_warn("warn: queue-fs: fstat");
+		close(j->fd);
+		j->fd = -1;
+		return (0);
+	}
+	j->size = sb.st_size;
+
+	return (1);
+}
+
+/*
+ * Append a version of an envelope, or its deletion when len is 0, and
+ * index it.  The caller holds the lock and syncs the journal if needed.
+ */
+static int
+fsqueue_journal_write(struct journal *j, uint64_t evpid, const char *buf,
+    size_t len)
+{
+	struct journal_header	*hdr;
+	struct journal_record	*rec;
+	char			 rbuf[sizeof(*hdr) + sizeof(struct envelope)];
+	ssize_t			 n;
+
+	if (len > sizeof(struct envelope)) {
+		log_warnx("warn: queue-fs: envelope too large");
+		return (0);
+	}
+	if (!fsqueue_journal_open(j, evpid_to_msgid(evpid) >> 24, 1))
+		return (0);
+
+	hdr = (struct journal_header *)rbuf;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = JOURNAL_MAGIC;
+	hdr->len = len;
+	hdr->evpid = evpid;
+	memcpy(rbuf + sizeof(*hdr), buf, len);
+	hdr->crc = crc32(0, (const Bytef *)rbuf, sizeof(*hdr) + len);
+
+	if ((n = pwrite(j->fd, rbuf, sizeof(*hdr) + len, j->size)) !=
+	    (ssize_t)(sizeof(*hdr) + len)) {
+		if (n == -1)
+			log_warn("warn: queue-fs: journal write");
+		else
+			log_warnx("warn: queue-fs: journal short write");
+		/* a torn record would hide the ones appended after it */
+		if (ftruncate(j->fd, j->size) == -1)
+			fatal("queue-fs: ftruncate");
+		return (0);
+	}
+
+	if (len == 0)
+		free(tree_pop(&j->records, evpid));
+	else {
+		if ((rec = tree_get(&j->records, evpid)) == NULL) {
+			rec = xcalloc(1, sizeof(*rec));
+			tree_xset(&j->records, evpid, rec);
+		}
+		rec->off = j->size + sizeof(*hdr);
+		rec->len = len;
+	}
+	j->size += sizeof(*hdr) + len;
+
+	return (1);
+}
+
+/*
+ * Read the latest journaled version of an envelope, return -1 if there
+ * is none and the envelope file is current.
+ */
+static int
+fsqueue_journal_load(uint64_t evpid, char *buf, size_t len)
+{
+	struct journal		*j = &journals[evpid_to_msgid(evpid) >> 24];
+	struct journal_record	*rec;
+	ssize_t			 n;
+	int			 r;
+
+	pthread_mutex_lock(&j->lock);
+	if ((rec = tree_get(&j->records, evpid)) == NULL)
+		r = -1;
+	else if (rec->len >= len) {
+		log_warnx("warn: queue-fs: too large");
+		r = 0;
+	}
+	else if ((n = pread(j->fd, buf, rec->len, rec->off)) !=
+	    (ssize_t)rec->len) {
+		log_warn("warn: queue-fs: journal read");
+		r = 0;
+	}
+	else {
+		buf[rec->len] = '\0';
+		r = rec->len;
+	}
+	pthread_mutex_unlock(&j->lock);
+
+	return (r);
+}
+
+/*
+ * Forget the journaled versions of a deleted envelope.  The deletion is
+ * only logged so that a replay does not apply them to an envelope later
+ * created under the same id, and need not be synced.
+ */
+static void
+fsqueue_journal_drop(struct journal *j, uint64_t evpid)
+{
+	if (!tree_check(&j->records, evpid))
+		return;
+	if (!fsqueue_journal_write(j, evpid, NULL, 0))
+		free(tree_pop(&j->records, evpid));
+}
+
+/*
+ * Rebuild the index of a journal, which is truncated after the last
+ * valid record.  Versions of envelopes that no longer exist are dropped.
+ */
+static void
+fsqueue_journal_replay(struct journal *j, unsigned int bucket)
+{
+	struct journal_header	 hdr;
+	struct journal_record	*rec;
+	char			 buf[sizeof(struct envelope)];
+	char			 name[32];
+	void			*iter;
+	uint64_t		 evpid, next;
+	struct bundle_slot	 slot;
+	uint32_t		 crc;
+	off_t			 off;
+	int			 fd, r;
+
+	(void)unlinkat(bucketfd[bucket], JOURNAL_FILE ".tmp", 0);
+	if (!fsqueue_journal_open(j, bucket, 0))
+		return;
+
+	for (off = 0; off < j->size; off += sizeof(hdr) + hdr.len) {
+		if (pread(j->fd, &hdr, sizeof(hdr), off) != sizeof(hdr) ||
+		    hdr.magic != JOURNAL_MAGIC ||
+		    hdr.len > sizeof(buf) ||
+		    evpid_to_msgid(hdr.evpid) >> 24 != bucket ||
+		    pread(j->fd, buf, hdr.len, off + sizeof(hdr)) !=
+		    (ssize_t)hdr.len)
+			break;
+		crc = hdr.crc;
+		hdr.crc = 0;
+		if (crc32(crc32(0, (const Bytef *)&hdr, sizeof(hdr)),
+		    (const Bytef *)buf, hdr.len) != crc)
+			break;
+
+		if (hdr.len == 0) {
+			free(tree_pop(&j->records, hdr.evpid));
+			continue;
+		}
+		if ((rec = tree_get(&j->records, hdr.evpid)) == NULL) {
+			rec = xcalloc(1, sizeof(*rec));
+			tree_xset(&j->records, hdr.evpid, rec);
+		}
+		rec->off = off + sizeof(hdr);
+		rec->len = hdr.len;
+	}
+
+	if (off != j->size) {
+		log_warnx("warn: queue-fs: %02x/%s: truncated at offset %lld",
+		    bucket, JOURNAL_FILE, (long long)off);
+		if (ftruncate(j->fd, off) == -1)
+			fatal("queue-fs: ftruncate");
+		j->size = off;
+	}
+
+	iter = NULL;
+	next = 0;
+	while (tree_iterfrom(&j->records, &iter, next, &evpid, NULL)) {
+		/* a torn slot is kept, its journaled version is intact */
+		if ((r = fsqueue_bundle_slot(evpid, O_RDONLY, &slot,
+		    NULL)) == 0 ||
+		    (r == 1 && !(slot.flags & BUNDLE_DELETED)))
+			continue;
+		(void)snprintf(name, sizeof(name), "%016" PRIx64, evpid);
+		if ((fd = fsqueue_openat(evpid_to_msgid(evpid), name,
+		    O_RDONLY, NULL, 0)) != -1) {
+			close(fd);
+			continue;
+		}
+		free(tree_pop(&j->records, evpid));
+		/* the handle went with the record, resume past it */
+		iter = NULL;
+		next = evpid + 1;
+	}
+
+	if (tree_count(&j->records))
+		log_debug("debug: queue-fs: %02x/%s: %zu envelopes updated",
+		    bucket, JOURNAL_FILE, tree_count(&j->records));
+}
+
+/*
+ * Once its versions are written back, the journal is emptied, or only
+ * keeps those appended in the meantime.  Called with the lock held.
+ */
+static void
+fsqueue_journal_rewrite(struct journal *j, unsigned int bucket)
+{
+	struct journal_record	*rec;
+	struct journal_header	 hdr;
+	char			 buf[sizeof(hdr) + sizeof(struct envelope)];
+	void			*iter;
+	uint64_t		 evpid;
+	off_t			 off = 0;
+	int			 fd;
+
+	if (tree_count(&j->records) == 0) {
+		if (ftruncate(j->fd, 0) == -1)
+			log_warn("warn: queue-fs: ftruncate");
+		else
+			j->size = 0;
+		return;
+	}
+
+	if ((fd = openat(bucketfd[bucket], JOURNAL_FILE ".tmp",
+	    O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1) {
+		log_warn("warn: queue-fs: open: %02x/%s", bucket,
+		    JOURNAL_FILE ".tmp");
+		return;
+	}
+
+	/* records are copied with their header, offsets are the same */
+	iter = NULL;
+	while (tree_iter(&j->records, &iter, &evpid, (void **)&rec)) {
+		if (pread(j->fd, buf, sizeof(hdr) + rec->len,
+		    rec->off - sizeof(hdr)) != (ssize_t)(sizeof(hdr) + rec->len) ||
+		    pwrite(fd, buf, sizeof(hdr) + rec->len, off) !=
+		    (ssize_t)(sizeof(hdr) + rec->len)) {
+			log_warn("warn: queue-fs: %02x/%s", bucket,
+			    JOURNAL_FILE ".tmp");
+			goto fail;
+		}
+		off += sizeof(hdr) + rec->len;
+	}
+	if (fsync(fd) == -1 ||
+	    renameat(bucketfd[bucket], JOURNAL_FILE ".tmp", bucketfd[bucket],
+	    JOURNAL_FILE) == -1) {
+		log_warn("warn: queue-fs: %02x/%s", bucket, JOURNAL_FILE);
+		goto fail;
+	}
+
+	off = 0;
+	iter = NULL;
+	while (tree_iter(&j->records, &iter, &evpid, (void **)&rec)) {
+		rec->off = off + sizeof(hdr);
+		off += sizeof(hdr) + rec->len;
+	}
+	close(j->fd);
+	j->fd = fd;
+	j->size = off;
+	return;
+
+fail:
+	close(fd);
+	(void)unlinkat(bucketfd[bucket], JOURNAL_FILE ".tmp", 0);
+}
+
+static void
+fsqueue_journal_timeout(int fd, short event, void *p)
+{
+	struct journal	*j;
+	struct timeval	 tv;
+	unsigned int	 n;
+	time_t		 now;
+	off_t		 size;
+
+	now = time(NULL);
+	for (n = 0; n < nitems(journals); n++) {
+		j = &journals[n];
+		pthread_mutex_lock(&j->lock);
+		size = j->size;
+		pthread_mutex_unlock(&j->lock);
+
+		if (j->compacting || size == 0)
+			continue;
+		if (size < JOURNAL_MAX && now - j->compacted < JOURNAL_INTERVAL)
+			continue;
+
+		j->compacting = 1;
+		queue_io_submit(fsqueue_compact_work, fsqueue_compact_done, j);
+	}
+
+	tv.tv_sec = JOURNAL_CHECK;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_journal, &tv);
+}
+
+/*
+ * Write the journaled versions back to the envelope files from a worker
+ * thread.  The journal is only locked to pick each version and to move
+ * the file in place, so that a deleted envelope is never written back.
+ */
+static void
+fsqueue_compact_work(void *arg)
+{
+	struct journal		*j = arg;
+	struct journal_record	*rec;
+	unsigned int		 bucket = j - journals;
+	char			 buf[sizeof(struct envelope)];
+	char			 name[32], tmp[48];
+	void			*iter;
+	uint64_t		 evpid, next;
+	off_t			 off;
+	size_t			 len, n = 0;
+	int			 fd, r, b;
+
+	pthread_mutex_lock(&j->lock);
+	iter = NULL;
+	r = tree_iter(&j->records, &iter, &next, NULL);
+	pthread_mutex_unlock(&j->lock);
+
+	while (r) {
+		evpid = next;
+
+		pthread_mutex_lock(&j->lock);
+		if ((rec = tree_get(&j->records, evpid)) != NULL) {
+			off = rec->off;
+			len = rec->len;
+			if (pread(j->fd, buf, len, off) != (ssize_t)len)
+				rec = NULL;
+		}
+		iter = NULL;
+		r = tree_iterfrom(&j->records, &iter, evpid + 1, &next, NULL);
+		pthread_mutex_unlock(&j->lock);
+		if (rec == NULL)
+			continue;
+
+		/* bundled envelopes are written back in their slot */
+		pthread_mutex_lock(&j->lock);
+		if (tree_check(&j->records, evpid))
+			b = fsqueue_bundle_update(evpid, buf, len, &fd);
+		else
+			b = 0;
+		pthread_mutex_unlock(&j->lock);
+		if (b == 0)
+			continue;
+		if (b == 1) {
+			if (fsync(fd) == -1)
+				log_warn("warn: queue-fs: fsync");
+			else {
+				pthread_mutex_lock(&j->lock);
+				if ((rec = tree_get(&j->records, evpid)) !=
+				    NULL && rec->off == off) {
+					free(tree_pop(&j->records, evpid));
+					n++;
+				}
+				pthread_mutex_unlock(&j->lock);
+			}
+			close(fd);
+			continue;
+		}
+
+		if ((fd = fsqueue_openat(evpid_to_msgid(evpid), NULL,
+		    O_RDONLY | O_DIRECTORY, NULL, 0)) == -1)
+			continue;
+		(void)snprintf(name, sizeof(name), "%016" PRIx64, evpid);
+		(void)snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+		(void)unlinkat(fd, tmp, 0);
+		if (!fsqueue_envelope_dump(fd, tmp, buf, len, 0, 1)) {
+			close(fd);
+			continue;
+		}
+
+		pthread_mutex_lock(&j->lock);
+		if ((rec = tree_get(&j->records, evpid)) == NULL)
+			(void)unlinkat(fd, tmp, 0);
+		else if (renameat(fd, tmp, fd, name) == -1) {
+			log_warn("warn: queue-fs: rename");
+			(void)unlinkat(fd, tmp, 0);
+		}
+		else if (rec->off == off) {
+			free(tree_pop(&j->records, evpid));
+			n++;
+		}
+		pthread_mutex_unlock(&j->lock);
+		close(fd);
+	}
+
+	pthread_mutex_lock(&j->lock);
+	fsqueue_journal_rewrite(j, bucket);
+	pthread_mutex_unlock(&j->lock);
+
+	if (n)
+		log_debug("debug: queue-fs: %02x/%s: %zu envelopes written back",
+		    bucket, JOURNAL_FILE, n);
+}
+
+static void
+fsqueue_compact_done(void *arg)
+{
+	struct journal	*j = arg;
+
+	j->compacting = 0;
+	j->compacted = time(NULL);
+}
+
+static uint32_t
+fsqueue_bundle_crc(const struct bundle_slot *slot)
+{
+	uLong	crc;
+
+	crc = crc32(0, (const Bytef *)&slot->evpid,
+	    offsetof(struct bundle_slot, crc) -
+	    offsetof(struct bundle_slot, evpid));
+	return (crc32(crc, (const Bytef *)slot->data, slot->len));
+}
+
+/*
+ * Append an envelope to the bundle of a message, which is only created
+ * if asked to.  Return 0 if the envelope must be stored in a file.
+ */
+static int
+fsqueue_bundle_append(int dfd, uint32_t msgid, int create, const char *buf,
+    size_t len, uint64_t *evpid)
+{
+	struct bundle_slot	slot;
+	struct timespec		ts;
+	struct stat		sb;
+	off_t			off;
+
+	if (len > sizeof(slot.data))
+		return (0);
+
+	if (bundle.msgid != msgid) {
+		fsqueue_bundle_close(bundle.msgid);
+		if ((bundle.fd = openat(dfd, QUEUE_BUNDLE_FILE,
+		    O_RDWR | (create ? O_CREAT : 0), 0600)) == -1) {
+			if (errno != ENOENT)
+				log_warn("warn: queue-fs: open: %s",
+				    QUEUE_BUNDLE_FILE);
+			return (0);
+		}
+		if (fstat(bundle.fd, &sb) == -1) {
+			log_warn("warn: queue-fs: fstat");
+			close(bundle.fd);
+			bundle.fd = -1;
+			return (0);
+		}
+		bundle.msgid = msgid;
+		/* a slot torn by a crash is left alone */
+		bundle.slots = (sb.st_size + BUNDLE_SLOT - 1) / BUNDLE_SLOT;
+	}
+	if (bundle.slots >= QUEUE_BUNDLE_SLOTS)
+		return (0);
+
+	if (clock_gettime(CLOCK_REALTIME, &ts))
+		fatal("clock_gettime");
+
+	memset(&slot, 0, sizeof(slot));
+	slot.magic = BUNDLE_MAGIC;
+	slot.evpid = msgid_to_evpid(msgid) | (bundle.slots + 1);
+	slot.sec = ts.tv_sec;
+	slot.nsec = ts.tv_nsec;
+	slot.len = len;
+	memcpy(slot.data, buf, len);
+	slot.crc = fsqueue_bundle_crc(&slot);
+
+	off = (off_t)bundle.slots * BUNDLE_SLOT;
+	if (pwrite(bundle.fd, &slot, sizeof(slot), off) != sizeof(slot)) {
+		log_warn("warn: queue-fs: write: %s", QUEUE_BUNDLE_FILE);
+		if (ftruncate(bundle.fd, off) == -1)
+			log_warn("warn: queue-fs: ftruncate");
+		fsqueue_bundle_close(msgid);
+		return (0);
+	}
+	bundle.slots += 1;
+	*evpid = slot.evpid;
+
+	return (1);
+}
+
+static void
+fsqueue_bundle_close(uint32_t msgid)
+{
+	if (bundle.fd == -1 || bundle.msgid != msgid)
+		return;
+	close(bundle.fd);
+	bundle.fd = -1;
+	bundle.msgid = 0;
+}
+
+/*
+ * Read the slot of an envelope, return -1 if it is not in a bundle.  The
+ * bundle is left open in fdp if given.
+ */
+static int
+fsqueue_bundle_slot(uint64_t evpid, int flags, struct bundle_slot *slot,
+    int *fdp)
+{
+	ssize_t	n;
+	int	fd;
+
+	if (!BUNDLED(evpid))
+		return (-1);
+
+	if ((fd = fsqueue_openat(evpid_to_msgid(evpid), QUEUE_BUNDLE_FILE,
+	    flags, NULL, 0)) == -1) {
+		if (errno == ENOENT)
+			return (-1);
+		log_warn("warn: queue-fs: open: %s", QUEUE_BUNDLE_FILE);
+		return (0);
+	}
+
+	n = pread(fd, slot, sizeof(*slot),
+	    (off_t)BUNDLE_INDEX(evpid) * BUNDLE_SLOT);
+	if (n == -1) {
+		log_warn("warn: queue-fs: read: %s", QUEUE_BUNDLE_FILE);
+		close(fd);
+		return (0);
+	}
+	if (n != sizeof(*slot) || slot->magic != BUNDLE_MAGIC ||
+	    slot->evpid != evpid) {
+		close(fd);
+		return (-1);
+	}
+
+	if (fdp)
+		*fdp = fd;
+	else
+		close(fd);
+
+	return (1);
+}
+
+static int
+fsqueue_bundle_load(uint64_t evpid, char *buf, size_t len)
+{
+	struct bundle_slot	slot;
+	int			r;
+
+	if ((r = fsqueue_bundle_slot(evpid, O_RDONLY, &slot, NULL)) != 1)
+		return (r);
+	if (slot.flags & BUNDLE_DELETED)
+		return (0);
+	if (slot.len > sizeof(slot.data) ||
+	    slot.crc != fsqueue_bundle_crc(&slot)) {
+		log_warnx("warn: queue-fs: %016" PRIx64 ": corrupt slot",
+		    evpid);
+		return (0);
+	}
+
+	return (fsqueue_bundle_copy(&slot, buf, len));
+}
+
+/*
+ * Overwrite the slot of an envelope with a new version, which must fit.
+ * The bundle is left open in fdp for the caller to sync.
+ */
+static int
+fsqueue_bundle_update(uint64_t evpid, const char *buf, size_t len, int *fdp)
+{
+	struct bundle_slot	slot;
+	int			fd, r;
+
+	if ((r = fsqueue_bundle_slot(evpid, O_RDWR, &slot, &fd)) != 1)
+		return (r);
+	if (slot.flags & BUNDLE_DELETED || len > sizeof(slot.data)) {
+		close(fd);
+		return (0);
+	}
+
+	slot.len = len;
+	memcpy(slot.data, buf, len);
+	slot.crc = fsqueue_bundle_crc(&slot);
+	if (pwrite(fd, &slot, sizeof(slot),
+	    (off_t)BUNDLE_INDEX(evpid) * BUNDLE_SLOT) != sizeof(slot)) {
+		log_warn("warn: queue-fs: write: %s", QUEUE_BUNDLE_FILE);
+		close(fd);
+		return (0);
+	}
+	*fdp = fd;
+
+	return (1);
+}
+
+static int
+fsqueue_bundle_delete(uint64_t evpid)
+{
+	struct bundle_slot	slot;
+	int			fd, r;
+
+	if ((r = fsqueue_bundle_slot(evpid, O_RDWR, &slot, &fd)) != 1)
+		return (r);
+
+	slot.flags |= BUNDLE_DELETED;
+	if (pwrite(fd, &slot.flags, sizeof(slot.flags),
+	    (off_t)BUNDLE_INDEX(evpid) * BUNDLE_SLOT +
+	    offsetof(struct bundle_slot, flags)) != sizeof(slot.flags)) {
+		log_warn("warn: queue-fs: write: %s", QUEUE_BUNDLE_FILE);
+		r = 0;
+	}
+	close(fd);
+
+	return (r);
+}
+
+/*
+ * Read the next slot of a bundle, return 0 if it holds no envelope and
+ * -1 at the end of the file.
+ */
+static int
+fsqueue_bundle_next(FILE *fp, struct bundle_slot *slot)
+{
+	if (fread(slot, sizeof(*slot), 1, fp) != 1)
+		return (-1);
+
+	if (slot->magic != BUNDLE_MAGIC || slot->flags & BUNDLE_DELETED)
+		return (0);
+	if (slot->len > sizeof(slot->data) ||
+	    slot->crc != fsqueue_bundle_crc(slot)) {
+		log_warnx("warn: queue-fs: %016" PRIx64 ": corrupt slot",
+		    slot->evpid);
+		return (0);
+	}
+
+	return (1);
+}
+
+static int
+fsqueue_bundle_copy(const struct bundle_slot *slot, char *buf, size_t len)
+{
+	if (slot->len >= len) {
+		log_warnx("warn: queue-fs: too large");
+		return (0);
+	}
+	memcpy(buf, slot->data, slot->len);
+	buf[slot->len] = '\0';
+
+	return (slot->len);
+}
+
+static void *
+fsqueue_qwalk_new(void)
+{
+	char		 path[PATH_MAX];
+	char * const	 path_argv[] = { path, NULL };
+	struct qwalk	*q;
+
+	q = xcalloc(1, sizeof(*q));
+	(void)strlcpy(path, PATH_QUEUE, sizeof(path));
+	q->fts = fts_open(path_argv,
+	    FTS_PHYSICAL | FTS_NOCHDIR, NULL);
+
+	if (q->fts == NULL)
+		fatal("fsqueue_qwalk_new: fts_open: %s", path);
+
+	return (q);
+}
+
+static void
+fsqueue_qwalk_close(void *hdl)
+{
+	struct qwalk	*q = hdl;
+
+	if (q->bundle)
+		fclose(q->bundle);
+	fts_close(q->fts);
+
+	free(q);
+}
+
+static int
+fsqueue_qwalk(void *hdl, uint64_t *evpid)
 {
 	struct qwalk	*q = hdl;
+	struct timespec	 ts;
 	FTSENT		*e;
 	char		*tmp;
+	int		 r;
+
+	/* envelopes of the bundle being read, then the next files */
+	while (q->bundle) {
+		if ((r = fsqueue_bundle_next(q->bundle, &q->slot)) == -1) {
+			fclose(q->bundle);
+			q->bundle = NULL;
+			break;
+		}
+		ts.tv_sec = q->slot.sec;
+		ts.tv_nsec = q->slot.nsec;
+		if (r == 0 || timespeccmp(&ts, &startup, >))
+			continue;
+		*evpid = q->slot.evpid;
+		return (1);
+	}
 
 	while ((e = fts_read(q->fts)) != NULL) {
 		switch (e->fts_info) {
 		case FTS_D:
-			q->depth += 1;
-			if (q->depth == 2 && e->fts_namelen != 2) {
-				log_debug("debug: fsqueue: bogus directory %s",
-				    e->fts_path);
-				fts_set(q->fts, e, FTS_SKIP);
+			/* buckets, possibly sub-buckets, then messages */
+			if (e->fts_level == 0)
 				break;
-			}
-			if (q->depth == 3 && e->fts_namelen != 8) {
-				log_debug("debug: fsqueue: bogus directory %s",
-				    e->fts_path);
-				fts_set(q->fts, e, FTS_SKIP);
+			if ((e->fts_level == 1 && e->fts_namelen == 2) ||
+			    (e->fts_level == 2 && (e->fts_namelen == 2 ||
+			    e->fts_namelen == 8)) ||
+			    (e->fts_level == 3 && e->fts_namelen == 8 &&
+			    e->fts_parent->fts_namelen == 2))
 				break;
-			}
-			break;
-
-		case FTS_DP:
-		case FTS_DNR:
-			q->depth -= 1;
+			log_debug("debug: fsqueue: bogus directory %s",
+			    e->fts_path);
+			fts_set(q->fts, e, FTS_SKIP);
 			break;
 
 		case FTS_F:
-			if (q->depth != 3)
+			if (e->fts_level < 3 ||
+			    e->fts_parent->fts_namelen != 8)
 				break;
+			if (strcmp(e->fts_name, QUEUE_BUNDLE_FILE) == 0) {
+				if ((q->bundle = fopen(e->fts_accpath,
+				    "r")) == NULL) {
+					log_warn("warn: queue-fs: fopen: %s",
+					    e->fts_path);
+					break;
+				}
+				return (fsqueue_qwalk(hdl, evpid));
+			}
 			if (e->fts_namelen != 16)
 				break;
 #if HAVE_STRUCT_STAT_ST_MTIM
@@ -650,14 +1945,13 @@ queue_fs_init(struct passwd *pw, int server, const char *conf)
 	unsigned int	 n;
 	char		*paths[] = { PATH_QUEUE, PATH_INCOMING };
 	char		 path[PATH_MAX];
+	char		 name[16];
 	int		 ret;
 
 	/* remove incoming/ if it exists */
 	if (server)
 		mvpurge(PATH_SPOOL PATH_INCOMING, PATH_SPOOL PATH_PURGE);
 
-	fsqueue_envelope_path(0, path, sizeof(path));
-
 	ret = 1;
 	for (n = 0; n < nitems(paths); n++) {
 		(void)strlcpy(path, PATH_SPOOL, sizeof(path));
@@ -667,6 +1961,61 @@ queue_fs_init(struct passwd *pw, int server, const char *conf)
 			ret = 0;
 	}
 
+	/* kept open to work relative to them after the chroot */
+	if ((queuefd = open(PATH_SPOOL PATH_QUEUE,
+	    O_RDONLY | O_DIRECTORY)) == -1 ||
+	    (incomingfd = open(PATH_SPOOL PATH_INCOMING,
+	    O_RDONLY | O_DIRECTORY)) == -1) {
+		log_warn("warn: queue-fs: open");
+		return (0);
+	}
+
+	bundles = server && (env->sc_queue_flags & QUEUE_BUNDLE);
+
+	layouts = fsqueue_layout_load();
+	if (server) {
+		levels = env->sc_queue_levels;
+		if (layouts != LAYOUT(levels)) {
+			layouts |= LAYOUT(levels);
+			if (!fsqueue_layout_save(layouts))
+				ret = 0;
+		}
+	}
+	else
+		levels = (layouts & LAYOUT(2)) ? 2 : 1;
+
+	/* all buckets exist upfront, so that their descriptors are cached */
+	for (n = 0; n < nitems(bucketfd); n++) {
+		(void)snprintf(name, sizeof(name), "%02x", n);
+		if (server) {
+			if (mkdirat(queuefd, name, 0700) == 0) {
+				if (fchownat(queuefd, name, pw->pw_uid, 0,
+				    0) == -1) {
+					log_warn("warn: queue-fs: chown");
+					ret = 0;
+				}
+			}
+			else if (errno != EEXIST) {
+				log_warn("warn: queue-fs: mkdir");
+				ret = 0;
+			}
+		}
+		bucketfd[n] = openat(queuefd, name, O_RDONLY | O_DIRECTORY);
+		if (bucketfd[n] == -1 && (server || errno != ENOENT)) {
+			log_warn("warn: queue-fs: open: %s", name);
+			ret = 0;
+		}
+	}
+
+	for (n = 0; n < nitems(journals); n++) {
+		pthread_mutex_init(&journals[n].lock, NULL);
+		journals[n].fd = -1;
+		journals[n].compacted = time(NULL);
+		tree_init_ordered(&journals[n].records);
+		if (server && bucketfd[n] != -1)
+			fsqueue_journal_replay(&journals[n], n);
+	}
+
 	if (clock_gettime(CLOCK_REALTIME, &startup))
 		fatal("clock_gettime");
 
@@ -682,6 +2031,7 @@ queue_fs_init(struct passwd *pw, int server, const char *conf)
 	queue_api_on_envelope_load(queue_fs_envelope_load);
 	queue_api_on_envelope_walk(queue_fs_envelope_walk);
 	queue_api_on_message_walk(queue_fs_message_walk);
+	queue_api_threaded();
 
 	return (ret);
 }
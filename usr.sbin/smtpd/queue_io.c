@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2026 The OpenSMTPD Project
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Worker threads for blocking queue operations.
+ *
+ * A job is a work function run by one of the threads and a done function
+ * run afterwards from the event loop.  Threads never touch the rest of
+ * the process state: finished jobs are passed back over a pipe and all
+ * bookkeeping happens in the done callback.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <imsg.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+#define QUEUE_IO_THREADS	4
+
+struct queue_io_job {
+	TAILQ_ENTRY(queue_io_job)	 entry;
+	void				(*work)(void *);
+	void				(*done)(void *);
+	void				*arg;
+};
+
+static void	 queue_io_init(void);
+static void	*queue_io_worker(void *);
+static void	 queue_io_dispatch(int, short, void *);
+
+static TAILQ_HEAD(, queue_io_job)	 jobs = TAILQ_HEAD_INITIALIZER(jobs);
+static pthread_mutex_t			 lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t			 cond = PTHREAD_COND_INITIALIZER;
+static int				 pipefd[2] = { -1, -1 };
+static struct event			 ev_done;
+static size_t				 nthreads;
+static int				 ready;
+
+void
+queue_io_submit(void (*work)(void *), void (*done)(void *), void *arg)
+{
+	struct queue_io_job	*job;
+
+	if (!ready)
+		queue_io_init();
+
+	if (nthreads == 0) {
+		work(arg);
+		done(arg);
+		return;
+	}
+
+	job = xcalloc(1, sizeof *job);
+	job->work = work;
+	job->done = done;
+	job->arg = arg;
+
+	pthread_mutex_lock(&lock);
+	TAILQ_INSERT_TAIL(&jobs, job, entry);
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+
+	stat_increment("queue.io.pending", 1);
+}
+
+static void
+queue_io_init(void)
+{
+	pthread_t	th;
+	sigset_t	set, oset;
+	int		error;
+
+	ready = 1;
+
+	if (pipe(pipefd) == -1) {
+		log_warn("warn: queue-io: pipe");
+		return;
+	}
+	if (fcntl(pipefd[0], F_SETFL, O_NONBLOCK) == -1)
+		fatal("queue-io: fcntl");
+	event_set(&ev_done, pipefd[0], EV_READ|EV_PERSIST, queue_io_dispatch,
+	    NULL);
+	event_add(&ev_done, NULL);
+
+	/* signals must keep being delivered to the event loop thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	while (nthreads < QUEUE_IO_THREADS) {
+		if ((error = pthread_create(&th, NULL, queue_io_worker,
+		    NULL)) != 0) {
+			log_warnx("warn: queue-io: pthread_create: %s",
+			    strerror(error));
+			break;
+		}
+		pthread_detach(th);
+		nthreads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+	log_debug("debug: queue-io: %zu worker threads", nthreads);
+}
+
+static void *
+queue_io_worker(void *arg)
+{
+	struct queue_io_job	*job;
+	ssize_t			 n;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		while ((job = TAILQ_FIRST(&jobs)) == NULL)
+			pthread_cond_wait(&cond, &lock);
+		TAILQ_REMOVE(&jobs, job, entry);
+		pthread_mutex_unlock(&lock);
+
+		job->work(job->arg);
+
+		/* pointer-sized writes to a pipe are atomic */
+		while ((n = write(pipefd[1], &job, sizeof job)) == -1 &&
+		    errno == EINTR)
+			;
+		if (n != sizeof job)
+			fatal("queue-io: write");
+	}
+
+	return (NULL);
+}
+
+static void
+queue_io_dispatch(int fd, short event, void *arg)
+{
+	struct queue_io_job	*done[64];
+	ssize_t			 n;
+	size_t			 i;
+
+	for (;;) {
+		n = read(fd, done, sizeof done);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return;
+			fatal("queue-io: read");
+		}
+		if (n == 0)
+			fatalx("queue-io: pipe closed");
+
+		for (i = 0; i < n / sizeof done[0]; i++) {
+			done[i]->done(done[i]->arg);
+			free(done[i]);
+		}
+		stat_decrement("queue.io.pending", i);
+	}
+}
@@ -0,0 +1,1178 @@
+/*
+ * Copyright (c) 2026 The OpenSMTPD Project
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Log-structured queue.
+ *
+ * Message bodies, envelopes and deletion records are appended to segment
+ * files in the log/ directory of the spool.  Every record carries a log
+ * sequence number, so the in-memory index can be rebuilt at startup by
+ * replaying all segments: for each object the record with the highest
+ * sequence number wins, and a deletion record hides every older record
+ * for the same object.  A message is only reachable once its body record
+ * exists, which is what makes the commit atomic.
+ *
+ * Records are not synced individually.  The queue process calls the sync
+ * handler once after a batch of message commits, so transactions arriving
+ * in the same event loop iteration share a single fsync.  Updates and
+ * deletions are flushed by a short timer.
+ *
+ * Sealed segments whose live data drops below a threshold are compacted
+ * in small steps: live records are copied to the head segment with their
+ * original sequence number and the segment file is removed.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+#define PATH_LOG		"/log"
+
+#define QL_MAGIC		0x514c4f47	/* "QLOG" */
+#define QL_SEGMENT_SIZE		(64 * 1024 * 1024)
+#define QL_COMPACT_RATIO	50	/* percent of live data */
+#define QL_COMPACT_STEP		(1024 * 1024)
+#define QL_COMPACT_DELAY	30
+#define QL_SYNC_DELAY		1
+
+enum {
+	QL_MESSAGE = 1,
+	QL_MESSAGE_DEL,
+	QL_ENVELOPE,
+	QL_ENVELOPE_DEL,
+};
+
+struct ql_header {
+	uint32_t	magic;
+	uint32_t	type;
+	uint64_t	lsn;
+	uint64_t	id;
+	uint32_t	len;
+	uint32_t	crc;
+};
+
+#define QL_RECSIZE(len)		((off_t)sizeof(struct ql_header) + (len))
+
+struct ql_loc {
+	uint64_t	lsn;
+	off_t		off;
+	uint32_t	seg;
+	uint32_t	len;
+};
+
+struct ql_segment {
+	uint32_t	id;
+	int		fd;
+	off_t		size;
+	off_t		live;
+};
+
+struct ql_envelope {
+	struct ql_loc	loc;
+	int		dead;		/* replay only */
+};
+
+struct ql_message {
+	struct ql_loc	body;
+	int		committed;
+	int		ondisk;
+	uint64_t	tomb;		/* replay only */
+	struct tree	envelopes;
+};
+
+static int	ql_replay(void);
+static int	ql_replay_segment(struct ql_segment *, int);
+static void	ql_replay_record(struct ql_segment *, struct ql_header *, off_t);
+static void	ql_resolve(void);
+static struct ql_segment *ql_segment_open(uint32_t, int);
+static int	ql_rotate(void);
+static int	ql_reserve(void);
+static void	ql_appended(struct ql_header *, off_t, struct ql_loc *);
+static int	ql_pwrite(int, const void *, size_t, off_t);
+static int	ql_copy(int, off_t, int, off_t, size_t, uint32_t *);
+static uint32_t	ql_crc(uint32_t, struct ql_header *);
+static int	ql_append(uint32_t, uint64_t, uint64_t, const char *, size_t,
+    struct ql_loc *);
+static int	ql_append_fd(uint32_t, uint64_t, uint64_t, int, off_t, size_t,
+    struct ql_loc *);
+static void	ql_release(struct ql_loc *);
+static int	ql_sync(void);
+static void	ql_schedule(void);
+static void	ql_sync_timeout(int, short, void *);
+static void	ql_compact_timeout(int, short, void *);
+static struct ql_segment *ql_compact_pick(void);
+static int	ql_compact_step(void);
+static int	ql_compact_record(struct ql_segment *, struct ql_header *, off_t);
+static struct ql_message *ql_message_get(uint32_t, int);
+static void	ql_message_free(struct ql_message *);
+static int	ql_walk(uint64_t *, uint32_t, uint64_t *, char *, size_t);
+static int	queue_log_message_delete(uint32_t);
+
+static struct tree	 messages;
+static struct tree	 segments;
+static struct ql_segment *head;
+static uint32_t		 nextseg = 1;
+static uint64_t		 nextlsn = 1;
+static int		 logfd = -1;
+static int		 dirty;
+
+static int		 evinit;
+static struct event	 ev_sync;
+static struct event	 ev_compact;
+
+static struct {
+	struct ql_segment	*seg;
+	off_t			 off;
+	int			 oldest;
+} compact;
+
+static char		 iobuf[65536];
+
+static int
+queue_log_message_create(uint32_t *msgid)
+{
+	struct ql_message	*msg;
+
+	msg = calloc(1, sizeof(*msg));
+	if (msg == NULL) {
+		log_warn("warn: queue-log: calloc");
+		return (0);
+	}
+	tree_init_ordered(&msg->envelopes);
+
+	do {
+		*msgid = queue_generate_msgid();
+	} while (tree_check(&messages, *msgid));
+
+	tree_xset(&messages, *msgid, msg);
+
+	return (1);
+}
+
+static int
+queue_log_message_commit(uint32_t msgid, const char *path)
+{
+	struct ql_message	*msg;
+	struct stat		 sb;
+	int			 fd, r;
+
+	if ((msg = tree_get(&messages, msgid)) == NULL) {
+		log_warnx("warn: queue-log: msgid not found");
+		return (0);
+	}
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		log_warn("warn: queue-log: open: %s", path);
+		return (0);
+	}
+	if (fstat(fd, &sb) == -1) {
+		log_warn("warn: queue-log: fstat");
+		close(fd);
+		return (0);
+	}
+	if (sb.st_size > UINT32_MAX) {
+		log_warnx("warn: queue-log: message too large");
+		close(fd);
+		return (0);
+	}
+
+	r = ql_append_fd(QL_MESSAGE, nextlsn++, msgid, fd, 0, sb.st_size,
+	    &msg->body);
+	close(fd);
+	if (!r)
+		return (0);
+
+	msg->committed = 1;
+	msg->ondisk = 1;
+	stat_increment("queue.log.message", 1);
+
+	return (1);
+}
+
+static int
+queue_log_message_delete(uint32_t msgid)
+{
+	struct ql_message	*msg;
+
+	if ((msg = tree_pop(&messages, msgid)) == NULL)
+		return (1);
+
+	/* one deletion record hides the body and all envelopes */
+	if (msg->ondisk) {
+		if (!ql_append(QL_MESSAGE_DEL, nextlsn++, msgid, NULL, 0, NULL))
+			log_warnx("warn: queue-log: "
+			    "could not log deletion of %08"PRIx32, msgid);
+		ql_schedule();
+	}
+	if (msg->committed)
+		stat_decrement("queue.log.message", 1);
+	ql_message_free(msg);
+
+	return (1);
+}
+
+static int
+queue_log_message_fd_r(uint32_t msgid)
+{
+	struct ql_message	*msg;
+	struct ql_segment	*seg;
+	int			 fd;
+
+	if ((msg = tree_get(&messages, msgid)) == NULL || !msg->committed) {
+		log_warnx("warn: queue-log: message not found");
+		return (-1);
+	}
+	if ((seg = tree_get(&segments, msg->body.seg)) == NULL) {
+		log_warnx("warn: queue-log: segment not found");
+		return (-1);
+	}
+
+	fd = mktmpfile();
+	if (!ql_copy(seg->fd, msg->body.off + sizeof(struct ql_header), fd, 0,
+	    msg->body.len, NULL)) {
+		close(fd);
+		return (-1);
+	}
+	lseek(fd, 0, SEEK_SET);
+
+	return (fd);
+}
+
+static int
+queue_log_envelope_create(uint32_t msgid, const char *buf, size_t len,
+    uint64_t *evpid)
+{
+	struct ql_message	*msg;
+	struct ql_envelope	*evp;
+
+	if ((msg = ql_message_get(msgid, 0)) == NULL)
+		return (0);
+
+	evp = calloc(1, sizeof *evp);
+	if (evp == NULL) {
+		log_warn("warn: queue-log: calloc");
+		return (0);
+	}
+
+	do {
+		*evpid = queue_generate_evpid(msgid);
+	} while (tree_check(&msg->envelopes, *evpid));
+
+	if (!ql_append(QL_ENVELOPE, nextlsn++, *evpid, buf, len, &evp->loc)) {
+		free(evp);
+		return (0);
+	}
+	tree_xset(&msg->envelopes, *evpid, evp);
+	msg->ondisk = 1;
+
+	/* envelopes of incoming messages are synced by the commit */
+	if (msg->committed)
+		ql_schedule();
+
+	return (1);
+}
+
+static int
+queue_log_envelope_delete(uint64_t evpid)
+{
+	struct ql_message	*msg;
+	struct ql_envelope	*evp;
+	uint32_t		 msgid;
+
+	msgid = evpid_to_msgid(evpid);
+	if ((msg = tree_get(&messages, msgid)) == NULL)
+		return (1);
+	if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
+		return (1);
+
+	if (tree_count(&msg->envelopes) == 1)
+		return (queue_log_message_delete(msgid));
+
+	if (!ql_append(QL_ENVELOPE_DEL, nextlsn++, evpid, NULL, 0, NULL))
+		return (0);
+
+	tree_xpop(&msg->envelopes, evpid);
+	ql_release(&evp->loc);
+	free(evp);
+	ql_schedule();
+
+	return (1);
+}
+
+static int
+queue_log_envelope_update(uint64_t evpid, const char *buf, size_t len)
+{
+	struct ql_message	*msg;
+	struct ql_envelope	*evp;
+	struct ql_loc		 loc;
+
+	if ((msg = ql_message_get(evpid_to_msgid(evpid), 0)) == NULL)
+		return (0);
+	if ((evp = tree_get(&msg->envelopes, evpid)) == NULL) {
+		log_warnx("warn: queue-log: envelope not found");
+		return (0);
+	}
+
+	if (!ql_append(QL_ENVELOPE, nextlsn++, evpid, buf, len, &loc))
+		return (0);
+	ql_release(&evp->loc);
+	evp->loc = loc;
+	ql_schedule();
+
+	return (1);
+}
+
+static int
+queue_log_envelope_load(uint64_t evpid, char *buf, size_t len)
+{
+	struct ql_message	*msg;
+	struct ql_envelope	*evp;
+	struct ql_segment	*seg;
+	ssize_t			 n;
+
+	if ((msg = tree_get(&messages, evpid_to_msgid(evpid))) == NULL)
+		return (0);
+	if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
+		return (0);
+	if (len < evp->loc.len) {
+		log_warnx("warn: queue-log: buffer too small");
+		return (0);
+	}
+	if ((seg = tree_get(&segments, evp->loc.seg)) == NULL) {
+		log_warnx("warn: queue-log: segment not found");
+		return (0);
+	}
+
+	n = pread(seg->fd, buf, evp->loc.len,
+	    evp->loc.off + sizeof(struct ql_header));
+	if (n != (ssize_t)evp->loc.len) {
+		log_warn("warn: queue-log: pread");
+		return (0);
+	}
+
+	return (evp->loc.len);
+}
+
+/*
+ * Walk committed envelopes in key order.  The position is kept as the
+ * next evpid to look at rather than as a tree iterator, since envelopes
+ * may be deleted while the queue is being loaded.
+ */
+static int
+ql_walk(uint64_t *cursor, uint32_t only, uint64_t *evpid, char *buf,
+    size_t len)
+{
+	struct ql_message	*msg;
+	struct ql_envelope	*evp;
+	uint32_t		 msgid;
+	uint64_t		 from;
+	void			*iter;
+
+	for (;;) {
+		iter = NULL;
+		if (!tree_iterfrom(&messages, &iter, evpid_to_msgid(*cursor),
+		    &from, (void **)&msg))
+			return (-1);
+		msgid = from;
+		if (only && msgid != only)
+			return (-1);
+
+		from = msgid_to_evpid(msgid);
+		if (evpid_to_msgid(*cursor) == msgid && *cursor > from)
+			from = *cursor;
+
+		iter = NULL;
+		if (msg->committed &&
+		    tree_iterfrom(&msg->envelopes, &iter, from, evpid,
+		    (void **)&evp)) {
+			if (*evpid == UINT64_MAX)
+				return (-1);
+			*cursor = *evpid + 1;
+			return (queue_log_envelope_load(*evpid, buf, len));
+		}
+
+		if (msgid == UINT32_MAX)
+			return (-1);
+		*cursor = msgid_to_evpid(msgid + 1);
+	}
+}
+
+static int
+queue_log_envelope_walk(uint64_t *evpid, char *buf, size_t len)
+{
+	static uint64_t	 cursor = 0;
+	static int	 done = 0;
+	int		 r;
+
+	if (done)
+		return (-1);
+
+	/* first call from the running queue process, start the timers */
+	if (cursor == 0)
+		ql_schedule();
+
+	if ((r = ql_walk(&cursor, 0, evpid, buf, len)) == -1)
+		done = 1;
+
+	return (r);
+}
+
+static int
+queue_log_message_walk(uint64_t *evpid, char *buf, size_t len,
+    uint32_t msgid, int *done, void **data)
+{
+	uint64_t	*cursor = *data;
+	int		 r;
+
+	if (*done)
+		return (-1);
+
+	if (cursor == NULL) {
+		cursor = xcalloc(1, sizeof *cursor);
+		*cursor = msgid_to_evpid(msgid);
+		*data = cursor;
+	}
+
+	if ((r = ql_walk(cursor, msgid, evpid, buf, len)) == -1) {
+		free(cursor);
+		*data = NULL;
+		*done = 1;
+	}
+
+	return (r);
+}
+
+static int
+queue_log_sync(void)
+{
+	return (ql_sync());
+}
+
+static int
+queue_log_close(void)
+{
+	return (ql_sync());
+}
+
+static struct ql_message *
+ql_message_get(uint32_t msgid, int create)
+{
+	struct ql_message	*msg;
+
+	if ((msg = tree_get(&messages, msgid)) != NULL || !create) {
+		if (msg == NULL)
+			log_warnx("warn: queue-log: message not found");
+		return (msg);
+	}
+
+	msg = xcalloc(1, sizeof *msg);
+	tree_init_ordered(&msg->envelopes);
+	tree_xset(&messages, msgid, msg);
+
+	return (msg);
+}
+
+static void
+ql_message_free(struct ql_message *msg)
+{
+	struct ql_envelope	*evp;
+
+	while (tree_poproot(&msg->envelopes, NULL, (void **)&evp)) {
+		ql_release(&evp->loc);
+		free(evp);
+	}
+	if (msg->committed)
+		ql_release(&msg->body);
+	free(msg);
+}
+
+static void
+ql_release(struct ql_loc *loc)
+{
+	struct ql_segment	*seg;
+
+	if ((seg = tree_get(&segments, loc->seg)) != NULL)
+		seg->live -= QL_RECSIZE(loc->len);
+}
+
+static int
+ql_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	const char	*p = buf;
+	ssize_t		 n;
+
+	while (len) {
+		if ((n = pwrite(fd, p, len, off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != ENOSPC)
+				log_warn("warn: queue-log: pwrite");
+			return (0);
+		}
+		p += n;
+		off += n;
+		len -= n;
+	}
+
+	return (1);
+}
+
+/*
+ * Copy len bytes from fdin to fdout, updating the running CRC if asked.
+ * With fdout set to -1 the data is only checksummed.
+ */
+static int
+ql_copy(int fdin, off_t inoff, int fdout, off_t outoff, size_t len,
+    uint32_t *crc)
+{
+	ssize_t	n;
+
+	while (len) {
+		n = pread(fdin, iobuf, MIN(len, sizeof iobuf), inoff);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			log_warn("warn: queue-log: pread");
+			return (0);
+		}
+		if (crc)
+			*crc = crc32(*crc, (const Bytef *)iobuf, n);
+		if (fdout != -1 && !ql_pwrite(fdout, iobuf, n, outoff))
+			return (0);
+		inoff += n;
+		outoff += n;
+		len -= n;
+	}
+
+	return (1);
+}
+
+static uint32_t
+ql_crc(uint32_t crc, struct ql_header *hdr)
+{
+	uint32_t	saved;
+
+	saved = hdr->crc;
+	hdr->crc = 0;
+	crc = crc32(crc, (const Bytef *)hdr, sizeof *hdr);
+	hdr->crc = saved;
+
+	return (crc);
+}
+
+static int
+ql_reserve(void)
+{
+	if (head == NULL || head->size >= QL_SEGMENT_SIZE)
+		if (!ql_rotate() && head == NULL)
+			return (0);
+
+	return (1);
+}
+
+static void
+ql_appended(struct ql_header *hdr, off_t off, struct ql_loc *loc)
+{
+	head->size = off + QL_RECSIZE(hdr->len);
+	dirty = 1;
+
+	if (loc) {
+		loc->lsn = hdr->lsn;
+		loc->off = off;
+		loc->seg = head->id;
+		loc->len = hdr->len;
+		head->live += QL_RECSIZE(hdr->len);
+	}
+}
+
+static int
+ql_append(uint32_t type, uint64_t lsn, uint64_t id, const char *buf,
+    size_t len, struct ql_loc *loc)
+{
+	struct ql_header	hdr;
+	off_t			off;
+
+	if (!ql_reserve())
+		return (0);
+
+	memset(&hdr, 0, sizeof hdr);
+	hdr.magic = QL_MAGIC;
+	hdr.type = type;
+	hdr.lsn = lsn;
+	hdr.id = id;
+	hdr.len = len;
+	hdr.crc = ql_crc(crc32(0, (const Bytef *)buf, len), &hdr);
+
+	off = head->size;
+	if (!ql_pwrite(head->fd, &hdr, sizeof hdr, off) ||
+	    !ql_pwrite(head->fd, buf, len, off + sizeof hdr)) {
+		if (ftruncate(head->fd, off) == -1)
+			log_warn("warn: queue-log: ftruncate");
+		return (0);
+	}
+	ql_appended(&hdr, off, loc);
+
+	return (1);
+}
+
+static int
+ql_append_fd(uint32_t type, uint64_t lsn, uint64_t id, int fd, off_t inoff,
+    size_t len, struct ql_loc *loc)
+{
+	struct ql_header	hdr;
+	uint32_t		crc;
+	off_t			off;
+
+	if (!ql_reserve())
+		return (0);
+
+	memset(&hdr, 0, sizeof hdr);
+	hdr.magic = QL_MAGIC;
+	hdr.type = type;
+	hdr.lsn = lsn;
+	hdr.id = id;
+	hdr.len = len;
+
+	/* payload first, the header is written once the CRC is known */
+	off = head->size;
+	crc = crc32(0, NULL, 0);
+	if (!ql_copy(fd, inoff, head->fd, off + sizeof hdr, len, &crc))
+		goto fail;
+	hdr.crc = ql_crc(crc, &hdr);
+	if (!ql_pwrite(head->fd, &hdr, sizeof hdr, off))
+		goto fail;
+	ql_appended(&hdr, off, loc);
+
+	return (1);
+
+fail:
+	if (ftruncate(head->fd, off) == -1)
+		log_warn("warn: queue-log: ftruncate");
+	return (0);
+}
+
+static struct ql_segment *
+ql_segment_open(uint32_t id, int create)
+{
+	struct ql_segment	*seg;
+	struct stat		 sb;
+	char			 name[16];
+	int			 fd, flags;
+
+	(void)snprintf(name, sizeof name, "%08"PRIx32, id);
+
+	flags = O_RDWR;
+	if (create)
+		flags |= O_CREAT | O_EXCL;
+	if ((fd = openat(logfd, name, flags, 0600)) == -1) {
+		log_warn("warn: queue-log: open: %s", name);
+		return (NULL);
+	}
+	if (fstat(fd, &sb) == -1) {
+		log_warn("warn: queue-log: fstat: %s", name);
+		close(fd);
+		return (NULL);
+	}
+
+	seg = xcalloc(1, sizeof *seg);
+	seg->id = id;
+	seg->fd = fd;
+	seg->size = sb.st_size;
+	tree_xset(&segments, id, seg);
+	if (id >= nextseg)
+		nextseg = id + 1;
+
+	return (seg);
+}
+
+static int
+ql_rotate(void)
+{
+	struct ql_segment	*seg;
+
+	if (head) {
+		if (fsync(head->fd) == -1) {
+			log_warn("warn: queue-log: fsync");
+			return (0);
+		}
+		dirty = 0;
+	}
+
+	if ((seg = ql_segment_open(nextseg, 1)) == NULL)
+		return (0);
+	if (fsync(logfd) == -1)
+		log_warn("warn: queue-log: fsync");
+	head = seg;
+	if (evinit)
+		stat_increment("queue.log.segment", 1);
+
+	log_debug("debug: queue-log: new segment %08"PRIx32, seg->id);
+
+	return (1);
+}
+
+static int
+ql_sync(void)
+{
+	if (!dirty)
+		return (1);
+
+	if (fsync(head->fd) == -1) {
+		log_warn("warn: queue-log: fsync");
+		return (0);
+	}
+	dirty = 0;
+	stat_increment("queue.log.sync", 1);
+
+	return (1);
+}
+
+static void
+ql_schedule(void)
+{
+	struct timeval	tv;
+
+	/* neither events nor stats are available when the backend is created */
+	if (!evinit) {
+		evtimer_set(&ev_sync, ql_sync_timeout, NULL);
+		evtimer_set(&ev_compact, ql_compact_timeout, NULL);
+		evinit = 1;
+		stat_increment("queue.log.segment", tree_count(&segments));
+		stat_increment("queue.log.message", tree_count(&messages));
+	}
+
+	if (!evtimer_pending(&ev_sync, NULL)) {
+		tv.tv_sec = QL_SYNC_DELAY;
+		tv.tv_usec = 0;
+		evtimer_add(&ev_sync, &tv);
+	}
+	if (!evtimer_pending(&ev_compact, NULL)) {
+		tv.tv_sec = QL_COMPACT_DELAY;
+		tv.tv_usec = 0;
+		evtimer_add(&ev_compact, &tv);
+	}
+}
+
+static void
+ql_sync_timeout(int fd, short event, void *p)
+{
+	(void)ql_sync();
+}
+
+static void
+ql_compact_timeout(int fd, short event, void *p)
+{
+	struct ql_segment	*seg;
+	struct timeval		 tv;
+	char			 name[16];
+	int			 r;
+
+	tv.tv_sec = QL_COMPACT_DELAY;
+	tv.tv_usec = 0;
+
+	if (compact.seg == NULL && (compact.seg = ql_compact_pick()) == NULL) {
+		evtimer_add(&ev_compact, &tv);
+		return;
+	}
+
+	r = ql_compact_step();
+	if (r == 0) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 10000;
+	}
+	else if (r == 1 && ql_sync()) {
+		/* all live records are safely stored elsewhere */
+		seg = compact.seg;
+		log_debug("debug: queue-log: segment %08"PRIx32" compacted",
+		    seg->id);
+		tree_xpop(&segments, seg->id);
+		(void)snprintf(name, sizeof name, "%08"PRIx32, seg->id);
+		if (unlinkat(logfd, name, 0) == -1)
+			log_warn("warn: queue-log: unlink: %s", name);
+		close(seg->fd);
+		free(seg);
+		compact.seg = NULL;
+		stat_decrement("queue.log.segment", 1);
+		stat_increment("queue.log.compact", 1);
+		tv.tv_sec = 0;
+		tv.tv_usec = 10000;
+	}
+	else {
+		log_warnx("warn: queue-log: compaction of segment %08"PRIx32
+		    " failed", compact.seg->id);
+		compact.seg = NULL;
+	}
+	evtimer_add(&ev_compact, &tv);
+}
+
+/*
+ * Pick the oldest sealed segment that is mostly dead.  Preferring old
+ * segments lets deletion records be dropped rather than carried forward.
+ */
+static struct ql_segment *
+ql_compact_pick(void)
+{
+	struct ql_segment	*seg;
+	void			*iter;
+	int			 oldest = 1;
+
+	iter = NULL;
+	while (tree_iter(&segments, &iter, NULL, (void **)&seg)) {
+		if (seg == head)
+			break;
+		if (seg->live * 100 < seg->size * QL_COMPACT_RATIO ||
+		    seg->size == 0) {
+			compact.off = 0;
+			compact.oldest = oldest;
+			return (seg);
+		}
+		oldest = 0;
+	}
+
+	return (NULL);
+}
+
+static int
+ql_compact_step(void)
+{
+	struct ql_segment	*seg = compact.seg;
+	struct ql_header	 hdr;
+	off_t			 done = 0;
+
+	while (compact.off < seg->size && done < QL_COMPACT_STEP) {
+		if (pread(seg->fd, &hdr, sizeof hdr, compact.off) !=
+		    sizeof hdr) {
+			log_warn("warn: queue-log: pread");
+			return (-1);
+		}
+		if (hdr.magic != QL_MAGIC) {
+			log_warnx("warn: queue-log: segment %08"PRIx32
+			    ": bad record at %lld", seg->id,
+			    (long long)compact.off);
+			return (-1);
+		}
+		if (!ql_compact_record(seg, &hdr, compact.off))
+			return (-1);
+		compact.off += QL_RECSIZE(hdr.len);
+		done += QL_RECSIZE(hdr.len);
+	}
+
+	return (compact.off >= seg->size);
+}
+
+static int
+ql_compact_record(struct ql_segment *seg, struct ql_header *hdr, off_t off)
+{
+	struct ql_message	*msg;
+	struct ql_envelope	*evp = NULL;
+	struct ql_loc		*loc;
+	struct ql_loc		 old;
+
+	switch (hdr->type) {
+	case QL_MESSAGE:
+		msg = tree_get(&messages, (uint32_t)hdr->id);
+		if (msg == NULL || !msg->committed)
+			return (1);
+		loc = &msg->body;
+		break;
+
+	case QL_ENVELOPE:
+		msg = tree_get(&messages, evpid_to_msgid(hdr->id));
+		if (msg)
+			evp = tree_get(&msg->envelopes, hdr->id);
+		if (evp == NULL)
+			return (1);
+		loc = &evp->loc;
+		break;
+
+	default:
+		/*
+		 * Older segments may still hold the records a deletion
+		 * applies to.  Only the oldest segment can drop them.
+		 */
+		if (compact.oldest)
+			return (1);
+		return (ql_append(hdr->type, hdr->lsn, hdr->id, NULL, 0, NULL));
+	}
+
+	if (loc->seg != seg->id || loc->off != off)
+		return (1);
+
+	old = *loc;
+	if (!ql_append_fd(hdr->type, hdr->lsn, hdr->id, seg->fd,
+	    off + sizeof *hdr, hdr->len, loc))
+		return (0);
+	ql_release(&old);
+
+	return (1);
+}
+
+static int
+ql_replay(void)
+{
+	struct ql_segment	*seg;
+	struct dirent		*dp;
+	DIR			*dir;
+	uint32_t		 id;
+	char			*ep;
+	void			*iter;
+	unsigned long		 ul;
+
+	if ((dir = opendir(PATH_SPOOL PATH_LOG)) == NULL) {
+		log_warn("warn: queue-log: opendir");
+		return (0);
+	}
+	while ((dp = readdir(dir)) != NULL) {
+		if (strlen(dp->d_name) != 8)
+			continue;
+		errno = 0;
+		ul = strtoul(dp->d_name, &ep, 16);
+		if (*ep != '\0' || errno || ul == 0 || ul > UINT32_MAX) {
+			log_debug("debug: queue-log: bogus file %s",
+			    dp->d_name);
+			continue;
+		}
+		if (ql_segment_open(ul, 0) == NULL) {
+			closedir(dir);
+			return (0);
+		}
+	}
+	closedir(dir);
+
+	/*
+	 * Sealed segments were synced when they were rotated, so only the
+	 * last one may end with a torn write and needs its bodies checked.
+	 */
+	iter = NULL;
+	while (tree_iter(&segments, &iter, NULL, (void **)&seg)) {
+		id = seg->id;
+		if (!ql_replay_segment(seg, id + 1 == nextseg))
+			return (0);
+	}
+
+	ql_resolve();
+
+	log_debug("debug: queue-log: %zu segments, %zu messages",
+	    tree_count(&segments), tree_count(&messages));
+
+	return (1);
+}
+
+static int
+ql_replay_segment(struct ql_segment *seg, int last)
+{
+	struct ql_header	hdr;
+	uint32_t		crc;
+	off_t			off;
+
+	off = 0;
+	while (off + QL_RECSIZE(0) <= seg->size) {
+		if (pread(seg->fd, &hdr, sizeof hdr, off) != sizeof hdr) {
+			log_warn("warn: queue-log: pread");
+			return (0);
+		}
+		if (hdr.magic != QL_MAGIC ||
+		    hdr.type < QL_MESSAGE || hdr.type > QL_ENVELOPE_DEL ||
+		    off + QL_RECSIZE(hdr.len) > seg->size)
+			break;
+
+		if (hdr.type != QL_MESSAGE || last) {
+			crc = crc32(0, NULL, 0);
+			if (!ql_copy(seg->fd, off + sizeof hdr, -1, 0, hdr.len,
+			    &crc))
+				return (0);
+			if (ql_crc(crc, &hdr) != hdr.crc)
+				break;
+		}
+
+		ql_replay_record(seg, &hdr, off);
+		if (hdr.lsn >= nextlsn)
+			nextlsn = hdr.lsn + 1;
+		off += QL_RECSIZE(hdr.len);
+	}
+
+	if (off != seg->size) {
+		log_warnx("warn: queue-log: segment %08"PRIx32
+		    ": truncating at offset %lld", seg->id, (long long)off);
+		if (ftruncate(seg->fd, off) == -1) {
+			log_warn("warn: queue-log: ftruncate");
+			return (0);
+		}
+		seg->size = off;
+	}
+
+	return (1);
+}
+
+static void
+ql_replay_record(struct ql_segment *seg, struct ql_header *hdr, off_t off)
+{
+	struct ql_message	*msg;
+	struct ql_envelope	*evp;
+	struct ql_loc		 loc;
+	uint32_t		 msgid;
+
+	loc.lsn = hdr->lsn;
+	loc.off = off;
+	loc.seg = seg->id;
+	loc.len = hdr->len;
+
+	if (hdr->type == QL_MESSAGE || hdr->type == QL_MESSAGE_DEL)
+		msgid = hdr->id;
+	else
+		msgid = evpid_to_msgid(hdr->id);
+	msg = ql_message_get(msgid, 1);
+
+	switch (hdr->type) {
+	case QL_MESSAGE:
+		if (msg->body.lsn < loc.lsn) {
+			msg->body = loc;
+			msg->committed = 1;
+		}
+		break;
+
+	case QL_MESSAGE_DEL:
+		if (msg->tomb < loc.lsn)
+			msg->tomb = loc.lsn;
+		break;
+
+	case QL_ENVELOPE:
+	case QL_ENVELOPE_DEL:
+		if ((evp = tree_get(&msg->envelopes, hdr->id)) == NULL) {
+			evp = xcalloc(1, sizeof *evp);
+			tree_xset(&msg->envelopes, hdr->id, evp);
+		}
+		if (evp->loc.lsn < loc.lsn) {
+			evp->loc = loc;
+			evp->dead = (hdr->type == QL_ENVELOPE_DEL);
+		}
+		break;
+	}
+}
+
+/*
+ * Drop everything hidden by a deletion record, envelopes of messages that
+ * were never committed and messages left without envelopes, then account
+ * for the live data in each segment.
+ */
+static void
+ql_resolve(void)
+{
+	struct ql_message	*msg;
+	struct ql_envelope	*evp;
+	struct ql_segment	*seg;
+	struct tree		 replay, keep;
+	void			*iter;
+	uint64_t		 msgid, id;
+
+	tree_init(&replay);
+	while (tree_poproot(&messages, &msgid, (void **)&msg))
+		tree_xset(&replay, msgid, msg);
+
+	while (tree_poproot(&replay, &msgid, (void **)&msg)) {
+		if (msg->body.lsn < msg->tomb)
+			msg->committed = 0;
+
+		tree_init(&keep);
+		while (tree_poproot(&msg->envelopes, &id, (void **)&evp)) {
+			if (evp->dead || evp->loc.lsn < msg->tomb ||
+			    !msg->committed)
+				free(evp);
+			else
+				tree_xset(&keep, id, evp);
+		}
+		while (tree_poproot(&keep, &id, (void **)&evp))
+			tree_xset(&msg->envelopes, id, evp);
+
+		if (tree_empty(&msg->envelopes)) {
+			msg->committed = 0;
+			ql_message_free(msg);
+			continue;
+		}
+
+		msg->ondisk = 1;
+		if ((seg = tree_get(&segments, msg->body.seg)) != NULL)
+			seg->live += QL_RECSIZE(msg->body.len);
+		iter = NULL;
+		while (tree_iter(&msg->envelopes, &iter, NULL, (void **)&evp))
+			if ((seg = tree_get(&segments, evp->loc.seg)) != NULL)
+				seg->live += QL_RECSIZE(evp->loc.len);
+		tree_xset(&messages, msgid, msg);
+	}
+}
+
+static int
+queue_log_init(struct passwd *pw, int server, const char *conf)
+{
+	tree_init_ordered(&messages);
+	tree_init_ordered(&segments);
+
+	if (ckdir(PATH_SPOOL PATH_LOG, 0700, pw->pw_uid, 0, server) == 0)
+		return (0);
+
+	/* kept open so segments can be created after the chroot */
+	if ((logfd = open(PATH_SPOOL PATH_LOG, O_RDONLY | O_DIRECTORY)) == -1) {
+		log_warn("warn: queue-log: open: %s", PATH_SPOOL PATH_LOG);
+		return (0);
+	}
+
+	if (!ql_replay())
+		return (0);
+
+	if (server) {
+		if (!ql_rotate())
+			return (0);
+		if (fchown(head->fd, pw->pw_uid, -1) == -1)
+			log_warn("warn: queue-log: fchown");
+	}
+
+	queue_api_on_close(queue_log_close);
+	queue_api_on_message_create(queue_log_message_create);
+	queue_api_on_message_commit(queue_log_message_commit);
+	queue_api_on_message_delete(queue_log_message_delete);
+	queue_api_on_message_fd_r(queue_log_message_fd_r);
+	queue_api_on_message_sync(queue_log_sync);
+	queue_api_on_envelope_create(queue_log_envelope_create);
+	queue_api_on_envelope_delete(queue_log_envelope_delete);
+	queue_api_on_envelope_update(queue_log_envelope_update);
+	queue_api_on_envelope_load(queue_log_envelope_load);
+	queue_api_on_envelope_walk(queue_log_envelope_walk);
+	queue_api_on_message_walk(queue_log_message_walk);
+
+	return (1);
+}
+
+struct queue_backend	queue_backend_log = {
+	queue_log_init,
+};
@@ -0,0 +1,1380 @@
+/*
+ * Copyright (c) 2026 The OpenSMTPD Project
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Tiered queue.
+ *
+ * Messages live in memory and every change is appended to a journal in
+ * the tiered/ directory of the spool, so that they survive a crash.  The
+ * journal is synced once per batch of commits and shortly after updates,
+ * and most messages are delivered before ever reaching the queue
+ * directories.  Bodies are only kept in memory within the budget set by
+ * "queue memory", others are read back from the journal.
+ *
+ * Messages still queued after a while, or whose body did not fit in
+ * memory, are spilled in the background to the fs backend this one is
+ * layered over: a worker thread writes them in the fs layout under the
+ * same ids, then they are dropped from memory and from the journal.
+ *
+ * Journal segments are removed oldest first, once nothing they hold is
+ * live, so a deletion record never outlives the records it hides.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+#define PATH_TIERED		"/tiered"
+
+#define QT_MAGIC		0x51544a52	/* "QTJR" */
+#define QT_SEGMENT_SIZE		(16 * 1024 * 1024)
+#define QT_SYNC_DELAY		1
+#define QT_SPILL_DELAY		1
+#define QT_SPILL_AGE		30	/* seconds before a message is spilled */
+#define QT_SPILL_JOBS		4
+#define QT_LARGE_RATIO		16	/* bodies above 1/16 of the budget */
+
+#define QT_COMMITTED		0x01
+#define QT_REPLAYED		0x02
+#define QT_SPILLING		0x04
+#define QT_DELETED		0x08
+
+enum {
+	QT_MESSAGE = 1,
+	QT_MESSAGE_DEL,
+	QT_ENVELOPE,
+	QT_ENVELOPE_DEL,
+};
+
+struct qt_header {
+	uint32_t	magic;
+	uint32_t	type;
+	uint64_t	id;
+	uint32_t	len;
+	uint32_t	crc;
+};
+
+#define QT_RECSIZE(len)		((off_t)sizeof(struct qt_header) + (len))
+
+struct qt_segment {
+	uint32_t	id;
+	int		fd;
+	off_t		size;
+	size_t		refs;		/* live records */
+};
+
+struct qt_envelope {
+	uint32_t	seg;
+	uint32_t	gen;
+	size_t		len;
+	char	       *buf;
+};
+
+struct qt_message {
+	TAILQ_ENTRY(qt_message)	 entry;
+	uint32_t		 msgid;
+	int			 flags;
+	time_t			 time;
+	uint32_t		 seg;		/* body in the journal */
+	off_t			 off;
+	size_t			 len;
+	char			*buf;		/* body, if kept in memory */
+	struct tree		 envelopes;
+};
+
+struct qt_spill {
+	struct qt_message	*msg;
+	uint32_t		 msgid;
+	const char		*buf;
+	int			 fd;
+	off_t			 off;
+	size_t			 len;
+	size_t			 count;
+	uint64_t		*evpids;
+	char		       **bufs;
+	size_t			*lens;
+	uint32_t		*gens;
+	int			 ret;
+};
+
+TAILQ_HEAD(qt_msglst, qt_message);
+
+extern struct queue_backend	queue_backend_fs;
+
+static int	qt_replay(void);
+static int	qt_replay_segment(struct qt_segment *, int);
+static void	qt_replay_record(struct qt_segment *, struct qt_header *, off_t,
+		    char *);
+static void	qt_resolve(void);
+static struct qt_segment *qt_segment_open(uint32_t, int);
+static int	qt_rotate(void);
+static void	qt_trim(void);
+static void	qt_release(uint32_t);
+static int	qt_pwrite(int, const void *, size_t, off_t);
+static int	qt_pread(int, void *, size_t, off_t);
+static int	qt_copy(int, off_t, int, off_t, size_t, uint32_t *);
+static uint32_t	qt_crc(uint32_t, struct qt_header *);
+static int	qt_append(uint32_t, uint64_t, const char *, size_t, int, off_t,
+		    uint32_t *, off_t *);
+static int	qt_sync(void);
+static void	qt_schedule(void);
+static void	qt_sync_timeout(int, short, void *);
+static void	qt_spill_timeout(int, short, void *);
+static void	qt_spill(void);
+static void	qt_spill_start(struct qt_message *);
+static void	qt_spill_work(void *);
+static void	qt_spill_done(void *);
+static int	qt_keep(size_t);
+static struct qt_message *qt_message_get(uint32_t, int);
+static void	qt_message_free(struct qt_message *);
+static void	qt_envelope_free(struct qt_envelope *);
+static int	qt_envelope_copy(struct qt_envelope *, char *, size_t);
+static void	qt_walk_check(void);
+static int	queue_tiered_message_delete(uint32_t);
+
+static struct queue_api	 lower;
+static struct tree	 messages;
+static struct tree	 segments;
+static struct tree	 cursors;
+static struct qt_msglst	 resident;	/* committed, oldest first */
+static struct qt_segment *head;
+static uint32_t		 nextseg = 1;
+static int		 journalfd = -1;
+static int		 dirty;
+static size_t		 memory;
+static size_t		 nspills;
+static int		 loaded;
+
+static int		 evinit;
+static struct event	 ev_sync;
+static struct event	 ev_spill;
+
+static struct {
+	int		checked;
+	int		done;
+	uint32_t	msgid;
+	uint64_t	evpid;
+} walk;
+
+static int
+queue_tiered_message_create(uint32_t *msgid)
+{
+	struct qt_message	*msg;
+
+	msg = calloc(1, sizeof(*msg));
+	if (msg == NULL) {
+		log_warn("warn: queue-tiered: calloc");
+		return (0);
+	}
+	tree_init_ordered(&msg->envelopes);
+
+	/* spilled messages keep their id */
+	do {
+		*msgid = queue_generate_msgid();
+	} while (tree_check(&messages, *msgid) ||
+	    queue_fs_message_exists(*msgid));
+
+	msg->msgid = *msgid;
+	tree_xset(&messages, *msgid, msg);
+
+	return (1);
+}
+
+static int
+queue_tiered_message_commit(uint32_t msgid, const char *path)
+{
+	struct qt_message	*msg;
+	struct stat		 sb;
+	char			*buf = NULL;
+	off_t			 off;
+	uint32_t		 seg;
+	int			 fd, r;
+
+	if ((msg = tree_get(&messages, msgid)) == NULL ||
+	    msg->flags & QT_COMMITTED) {
+		log_warnx("warn: queue-tiered: msgid not found");
+		return (0);
+	}
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		log_warn("warn: queue-tiered: open: %s", path);
+		return (0);
+	}
+	if (fstat(fd, &sb) == -1) {
+		log_warn("warn: queue-tiered: fstat");
+		close(fd);
+		return (0);
+	}
+	if (sb.st_size > UINT32_MAX) {
+		log_warnx("warn: queue-tiered: message too large");
+		close(fd);
+		return (0);
+	}
+
+	if (qt_keep(sb.st_size) && (buf = malloc(sb.st_size + 1)) != NULL &&
+	    !qt_pread(fd, buf, sb.st_size, 0)) {
+		free(buf);
+		close(fd);
+		return (0);
+	}
+	if (buf)
+		r = qt_append(QT_MESSAGE, msgid, buf, sb.st_size, -1, 0,
+		    &seg, &off);
+	else
+		r = qt_append(QT_MESSAGE, msgid, NULL, sb.st_size, fd, 0,
+		    &seg, &off);
+	close(fd);
+	if (!r) {
+		free(buf);
+		return (0);
+	}
+
+	msg->flags |= QT_COMMITTED;
+	msg->time = time(NULL);
+	msg->seg = seg;
+	msg->off = off;
+	msg->len = sb.st_size;
+	msg->buf = buf;
+	if (buf)
+		memory += msg->len;
+	TAILQ_INSERT_TAIL(&resident, msg, entry);
+	qt_schedule();
+
+	return (1);
+}
+
+static int
+queue_tiered_message_delete(uint32_t msgid)
+{
+	struct qt_message	*msg;
+
+	if ((msg = tree_pop(&messages, msgid)) == NULL)
+		return (lower.message_delete(msgid));
+
+	/* one deletion record hides the body and all envelopes */
+	if (!qt_append(QT_MESSAGE_DEL, msgid, NULL, 0, -1, 0, NULL, NULL))
+		log_warnx("warn: queue-tiered: "
+		    "could not log deletion of %08"PRIx32, msgid);
+	qt_schedule();
+
+	/* the spill completes first and removes it from the fs queue */
+	if (msg->flags & QT_SPILLING) {
+		msg->flags |= QT_DELETED;
+		return (1);
+	}
+	if (msg->flags & QT_COMMITTED)
+		TAILQ_REMOVE(&resident, msg, entry);
+	qt_message_free(msg);
+
+	return (1);
+}
+
+static int
+queue_tiered_message_fd_r(uint32_t msgid)
+{
+	struct qt_message	*msg;
+	struct qt_segment	*seg;
+	int			 fd, r;
+
+	if ((msg = tree_get(&messages, msgid)) == NULL)
+		return (lower.message_fd_r(msgid));
+	if (!(msg->flags & QT_COMMITTED)) {
+		log_warnx("warn: queue-tiered: message not found");
+		return (-1);
+	}
+
+	fd = mktmpfile();
+	if (msg->buf)
+		r = qt_pwrite(fd, msg->buf, msg->len, 0);
+	else if ((seg = tree_get(&segments, msg->seg)) != NULL)
+		r = qt_copy(seg->fd, msg->off, fd, 0, msg->len, NULL);
+	else {
+		log_warnx("warn: queue-tiered: segment not found");
+		r = 0;
+	}
+	if (!r) {
+		close(fd);
+		return (-1);
+	}
+	lseek(fd, 0, SEEK_SET);
+
+	return (fd);
+}
+
+static int
+queue_tiered_envelope_create(uint32_t msgid, const char *buf, size_t len,
+    uint64_t *evpid)
+{
+	struct qt_message	*msg;
+	struct qt_envelope	*evp;
+
+	if ((msg = tree_get(&messages, msgid)) == NULL)
+		return (lower.envelope_create(msgid, buf, len, evpid));
+
+	evp = calloc(1, sizeof *evp);
+	if (evp == NULL) {
+		log_warn("warn: queue-tiered: calloc");
+		return (0);
+	}
+	if ((evp->buf = malloc(len)) == NULL) {
+		log_warn("warn: queue-tiered: malloc");
+		free(evp);
+		return (0);
+	}
+	memmove(evp->buf, buf, len);
+	evp->len = len;
+
+	do {
+		*evpid = queue_generate_evpid(msgid);
+	} while (tree_check(&msg->envelopes, *evpid));
+
+	if (!qt_append(QT_ENVELOPE, *evpid, buf, len, -1, 0, &evp->seg,
+	    NULL)) {
+		free(evp->buf);
+		free(evp);
+		return (0);
+	}
+	tree_xset(&msg->envelopes, *evpid, evp);
+	memory += len;
+
+	/* envelopes of incoming messages are synced by the commit */
+	if (msg->flags & QT_COMMITTED)
+		qt_schedule();
+
+	return (1);
+}
+
+static int
+queue_tiered_envelope_delete(uint64_t evpid)
+{
+	struct qt_message	*msg;
+	struct qt_envelope	*evp;
+	uint32_t		 msgid;
+
+	msgid = evpid_to_msgid(evpid);
+	if ((msg = tree_get(&messages, msgid)) == NULL)
+		return (lower.envelope_delete(evpid));
+
+	if ((evp = tree_pop(&msg->envelopes, evpid)) == NULL) {
+		log_warnx("warn: queue-tiered: envelope not found");
+		return (0);
+	}
+	if (!qt_append(QT_ENVELOPE_DEL, evpid, NULL, 0, -1, 0, NULL, NULL))
+		log_warnx("warn: queue-tiered: "
+		    "could not log deletion of %016"PRIx64, evpid);
+	qt_envelope_free(evp);
+	qt_schedule();
+
+	if (tree_empty(&msg->envelopes))
+		queue_tiered_message_delete(msgid);
+	qt_trim();
+
+	return (1);
+}
+
+static int
+queue_tiered_envelope_update(uint64_t evpid, const char *buf, size_t len)
+{
+	struct qt_message	*msg;
+	struct qt_envelope	*evp;
+	uint32_t		 seg;
+	char			*tmp;
+
+	if ((msg = tree_get(&messages, evpid_to_msgid(evpid))) == NULL)
+		return (lower.envelope_update(evpid, buf, len));
+
+	if ((evp = tree_get(&msg->envelopes, evpid)) == NULL) {
+		log_warnx("warn: queue-tiered: envelope not found");
+		return (0);
+	}
+	if ((tmp = malloc(len)) == NULL) {
+		log_warn("warn: queue-tiered: malloc");
+		return (0);
+	}
+	memmove(tmp, buf, len);
+
+	if (!qt_append(QT_ENVELOPE, evpid, buf, len, -1, 0, &seg, NULL)) {
+		free(tmp);
+		return (0);
+	}
+	qt_release(evp->seg);
+	memory -= evp->len;
+	free(evp->buf);
+	evp->seg = seg;
+	evp->buf = tmp;
+	evp->len = len;
+	evp->gen++;
+	memory += len;
+	qt_schedule();
+	qt_trim();
+
+	return (1);
+}
+
+static int
+queue_tiered_envelope_load(uint64_t evpid, char *buf, size_t len)
+{
+	struct qt_message	*msg;
+	struct qt_envelope	*evp;
+
+	if ((msg = tree_get(&messages, evpid_to_msgid(evpid))) == NULL)
+		return (lower.envelope_load(evpid, buf, len));
+
+	if ((evp = tree_get(&msg->envelopes, evpid)) == NULL) {
+		log_warnx("warn: queue-tiered: envelope not found");
+		return (0);
+	}
+
+	return (qt_envelope_copy(evp, buf, len));
+}
+
+/*
+ * Envelopes found in the journal at startup are walked first, then those
+ * of the fs queue.  Messages are only spilled once the walk is over, so
+ * that none moves to the part of the queue already walked.
+ */
+static int
+queue_tiered_envelope_walk(uint64_t *evpid, char *buf, size_t len)
+{
+	struct qt_message	*msg;
+	struct qt_envelope	*evp;
+	uint64_t		 id;
+	void			*iter;
+	int			 r;
+
+	if (!walk.checked) {
+		qt_walk_check();
+		walk.checked = 1;
+	}
+
+	while (!walk.done) {
+		iter = NULL;
+		if (!tree_iterfrom(&messages, &iter, walk.msgid, &id,
+		    (void **)&msg)) {
+			walk.done = 1;
+			break;
+		}
+		if (msg->flags & QT_REPLAYED) {
+			iter = NULL;
+			if (tree_iterfrom(&msg->envelopes, &iter, walk.evpid,
+			    evpid, (void **)&evp)) {
+				walk.msgid = id;
+				walk.evpid = *evpid + 1;
+				return (qt_envelope_copy(evp, buf, len));
+			}
+		}
+		if (id == UINT32_MAX) {
+			walk.done = 1;
+			break;
+		}
+		walk.msgid = id + 1;
+		walk.evpid = msgid_to_evpid(walk.msgid);
+	}
+
+	r = lower.envelope_walk(evpid, buf, len);
+	if (r == -1 && !loaded) {
+		loaded = 1;
+		qt_schedule();
+	}
+
+	return (r);
+}
+
+static int
+queue_tiered_message_walk(uint64_t *evpid, char *buf, size_t len,
+    uint32_t msgid, int *done, void **data)
+{
+	struct qt_message	*msg;
+	struct qt_envelope	*evp;
+	uint64_t		*cursor;
+	void			*iter;
+
+	if (*done)
+		return (-1);
+
+	/* the walk stays on the side it started on */
+	if (*data == NULL) {
+		msg = tree_get(&messages, msgid);
+		if (msg == NULL || !(msg->flags & QT_COMMITTED))
+			return (lower.message_walk(evpid, buf, len, msgid,
+			    done, data));
+		cursor = xmalloc(sizeof *cursor);
+		*cursor = msgid_to_evpid(msgid);
+		tree_xset(&cursors, (uintptr_t)cursor, cursor);
+		*data = cursor;
+	}
+	else if (!tree_check(&cursors, (uintptr_t)*data))
+		return (lower.message_walk(evpid, buf, len, msgid, done, data));
+	cursor = *data;
+
+	iter = NULL;
+	if ((msg = tree_get(&messages, msgid)) != NULL &&
+	    tree_iterfrom(&msg->envelopes, &iter, *cursor, evpid,
+	    (void **)&evp)) {
+		*cursor = *evpid + 1;
+		return (qt_envelope_copy(evp, buf, len));
+	}
+
+	tree_xpop(&cursors, (uintptr_t)cursor);
+	free(cursor);
+	*data = NULL;
+	*done = 1;
+	return (-1);
+}
+
+static int
+queue_tiered_sync(void)
+{
+	return (qt_sync());
+}
+
+static int
+queue_tiered_close(void)
+{
+	return (qt_sync());
+}
+
+/*
+ * A spill that completed right before a crash may have left the message
+ * in the journal too.  The fs copy wins, it is complete once it exists.
+ */
+static void
+qt_walk_check(void)
+{
+	struct qt_message	*msg;
+	uint64_t		 id;
+	uint32_t		 msgid;
+	void			*iter;
+
+	msgid = 0;
+	for (;;) {
+		iter = NULL;
+		if (!tree_iterfrom(&messages, &iter, msgid, &id,
+		    (void **)&msg))
+			break;
+		if (msg->flags & QT_REPLAYED && queue_fs_message_exists(id)) {
+			log_debug("debug: queue-tiered: %08"PRIx64
+			    " already spilled", id);
+			queue_tiered_message_delete(id);
+		}
+		if (id == UINT32_MAX)
+			break;
+		msgid = id + 1;
+	}
+}
+
+static int
+qt_keep(size_t len)
+{
+	return (len <= env->sc_queue_memory / QT_LARGE_RATIO &&
+	    memory + len <= env->sc_queue_memory);
+}
+
+static struct qt_message *
+qt_message_get(uint32_t msgid, int create)
+{
+	struct qt_message	*msg;
+
+	if ((msg = tree_get(&messages, msgid)) != NULL || !create)
+		return (msg);
+
+	msg = xcalloc(1, sizeof *msg);
+	msg->msgid = msgid;
+	tree_init_ordered(&msg->envelopes);
+	tree_xset(&messages, msgid, msg);
+
+	return (msg);
+}
+
+static void
+qt_message_free(struct qt_message *msg)
+{
+	struct qt_envelope	*evp;
+
+	while (tree_poproot(&msg->envelopes, NULL, (void **)&evp))
+		qt_envelope_free(evp);
+	if (msg->flags & QT_COMMITTED)
+		qt_release(msg->seg);
+	if (msg->buf) {
+		memory -= msg->len;
+		free(msg->buf);
+	}
+	free(msg);
+	qt_trim();
+}
+
+static void
+qt_envelope_free(struct qt_envelope *evp)
+{
+	qt_release(evp->seg);
+	memory -= evp->len;
+	free(evp->buf);
+	free(evp);
+}
+
+static int
+qt_envelope_copy(struct qt_envelope *evp, char *buf, size_t len)
+{
+	if (evp->len >= len) {
+		log_warnx("warn: queue-tiered: buffer too small");
+		return (0);
+	}
+	memmove(buf, evp->buf, evp->len);
+	buf[evp->len] = '\0';
+
+	return (evp->len);
+}
+
+/*
+ * Spill the oldest messages that were not delivered in time, those whose
+ * body is not in memory and, while over budget, any of them.
+ */
+static void
+qt_spill(void)
+{
+	struct qt_message	*msg, *next;
+	time_t			 now;
+
+	if (!loaded)
+		return;
+
+	now = time(NULL);
+	for (msg = TAILQ_FIRST(&resident); msg; msg = next) {
+		next = TAILQ_NEXT(msg, entry);
+		if (nspills >= QT_SPILL_JOBS)
+			break;
+		if (msg->buf && now - msg->time < QT_SPILL_AGE &&
+		    memory <= env->sc_queue_memory)
+			continue;
+		qt_spill_start(msg);
+	}
+}
+
+static void
+qt_spill_start(struct qt_message *msg)
+{
+	struct qt_spill		*job;
+	struct qt_envelope	*evp;
+	struct qt_segment	*seg;
+	uint64_t		 evpid;
+	void			*iter;
+	size_t			 i;
+
+	job = xcalloc(1, sizeof *job);
+	job->msg = msg;
+	job->msgid = msg->msgid;
+	job->buf = msg->buf;
+	job->fd = -1;
+	job->off = msg->off;
+	job->len = msg->len;
+	if (msg->buf == NULL) {
+		/* the body reference keeps the segment open */
+		seg = tree_xget(&segments, msg->seg);
+		job->fd = seg->fd;
+	}
+
+	job->count = tree_count(&msg->envelopes);
+	job->evpids = xcalloc(job->count, sizeof *job->evpids);
+	job->bufs = xcalloc(job->count, sizeof *job->bufs);
+	job->lens = xcalloc(job->count, sizeof *job->lens);
+	job->gens = xcalloc(job->count, sizeof *job->gens);
+	i = 0;
+	iter = NULL;
+	while (tree_iter(&msg->envelopes, &iter, &evpid, (void **)&evp)) {
+		job->evpids[i] = evpid;
+		job->bufs[i] = xmemdup(evp->buf, evp->len);
+		job->lens[i] = evp->len;
+		job->gens[i] = evp->gen;
+		i++;
+	}
+
+	msg->flags |= QT_SPILLING;
+	TAILQ_REMOVE(&resident, msg, entry);
+	nspills++;
+
+	queue_io_submit(qt_spill_work, qt_spill_done, job);
+}
+
+static void
+qt_spill_work(void *arg)
+{
+	struct qt_spill	*job = arg;
+	char		 path[PATH_MAX];
+	int		 fd, r;
+
+	if (!bsnprintf(path, sizeof path, "%s/%08"PRIx32".spill",
+	    PATH_TEMPORARY, job->msgid))
+		return;
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1) {
+		log_warn("warn: queue-tiered: open: %s", path);
+		return;
+	}
+	if (job->buf)
+		r = qt_pwrite(fd, job->buf, job->len, 0);
+	else
+		r = qt_copy(job->fd, job->off, fd, 0, job->len, NULL);
+
+	/* the journal copy goes away once the spill is done */
+	if (r && fsync(fd) == -1) {
+		log_warn("warn: queue-tiered: fsync");
+		r = 0;
+	}
+	close(fd);
+
+	if (r)
+		job->ret = queue_fs_message_import(job->msgid, path,
+		    job->count, job->evpids, job->bufs, job->lens);
+	unlink(path);
+}
+
+static void
+qt_spill_done(void *arg)
+{
+	struct qt_spill		*job = arg;
+	struct qt_message	*msg = job->msg;
+	struct qt_envelope	*evp;
+	size_t			 i;
+
+	msg->flags &= ~QT_SPILLING;
+	nspills--;
+
+	if (!job->ret) {
+		log_warnx("warn: queue-tiered: could not spill %08"PRIx32,
+		    job->msgid);
+		if (msg->flags & QT_DELETED)
+			qt_message_free(msg);
+		else {
+			msg->time = time(NULL);
+			TAILQ_INSERT_TAIL(&resident, msg, entry);
+		}
+		goto end;
+	}
+
+	queue_fs_message_adopt(job->msgid, job->count);
+	if (msg->flags & QT_DELETED) {
+		lower.message_delete(job->msgid);
+		qt_message_free(msg);
+		goto end;
+	}
+
+	/* catch up with what happened while the message was written */
+	for (i = 0; i < job->count; i++) {
+		evp = tree_get(&msg->envelopes, job->evpids[i]);
+		if (evp == NULL)
+			lower.envelope_delete(job->evpids[i]);
+		else if (evp->gen != job->gens[i] &&
+		    !lower.envelope_update(job->evpids[i], evp->buf, evp->len))
+			log_warnx("warn: queue-tiered: could not update "
+			    "%016"PRIx64, job->evpids[i]);
+	}
+
+	if (!qt_append(QT_MESSAGE_DEL, job->msgid, NULL, 0, -1, 0, NULL,
+	    NULL) || !qt_sync())
+		log_warnx("warn: queue-tiered: "
+		    "could not log spill of %08"PRIx32, job->msgid);
+	tree_xpop(&messages, job->msgid);
+	qt_message_free(msg);
+	stat_increment("queue.tiered.spilled", 1);
+
+	log_debug("debug: queue-tiered: spilled %08"PRIx32" (%zu bytes)",
+	    job->msgid, job->len);
+
+end:
+	for (i = 0; i < job->count; i++)
+		free(job->bufs[i]);
+	free(job->evpids);
+	free(job->bufs);
+	free(job->lens);
+	free(job->gens);
+	free(job);
+
+	qt_spill();
+}
+
+static void
+qt_release(uint32_t id)
+{
+	struct qt_segment	*seg;
+
+	if ((seg = tree_get(&segments, id)) != NULL)
+		seg->refs--;
+}
+
+/* remove the oldest segments as long as they hold nothing live */
+static void
+qt_trim(void)
+{
+	struct qt_segment	*seg;
+	char			 name[16];
+	void			*iter;
+
+	if (head == NULL)
+		return;
+
+	for (;;) {
+		iter = NULL;
+		if (!tree_iter(&segments, &iter, NULL, (void **)&seg))
+			break;
+		if (seg == head || seg->refs)
+			break;
+		(void)snprintf(name, sizeof name, "%08"PRIx32, seg->id);
+		if (unlinkat(journalfd, name, 0) == -1)
+			log_warn("warn: queue-tiered: unlink: %s", name);
+		close(seg->fd);
+		tree_xpop(&segments, seg->id);
+		free(seg);
+		log_debug("debug: queue-tiered: removed segment %s", name);
+	}
+}
+
+static int
+qt_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	const char	*p = buf;
+	ssize_t		 n;
+
+	while (len) {
+		if ((n = pwrite(fd, p, len, off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != ENOSPC)
+				log_warn("warn: queue-tiered: pwrite");
+			return (0);
+		}
+		p += n;
+		off += n;
+		len -= n;
+	}
+
+	return (1);
+}
+
+static int
+qt_pread(int fd, void *buf, size_t len, off_t off)
+{
+	char	*p = buf;
+	ssize_t	 n;
+
+	while (len) {
+		n = pread(fd, p, len, off);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			log_warn("warn: queue-tiered: pread");
+			return (0);
+		}
+		p += n;
+		off += n;
+		len -= n;
+	}
+
+	return (1);
+}
+
+/*
+ * Copy len bytes from fdin to fdout, updating the running CRC if asked.
+ * With fdout set to -1 the data is only checksummed.  Spills call it
+ * from the worker threads.
+ */
+static int
+qt_copy(int fdin, off_t inoff, int fdout, off_t outoff, size_t len,
+    uint32_t *crc)
+{
+	char	buf[16384];
+	size_t	n;
+
+	while (len) {
+		n = MIN(len, sizeof buf);
+		if (!qt_pread(fdin, buf, n, inoff))
+			return (0);
+		if (crc)
+			*crc = crc32(*crc, (const Bytef *)buf, n);
+		if (fdout != -1 && !qt_pwrite(fdout, buf, n, outoff))
+			return (0);
+		inoff += n;
+		outoff += n;
+		len -= n;
+	}
+
+	return (1);
+}
+
+static uint32_t
+qt_crc(uint32_t crc, struct qt_header *hdr)
+{
+	uint32_t	saved;
+
+	saved = hdr->crc;
+	hdr->crc = 0;
+	crc = crc32(crc, (const Bytef *)hdr, sizeof *hdr);
+	hdr->crc = saved;
+
+	return (crc);
+}
+
+/*
+ * Append a record whose payload is either buf or len bytes of fd.  For
+ * records that stay live, the segment is referenced and returned along
+ * with the offset of the payload.
+ */
+static int
+qt_append(uint32_t type, uint64_t id, const char *buf, size_t len, int fd,
+    off_t inoff, uint32_t *segp, off_t *offp)
+{
+	struct qt_header	hdr;
+	uint32_t		crc;
+	off_t			off;
+
+	if (head == NULL || head->size >= QT_SEGMENT_SIZE)
+		if (!qt_rotate() && head == NULL)
+			return (0);
+
+	memset(&hdr, 0, sizeof hdr);
+	hdr.magic = QT_MAGIC;
+	hdr.type = type;
+	hdr.id = id;
+	hdr.len = len;
+
+	/* payload first, the header is written once the CRC is known */
+	off = head->size;
+	crc = crc32(0, NULL, 0);
+	if (buf) {
+		crc = crc32(crc, (const Bytef *)buf, len);
+		if (!qt_pwrite(head->fd, buf, len, off + sizeof hdr))
+			goto fail;
+	}
+	else if (fd != -1 &&
+	    !qt_copy(fd, inoff, head->fd, off + sizeof hdr, len, &crc))
+		goto fail;
+	hdr.crc = qt_crc(crc, &hdr);
+	if (!qt_pwrite(head->fd, &hdr, sizeof hdr, off))
+		goto fail;
+
+	head->size = off + QT_RECSIZE(len);
+	dirty = 1;
+	if (segp) {
+		*segp = head->id;
+		head->refs++;
+	}
+	if (offp)
+		*offp = off + sizeof hdr;
+
+	return (1);
+
+fail:
+	if (ftruncate(head->fd, off) == -1)
+		log_warn("warn: queue-tiered: ftruncate");
+	return (0);
+}
+
+static struct qt_segment *
+qt_segment_open(uint32_t id, int create)
+{
+	struct qt_segment	*seg;
+	struct stat		 sb;
+	char			 name[16];
+	int			 fd, flags;
+
+	(void)snprintf(name, sizeof name, "%08"PRIx32, id);
+
+	flags = O_RDWR;
+	if (create)
+		flags |= O_CREAT | O_EXCL;
+	if ((fd = openat(journalfd, name, flags, 0600)) == -1) {
+		log_warn("warn: queue-tiered: open: %s", name);
+		return (NULL);
+	}
+	if (fstat(fd, &sb) == -1) {
+		log_warn("warn: queue-tiered: fstat: %s", name);
+		close(fd);
+		return (NULL);
+	}
+
+	seg = xcalloc(1, sizeof *seg);
+	seg->id = id;
+	seg->fd = fd;
+	seg->size = sb.st_size;
+	tree_xset(&segments, id, seg);
+	if (id >= nextseg)
+		nextseg = id + 1;
+
+	return (seg);
+}
+
+static int
+qt_rotate(void)
+{
+	struct qt_segment	*seg;
+
+	if (head) {
+		if (fsync(head->fd) == -1) {
+			log_warn("warn: queue-tiered: fsync");
+			return (0);
+		}
+		dirty = 0;
+	}
+
+	if ((seg = qt_segment_open(nextseg, 1)) == NULL)
+		return (0);
+	if (fsync(journalfd) == -1)
+		log_warn("warn: queue-tiered: fsync");
+	head = seg;
+	qt_trim();
+
+	log_debug("debug: queue-tiered: new segment %08"PRIx32, seg->id);
+
+	return (1);
+}
+
+static int
+qt_sync(void)
+{
+	if (!dirty)
+		return (1);
+
+	if (fsync(head->fd) == -1) {
+		log_warn("warn: queue-tiered: fsync");
+		return (0);
+	}
+	dirty = 0;
+
+	return (1);
+}
+
+static void
+qt_schedule(void)
+{
+	struct timeval	tv;
+
+	/* events are not available when the backend is created */
+	if (!evinit) {
+		evtimer_set(&ev_sync, qt_sync_timeout, NULL);
+		evtimer_set(&ev_spill, qt_spill_timeout, NULL);
+		evinit = 1;
+	}
+
+	if (dirty && !evtimer_pending(&ev_sync, NULL)) {
+		tv.tv_sec = QT_SYNC_DELAY;
+		tv.tv_usec = 0;
+		evtimer_add(&ev_sync, &tv);
+	}
+	if (loaded && !evtimer_pending(&ev_spill, NULL)) {
+		tv.tv_sec = QT_SPILL_DELAY;
+		tv.tv_usec = 0;
+		evtimer_add(&ev_spill, &tv);
+	}
+}
+
+static void
+qt_sync_timeout(int fd, short event, void *p)
+{
+	(void)qt_sync();
+}
+
+static void
+qt_spill_timeout(int fd, short event, void *p)
+{
+	struct timeval	tv;
+
+	qt_spill();
+
+	stat_set("queue.tiered.memory", stat_counter(memory));
+	stat_set("queue.tiered.message", stat_counter(tree_count(&messages)));
+	stat_set("queue.tiered.segment", stat_counter(tree_count(&segments)));
+
+	if (!TAILQ_EMPTY(&resident) || nspills) {
+		tv.tv_sec = QT_SPILL_DELAY;
+		tv.tv_usec = 0;
+		evtimer_add(&ev_spill, &tv);
+	}
+}
+
+static int
+qt_replay(void)
+{
+	struct qt_segment	*seg;
+	struct dirent		*dp;
+	DIR			*dir;
+	uint32_t		 id;
+	char			*ep;
+	void			*iter;
+	unsigned long		 ul;
+
+	if ((dir = opendir(PATH_SPOOL PATH_TIERED)) == NULL) {
+		log_warn("warn: queue-tiered: opendir");
+		return (0);
+	}
+	while ((dp = readdir(dir)) != NULL) {
+		if (strlen(dp->d_name) != 8)
+			continue;
+		errno = 0;
+		ul = strtoul(dp->d_name, &ep, 16);
+		if (*ep != '\0' || errno || ul == 0 || ul > UINT32_MAX) {
+			log_debug("debug: queue-tiered: bogus file %s",
+			    dp->d_name);
+			continue;
+		}
+		if (qt_segment_open(ul, 0) == NULL) {
+			closedir(dir);
+			return (0);
+		}
+	}
+	closedir(dir);
+
+	/*
+	 * Sealed segments were synced when they were rotated, so only the
+	 * last one may end with a torn write and needs its bodies checked.
+	 */
+	iter = NULL;
+	while (tree_iter(&segments, &iter, NULL, (void **)&seg)) {
+		id = seg->id;
+		if (!qt_replay_segment(seg, id + 1 == nextseg))
+			return (0);
+	}
+
+	qt_resolve();
+
+	log_debug("debug: queue-tiered: %zu segments, %zu messages, "
+	    "%zu bytes in memory", tree_count(&segments),
+	    tree_count(&messages), memory);
+
+	return (1);
+}
+
+static int
+qt_replay_segment(struct qt_segment *seg, int last)
+{
+	struct qt_header	hdr;
+	uint32_t		crc;
+	char			*buf;
+	off_t			off;
+
+	off = 0;
+	while (off + QT_RECSIZE(0) <= seg->size) {
+		if (!qt_pread(seg->fd, &hdr, sizeof hdr, off))
+			return (0);
+		if (hdr.magic != QT_MAGIC ||
+		    hdr.type < QT_MESSAGE || hdr.type > QT_ENVELOPE_DEL ||
+		    (hdr.type == QT_ENVELOPE &&
+		    hdr.len >= sizeof(struct envelope)) ||
+		    off + QT_RECSIZE(hdr.len) > seg->size)
+			break;
+
+		buf = NULL;
+		crc = crc32(0, NULL, 0);
+		if (hdr.type == QT_ENVELOPE) {
+			buf = xmalloc(hdr.len + 1);
+			if (!qt_pread(seg->fd, buf, hdr.len,
+			    off + sizeof hdr)) {
+				free(buf);
+				return (0);
+			}
+			crc = crc32(crc, (const Bytef *)buf, hdr.len);
+		}
+		else if (hdr.type == QT_MESSAGE && last &&
+		    !qt_copy(seg->fd, off + sizeof hdr, -1, 0, hdr.len, &crc))
+			return (0);
+		if ((hdr.type != QT_MESSAGE || last) &&
+		    qt_crc(crc, &hdr) != hdr.crc) {
+			free(buf);
+			break;
+		}
+
+		qt_replay_record(seg, &hdr, off, buf);
+		off += QT_RECSIZE(hdr.len);
+	}
+
+	if (off != seg->size) {
+		log_warnx("warn: queue-tiered: segment %08"PRIx32
+		    ": truncating at offset %lld", seg->id, (long long)off);
+		if (ftruncate(seg->fd, off) == -1) {
+			log_warn("warn: queue-tiered: ftruncate");
+			return (0);
+		}
+		seg->size = off;
+	}
+
+	return (1);
+}
+
+/* records are replayed in order, the last one for an object wins */
+static void
+qt_replay_record(struct qt_segment *seg, struct qt_header *hdr, off_t off,
+    char *buf)
+{
+	struct qt_message	*msg;
+	struct qt_envelope	*evp;
+
+	switch (hdr->type) {
+	case QT_MESSAGE:
+		msg = qt_message_get(hdr->id, 1);
+		if (msg->flags & QT_COMMITTED)
+			qt_release(msg->seg);
+		msg->flags |= QT_COMMITTED;
+		msg->seg = seg->id;
+		msg->off = off + sizeof *hdr;
+		msg->len = hdr->len;
+		seg->refs++;
+		break;
+
+	case QT_MESSAGE_DEL:
+		if ((msg = tree_pop(&messages, hdr->id)) != NULL)
+			qt_message_free(msg);
+		break;
+
+	case QT_ENVELOPE:
+		msg = qt_message_get(evpid_to_msgid(hdr->id), 1);
+		if ((evp = tree_pop(&msg->envelopes, hdr->id)) != NULL)
+			qt_envelope_free(evp);
+		evp = xcalloc(1, sizeof *evp);
+		evp->seg = seg->id;
+		evp->buf = buf;
+		evp->len = hdr->len;
+		tree_xset(&msg->envelopes, hdr->id, evp);
+		memory += evp->len;
+		seg->refs++;
+		break;
+
+	case QT_ENVELOPE_DEL:
+		msg = qt_message_get(evpid_to_msgid(hdr->id), 0);
+		if (msg && (evp = tree_pop(&msg->envelopes, hdr->id)) != NULL)
+			qt_envelope_free(evp);
+		break;
+	}
+}
+
+/*
+ * Drop messages that were never committed or have no envelope left,
+ * then read bodies back in memory while they fit.
+ */
+static void
+qt_resolve(void)
+{
+	struct qt_message	*msg;
+	struct qt_segment	*seg;
+	uint64_t		 id;
+	uint32_t		 msgid;
+	void			*iter;
+	time_t			 now;
+
+	now = time(NULL);
+	msgid = 0;
+	for (;;) {
+		iter = NULL;
+		if (!tree_iterfrom(&messages, &iter, msgid, &id,
+		    (void **)&msg))
+			break;
+
+		if (!(msg->flags & QT_COMMITTED) ||
+		    tree_empty(&msg->envelopes)) {
+			tree_xpop(&messages, id);
+			qt_message_free(msg);
+		}
+		else {
+			msg->flags |= QT_REPLAYED;
+			msg->time = now;
+			TAILQ_INSERT_TAIL(&resident, msg, entry);
+			seg = tree_xget(&segments, msg->seg);
+			if (qt_keep(msg->len) &&
+			    (msg->buf = malloc(msg->len + 1)) != NULL) {
+				if (qt_pread(seg->fd, msg->buf, msg->len,
+				    msg->off))
+					memory += msg->len;
+				else {
+					free(msg->buf);
+					msg->buf = NULL;
+				}
+			}
+		}
+
+		if (id == UINT32_MAX)
+			break;
+		msgid = id + 1;
+	}
+}
+
+static int
+queue_tiered_init(struct passwd *pw, int server, const char *conf)
+{
+	/* spilled messages go to the fs queue */
+	if (!queue_backend_fs.init(pw, server, conf))
+		return (0);
+	queue_api_layer(&lower);
+
+	tree_init_ordered(&messages);
+	tree_init_ordered(&segments);
+	tree_init(&cursors);
+	TAILQ_INIT(&resident);
+
+	if (ckdir(PATH_SPOOL PATH_TIERED, 0700, pw->pw_uid, 0, server) == 0)
+		return (0);
+
+	/* kept open so segments can be created after the chroot */
+	if ((journalfd = open(PATH_SPOOL PATH_TIERED,
+	    O_RDONLY | O_DIRECTORY)) == -1) {
+		log_warn("warn: queue-tiered: open: %s",
+		    PATH_SPOOL PATH_TIERED);
+		return (0);
+	}
+
+	if (!qt_replay())
+		return (0);
+
+	if (server) {
+		if (!qt_rotate())
+			return (0);
+		if (fchown(head->fd, pw->pw_uid, -1) == -1)
+			log_warn("warn: queue-tiered: fchown");
+	}
+
+	queue_api_on_close(queue_tiered_close);
+	queue_api_on_message_create(queue_tiered_message_create);
+	queue_api_on_message_commit(queue_tiered_message_commit);
+	queue_api_on_message_delete(queue_tiered_message_delete);
+	queue_api_on_message_fd_r(queue_tiered_message_fd_r);
+	queue_api_on_message_sync(queue_tiered_sync);
+	queue_api_on_envelope_create(queue_tiered_envelope_create);
+	queue_api_on_envelope_delete(queue_tiered_envelope_delete);
+	queue_api_on_envelope_update(queue_tiered_envelope_update);
+	queue_api_on_envelope_load(queue_tiered_envelope_load);
+	queue_api_on_envelope_walk(queue_tiered_envelope_walk);
+	queue_api_on_message_walk(queue_tiered_message_walk);
+
+	return (1);
+}
+
+struct queue_backend	queue_backend_tiered = {
+	queue_tiered_init,
+};
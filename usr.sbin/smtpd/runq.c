@@ -31,32 +31,119 @@
 
 #include "smtpd.h"
 
-struct job {
-	TAILQ_ENTRY(job)	 entry;
+/*
+ * Jobs are kept on a binary heap ordered by time, then by order of
+ * scheduling.  Callers that keep the handle of their job can cancel or
+ * look it up directly, the others are found by a scan of the heap.
+ */
+struct runq_job {
 	time_t			 when;
+	uint64_t		 seq;
+	size_t			 idx;
 	void			*arg;
+	struct runq_job	       **handle;
 };
 
 struct runq {
-	TAILQ_HEAD(, job)	 jobs;
+	struct runq_job	       **heap;
+	size_t			 count;
+	size_t			 size;
+	uint64_t		 seq;
 	void			(*cb)(struct runq *, void *);
 	struct event		 ev;
 };
 
 static void runq_timeout(int, short, void *);
+static int runq_job_cmp(struct runq_job *, struct runq_job *);
+static void runq_heap_set(struct runq *, size_t, struct runq_job *);
+static void runq_heap_up(struct runq *, size_t);
+static void runq_heap_down(struct runq *, size_t);
+static void runq_heap_remove(struct runq *, struct runq_job *);
+static int runq_insert(struct runq *, time_t, void *, struct runq_job **);
+static void runq_remove(struct runq *, struct runq_job *);
+static struct runq_job *runq_find(struct runq *, void *);
 
 static struct runq *active;
 
+static int
+runq_job_cmp(struct runq_job *a, struct runq_job *b)
+{
+	if (a->when != b->when)
+		return (a->when < b->when) ? -1 : 1;
+	if (a->seq != b->seq)
+		return (a->seq < b->seq) ? -1 : 1;
+	return (0);
+}
+
+static void
+runq_heap_set(struct runq *runq, size_t i, struct runq_job *job)
+{
+	runq->heap[i] = job;
+	job->idx = i;
+}
+
+static void
+runq_heap_up(struct runq *runq, size_t i)
+{
+	struct runq_job	*job = runq->heap[i];
+	size_t		 parent;
+
+	while (i) {
+		parent = (i - 1) / 2;
+		if (runq_job_cmp(runq->heap[parent], job) <= 0)
+			break;
+		runq_heap_set(runq, i, runq->heap[parent]);
+		i = parent;
+	}
+	runq_heap_set(runq, i, job);
+}
+
+static void
+runq_heap_down(struct runq *runq, size_t i)
+{
+	struct runq_job	*job = runq->heap[i];
+	size_t		 child;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= runq->count)
+			break;
+		if (child + 1 < runq->count &&
+		    runq_job_cmp(runq->heap[child + 1], runq->heap[child]) < 0)
+			child++;
+		if (runq_job_cmp(job, runq->heap[child]) <= 0)
+			break;
+		runq_heap_set(runq, i, runq->heap[child]);
+		i = child;
+	}
+	runq_heap_set(runq, i, job);
+}
+
+static void
+runq_heap_remove(struct runq *runq, struct runq_job *job)
+{
+	size_t	i = job->idx;
+
+	if (--runq->count == i)
+		return;
+
+	runq_heap_set(runq, i, runq->heap[runq->count]);
+	if (i && runq_job_cmp(runq->heap[i], runq->heap[(i - 1) / 2]) < 0)
+		runq_heap_up(runq, i);
+	else
+		runq_heap_down(runq, i);
+}
+
 static void
 runq_reset(struct runq *runq)
 {
 	struct timeval	 tv;
-	struct job	*job;
+	struct runq_job	*job;
 	time_t		 now;
 
-	job = TAILQ_FIRST(&runq->jobs);
-	if (job == NULL)
+	if (runq->count == 0)
 		return;
+	job = runq->heap[0];
 
 	now = time(NULL);
 	if (job->when <= now)
@@ -71,16 +158,19 @@ static void
 runq_timeout(int fd, short ev, void *arg)
 {
 	struct runq	*runq = arg;
-	struct job	*job;
+	struct runq_job	*job;
 	time_t		 now;
 
 	active = runq;
 	now = time(NULL);
 
-	while((job = TAILQ_FIRST(&runq->jobs))) {
+	while (runq->count) {
+		job = runq->heap[0];
 		if (job->when > now)
 			break;
-		TAILQ_REMOVE(&runq->jobs, job, entry);
+		runq_heap_remove(runq, job);
+		if (job->handle)
+			*job->handle = NULL;
 		runq->cb(runq, job->arg);
 		free(job);
 	}
@@ -94,12 +184,11 @@ runq_init(struct runq **runqp, void (*cb)(struct runq *, void *))
 {
 	struct runq	*runq;
 
-	runq = malloc(sizeof(*runq));
+	runq = calloc(1, sizeof(*runq));
 	if (runq == NULL)
 		return (0);
 
 	runq->cb = cb;
-	TAILQ_INIT(&runq->jobs);
 	evtimer_set(&runq->ev, runq_timeout, runq);
 
 	*runqp = runq;
@@ -107,19 +196,35 @@ runq_init(struct runq **runqp, void (*cb)(struct runq *, void *))
 	return (1);
 }
 
-int
-runq_schedule(struct runq *runq, time_t delay, void *arg)
+/*
+ * A job already scheduled under the handle is moved to its new time.
+ */
+static int
+runq_insert(struct runq *runq, time_t when, void *arg,
+    struct runq_job **handle)
 {
-	time_t t;
-
-	time(&t);
-	return runq_schedule_at(runq, t + delay, arg);
-}
+	struct runq_job	**heap, *job, *first;
+	size_t		  size;
+
+	first = runq->count ? runq->heap[0] : NULL;
+
+	if (handle && (job = *handle)) {
+		job->when = when;
+		job->seq = runq->seq++;
+		job->arg = arg;
+		runq_heap_up(runq, job->idx);
+		runq_heap_down(runq, job->idx);
+		goto done;
+	}
 
-int
-runq_schedule_at(struct runq *runq, time_t when, void *arg)
-{
-	struct job	*job, *tmpjob;
+	if (runq->count == runq->size) {
+		size = runq->size ? runq->size * 2 : 16;
+		heap = reallocarray(runq->heap, size, sizeof(*heap));
+		if (heap == NULL)
+			return (0);
+		runq->heap = heap;
+		runq->size = size;
+	}
 
 	job = malloc(sizeof(*job));
 	if (job == NULL)
@@ -127,56 +232,134 @@ runq_schedule_at(struct runq *runq, time_t when, void *arg)
 
 	job->arg = arg;
 	job->when = when;
+	job->seq = runq->seq++;
+	job->handle = handle;
+	if (handle)
+		*handle = job;
 
-	TAILQ_FOREACH(tmpjob, &runq->jobs, entry) {
-		if (tmpjob->when > job->when) {
-			TAILQ_INSERT_BEFORE(tmpjob, job, entry);
-			goto done;
-		}
-	}
-	TAILQ_INSERT_TAIL(&runq->jobs, job, entry);
+	runq_heap_set(runq, runq->count++, job);
+	runq_heap_up(runq, job->idx);
 
     done:
-	if (runq != active && job == TAILQ_FIRST(&runq->jobs)) {
+	if (runq != active && (runq->heap[0] != first || job == first)) {
 		evtimer_del(&runq->ev);
 		runq_reset(runq);
 	}
 	return (1);
 }
 
+static void
+runq_remove(struct runq *runq, struct runq_job *job)
+{
+	int	first;
+
+	first = (job->idx == 0);
+	runq_heap_remove(runq, job);
+	if (job->handle)
+		*job->handle = NULL;
+	free(job);
+
+	if (runq != active && first) {
+		evtimer_del(&runq->ev);
+		runq_reset(runq);
+	}
+}
+
+/* The first job to run for the argument, if any. */
+static struct runq_job *
+runq_find(struct runq *runq, void *arg)
+{
+	struct runq_job	*job = NULL;
+	size_t		 i;
+
+	for (i = 0; i < runq->count; i++) {
+		if (runq->heap[i]->arg != arg)
+			continue;
+		if (job == NULL || runq_job_cmp(runq->heap[i], job) < 0)
+			job = runq->heap[i];
+	}
+
+	return (job);
+}
+
+int
+runq_schedule(struct runq *runq, time_t delay, void *arg)
+{
+	time_t t;
+
+	time(&t);
+	return runq_schedule_at(runq, t + delay, arg);
+}
+
+int
+runq_schedule_at(struct runq *runq, time_t when, void *arg)
+{
+	return runq_insert(runq, when, arg, NULL);
+}
+
 int
 runq_cancel(struct runq *runq, void *arg)
 {
-	struct job	*job, *first;
-
-	first = TAILQ_FIRST(&runq->jobs);
-	TAILQ_FOREACH(job, &runq->jobs, entry) {
-		if (job->arg == arg) {
-			TAILQ_REMOVE(&runq->jobs, job, entry);
-			free(job);
-			if (runq != active && job == first) {
-				evtimer_del(&runq->ev);
-				runq_reset(runq);
-			}
-			return (1);
-		}
-	}
+	struct runq_job	*job;
 
-	return (0);
+	if ((job = runq_find(runq, arg)) == NULL)
+		return (0);
+
+	runq_remove(runq, job);
+	return (1);
 }
 
 int
 runq_pending(struct runq *runq, void *arg, time_t *when)
 {
-	struct job	*job;
+	struct runq_job	*job;
 
-	TAILQ_FOREACH(job, &runq->jobs, entry) {
-		if (job->arg == arg) {
-			if (when)
-				*when = job->when;
-			return (1);
-		}
-	}
+	if ((job = runq_find(runq, arg)) == NULL)
+		return (0);
 
-	return (0);
+	if (when)
+		*when = job->when;
+	return (1);
+}
+
+/*
+ * The handle is set while the job is scheduled, and cleared when it is
+ * cancelled or right before it runs.
+ */
+int
+runq_job_schedule(struct runq *runq, time_t delay, void *arg,
+    struct runq_job **handle)
+{
+	time_t t;
+
+	time(&t);
+	return runq_insert(runq, t + delay, arg, handle);
+}
+
+int
+runq_job_schedule_at(struct runq *runq, time_t when, void *arg,
+    struct runq_job **handle)
+{
+	return runq_insert(runq, when, arg, handle);
+}
+
+int
+runq_job_cancel(struct runq *runq, struct runq_job **handle)
+{
+	if (*handle == NULL)
+		return (0);
+
+	runq_remove(runq, *handle);
+	return (1);
+}
+
+int
+runq_job_pending(struct runq_job *job, time_t *when)
+{
+	if (job == NULL)
+		return (0);
+
+	if (when)
+		*when = job->when;
+	return (1);
 }
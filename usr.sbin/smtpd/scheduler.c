@@ -41,10 +41,16 @@
 #include "smtpd.h"
 #include "log.h"
 
+/* envelopes of a message requested at once from the queue */
+#define	SCHEDULER_DELIVER_MAX	\
+	((MAX_IMSGSIZE - IMSG_HEADER_SIZE - sizeof(size_t)) / sizeof(uint64_t))
+
 static void scheduler_imsg(struct mproc *, struct imsg *);
 static void scheduler_shutdown(void);
 static void scheduler_reset_events(void);
 static void scheduler_timeout(int, short, void *);
+static void scheduler_notify_suspend(uint64_t, int);
+static void scheduler_deliver(int, int, size_t);
 
 static struct scheduler_backend *backend = NULL;
 static struct event		 ev;
@@ -60,13 +66,13 @@ void
 scheduler_imsg(struct mproc *p, struct imsg *imsg)
 {
 	struct bounce_req_msg	 req;
-	struct envelope		 evp;
 	struct scheduler_info	 si;
 	struct msg		 m;
+	const void		*data;
 	uint64_t		 evpid, id, holdq;
 	uint32_t		 msgid;
 	uint32_t       		 inflight;
-	size_t			 n, i;
+	size_t			 n, i, sz;
 	time_t			 timestamp;
 	int			 v, r, type;
 
@@ -77,15 +83,48 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 
 	case IMSG_QUEUE_ENVELOPE_SUBMIT:
 		m_msg(&m, imsg);
-		m_get_envelope(&m, &evp);
+		m_get_scheduler_info(&m, &si);
 		m_end(&m);
 		log_trace(TRACE_SCHEDULER,
-		    "scheduler: inserting evp:%016" PRIx64, evp.id);
-		scheduler_info(&si, &evp);
+		    "scheduler: inserting evp:%016" PRIx64, si.evpid);
 		stat_increment("scheduler.envelope.incoming", 1);
 		backend->insert(&si);
 		return;
 
+	case IMSG_QUEUE_ENVELOPE_LOAD:
+		m_msg(&m, imsg);
+		m_get_data(&m, &data, &sz);
+		if (sz % sizeof(si))
+			fatalx("scheduler: bad envelope batch size");
+		for (i = 0; i < sz / sizeof(si); i++) {
+			memmove(&si, (const char *)data + i * sizeof(si),
+			    sizeof(si));
+			backend->insert(&si);
+		}
+		stat_increment("scheduler.envelope.incoming", i);
+		m_get_size(&m, &n);
+		while (n--) {
+			m_get_msgid(&m, &msgid);
+			i = backend->commit(msgid);
+			stat_decrement("scheduler.envelope.incoming", i);
+			stat_increment("scheduler.envelope", i);
+		}
+		m_get_size(&m, &n);
+		while (n--) {
+			m_get_evpid(&m, &evpid);
+			backend->suspend(evpid);
+		}
+		m_get_size(&m, &n);
+		while (n--) {
+			m_get_evpid(&m, &evpid);
+			if (backend->remove(evpid))
+				stat_decrement("scheduler.envelope", 1);
+		}
+		m_end(&m);
+		m_compose(p, IMSG_SCHED_ENVELOPE_LOADED, 0, 0, -1, NULL, 0);
+		scheduler_reset_events();
+		return;
+
 	case IMSG_QUEUE_MESSAGE_COMMIT:
 		m_msg(&m, imsg);
 		m_get_msgid(&m, &msgid);
@@ -100,17 +139,16 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 
 	case IMSG_QUEUE_DISCOVER_EVPID:
 		m_msg(&m, imsg);
-		m_get_envelope(&m, &evp);
+		m_get_scheduler_info(&m, &si);
 		m_end(&m);
-		r = backend->query(evp.id);
+		r = backend->query(si.evpid);
 		if (r) {
 			log_debug("debug: scheduler: evp:%016" PRIx64
-			    " already scheduled", evp.id);
+			    " already scheduled", si.evpid);
 			return;
 		}
 		log_trace(TRACE_SCHEDULER,
-		    "scheduler: discovering evp:%016" PRIx64, evp.id);
-		scheduler_info(&si, &evp);
+		    "scheduler: discovering evp:%016" PRIx64, si.evpid);
 		stat_increment("scheduler.envelope.incoming", 1);
 		backend->insert(&si);
 		return;
@@ -192,11 +230,10 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 
 	case IMSG_QUEUE_DELIVERY_TEMPFAIL:
 		m_msg(&m, imsg);
-		m_get_envelope(&m, &evp);
+		m_get_scheduler_info(&m, &si);
 		m_end(&m);
 		log_trace(TRACE_SCHEDULER,
-		    "scheduler: updating evp:%016" PRIx64, evp.id);
-		scheduler_info(&si, &evp);
+		    "scheduler: updating evp:%016" PRIx64, si.evpid);
 		backend->update(&si);
 		ninflight -= 1;
 		stat_increment("scheduler.delivery.tempfail", 1);
@@ -208,7 +245,7 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 			timestamp = si.creation + env->sc_bounce_warn[i];
 			if (si.nexttry >= timestamp &&
 			    si.lastbounce < timestamp) {
-	    			req.evpid = evp.id;
+	    			req.evpid = si.evpid;
 				req.timestamp = timestamp;
 				req.bounce.type = B_DELAYED;
 				req.bounce.delay = env->sc_bounce_warn[i];
@@ -377,6 +414,8 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 			log_debug("debug: scheduler: "
 			    "suspending evp:%016" PRIx64, id);
 		r = backend->suspend(id);
+		if (r)
+			scheduler_notify_suspend(id, 1);
 		scheduler_reset_events();
 		m_compose(p, r ? IMSG_CTL_OK : IMSG_CTL_FAIL, imsg->hdr.peerid,
 		    0, -1, NULL, 0);
@@ -391,6 +430,8 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 			log_debug("debug: scheduler: "
 			    "resuming evp:%016" PRIx64, id);
 		r = backend->resume(id);
+		if (r)
+			scheduler_notify_suspend(id, 0);
 		scheduler_reset_events();
 		m_compose(p, r ? IMSG_CTL_OK : IMSG_CTL_FAIL, imsg->hdr.peerid,
 		    0, -1, NULL, 0);
@@ -408,6 +449,51 @@ scheduler_shutdown(void)
 	_exit(0);
 }
 
+/*
+ * Let the queue record suspended envelopes so that they remain
+ * suspended across a restart.
+ */
+static void
+scheduler_notify_suspend(uint64_t id, int suspend)
+{
+	uint64_t	from;
+	size_t		i, n, max, count;
+
+	max = env->sc_scheduler_max_evp_batch_size;
+	if (id > 0xffffffffL) {
+		m_create(p_queue, IMSG_SCHED_ENVELOPE_SUSPEND, 0, 0, -1);
+		m_add_int(p_queue, suspend);
+		m_add_size(p_queue, 1);
+		m_add_evpid(p_queue, id);
+		m_close(p_queue);
+		return;
+	}
+
+	from = id << 32;
+	do {
+		n = backend->envelopes(from, state, max);
+		for (i = 0; i < n; i++)
+			if (evpid_to_msgid(state[i].evpid) != id)
+				break;
+		n = i;
+		if (n == 0)
+			break;
+
+		m_create(p_queue, IMSG_SCHED_ENVELOPE_SUSPEND, 0, 0, -1);
+		m_add_int(p_queue, suspend);
+		for (i = 0, count = 0; i < n; i++)
+			if (!(state[i].flags & EF_SUSPEND) == !suspend)
+				count++;
+		m_add_size(p_queue, count);
+		for (i = 0; i < n; i++)
+			if (!(state[i].flags & EF_SUSPEND) == !suspend)
+				m_add_evpid(p_queue, state[i].evpid);
+		m_close(p_queue);
+
+		from = state[n - 1].evpid + 1;
+	} while (n == max);
+}
+
 static void
 scheduler_reset_events(void)
 {
@@ -488,7 +574,7 @@ scheduler_timeout(int fd, short event, void *p)
 	size_t			d_removed;
 	size_t			d_expired;
 	size_t			d_updated;
-	size_t			count;
+	size_t			count, n;
 	int			mask, r, delay;
 
 	tv.tv_sec = 0;
@@ -539,6 +625,22 @@ scheduler_timeout(int fd, short event, void *p)
 	d_expired = 0;
 	d_updated = 0;
 
+	/*
+	 * Tell the queue which envelopes are about to be requested so that
+	 * it can read them in parallel rather than one at a time.
+	 */
+	for (n = 0, i = 0; i < count; i++)
+		if (types[i] == SCHED_MDA || types[i] == SCHED_MTA)
+			n++;
+	if (n > 1) {
+		m_create(p_queue, IMSG_SCHED_ENVELOPE_PREFETCH, 0, 0, -1);
+		m_add_size(p_queue, n);
+		for (i = 0; i < count; i++)
+			if (types[i] == SCHED_MDA || types[i] == SCHED_MTA)
+				m_add_evpid(p_queue, evpids[i]);
+		m_close(p_queue);
+	}
+
 	for (i = 0; i < count; i++) {
 		switch(types[i]) {
 		case SCHED_REMOVE:
@@ -581,23 +683,20 @@ scheduler_timeout(int fd, short event, void *p)
 		case SCHED_MDA:
 			log_debug("debug: scheduler: evp:%016" PRIx64
 			    " scheduled (mda)", evpids[i]);
-			m_create(p_queue, IMSG_SCHED_ENVELOPE_DELIVER, 0, 0, -1);
-			m_add_evpid(p_queue, evpids[i]);
-			m_close(p_queue);
 			d_inflight += 1;
 			break;
 
 		case SCHED_MTA:
 			log_debug("debug: scheduler: evp:%016" PRIx64
 			    " scheduled (mta)", evpids[i]);
-			m_create(p_queue, IMSG_SCHED_ENVELOPE_TRANSFER, 0, 0, -1);
-			m_add_evpid(p_queue, evpids[i]);
-			m_close(p_queue);
 			d_inflight += 1;
 			break;
 		}
 	}
 
+	scheduler_deliver(SCHED_MDA, IMSG_SCHED_ENVELOPE_DELIVER, count);
+	scheduler_deliver(SCHED_MTA, IMSG_SCHED_ENVELOPE_TRANSFER, count);
+
 	stat_decrement("scheduler.envelope", d_envelope);
 	stat_increment("scheduler.envelope.inflight", d_inflight);
 	stat_increment("scheduler.envelope.expired", d_expired);
@@ -610,3 +709,40 @@ scheduler_timeout(int fd, short event, void *p)
 	tv.tv_usec = 0;
 	evtimer_add(&ev, &tv);
 }
+
+/*
+ * Request the envelopes of a given type in the batch from the queue,
+ * grouped by message so that they are loaded and handed over to the
+ * dispatcher together.
+ */
+static void
+scheduler_deliver(int type, int imsg, size_t count)
+{
+	uint32_t	msgid;
+	size_t		i, j, n;
+
+	for (i = 0; i < count; i++) {
+		if (types[i] != type)
+			continue;
+
+		msgid = evpid_to_msgid(evpids[i]);
+		for (n = 0, j = i; j < count; j++)
+			if (types[j] == type &&
+			    evpid_to_msgid(evpids[j]) == msgid)
+				n++;
+		if (n > SCHEDULER_DELIVER_MAX)
+			n = SCHEDULER_DELIVER_MAX;
+
+		m_create(p_queue, imsg, 0, 0, -1);
+		m_add_size(p_queue, n);
+		for (j = i; n; j++) {
+			if (types[j] != type ||
+			    evpid_to_msgid(evpids[j]) != msgid)
+				continue;
+			m_add_evpid(p_queue, evpids[j]);
+			types[j] = 0;
+			n--;
+		}
+		m_close(p_queue);
+	}
+}
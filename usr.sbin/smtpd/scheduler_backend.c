@@ -52,6 +52,7 @@ void
 scheduler_info(struct scheduler_info *sched, struct envelope *evp)
 {
 	struct dispatcher *disp;
+	char		  *p;
 
 	disp = evp->type == D_BOUNCE ?
 	    env->sc_dispatcher_bounce :
@@ -76,4 +77,22 @@ scheduler_info(struct scheduler_info *sched, struct envelope *evp)
 	sched->lasttry = evp->lasttry;
 	sched->lastbounce = evp->lastbounce;
 	sched->nexttry	= 0;
+
+	/* longer keys share the class of their truncated name */
+	memset(sched->class, 0, sizeof sched->class);
+	switch (env->sc_scheduler_class_key) {
+	case SCHEDULER_CLASS_DISPATCHER:
+		(void)strlcpy(sched->class, evp->dispatcher,
+		    sizeof sched->class);
+		break;
+	case SCHEDULER_CLASS_SENDER_DOMAIN:
+		(void)strlcpy(sched->class, evp->sender.domain,
+		    sizeof sched->class);
+		for (p = sched->class; *p; p++)
+			*p = tolower((unsigned char)*p);
+		break;
+	case SCHEDULER_CLASS_TAG:
+		(void)strlcpy(sched->class, evp->tag, sizeof sched->class);
+		break;
+	}
 }
@@ -36,26 +36,51 @@
 #include "smtpd.h"
 #include "log.h"
 
-TAILQ_HEAD(evplist, rq_envelope);
+/*
+ * Envelopes are fixed-size records allocated from slabs and known by
+ * their index, 0 standing for none.  The lists they are on are linked
+ * by index, and their times are kept in seconds relative to the start
+ * of the scheduler.  A message keeps the indices of its envelopes in an
+ * array, sorted by envelope id once the message is committed.
+ */
+#define RQ_NONE			0
+
+struct rq_list {
+	uint32_t		 first;
+	uint32_t		 last;
+};
 
 struct rq_message {
 	uint32_t		 msgid;
-	struct tree		 envelopes;
+	uint32_t		 count;
+	uint32_t		 size;
+	uint32_t		*evps;
 };
 
 struct rq_envelope {
-	TAILQ_ENTRY(rq_envelope) entry;
-	SPLAY_ENTRY(rq_envelope) t_entry;
-
 	uint64_t		 evpid;
-	uint64_t		 holdq;
-	enum delivery_type	 type;
+	union {
+		uint64_t	 holdq;	/* when held */
+		uint32_t	 slot;	/* on the wheel, when pending */
+	}			 u;
+
+	uint32_t		 idx;
+	uint32_t		 next;
+	uint32_t		 prev;
+
+	int32_t			 ctime;
+	int32_t			 sched;
+	int32_t			 expire;
+	int32_t			 t_state;	/* entered scheduled or inflight */
+
+	uint16_t		 class;
+	uint8_t			 type:4;
 
 #define	RQ_EVPSTATE_PENDING	 0
 #define	RQ_EVPSTATE_SCHEDULED	 1
 #define	RQ_EVPSTATE_INFLIGHT	 2
 #define	RQ_EVPSTATE_HELD	 3
-	uint8_t			 state;
+	uint8_t			 state:4;
 
 #define	RQ_ENVELOPE_EXPIRED	 0x01
 #define	RQ_ENVELOPE_REMOVED	 0x02
@@ -63,41 +88,101 @@ struct rq_envelope {
 #define	RQ_ENVELOPE_UPDATE	 0x08
 #define	RQ_ENVELOPE_OVERFLOW	 0x10
 	uint8_t			 flags;
+};
 
-	time_t			 ctime;
-	time_t			 sched;
-	time_t			 expire;
-
-	struct rq_message	*message;
+#define RQ_SLAB_BITS		12
+#define RQ_SLAB_SIZE		(1 << RQ_SLAB_BITS)
+#define RQ_SLAB_MASK		(RQ_SLAB_SIZE - 1)
 
-	time_t			 t_inflight;
-	time_t			 t_scheduled;
+struct rq_holdq {
+	struct rq_list		 q;
+	size_t			 count;
 };
 
-struct rq_holdq {
-	struct evplist		 q;
+/*
+ * Scheduled MDA and MTA envelopes are queued per class, as given by the
+ * "scheduler fair-queue" key, and each class has one flow per delivery
+ * type.  Backlogged flows take turns on an active list, a flow serving
+ * up to its weight in envelopes per turn (deficit round robin).  Flows
+ * of interactive classes are on a lane of their own, served first.
+ * Configured classes live as long as the scheduler, the others as long
+ * as they have envelopes, and class 0 is the default.
+ */
+#define RQ_CLASS_DEFAULT	0
+#define RQ_CLASS_MAX		UINT16_MAX
+
+#define RQ_LANE_INTERACTIVE	0
+#define RQ_LANE_BULK		1
+#define RQ_LANES		2
+
+struct rq_class;
+
+struct rq_flow {
+	TAILQ_ENTRY(rq_flow)	 entry;
+	struct rq_class		*class;
+	struct rq_list		 q;
 	size_t			 count;
+	uint32_t		 deficit;
+};
+TAILQ_HEAD(rq_flows, rq_flow);
+
+struct rq_classstat {
+	char			 name[SMTPD_CLASS_SIZE];
+	time_t			 t_report;
+	size_t			 dispatched;
+	time_t			 waited;
+};
+
+struct rq_class {
+	uint16_t		 id;
+	char			 name[SMTPD_CLASS_SIZE];
+	uint32_t		 weight;
+	int			 interactive;
+	int			 configured;
+	size_t			 refs;
+	struct rq_classstat	*stat;
+	struct rq_flow		 flows[2];	/* D_MDA, D_MTA */
+};
+
+/*
+ * Pending envelopes sit on a hierarchical timing wheel, by the earliest
+ * of their schedule and expiry times.  Level 0 has one slot per second,
+ * a slot on each level above spans a whole turn of the level below.  As
+ * the wheel turns, slots are cascaded one level down and level 0 slots
+ * are moved to the due list, so that envelopes come out in time order.
+ * Beyond the range of the top level, envelopes are parked on its last
+ * slot and go around again.
+ */
+#define RQ_WHEEL_BITS		6
+#define RQ_WHEEL_SLOTS		(1 << RQ_WHEEL_BITS)
+#define RQ_WHEEL_MASK		(RQ_WHEEL_SLOTS - 1)
+#define RQ_WHEEL_LEVELS		5
+#define RQ_WHEEL_RANGE		((time_t)1 << (RQ_WHEEL_BITS * RQ_WHEEL_LEVELS))
+#define RQ_WHEEL_DUE		(RQ_WHEEL_LEVELS * RQ_WHEEL_SLOTS)
+
+struct rq_wheel {
+	time_t			 now;
+	size_t			 count;	/* on the slots */
+	struct rq_list		 slots[RQ_WHEEL_LEVELS][RQ_WHEEL_SLOTS];
+	struct rq_list		 due;
 };
 
 struct rq_queue {
 	size_t			 evpcount;
 	struct tree		 messages;
-	SPLAY_HEAD(prioqtree, rq_envelope)	q_priotree;
 
-	struct evplist		 q_pending;
-	struct evplist		 q_inflight;
+	/* the wheel only exists for the ramqueue, updates use the list */
+	struct rq_wheel		*q_wheel;
+	struct rq_list		 q_pending;
+	struct rq_list		 q_inflight;
 
-	struct evplist		 q_mta;
-	struct evplist		 q_mda;
-	struct evplist		 q_bounce;
-	struct evplist		 q_update;
-	struct evplist		 q_expired;
-	struct evplist		 q_removed;
+	struct rq_flows		 q_flows[2][RQ_LANES];	/* D_MDA, D_MTA */
+	struct rq_list		 q_bounce;
+	struct rq_list		 q_update;
+	struct rq_list		 q_expired;
+	struct rq_list		 q_removed;
 };
 
-static int rq_envelope_cmp(struct rq_envelope *, struct rq_envelope *);
-
-SPLAY_PROTOTYPE(prioqtree, rq_envelope, t_entry, rq_envelope_cmp);
 static int scheduler_ram_init(const char *);
 static int scheduler_ram_insert(struct scheduler_info *);
 static size_t scheduler_ram_commit(uint32_t);
@@ -117,11 +202,62 @@ static int scheduler_ram_query(uint64_t);
 
 static void sorted_insert(struct rq_queue *, struct rq_envelope *);
 
+static int32_t rq_reltime(time_t);
+static time_t rq_abstime(int32_t);
+
+static struct rq_envelope *rq_evp(uint32_t);
+static struct rq_envelope *rq_evp_alloc(void);
+static void rq_evp_free(struct rq_envelope *);
+
+static void rq_list_init(struct rq_list *);
+static struct rq_envelope *rq_list_first(struct rq_list *);
+static void rq_list_insert_head(struct rq_list *, struct rq_envelope *);
+static void rq_list_insert_tail(struct rq_list *, struct rq_envelope *);
+static void rq_list_remove(struct rq_list *, struct rq_envelope *);
+static void rq_list_concat(struct rq_list *, struct rq_list *);
+
+static struct rq_message *rq_message_new(uint32_t);
+static void rq_message_free(struct rq_message *);
+static void rq_message_resize(struct rq_message *, uint32_t);
+static void rq_message_add(struct rq_message *, struct rq_envelope *);
+static void rq_message_del(struct rq_message *, struct rq_envelope *);
+static void rq_message_sort(struct rq_message *);
+static uint32_t rq_message_lookup(struct rq_message *, uint64_t);
+static int rq_message_cmp(const void *, const void *);
+
+static void rq_class_init(void);
+static struct rq_class *rq_class_new(const char *, uint32_t, int,
+    struct rq_classstat *);
+static struct rq_class *rq_class_get(const char *);
+static void rq_class_ref(struct rq_class *);
+static void rq_class_unref(uint16_t);
+static void rq_classstat_key(char *, size_t, struct rq_classstat *,
+    const char *);
+static void rq_classstat_queued(struct rq_classstat *, int);
+static void rq_classstat_report(struct rq_classstat *, time_t);
+
+static struct rq_flow *rq_flow(struct rq_envelope *);
+static void rq_flow_push(struct rq_queue *, struct rq_envelope *);
+static void rq_flow_remove(struct rq_queue *, struct rq_envelope *);
+static struct rq_envelope *rq_flow_pop(struct rq_queue *, int);
+
+static time_t rq_envelope_time(struct rq_envelope *);
+static void rq_wheel_init(struct rq_wheel *, time_t);
+static void rq_wheel_insert(struct rq_wheel *, struct rq_envelope *);
+static void rq_wheel_remove(struct rq_wheel *, struct rq_envelope *);
+static void rq_wheel_cascade(struct rq_wheel *, int);
+static void rq_wheel_advance(struct rq_wheel *, time_t);
+static time_t rq_wheel_next(struct rq_wheel *);
+
 static void rq_queue_init(struct rq_queue *);
 static void rq_queue_merge(struct rq_queue *, struct rq_queue *);
 static void rq_queue_dump(struct rq_queue *, const char *);
 static void rq_queue_schedule(struct rq_queue *rq);
-static struct evplist *rq_envelope_list(struct rq_queue *, struct rq_envelope *);
+static struct rq_envelope *rq_envelope_get(uint64_t);
+static struct rq_envelope *rq_envelope_xget(uint64_t);
+static struct rq_list *rq_envelope_list(struct rq_queue *, struct rq_envelope *);
+static void rq_envelope_unlink(struct rq_queue *, struct rq_envelope *);
+static void rq_envelope_relink(struct rq_queue *, struct rq_envelope *);
 static void rq_envelope_schedule(struct rq_queue *, struct rq_envelope *);
 static int rq_envelope_remove(struct rq_queue *, struct rq_envelope *);
 static int rq_envelope_suspend(struct rq_queue *, struct rq_envelope *);
@@ -153,9 +289,23 @@ struct scheduler_backend scheduler_backend_ramqueue = {
 };
 
 static struct rq_queue	ramqueue;
+static struct rq_wheel	wheel;
 static struct tree	updates;
 static struct tree	holdqs[3]; /* delivery type */
 
+static struct rq_envelope **slabs;
+static size_t		nslabs;
+static uint32_t		slab_used;	/* records handed out so far */
+static uint32_t		slab_free;	/* released records, through next */
+
+static struct rq_class	**classes;
+static size_t		nclasses;	/* ids handed out so far */
+static size_t		classsize;
+static uint16_t		*classfree;	/* ids of released classes */
+static size_t		nclassfree;
+static struct dict	classnames;
+
+static time_t		epoch;
 static time_t		currtime;
 
 #define BACKOFF_TRANSFER	400
@@ -183,11 +333,16 @@ scheduler_next(time_t t0, time_t base, uint32_t step)
 static int
 scheduler_ram_init(const char *arg)
 {
+	epoch = time(NULL);
+
 	rq_queue_init(&ramqueue);
+	rq_wheel_init(&wheel, epoch);
+	ramqueue.q_wheel = &wheel;
 	tree_init(&updates);
 	tree_init(&holdqs[D_MDA]);
 	tree_init(&holdqs[D_MTA]);
 	tree_init(&holdqs[D_BOUNCE]);
+	rq_class_init();
 
 	return (1);
 }
@@ -198,11 +353,14 @@ scheduler_ram_insert(struct scheduler_info *si)
 	struct rq_queue		*update;
 	struct rq_message	*message;
 	struct rq_envelope	*envelope;
+	struct rq_class		*class;
 	uint32_t		 msgid;
+	time_t			 sched;
 
 	currtime = time(NULL);
 
 	msgid = evpid_to_msgid(si->evpid);
+	si->class[sizeof(si->class) - 1] = '\0';
 
 	/* find/prepare a ramqueue update */
 	if ((update = tree_get(&updates, msgid)) == NULL) {
@@ -214,31 +372,32 @@ scheduler_ram_insert(struct scheduler_info *si)
 
 	/* find/prepare the msgtree message in ramqueue update */
 	if ((message = tree_get(&update->messages, msgid)) == NULL) {
-		message = xcalloc(1, sizeof *message);
-		message->msgid = msgid;
-		tree_init(&message->envelopes);
+		message = rq_message_new(msgid);
 		tree_xset(&update->messages, msgid, message);
-		stat_increment("scheduler.ramqueue.message", 1);
 	}
 
 	/* create envelope in ramqueue message */
-	envelope = xcalloc(1, sizeof *envelope);
+	sched = scheduler_backoff(si->creation,
+	    (si->type == D_MTA) ? BACKOFF_TRANSFER : BACKOFF_DELIVERY, si->retry);
+	envelope = rq_evp_alloc();
 	envelope->evpid = si->evpid;
 	envelope->type = si->type;
-	envelope->message = message;
-	envelope->ctime = si->creation;
-	envelope->expire = si->creation + si->ttl;
-	envelope->sched = scheduler_backoff(si->creation,
-	    (si->type == D_MTA) ? BACKOFF_TRANSFER : BACKOFF_DELIVERY, si->retry);
-	tree_xset(&message->envelopes, envelope->evpid, envelope);
+	envelope->ctime = rq_reltime(si->creation);
+	envelope->expire = rq_reltime(si->creation + si->ttl);
+	envelope->sched = rq_reltime(sched);
+	if (si->type != D_BOUNCE) {
+		class = rq_class_get(si->class);
+		rq_class_ref(class);
+		envelope->class = class->id;
+	}
+	rq_message_add(message, envelope);
 
 	update->evpcount++;
-	stat_increment("scheduler.ramqueue.envelope", 1);
 
 	envelope->state = RQ_EVPSTATE_PENDING;
-	TAILQ_INSERT_TAIL(&update->q_pending, envelope, entry);
+	rq_list_insert_tail(&update->q_pending, envelope);
 
-	si->nexttry = envelope->sched;
+	si->nexttry = sched;
 
 	return (1);
 }
@@ -274,6 +433,7 @@ static size_t
 scheduler_ram_rollback(uint32_t msgid)
 {
 	struct rq_queue		*update;
+	struct rq_message	*message;
 	struct rq_envelope	*evp;
 	size_t			 r;
 
@@ -283,10 +443,14 @@ scheduler_ram_rollback(uint32_t msgid)
 		return (0);
 	r = update->evpcount;
 
-	while ((evp = TAILQ_FIRST(&update->q_pending))) {
-		TAILQ_REMOVE(&update->q_pending, evp, entry);
-		rq_envelope_delete(update, evp);
+	while ((evp = rq_list_first(&update->q_pending))) {
+		rq_list_remove(&update->q_pending, evp);
+		if (evp->type != D_BOUNCE)
+			rq_class_unref(evp->class);
+		rq_evp_free(evp);
 	}
+	while (tree_poproot(&update->messages, NULL, (void **)&message))
+		rq_message_free(message);
 
 	free(update);
 	stat_decrement("scheduler.ramqueue.update", 1);
@@ -297,41 +461,39 @@ scheduler_ram_rollback(uint32_t msgid)
 static int
 scheduler_ram_update(struct scheduler_info *si)
 {
-	struct rq_message	*msg;
 	struct rq_envelope	*evp;
-	uint32_t		 msgid;
+	time_t			 sched;
 
 	currtime = time(NULL);
 
-	msgid = evpid_to_msgid(si->evpid);
-	msg = tree_xget(&ramqueue.messages, msgid);
-	evp = tree_xget(&msg->envelopes, si->evpid);
+	evp = rq_envelope_xget(si->evpid);
 
 	/* it *must* be in-flight */
 	if (evp->state != RQ_EVPSTATE_INFLIGHT)
 		fatalx("evp:%016" PRIx64 " not in-flight", si->evpid);
 
-	TAILQ_REMOVE(&ramqueue.q_inflight, evp, entry);
+	rq_list_remove(&ramqueue.q_inflight, evp);
 
 	/*
 	 * If the envelope was removed while inflight,  schedule it for
 	 * removal immediately.
 	 */
 	if (evp->flags & RQ_ENVELOPE_REMOVED) {
-		TAILQ_INSERT_TAIL(&ramqueue.q_removed, evp, entry);
+		rq_list_insert_tail(&ramqueue.q_removed, evp);
 		evp->state = RQ_EVPSTATE_SCHEDULED;
-		evp->t_scheduled = currtime;
+		evp->t_state = rq_reltime(currtime);
 		return (1);
 	}
 
-	evp->sched = scheduler_next(evp->ctime,
+	sched = scheduler_next(rq_abstime(evp->ctime),
 	    (si->type == D_MTA) ? BACKOFF_TRANSFER : BACKOFF_DELIVERY, si->retry);
+	evp->sched = rq_reltime(sched);
 
 	evp->state = RQ_EVPSTATE_PENDING;
 	if (!(evp->flags & RQ_ENVELOPE_SUSPEND))
 		sorted_insert(&ramqueue, evp);
 
-	si->nexttry = evp->sched;
+	si->nexttry = sched;
 
 	return (1);
 }
@@ -339,21 +501,17 @@ scheduler_ram_update(struct scheduler_info *si)
 static int
 scheduler_ram_delete(uint64_t evpid)
 {
-	struct rq_message	*msg;
 	struct rq_envelope	*evp;
-	uint32_t		 msgid;
 
 	currtime = time(NULL);
 
-	msgid = evpid_to_msgid(evpid);
-	msg = tree_xget(&ramqueue.messages, msgid);
-	evp = tree_xget(&msg->envelopes, evpid);
+	evp = rq_envelope_xget(evpid);
 
 	/* it *must* be in-flight */
 	if (evp->state != RQ_EVPSTATE_INFLIGHT)
 		fatalx("evp:%016" PRIx64 " not in-flight", evpid);
 
-	TAILQ_REMOVE(&ramqueue.q_inflight, evp, entry);
+	rq_list_remove(&ramqueue.q_inflight, evp);
 
 	rq_envelope_delete(&ramqueue, evp);
 
@@ -366,21 +524,17 @@ static int
 scheduler_ram_hold(uint64_t evpid, uint64_t holdq)
 {
 	struct rq_holdq		*hq;
-	struct rq_message	*msg;
 	struct rq_envelope	*evp;
-	uint32_t		 msgid;
 
 	currtime = time(NULL);
 
-	msgid = evpid_to_msgid(evpid);
-	msg = tree_xget(&ramqueue.messages, msgid);
-	evp = tree_xget(&msg->envelopes, evpid);
+	evp = rq_envelope_xget(evpid);
 
 	/* it *must* be in-flight */
 	if (evp->state != RQ_EVPSTATE_INFLIGHT)
 		fatalx("evp:%016" PRIx64 " not in-flight", evpid);
 
-	TAILQ_REMOVE(&ramqueue.q_inflight, evp, entry);
+	rq_list_remove(&ramqueue.q_inflight, evp);
 
 	/* If the envelope is suspended, just mark it as pending */
 	if (evp->flags & RQ_ENVELOPE_SUSPEND) {
@@ -391,7 +545,7 @@ scheduler_ram_hold(uint64_t evpid, uint64_t holdq)
 	hq = tree_get(&holdqs[evp->type], holdq);
 	if (hq == NULL) {
 		hq = xcalloc(1, sizeof(*hq));
-		TAILQ_INIT(&hq->q);
+		rq_list_init(&hq->q);
 		tree_xset(&holdqs[evp->type], holdq, hq);
 		stat_increment("scheduler.ramqueue.holdq", 1);
 	}
@@ -407,14 +561,14 @@ scheduler_ram_hold(uint64_t evpid, uint64_t holdq)
 	}
 
 	evp->state = RQ_EVPSTATE_HELD;
-	evp->holdq = holdq;
+	evp->u.holdq = holdq;
 	/* This is an optimization: upon release, the envelopes will be
 	 * inserted in the pending queue from the first element to the last.
 	 * Since elements already in the queue were received first, they
 	 * were scheduled first, so they will be reinserted before the
 	 * current element.
 	 */
-	TAILQ_INSERT_HEAD(&hq->q, evp, entry);
+	rq_list_insert_head(&hq->q, evp);
 	hq->count += 1;
 	stat_increment("scheduler.ramqueue.hold", 1);
 
@@ -442,13 +596,13 @@ scheduler_ram_release(int type, uint64_t holdq, int n)
 		update = 0;
 
 	for (i = 0; n == 0 || i < n; i++) {
-		evp = TAILQ_FIRST(&hq->q);
+		evp = rq_list_first(&hq->q);
 		if (evp == NULL)
 			break;
 
-		TAILQ_REMOVE(&hq->q, evp, entry);
+		rq_list_remove(&hq->q, evp);
 		hq->count -= 1;
-		evp->holdq = 0;
+		evp->u.holdq = 0;
 
 		/* When released, all envelopes are put in the pending queue
 		 * and will be rescheduled immediately.  As an optimization,
@@ -460,7 +614,7 @@ scheduler_ram_release(int type, uint64_t holdq, int n)
 		sorted_insert(&ramqueue, evp);
 	}
 
-	if (TAILQ_EMPTY(&hq->q)) {
+	if (hq->q.first == RQ_NONE) {
 		tree_xpop(&holdqs[type], holdq);
 		free(hq);
 		stat_decrement("scheduler.ramqueue.holdq", 1);
@@ -488,8 +642,8 @@ scheduler_ram_batch(int mask, int *delay, size_t *count, uint64_t *evpids, int *
 
 	for (;;) {
 
-		if (mask & SCHED_REMOVE && (evp = TAILQ_FIRST(&ramqueue.q_removed))) {
-			TAILQ_REMOVE(&ramqueue.q_removed, evp, entry);
+		if (mask & SCHED_REMOVE && (evp = rq_list_first(&ramqueue.q_removed))) {
+			rq_list_remove(&ramqueue.q_removed, evp);
 			types[i] = SCHED_REMOVE;
 			evpids[i] = evp->evpid;
 			rq_envelope_delete(&ramqueue, evp);
@@ -498,8 +652,8 @@ scheduler_ram_batch(int mask, int *delay, size_t *count, uint64_t *evpids, int *
 				break;
 		}
 
-		if (mask & SCHED_EXPIRE && (evp = TAILQ_FIRST(&ramqueue.q_expired))) {
-			TAILQ_REMOVE(&ramqueue.q_expired, evp, entry);
+		if (mask & SCHED_EXPIRE && (evp = rq_list_first(&ramqueue.q_expired))) {
+			rq_list_remove(&ramqueue.q_expired, evp);
 			types[i] = SCHED_EXPIRE;
 			evpids[i] = evp->evpid;
 			rq_envelope_delete(&ramqueue, evp);
@@ -508,8 +662,8 @@ scheduler_ram_batch(int mask, int *delay, size_t *count, uint64_t *evpids, int *
 				break;
 		}
 
-		if (mask & SCHED_UPDATE && (evp = TAILQ_FIRST(&ramqueue.q_update))) {
-			TAILQ_REMOVE(&ramqueue.q_update, evp, entry);
+		if (mask & SCHED_UPDATE && (evp = rq_list_first(&ramqueue.q_update))) {
+			rq_list_remove(&ramqueue.q_update, evp);
 			types[i] = SCHED_UPDATE;
 			evpids[i] = evp->evpid;
 
@@ -520,7 +674,8 @@ scheduler_ram_batch(int mask, int *delay, size_t *count, uint64_t *evpids, int *
 			else
 				t = BACKOFF_DELIVERY;
 
-			evp->sched = scheduler_next(evp->ctime, t, 0);
+			evp->sched = rq_reltime(scheduler_next(
+			    rq_abstime(evp->ctime), t, 0));
 			evp->flags &= ~(RQ_ENVELOPE_UPDATE|RQ_ENVELOPE_OVERFLOW);
 			evp->state = RQ_EVPSTATE_PENDING;
 			if (!(evp->flags & RQ_ENVELOPE_SUSPEND))
@@ -530,40 +685,38 @@ scheduler_ram_batch(int mask, int *delay, size_t *count, uint64_t *evpids, int *
 				break;
 		}
 
-		if (mask & SCHED_BOUNCE && (evp = TAILQ_FIRST(&ramqueue.q_bounce))) {
-			TAILQ_REMOVE(&ramqueue.q_bounce, evp, entry);
+		if (mask & SCHED_BOUNCE && (evp = rq_list_first(&ramqueue.q_bounce))) {
+			rq_list_remove(&ramqueue.q_bounce, evp);
 			types[i] = SCHED_BOUNCE;
 			evpids[i] = evp->evpid;
 
-			TAILQ_INSERT_TAIL(&ramqueue.q_inflight, evp, entry);
+			rq_list_insert_tail(&ramqueue.q_inflight, evp);
 			evp->state = RQ_EVPSTATE_INFLIGHT;
-			evp->t_inflight = currtime;
+			evp->t_state = rq_reltime(currtime);
 
 			if (++i == *count)
 				break;
 		}
 
-		if (mask & SCHED_MDA && (evp = TAILQ_FIRST(&ramqueue.q_mda))) {
-			TAILQ_REMOVE(&ramqueue.q_mda, evp, entry);
+		if (mask & SCHED_MDA && (evp = rq_flow_pop(&ramqueue, D_MDA))) {
 			types[i] = SCHED_MDA;
 			evpids[i] = evp->evpid;
 
-			TAILQ_INSERT_TAIL(&ramqueue.q_inflight, evp, entry);
+			rq_list_insert_tail(&ramqueue.q_inflight, evp);
 			evp->state = RQ_EVPSTATE_INFLIGHT;
-			evp->t_inflight = currtime;
+			evp->t_state = rq_reltime(currtime);
 
 			if (++i == *count)
 				break;
 		}
 
-		if (mask & SCHED_MTA && (evp = TAILQ_FIRST(&ramqueue.q_mta))) {
-			TAILQ_REMOVE(&ramqueue.q_mta, evp, entry);
+		if (mask & SCHED_MTA && (evp = rq_flow_pop(&ramqueue, D_MTA))) {
 			types[i] = SCHED_MTA;
 			evpids[i] = evp->evpid;
 
-			TAILQ_INSERT_TAIL(&ramqueue.q_inflight, evp, entry);
+			rq_list_insert_tail(&ramqueue.q_inflight, evp);
 			evp->state = RQ_EVPSTATE_INFLIGHT;
-			evp->t_inflight = currtime;
+			evp->t_state = rq_reltime(currtime);
 
 			if (++i == *count)
 				break;
@@ -581,13 +734,8 @@ scheduler_ram_batch(int mask, int *delay, size_t *count, uint64_t *evpids, int *
 		return (1);
 	}
 
-	if ((evp = TAILQ_FIRST(&ramqueue.q_pending))) {
-		if (evp->sched < evp->expire)
-			t = evp->sched;
-		else
-			t = evp->expire;
+	if ((t = rq_wheel_next(ramqueue.q_wheel)) != -1)
 		*delay = (t < currtime) ? 0 : (t - currtime);
-	}
 	else
 		*delay = -1;
 
@@ -615,17 +763,16 @@ scheduler_ram_envelopes(uint64_t from, struct evpstate *dst, size_t size)
 {
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
-	void			*i;
+	uint32_t		 i;
 	size_t			 n;
 
 	if ((msg = tree_get(&ramqueue.messages, evpid_to_msgid(from))) == NULL)
 		return (0);
 
-	for (n = 0, i = NULL; n < size; ) {
+	for (n = 0, i = rq_message_lookup(msg, from);
+	    n < size && i < msg->count; i++) {
 
-		if (tree_iterfrom(&msg->envelopes, &i, from, NULL,
-		    (void**)&evp) == 0)
-			break;
+		evp = rq_evp(msg->evps[i]);
 
 		if (evp->flags & (RQ_ENVELOPE_REMOVED | RQ_ENVELOPE_EXPIRED))
 			continue;
@@ -636,20 +783,20 @@ scheduler_ram_envelopes(uint64_t from, struct evpstate *dst, size_t size)
 		dst[n].time = 0;
 
 		if (evp->state == RQ_EVPSTATE_PENDING) {
-			dst[n].time = evp->sched;
+			dst[n].time = rq_abstime(evp->sched);
 			dst[n].flags = EF_PENDING;
 		}
 		else if (evp->state == RQ_EVPSTATE_SCHEDULED) {
-			dst[n].time = evp->t_scheduled;
+			dst[n].time = rq_abstime(evp->t_state);
 			dst[n].flags = EF_PENDING;
 		}
 		else if (evp->state == RQ_EVPSTATE_INFLIGHT) {
-			dst[n].time = evp->t_inflight;
+			dst[n].time = rq_abstime(evp->t_state);
 			dst[n].flags = EF_INFLIGHT;
 		}
 		else if (evp->state == RQ_EVPSTATE_HELD) {
 			/* same as scheduled */
-			dst[n].time = evp->t_scheduled;
+			dst[n].time = rq_abstime(evp->t_state);
 			dst[n].flags = EF_PENDING;
 			dst[n].flags |= EF_HOLD;
 		}
@@ -667,17 +814,13 @@ scheduler_ram_schedule(uint64_t evpid)
 {
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
-	uint32_t		 msgid;
-	void			*i;
+	uint32_t		 msgid, i;
 	int			 r;
 
 	currtime = time(NULL);
 
 	if (evpid > 0xffffffff) {
-		msgid = evpid_to_msgid(evpid);
-		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
-			return (0);
-		if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
+		if ((evp = rq_envelope_get(evpid)) == NULL)
 			return (0);
 		if (evp->state == RQ_EVPSTATE_INFLIGHT)
 			return (0);
@@ -688,9 +831,9 @@ scheduler_ram_schedule(uint64_t evpid)
 		msgid = evpid;
 		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
 			return (0);
-		i = NULL;
 		r = 0;
-		while (tree_iter(&msg->envelopes, &i, NULL, (void*)(&evp))) {
+		for (i = 0; i < msg->count; i++) {
+			evp = rq_evp(msg->evps[i]);
 			if (evp->state == RQ_EVPSTATE_INFLIGHT)
 				continue;
 			rq_envelope_schedule(&ramqueue, evp);
@@ -705,17 +848,13 @@ scheduler_ram_remove(uint64_t evpid)
 {
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
-	uint32_t		 msgid;
-	void			*i;
+	uint32_t		 msgid, i;
 	int			 r;
 
 	currtime = time(NULL);
 
 	if (evpid > 0xffffffff) {
-		msgid = evpid_to_msgid(evpid);
-		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
-			return (0);
-		if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
+		if ((evp = rq_envelope_get(evpid)) == NULL)
 			return (0);
 		if (rq_envelope_remove(&ramqueue, evp))
 			return (1);
@@ -725,10 +864,9 @@ scheduler_ram_remove(uint64_t evpid)
 		msgid = evpid;
 		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
 			return (0);
-		i = NULL;
 		r = 0;
-		while (tree_iter(&msg->envelopes, &i, NULL, (void*)(&evp)))
-			if (rq_envelope_remove(&ramqueue, evp))
+		for (i = 0; i < msg->count; i++)
+			if (rq_envelope_remove(&ramqueue, rq_evp(msg->evps[i])))
 				r++;
 		return (r);
 	}
@@ -739,17 +877,13 @@ scheduler_ram_suspend(uint64_t evpid)
 {
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
-	uint32_t		 msgid;
-	void			*i;
+	uint32_t		 msgid, i;
 	int			 r;
 
 	currtime = time(NULL);
 
 	if (evpid > 0xffffffff) {
-		msgid = evpid_to_msgid(evpid);
-		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
-			return (0);
-		if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
+		if ((evp = rq_envelope_get(evpid)) == NULL)
 			return (0);
 		if (rq_envelope_suspend(&ramqueue, evp))
 			return (1);
@@ -759,10 +893,9 @@ scheduler_ram_suspend(uint64_t evpid)
 		msgid = evpid;
 		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
 			return (0);
-		i = NULL;
 		r = 0;
-		while (tree_iter(&msg->envelopes, &i, NULL, (void*)(&evp)))
-			if (rq_envelope_suspend(&ramqueue, evp))
+		for (i = 0; i < msg->count; i++)
+			if (rq_envelope_suspend(&ramqueue, rq_evp(msg->evps[i])))
 				r++;
 		return (r);
 	}
@@ -773,17 +906,13 @@ scheduler_ram_resume(uint64_t evpid)
 {
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
-	uint32_t		 msgid;
-	void			*i;
+	uint32_t		 msgid, i;
 	int			 r;
 
 	currtime = time(NULL);
 
 	if (evpid > 0xffffffff) {
-		msgid = evpid_to_msgid(evpid);
-		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
-			return (0);
-		if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
+		if ((evp = rq_envelope_get(evpid)) == NULL)
 			return (0);
 		if (rq_envelope_resume(&ramqueue, evp))
 			return (1);
@@ -793,10 +922,9 @@ scheduler_ram_resume(uint64_t evpid)
 		msgid = evpid;
 		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
 			return (0);
-		i = NULL;
 		r = 0;
-		while (tree_iter(&msg->envelopes, &i, NULL, (void*)(&evp)))
-			if (rq_envelope_resume(&ramqueue, evp))
+		for (i = 0; i < msg->count; i++)
+			if (rq_envelope_resume(&ramqueue, rq_evp(msg->evps[i])))
 				r++;
 		return (r);
 	}
@@ -821,30 +949,644 @@ scheduler_ram_query(uint64_t evpid)
 static void
 sorted_insert(struct rq_queue *rq, struct rq_envelope *evp)
 {
-	struct rq_envelope	*evp2;
+	rq_wheel_insert(rq->q_wheel, evp);
+}
+
+static int32_t
+rq_reltime(time_t t)
+{
+	t -= epoch;
+	if (t > INT32_MAX)
+		return (INT32_MAX);
+	if (t < INT32_MIN)
+		return (INT32_MIN);
+	return (t);
+}
+
+static time_t
+rq_abstime(int32_t t)
+{
+	return (epoch + t);
+}
+
+static struct rq_envelope *
+rq_evp(uint32_t idx)
+{
+	if (idx == RQ_NONE)
+		return (NULL);
+	return (&slabs[idx >> RQ_SLAB_BITS][idx & RQ_SLAB_MASK]);
+}
+
+/*
+ * Slabs are never given back, released records are reused first.
+ */
+static struct rq_envelope *
+rq_evp_alloc(void)
+{
+	struct rq_envelope	*evp, **tmp;
+	uint32_t		 idx;
+
+	if (slab_free != RQ_NONE) {
+		idx = slab_free;
+		evp = rq_evp(idx);
+		slab_free = evp->next;
+	}
+	else {
+		if (slab_used == UINT32_MAX)
+			fatalx("rq_evp_alloc: out of envelope records");
+		/* record 0 stands for none and is never handed out */
+		idx = ++slab_used;
+		if ((idx >> RQ_SLAB_BITS) == nslabs) {
+			if ((tmp = reallocarray(slabs, nslabs + 1,
+			    sizeof *slabs)) == NULL)
+				fatal("rq_evp_alloc: reallocarray");
+			slabs = tmp;
+			slabs[nslabs++] = xcalloc(RQ_SLAB_SIZE, sizeof **slabs);
+			stat_increment("scheduler.ramqueue.bytes",
+			    RQ_SLAB_SIZE * sizeof **slabs);
+		}
+		evp = rq_evp(idx);
+	}
+
+	memset(evp, 0, sizeof *evp);
+	evp->idx = idx;
+	stat_increment("scheduler.ramqueue.envelope", 1);
+
+	return (evp);
+}
+
+static void
+rq_evp_free(struct rq_envelope *evp)
+{
+	evp->next = slab_free;
+	slab_free = evp->idx;
+	stat_decrement("scheduler.ramqueue.envelope", 1);
+}
+
+static void
+rq_list_init(struct rq_list *l)
+{
+	l->first = RQ_NONE;
+	l->last = RQ_NONE;
+}
+
+static struct rq_envelope *
+rq_list_first(struct rq_list *l)
+{
+	return (rq_evp(l->first));
+}
+
+static void
+rq_list_insert_head(struct rq_list *l, struct rq_envelope *evp)
+{
+	evp->prev = RQ_NONE;
+	evp->next = l->first;
+	if (l->first != RQ_NONE)
+		rq_evp(l->first)->prev = evp->idx;
+	else
+		l->last = evp->idx;
+	l->first = evp->idx;
+}
+
+static void
+rq_list_insert_tail(struct rq_list *l, struct rq_envelope *evp)
+{
+	evp->next = RQ_NONE;
+	evp->prev = l->last;
+	if (l->last != RQ_NONE)
+		rq_evp(l->last)->next = evp->idx;
+	else
+		l->first = evp->idx;
+	l->last = evp->idx;
+}
+
+static void
+rq_list_remove(struct rq_list *l, struct rq_envelope *evp)
+{
+	if (evp->prev != RQ_NONE)
+		rq_evp(evp->prev)->next = evp->next;
+	else
+		l->first = evp->next;
+	if (evp->next != RQ_NONE)
+		rq_evp(evp->next)->prev = evp->prev;
+	else
+		l->last = evp->prev;
+	evp->next = RQ_NONE;
+	evp->prev = RQ_NONE;
+}
+
+/* Move all of src at the end of dst. */
+static void
+rq_list_concat(struct rq_list *dst, struct rq_list *src)
+{
+	if (src->first == RQ_NONE)
+		return;
+
+	if (dst->first == RQ_NONE)
+		*dst = *src;
+	else {
+		rq_evp(dst->last)->next = src->first;
+		rq_evp(src->first)->prev = dst->last;
+		dst->last = src->last;
+	}
+	rq_list_init(src);
+}
+
+static struct rq_message *
+rq_message_new(uint32_t msgid)
+{
+	struct rq_message	*msg;
+
+	msg = xcalloc(1, sizeof *msg);
+	msg->msgid = msgid;
+	stat_increment("scheduler.ramqueue.message", 1);
+	stat_increment("scheduler.ramqueue.bytes", sizeof *msg);
+
+	return (msg);
+}
+
+static void
+rq_message_free(struct rq_message *msg)
+{
+	stat_decrement("scheduler.ramqueue.message", 1);
+	stat_decrement("scheduler.ramqueue.bytes",
+	    sizeof *msg + msg->size * sizeof *msg->evps);
+	free(msg->evps);
+	free(msg);
+}
+
+static void
+rq_message_resize(struct rq_message *msg, uint32_t size)
+{
+	uint32_t	*tmp;
+
+	if ((tmp = reallocarray(msg->evps, size, sizeof *tmp)) == NULL)
+		fatal("rq_message_resize: reallocarray");
+	if (size > msg->size)
+		stat_increment("scheduler.ramqueue.bytes",
+		    (size - msg->size) * sizeof *tmp);
+	else
+		stat_decrement("scheduler.ramqueue.bytes",
+		    (msg->size - size) * sizeof *tmp);
+	msg->evps = tmp;
+	msg->size = size;
+}
+
+/* The array must be sorted again before lookups. */
+static void
+rq_message_add(struct rq_message *msg, struct rq_envelope *evp)
+{
+	if (msg->count == msg->size)
+		rq_message_resize(msg, msg->size ? msg->size * 2 : 4);
+	msg->evps[msg->count++] = evp->idx;
+}
+
+static void
+rq_message_del(struct rq_message *msg, struct rq_envelope *evp)
+{
+	uint32_t	i;
+
+	i = rq_message_lookup(msg, evp->evpid);
+	if (i == msg->count || msg->evps[i] != evp->idx)
+		fatalx("evp:%016" PRIx64 " not in message", evp->evpid);
+
+	memmove(&msg->evps[i], &msg->evps[i + 1],
+	    (msg->count - i - 1) * sizeof *msg->evps);
+	msg->count--;
+
+	if (msg->size > 4 && msg->count < msg->size / 4)
+		rq_message_resize(msg, msg->size / 2);
+}
+
+static void
+rq_message_sort(struct rq_message *msg)
+{
+	qsort(msg->evps, msg->count, sizeof *msg->evps, rq_message_cmp);
+}
+
+/* Position of the first envelope not below evpid. */
+static uint32_t
+rq_message_lookup(struct rq_message *msg, uint64_t evpid)
+{
+	uint32_t	lo, hi, mid;
+
+	lo = 0;
+	hi = msg->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (rq_evp(msg->evps[mid])->evpid < evpid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo);
+}
+
+static int
+rq_message_cmp(const void *a, const void *b)
+{
+	uint64_t	e1, e2;
+
+	e1 = rq_evp(*(const uint32_t *)a)->evpid;
+	e2 = rq_evp(*(const uint32_t *)b)->evpid;
+	if (e1 != e2)
+		return (e1 < e2) ? -1 : 1;
+	return (0);
+}
+
+static void
+rq_class_init(void)
+{
+	struct scheduler_class	*sc;
+	struct rq_classstat	*stat;
+	struct rq_class		*class;
+	const char		*name;
+	void			*iter;
+
+	dict_init(&classnames);
+
+	stat = xcalloc(1, sizeof *stat);
+	(void)strlcpy(stat->name, "default", sizeof stat->name);
+	class = rq_class_new("", 1, 0, stat);
+	class->configured = 1;
+
+	iter = NULL;
+	while (dict_iter(env->sc_scheduler_classes, &iter, &name,
+	    (void **)&sc)) {
+		stat = xcalloc(1, sizeof *stat);
+		(void)strlcpy(stat->name, name, sizeof stat->name);
+		class = rq_class_new(name, sc->weight, sc->interactive, stat);
+		class->configured = 1;
+	}
+}
+
+static struct rq_class *
+rq_class_new(const char *name, uint32_t weight, int interactive,
+    struct rq_classstat *stat)
+{
+	struct rq_class	**tmp;
+	struct rq_class	 *class;
+	uint16_t	 *tmpfree;
+	size_t		  size, i;
+	uint16_t	  id;
+
+	if (nclassfree)
+		id = classfree[--nclassfree];
+	else {
+		if (nclasses > RQ_CLASS_MAX)
+			return (NULL);
+		if (nclasses == classsize) {
+			size = classsize ? classsize * 2 : 16;
+			if ((tmp = reallocarray(classes, size,
+			    sizeof *classes)) == NULL)
+				fatal("rq_class_new: reallocarray");
+			classes = tmp;
+			if ((tmpfree = reallocarray(classfree, size,
+			    sizeof *classfree)) == NULL)
+				fatal("rq_class_new: reallocarray");
+			classfree = tmpfree;
+			classsize = size;
+		}
+		id = nclasses++;
+	}
+
+	class = xcalloc(1, sizeof *class);
+	class->id = id;
+	(void)strlcpy(class->name, name, sizeof class->name);
+	class->weight = weight;
+	class->interactive = interactive;
+	class->stat = stat;
+	for (i = 0; i < nitems(class->flows); i++) {
+		class->flows[i].class = class;
+		rq_list_init(&class->flows[i].q);
+	}
+	if (id != RQ_CLASS_DEFAULT)
+		dict_xset(&classnames, class->name, class);
+	classes[id] = class;
+
+	return (class);
+}
+
+static struct rq_class *
+rq_class_get(const char *name)
+{
+	struct rq_class	*class;
+
+	if (name[0] == '\0')
+		return (classes[RQ_CLASS_DEFAULT]);
+	if ((class = dict_get(&classnames, name)))
+		return (class);
+
+	/* fall back to the default class when out of ids */
+	class = rq_class_new(name, 1, 0, classes[RQ_CLASS_DEFAULT]->stat);
+	if (class == NULL) {
+		stat_increment("scheduler.ramqueue.class-overflow", 1);
+		return (classes[RQ_CLASS_DEFAULT]);
+	}
+	stat_increment("scheduler.ramqueue.class", 1);
+
+	return (class);
+}
+
+static void
+rq_class_ref(struct rq_class *class)
+{
+	class->refs++;
+}
+
+static void
+rq_class_unref(uint16_t id)
+{
+	struct rq_class	*class;
+
+	class = classes[id];
+	if (--class->refs || class->configured)
+		return;
+
+	dict_xpop(&classnames, class->name);
+	classes[id] = NULL;
+	classfree[nclassfree++] = id;
+	free(class);
+	stat_decrement("scheduler.ramqueue.class", 1);
+}
+
+static void
+rq_classstat_key(char *buf, size_t len, struct rq_classstat *stat,
+    const char *what)
+{
+	(void)snprintf(buf, len, "scheduler.class.%s.%s", stat->name, what);
+}
+
+static void
+rq_classstat_queued(struct rq_classstat *stat, int delta)
+{
+	char	key[STAT_KEY_SIZE];
 
-	SPLAY_INSERT(prioqtree, &rq->q_priotree, evp);
-	evp2 = SPLAY_NEXT(prioqtree, &rq->q_priotree, evp);
-	if (evp2)
-		TAILQ_INSERT_BEFORE(evp2, evp, entry);
+	rq_classstat_key(key, sizeof key, stat, "queued");
+	if (delta > 0)
+		stat_increment(key, delta);
 	else
-		TAILQ_INSERT_TAIL(&rq->q_pending, evp, entry);
+		stat_decrement(key, -delta);
+}
+
+/*
+ * Account for the time an envelope waited in its flow.  The average is
+ * reported at most once per second, over the envelopes dispatched since.
+ */
+static void
+rq_classstat_report(struct rq_classstat *stat, time_t wait)
+{
+	char	key[STAT_KEY_SIZE];
+
+	stat->dispatched++;
+	stat->waited += wait;
+	if (currtime - stat->t_report < 1)
+		return;
+
+	rq_classstat_key(key, sizeof key, stat, "delay");
+	stat_set(key, stat_counter(stat->waited / stat->dispatched));
+	stat->t_report = currtime;
+	stat->dispatched = 0;
+	stat->waited = 0;
+}
+
+static struct rq_flow *
+rq_flow(struct rq_envelope *evp)
+{
+	return (&classes[evp->class]->flows[evp->type]);
+}
+
+static void
+rq_flow_push(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	struct rq_flow	*flow;
+	int		 lane;
+
+	flow = rq_flow(evp);
+	rq_list_insert_tail(&flow->q, evp);
+	if (flow->count++ == 0) {
+		lane = flow->class->interactive ?
+		    RQ_LANE_INTERACTIVE : RQ_LANE_BULK;
+		flow->deficit = 0;
+		TAILQ_INSERT_TAIL(&rq->q_flows[evp->type][lane], flow, entry);
+	}
+	rq_classstat_queued(flow->class->stat, 1);
+}
+
+static void
+rq_flow_remove(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	struct rq_flow	*flow;
+	int		 lane;
+
+	flow = rq_flow(evp);
+	rq_list_remove(&flow->q, evp);
+	if (--flow->count == 0) {
+		lane = flow->class->interactive ?
+		    RQ_LANE_INTERACTIVE : RQ_LANE_BULK;
+		TAILQ_REMOVE(&rq->q_flows[evp->type][lane], flow, entry);
+	}
+	rq_classstat_queued(flow->class->stat, -1);
+}
+
+/*
+ * Take the next envelope of the given delivery type.  The flow at the
+ * head of a lane gets a fresh deficit of its weight when its turn
+ * starts, and goes to the back of the lane once it is spent.
+ */
+static struct rq_envelope *
+rq_flow_pop(struct rq_queue *rq, int type)
+{
+	struct rq_flows		*flows;
+	struct rq_flow		*flow;
+	struct rq_envelope	*evp;
+	int			 lane;
+
+	for (lane = 0; lane < RQ_LANES; lane++)
+		if (!TAILQ_EMPTY(&rq->q_flows[type][lane]))
+			break;
+	if (lane == RQ_LANES)
+		return (NULL);
+
+	flows = &rq->q_flows[type][lane];
+	flow = TAILQ_FIRST(flows);
+	if (flow->deficit == 0)
+		flow->deficit = flow->class->weight;
+
+	evp = rq_list_first(&flow->q);
+	rq_flow_remove(rq, evp);
+	rq_classstat_report(flow->class->stat,
+	    currtime - rq_abstime(evp->t_state));
+
+	if (flow->count && --flow->deficit == 0) {
+		TAILQ_REMOVE(flows, flow, entry);
+		TAILQ_INSERT_TAIL(flows, flow, entry);
+	}
+
+	return (evp);
+}
+
+static time_t
+rq_envelope_time(struct rq_envelope *evp)
+{
+	return rq_abstime((evp->sched < evp->expire) ? evp->sched :
+	    evp->expire);
+}
+
+static void
+rq_wheel_init(struct rq_wheel *w, time_t now)
+{
+	int	l, i;
+
+	memset(w, 0, sizeof *w);
+	w->now = now;
+	for (l = 0; l < RQ_WHEEL_LEVELS; l++)
+		for (i = 0; i < RQ_WHEEL_SLOTS; i++)
+			rq_list_init(&w->slots[l][i]);
+	rq_list_init(&w->due);
+}
+
+static void
+rq_wheel_insert(struct rq_wheel *w, struct rq_envelope *evp)
+{
+	time_t	t, delta;
+	int	l, i;
+
+	t = rq_envelope_time(evp);
+	if (t <= w->now) {
+		evp->u.slot = RQ_WHEEL_DUE;
+		rq_list_insert_tail(&w->due, evp);
+		return;
+	}
+
+	delta = t - w->now;
+	if (delta >= RQ_WHEEL_RANGE) {
+		t = w->now + RQ_WHEEL_RANGE - 1;
+		delta = RQ_WHEEL_RANGE - 1;
+	}
+
+	/* the lowest level whose turn covers the delay */
+	for (l = 0; l < RQ_WHEEL_LEVELS - 1; l++)
+		if (delta < (time_t)1 << (RQ_WHEEL_BITS * (l + 1)))
+			break;
+	i = (t >> (RQ_WHEEL_BITS * l)) & RQ_WHEEL_MASK;
+
+	evp->u.slot = l * RQ_WHEEL_SLOTS + i;
+	rq_list_insert_tail(&w->slots[l][i], evp);
+	w->count++;
+}
+
+static void
+rq_wheel_remove(struct rq_wheel *w, struct rq_envelope *evp)
+{
+	if (evp->u.slot == RQ_WHEEL_DUE) {
+		rq_list_remove(&w->due, evp);
+		return;
+	}
+
+	rq_list_remove(&w->slots[evp->u.slot / RQ_WHEEL_SLOTS]
+	    [evp->u.slot % RQ_WHEEL_SLOTS], evp);
+	w->count--;
+}
+
+/* Spread the current slot of a level over the levels below. */
+static void
+rq_wheel_cascade(struct rq_wheel *w, int l)
+{
+	struct rq_list		 q;
+	struct rq_envelope	*evp;
+	int			 i;
+
+	i = (w->now >> (RQ_WHEEL_BITS * l)) & RQ_WHEEL_MASK;
+
+	rq_list_init(&q);
+	rq_list_concat(&q, &w->slots[l][i]);
+	while ((evp = rq_list_first(&q))) {
+		rq_list_remove(&q, evp);
+		w->count--;
+		rq_wheel_insert(w, evp);
+	}
+}
+
+static void
+rq_wheel_advance(struct rq_wheel *w, time_t now)
+{
+	struct rq_envelope	*evp;
+	int			 l, i;
+
+	while (w->now < now) {
+		/* nothing to turn for */
+		if (w->count == 0) {
+			w->now = now;
+			break;
+		}
+
+		w->now++;
+		for (l = 1; l < RQ_WHEEL_LEVELS; l++) {
+			if ((w->now >> (RQ_WHEEL_BITS * (l - 1))) & RQ_WHEEL_MASK)
+				break;
+			rq_wheel_cascade(w, l);
+		}
+
+		i = w->now & RQ_WHEEL_MASK;
+		while ((evp = rq_list_first(&w->slots[0][i]))) {
+			rq_list_remove(&w->slots[0][i], evp);
+			w->count--;
+			evp->u.slot = RQ_WHEEL_DUE;
+			rq_list_insert_tail(&w->due, evp);
+		}
+	}
+}
+
+/*
+ * Earliest time at which something may be due.  For the upper levels,
+ * this is when the first non-empty slot gets cascaded.
+ */
+static time_t
+rq_wheel_next(struct rq_wheel *w)
+{
+	struct rq_envelope	*evp;
+	time_t			 b, t, next = -1;
+	int			 l, k;
+
+	if ((evp = rq_list_first(&w->due)))
+		return rq_envelope_time(evp);
+
+	if (w->count == 0)
+		return (-1);
+
+	for (l = 0; l < RQ_WHEEL_LEVELS; l++) {
+		b = w->now >> (RQ_WHEEL_BITS * l);
+		for (k = 1; k <= RQ_WHEEL_SLOTS; k++) {
+			if (w->slots[l][(b + k) & RQ_WHEEL_MASK].first ==
+			    RQ_NONE)
+				continue;
+			t = (b + k) << (RQ_WHEEL_BITS * l);
+			if (next == -1 || t < next)
+				next = t;
+			break;
+		}
+	}
+
+	return (next);
 }
 
 static void
 rq_queue_init(struct rq_queue *rq)
 {
 	memset(rq, 0, sizeof *rq);
-	tree_init(&rq->messages);
-	TAILQ_INIT(&rq->q_pending);
-	TAILQ_INIT(&rq->q_inflight);
-	TAILQ_INIT(&rq->q_mta);
-	TAILQ_INIT(&rq->q_mda);
-	TAILQ_INIT(&rq->q_bounce);
-	TAILQ_INIT(&rq->q_update);
-	TAILQ_INIT(&rq->q_expired);
-	TAILQ_INIT(&rq->q_removed);
-	SPLAY_INIT(&rq->q_priotree);
+	tree_init_ordered(&rq->messages);
+	rq_list_init(&rq->q_pending);
+	rq_list_init(&rq->q_inflight);
+	TAILQ_INIT(&rq->q_flows[D_MDA][RQ_LANE_INTERACTIVE]);
+	TAILQ_INIT(&rq->q_flows[D_MDA][RQ_LANE_BULK]);
+	TAILQ_INIT(&rq->q_flows[D_MTA][RQ_LANE_INTERACTIVE]);
+	TAILQ_INIT(&rq->q_flows[D_MTA][RQ_LANE_BULK]);
+	rq_list_init(&rq->q_bounce);
+	rq_list_init(&rq->q_update);
+	rq_list_init(&rq->q_expired);
+	rq_list_init(&rq->q_removed);
 }
 
 static void
@@ -853,27 +1595,24 @@ rq_queue_merge(struct rq_queue *rq, struct rq_queue *update)
 	struct rq_message	*message, *tomessage;
 	struct rq_envelope	*envelope;
 	uint64_t		 id;
-	void			*i;
+	uint32_t		 i;
 
 	while (tree_poproot(&update->messages, &id, (void*)&message)) {
 		if ((tomessage = tree_get(&rq->messages, id)) == NULL) {
 			/* message does not exist. reuse structure */
+			rq_message_sort(message);
 			tree_xset(&rq->messages, id, message);
 			continue;
 		}
-		/* need to re-link all envelopes before merging them */
-		i = NULL;
-		while ((tree_iter(&message->envelopes, &i, &id,
-		    (void*)&envelope)))
-			envelope->message = tomessage;
-		tree_merge(&tomessage->envelopes, &message->envelopes);
-		free(message);
-		stat_decrement("scheduler.ramqueue.message", 1);
+		for (i = 0; i < message->count; i++)
+			rq_message_add(tomessage, rq_evp(message->evps[i]));
+		rq_message_sort(tomessage);
+		rq_message_free(message);
 	}
 
 	/* Sorted insert in the pending queue */
-	while ((envelope = TAILQ_FIRST(&update->q_pending))) {
-		TAILQ_REMOVE(&update->q_pending, envelope, entry);
+	while ((envelope = rq_list_first(&update->q_pending))) {
+		rq_list_remove(&update->q_pending, envelope);
 		sorted_insert(rq, envelope);
 	}
 
@@ -888,9 +1627,13 @@ rq_queue_schedule(struct rq_queue *rq)
 	struct rq_envelope	*evp;
 	size_t			 n;
 
+	rq_wheel_advance(rq->q_wheel, currtime);
+
 	n = 0;
-	while ((evp = TAILQ_FIRST(&rq->q_pending))) {
-		if (evp->sched > currtime && evp->expire > currtime)
+	while ((evp = rq_list_first(&rq->q_wheel->due))) {
+		/* the clock went backward */
+		if (rq_abstime(evp->sched) > currtime &&
+		    rq_abstime(evp->expire) > currtime)
 			break;
 
 		if (n == SCHEDULEMAX)
@@ -900,13 +1643,12 @@ rq_queue_schedule(struct rq_queue *rq)
 			fatalx("evp:%016" PRIx64 " flags=0x%x", evp->evpid,
 			    evp->flags);
 
-		if (evp->expire <= currtime) {
-			TAILQ_REMOVE(&rq->q_pending, evp, entry);
-			SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
-			TAILQ_INSERT_TAIL(&rq->q_expired, evp, entry);
+		if (rq_abstime(evp->expire) <= currtime) {
+			rq_wheel_remove(rq->q_wheel, evp);
+			rq_list_insert_tail(&rq->q_expired, evp);
 			evp->state = RQ_EVPSTATE_SCHEDULED;
 			evp->flags |= RQ_ENVELOPE_EXPIRED;
-			evp->t_scheduled = currtime;
+			evp->t_state = rq_reltime(currtime);
 			continue;
 		}
 		rq_envelope_schedule(rq, evp);
@@ -914,7 +1656,35 @@ rq_queue_schedule(struct rq_queue *rq)
 	}
 }
 
-static struct evplist *
+static struct rq_envelope *
+rq_envelope_get(uint64_t evpid)
+{
+	struct rq_message	*msg;
+	uint32_t		 i;
+
+	msg = tree_get(&ramqueue.messages, evpid_to_msgid(evpid));
+	if (msg == NULL)
+		return (NULL);
+
+	i = rq_message_lookup(msg, evpid);
+	if (i == msg->count || rq_evp(msg->evps[i])->evpid != evpid)
+		return (NULL);
+
+	return (rq_evp(msg->evps[i]));
+}
+
+static struct rq_envelope *
+rq_envelope_xget(uint64_t evpid)
+{
+	struct rq_envelope	*evp;
+
+	if ((evp = rq_envelope_get(evpid)) == NULL)
+		fatalx("evp:%016" PRIx64 " not found", evpid);
+
+	return (evp);
+}
+
+static struct rq_list *
 rq_envelope_list(struct rq_queue *rq, struct rq_envelope *evp)
 {
 	switch (evp->state) {
@@ -928,10 +1698,8 @@ rq_envelope_list(struct rq_queue *rq, struct rq_envelope *evp)
 			return &rq->q_removed;
 		if (evp->flags & RQ_ENVELOPE_UPDATE)
 			return &rq->q_update;
-		if (evp->type == D_MTA)
-			return &rq->q_mta;
-		if (evp->type == D_MDA)
-			return &rq->q_mda;
+		if (evp->type == D_MTA || evp->type == D_MDA)
+			return &rq_flow(evp)->q;
 		if (evp->type == D_BOUNCE)
 			return &rq->q_bounce;
 		fatalx("%016" PRIx64 " bad evp type %d", evp->evpid, evp->type);
@@ -948,52 +1716,61 @@ rq_envelope_list(struct rq_queue *rq, struct rq_envelope *evp)
 }
 
 static void
-rq_envelope_schedule(struct rq_queue *rq, struct rq_envelope *evp)
+rq_envelope_unlink(struct rq_queue *rq, struct rq_envelope *evp)
 {
-	struct rq_holdq	*hq;
-	struct evplist	*q = NULL;
+	struct rq_list	*evl;
 
-	switch (evp->type) {
-	case D_MTA:
-		q = &rq->q_mta;
-		break;
-	case D_MDA:
-		q = &rq->q_mda;
-		break;
-	case D_BOUNCE:
-		q = &rq->q_bounce;
-		break;
-	}
+	evl = rq_envelope_list(rq, evp);
+	if (evl == &rq->q_pending)
+		rq_wheel_remove(rq->q_wheel, evp);
+	else if (evp->type != D_BOUNCE && evl == &rq_flow(evp)->q)
+		rq_flow_remove(rq, evp);
+	else
+		rq_list_remove(evl, evp);
+}
+
+static void
+rq_envelope_relink(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	struct rq_list	*evl;
 
-	if (evp->flags & RQ_ENVELOPE_UPDATE)
-		q = &rq->q_update;
+	evl = rq_envelope_list(rq, evp);
+	if (evl == &rq->q_pending)
+		sorted_insert(rq, evp);
+	else if (evp->type != D_BOUNCE && evl == &rq_flow(evp)->q)
+		rq_flow_push(rq, evp);
+	else
+		rq_list_insert_tail(evl, evp);
+}
+
+static void
+rq_envelope_schedule(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	struct rq_holdq	*hq;
 
 	if (evp->state == RQ_EVPSTATE_HELD) {
-		hq = tree_xget(&holdqs[evp->type], evp->holdq);
-		TAILQ_REMOVE(&hq->q, evp, entry);
+		hq = tree_xget(&holdqs[evp->type], evp->u.holdq);
+		rq_list_remove(&hq->q, evp);
 		hq->count -= 1;
-		if (TAILQ_EMPTY(&hq->q)) {
-			tree_xpop(&holdqs[evp->type], evp->holdq);
+		if (hq->q.first == RQ_NONE) {
+			tree_xpop(&holdqs[evp->type], evp->u.holdq);
 			free(hq);
 		}
-		evp->holdq = 0;
+		evp->u.holdq = 0;
 		stat_decrement("scheduler.ramqueue.hold", 1);
 	}
-	else if (!(evp->flags & RQ_ENVELOPE_SUSPEND)) {
-		TAILQ_REMOVE(&rq->q_pending, evp, entry);
-		SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
-	}
+	else if (!(evp->flags & RQ_ENVELOPE_SUSPEND))
+		rq_envelope_unlink(rq, evp);
 
-	TAILQ_INSERT_TAIL(q, evp, entry);
 	evp->state = RQ_EVPSTATE_SCHEDULED;
-	evp->t_scheduled = currtime;
+	evp->t_state = rq_reltime(currtime);
+	rq_envelope_relink(rq, evp);
 }
 
 static int
 rq_envelope_remove(struct rq_queue *rq, struct rq_envelope *evp)
 {
 	struct rq_holdq	*hq;
-	struct evplist	*evl;
 
 	if (evp->flags & (RQ_ENVELOPE_REMOVED | RQ_ENVELOPE_EXPIRED))
 		return (0);
@@ -1006,27 +1783,23 @@ rq_envelope_remove(struct rq_queue *rq, struct rq_envelope *evp)
 	}
 
 	if (evp->state == RQ_EVPSTATE_HELD) {
-		hq = tree_xget(&holdqs[evp->type], evp->holdq);
-		TAILQ_REMOVE(&hq->q, evp, entry);
+		hq = tree_xget(&holdqs[evp->type], evp->u.holdq);
+		rq_list_remove(&hq->q, evp);
 		hq->count -= 1;
-		if (TAILQ_EMPTY(&hq->q)) {
-			tree_xpop(&holdqs[evp->type], evp->holdq);
+		if (hq->q.first == RQ_NONE) {
+			tree_xpop(&holdqs[evp->type], evp->u.holdq);
 			free(hq);
 		}
-		evp->holdq = 0;
+		evp->u.holdq = 0;
 		stat_decrement("scheduler.ramqueue.hold", 1);
 	}
-	else if (!(evp->flags & RQ_ENVELOPE_SUSPEND)) {
-		evl = rq_envelope_list(rq, evp);
-		TAILQ_REMOVE(evl, evp, entry);
-		if (evl == &rq->q_pending)
-			SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
-	}
+	else if (!(evp->flags & RQ_ENVELOPE_SUSPEND))
+		rq_envelope_unlink(rq, evp);
 
-	TAILQ_INSERT_TAIL(&rq->q_removed, evp, entry);
+	rq_list_insert_tail(&rq->q_removed, evp);
 	evp->state = RQ_EVPSTATE_SCHEDULED;
 	evp->flags |= RQ_ENVELOPE_REMOVED;
-	evp->t_scheduled = currtime;
+	evp->t_state = rq_reltime(currtime);
 
 	return (1);
 }
@@ -1035,29 +1808,24 @@ static int
 rq_envelope_suspend(struct rq_queue *rq, struct rq_envelope *evp)
 {
 	struct rq_holdq	*hq;
-	struct evplist	*evl;
 
 	if (evp->flags & RQ_ENVELOPE_SUSPEND)
 		return (0);
 
 	if (evp->state == RQ_EVPSTATE_HELD) {
-		hq = tree_xget(&holdqs[evp->type], evp->holdq);
-		TAILQ_REMOVE(&hq->q, evp, entry);
+		hq = tree_xget(&holdqs[evp->type], evp->u.holdq);
+		rq_list_remove(&hq->q, evp);
 		hq->count -= 1;
-		if (TAILQ_EMPTY(&hq->q)) {
-			tree_xpop(&holdqs[evp->type], evp->holdq);
+		if (hq->q.first == RQ_NONE) {
+			tree_xpop(&holdqs[evp->type], evp->u.holdq);
 			free(hq);
 		}
-		evp->holdq = 0;
+		evp->u.holdq = 0;
 		evp->state = RQ_EVPSTATE_PENDING;
 		stat_decrement("scheduler.ramqueue.hold", 1);
 	}
-	else if (evp->state != RQ_EVPSTATE_INFLIGHT) {
-		evl = rq_envelope_list(rq, evp);
-		TAILQ_REMOVE(evl, evp, entry);
-		if (evl == &rq->q_pending)
-			SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
-	}
+	else if (evp->state != RQ_EVPSTATE_INFLIGHT)
+		rq_envelope_unlink(rq, evp);
 
 	evp->flags |= RQ_ENVELOPE_SUSPEND;
 
@@ -1067,18 +1835,11 @@ rq_envelope_suspend(struct rq_queue *rq, struct rq_envelope *evp)
 static int
 rq_envelope_resume(struct rq_queue *rq, struct rq_envelope *evp)
 {
-	struct evplist	*evl;
-
 	if (!(evp->flags & RQ_ENVELOPE_SUSPEND))
 		return (0);
 
-	if (evp->state != RQ_EVPSTATE_INFLIGHT) {
-		evl = rq_envelope_list(rq, evp);
-		if (evl == &rq->q_pending)
-			sorted_insert(rq, evp);
-		else
-			TAILQ_INSERT_TAIL(evl, evp, entry);
-	}
+	if (evp->state != RQ_EVPSTATE_INFLIGHT)
+		rq_envelope_relink(rq, evp);
 
 	evp->flags &= ~RQ_ENVELOPE_SUSPEND;
 
@@ -1088,16 +1849,19 @@ rq_envelope_resume(struct rq_queue *rq, struct rq_envelope *evp)
 static void
 rq_envelope_delete(struct rq_queue *rq, struct rq_envelope *evp)
 {
-	tree_xpop(&evp->message->envelopes, evp->evpid);
-	if (tree_empty(&evp->message->envelopes)) {
-		tree_xpop(&rq->messages, evp->message->msgid);
-		free(evp->message);
-		stat_decrement("scheduler.ramqueue.message", 1);
+	struct rq_message	*msg;
+
+	msg = tree_xget(&rq->messages, evpid_to_msgid(evp->evpid));
+	rq_message_del(msg, evp);
+	if (msg->count == 0) {
+		tree_xpop(&rq->messages, msg->msgid);
+		rq_message_free(msg);
 	}
 
-	free(evp);
+	if (evp->type != D_BOUNCE)
+		rq_class_unref(evp->class);
+	rq_evp_free(evp);
 	rq->evpcount--;
-	stat_decrement("scheduler.ramqueue.envelope", 1);
 }
 
 static const char *
@@ -1115,33 +1879,38 @@ rq_envelope_to_text(struct rq_envelope *e)
 	else if (e->type == D_MTA)
 		(void)strlcat(buf, "mta", sizeof buf);
 
+	if (e->type != D_BOUNCE && e->class != RQ_CLASS_DEFAULT) {
+		(void)strlcat(buf, ",class=", sizeof buf);
+		(void)strlcat(buf, classes[e->class]->name, sizeof buf);
+	}
+
 	(void)snprintf(t, sizeof t, ",expire=%s",
-	    duration_to_text(e->expire - currtime));
+	    duration_to_text(rq_abstime(e->expire) - currtime));
 	(void)strlcat(buf, t, sizeof buf);
 
 
 	switch (e->state) {
 	case RQ_EVPSTATE_PENDING:
 		(void)snprintf(t, sizeof t, ",pending=%s",
-		    duration_to_text(e->sched - currtime));
+		    duration_to_text(rq_abstime(e->sched) - currtime));
 		(void)strlcat(buf, t, sizeof buf);
 		break;
 
 	case RQ_EVPSTATE_SCHEDULED:
 		(void)snprintf(t, sizeof t, ",scheduled=%s",
-		    duration_to_text(currtime - e->t_scheduled));
+		    duration_to_text(currtime - rq_abstime(e->t_state)));
 		(void)strlcat(buf, t, sizeof buf);
 		break;
 
 	case RQ_EVPSTATE_INFLIGHT:
 		(void)snprintf(t, sizeof t, ",inflight=%s",
-		    duration_to_text(currtime - e->t_inflight));
+		    duration_to_text(currtime - rq_abstime(e->t_state)));
 		(void)strlcat(buf, t, sizeof buf);
 		break;
 
 	case RQ_EVPSTATE_HELD:
 		(void)snprintf(t, sizeof t, ",held=%s",
-		    duration_to_text(currtime - e->t_inflight));
+		    duration_to_text(currtime - rq_abstime(e->t_state)));
 		(void)strlcat(buf, t, sizeof buf);
 		break;
 	default:
@@ -1164,38 +1933,18 @@ static void
 rq_queue_dump(struct rq_queue *rq, const char * name)
 {
 	struct rq_message	*message;
-	struct rq_envelope	*envelope;
-	void			*i, *j;
+	void			*i;
 	uint64_t		 id;
+	uint32_t		 j;
 
 	log_debug("debug: /--- ramqueue: %s", name);
 
 	i = NULL;
 	while ((tree_iter(&rq->messages, &i, &id, (void*)&message))) {
 		log_debug("debug: | msg:%08" PRIx32, message->msgid);
-		j = NULL;
-		while ((tree_iter(&message->envelopes, &j, &id,
-		    (void*)&envelope)))
+		for (j = 0; j < message->count; j++)
 			log_debug("debug: |   %s",
-			    rq_envelope_to_text(envelope));
+			    rq_envelope_to_text(rq_evp(message->evps[j])));
 	}
 	log_debug("debug: \\---");
 }
-
-static int
-rq_envelope_cmp(struct rq_envelope *e1, struct rq_envelope *e2)
-{
-	time_t	ref1, ref2;
-
-	ref1 = (e1->sched < e1->expire) ? e1->sched : e1->expire;
-	ref2 = (e2->sched < e2->expire) ? e2->sched : e2->expire;
-	if (ref1 != ref2)
-		return (ref1 < ref2) ? -1 : 1;
-
-	if (e1->evpid != e2->evpid)
-		return (e1->evpid < e2->evpid) ? -1 : 1;
-
-	return 0;
-}
-
-SPLAY_GENERATE(prioqtree, rq_envelope, t_entry, rq_envelope_cmp);
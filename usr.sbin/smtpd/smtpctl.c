@@ -58,9 +58,6 @@
 #include "parser.h"
 #include "log.h"
 
-#ifndef PATH_GZCAT
-#define PATH_GZCAT	"/usr/bin/gzcat"
-#endif
 #define	PATH_CAT	"/bin/cat"
 #define PATH_QUEUE	"/queue"
 #ifndef PATH_ENCRYPT
@@ -79,13 +76,20 @@ void usage(void);
 static void show_queue_envelope(struct envelope *, int);
 static void getflag(uint *, int, char *, char *, size_t);
 static void display(const char *);
+static void display_envelope(FILE *, const char *);
+static FILE *bundle_envelope(const char *, uint64_t);
+static FILE *display_decrypt(FILE *);
 static int str_to_trace(const char *);
 static int str_to_profile(const char *);
 static void show_offline_envelope(uint64_t);
-static int is_gzip_fp(FILE *);
+static void show_offline_bundle(const char *);
+static void show_offline_buffer(uint64_t, char *, size_t);
+static int queue_path(char *, size_t, const char *, uint32_t, const char *);
+static void display_uncompress(FILE *);
+static int display_sink(void *, const void *, size_t);
+static int is_compressed_fp(FILE *);
 static int is_encrypted_fp(FILE *);
 static int is_encrypted_buffer(const char *);
-static int is_gzip_buffer(const char *);
 static FILE *offline_file(void);
 static void sendmail_compat(int, char **);
 
@@ -100,9 +104,11 @@ char		*rdata;
 size_t		 rlen;
 time_t		 now;
 
+struct queue_backend queue_backend_log;
 struct queue_backend queue_backend_null;
 struct queue_backend queue_backend_proc;
 struct queue_backend queue_backend_ram;
+struct queue_backend queue_backend_tiered;
 
 __dead void
 usage(void)
@@ -718,17 +724,28 @@ do_schedule(int argc, struct parameter *argv)
 static int
 do_show_envelope(int argc, struct parameter *argv)
 {
-	char	 buf[PATH_MAX];
+	struct stat	 sb;
+	FILE		*fp;
+	char		 buf[PATH_MAX];
+	char		 name[17];
+	uint64_t	 evpid = argv[0].u.u_evpid;
 
-	if (!bsnprintf(buf, sizeof(buf), "%s%s/%02x/%08x/%016" PRIx64,
-	    PATH_SPOOL,
-	    PATH_QUEUE,
-	    (evpid_to_msgid(argv[0].u.u_evpid) & 0xff000000) >> 24,
-	    evpid_to_msgid(argv[0].u.u_evpid),
-	    argv[0].u.u_evpid))
+	(void)snprintf(name, sizeof(name), "%016" PRIx64, evpid);
+	if (!queue_path(buf, sizeof(buf), PATH_SPOOL,
+	    evpid_to_msgid(evpid), name))
 		errx(1, "unable to retrieve envelope");
 
-	display(buf);
+	if ((evpid & 0xffffffff) <= QUEUE_BUNDLE_SLOTS &&
+	    stat(buf, &sb) == -1 && errno == ENOENT) {
+		if (!queue_path(buf, sizeof(buf), PATH_SPOOL,
+		    evpid_to_msgid(evpid), QUEUE_BUNDLE_FILE))
+			errx(1, "unable to retrieve envelope");
+		fp = bundle_envelope(buf, evpid);
+	}
+	else if ((fp = fopen(buf, "r")) == NULL)
+		err(1, "fopen");
+
+	display_envelope(fp, buf);
 
 	return (0);
 }
@@ -752,11 +769,7 @@ do_show_message(int argc, struct parameter *argv)
 	else
 		msgid = argv[0].u.u_msgid;
 
-	if (!bsnprintf(buf, sizeof(buf), "%s%s/%02x/%08x/message",
-	    PATH_SPOOL,
-	    PATH_QUEUE,
-	    (msgid & 0xff000000) >> 24,
-	    msgid))
+	if (!queue_path(buf, sizeof(buf), PATH_SPOOL, msgid, "message"))
 		errx(1, "unable to retrieve message");
 
 	display(buf);
@@ -791,6 +804,11 @@ do_show_queue(int argc, struct parameter *argv)
 			case FTS_DNR:
 				break;
 			case FTS_F:
+				if (strcmp(ftse->fts_name,
+				    QUEUE_BUNDLE_FILE) == 0) {
+					show_offline_bundle(ftse->fts_path);
+					break;
+				}
 				tmp = NULL;
 				evpid = strtoull(ftse->fts_name, &tmp, 16);
 				if (tmp && *tmp != '\0')
@@ -895,11 +913,14 @@ do_show_stats(int argc, struct parameter *argv)
 static int
 do_show_status(int argc, struct parameter *argv)
 {
-	uint32_t	sc_flags;
+	struct queue_load_status	qload;
+	uint32_t			sc_flags;
+	time_t				elapsed;
 
 	srv_send(IMSG_CTL_SHOW_STATUS, NULL, 0);
 	srv_recv(IMSG_CTL_SHOW_STATUS);
 	srv_read(&sc_flags, sizeof(sc_flags));
+	srv_read(&qload, sizeof(qload));
 	srv_end();
 	printf("MDA %s\n",
 	    (sc_flags & SMTPD_MDA_PAUSED) ? "paused" : "running");
@@ -907,6 +928,24 @@ do_show_status(int argc, struct parameter *argv)
 	    (sc_flags & SMTPD_MTA_PAUSED) ? "paused" : "running");
 	printf("SMTP %s\n",
 	    (sc_flags & SMTPD_SMTP_PAUSED) ? "paused" : "running");
+	if (qload.start == 0)
+		return (0);
+	switch (qload.state) {
+	case QUEUE_LOAD_DONE:
+		printf("QUEUE loaded (%zu envelopes in %s)\n",
+		    qload.envelopes, duration_to_text(qload.end - qload.start));
+		break;
+	case QUEUE_LOAD_VALIDATING:
+		printf("QUEUE validating (%zu envelopes restored, "
+		    "%zu total)\n", qload.restored, qload.envelopes);
+		break;
+	default:
+		elapsed = time(NULL) - qload.start;
+		printf("QUEUE loading (%zu envelopes, %lld/s)\n",
+		    qload.envelopes, elapsed ?
+		    (long long)(qload.envelopes / elapsed) : 0LL);
+		break;
+	}
 	return (0);
 }
 
@@ -1270,96 +1309,235 @@ getflag(uint *bitmap, int bit, char *bitstr, char *buf, size_t len)
 	}
 }
 
+/*
+ * Messages are hashed in the queue under one or two levels of buckets
+ * depending on the configuration, and under both during a migration.
+ */
+static int
+queue_path(char *buf, size_t len, const char *root, uint32_t msgid,
+    const char *file)
+{
+	struct stat	sb;
+
+	if (!bsnprintf(buf, len, "%s%s/%02x/%02x/%08x/%s", root, PATH_QUEUE,
+	    (msgid & 0xff000000) >> 24, (msgid & 0xff0000) >> 16, msgid, file))
+		return (0);
+	if (stat(buf, &sb) == 0)
+		return (1);
+
+	return (bsnprintf(buf, len, "%s%s/%02x/%08x/%s", root, PATH_QUEUE,
+	    (msgid & 0xff000000) >> 24, msgid, file));
+}
+
 static void
 show_offline_envelope(uint64_t evpid)
 {
 	FILE   *fp = NULL;
 	char	pathname[PATH_MAX];
-	size_t	plen;
-	char   *p;
+	char	name[17];
 	size_t	buflen;
 	char	buffer[sizeof(struct envelope)];
 
-	struct envelope	evp;
-
-	if (!bsnprintf(pathname, sizeof pathname,
-		"/queue/%02x/%08x/%016"PRIx64,
-		(evpid_to_msgid(evpid) & 0xff000000) >> 24,
-		evpid_to_msgid(evpid), evpid))
-		goto end;
+	(void)snprintf(name, sizeof(name), "%016" PRIx64, evpid);
+	if (!queue_path(pathname, sizeof pathname, "", evpid_to_msgid(evpid),
+	    name))
+		return;
 	fp = fopen(pathname, "r");
 	if (fp == NULL)
-		goto end;
+		return;
 
 	buflen = fread(buffer, 1, sizeof (buffer) - 1, fp);
-	p = buffer;
-	plen = buflen;
 	buffer[buflen] = '\0';
+	fclose(fp);
+
+	show_offline_buffer(evpid, buffer, buflen);
+}
+
+static void
+show_offline_bundle(const char *path)
+{
+	FILE		*fp;
+	char		 buffer[sizeof(struct envelope)];
+	uint64_t	 evpid;
+	int		 r;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return;
+
+	while ((r = queue_fs_bundle_next(fp, &evpid, buffer,
+	    sizeof(buffer))) != -1)
+		if (r > 0)
+			show_offline_buffer(evpid, buffer, r);
+
+	fclose(fp);
+}
+
+static void
+show_offline_buffer(uint64_t evpid, char *p, size_t plen)
+{
+	struct envelope	evp;
 
 	if (is_encrypted_buffer(p)) {
 		warnx("offline encrypted queue is not supported yet");
-		goto end;
+		return;
 	}
 
-	if (is_gzip_buffer(p)) {
+	if (compress_is_compressed(p, plen)) {
 		warnx("offline compressed queue is not supported yet");
-		goto end;
+		return;
 	}
 
 	if (!envelope_load_buffer(&evp, p, plen))
-		goto end;
+		return;
 	evp.id = evpid;
 	show_queue_envelope(&evp, 0);
-
-end:
-	if (fp)
-		fclose(fp);
 }
 
 static void
 display(const char *s)
 {
 	FILE   *fp;
-	char   *key;
-	int	gzipped;
-	char   *gzcat_argv0 = strrchr(PATH_GZCAT, '/') + 1;
 
 	if ((fp = fopen(s, "r")) == NULL)
 		err(1, "fopen");
 
-	if (is_encrypted_fp(fp)) {
-		int	i;
-		FILE   *ofp = NULL;
+	if (is_encrypted_fp(fp))
+		fp = display_decrypt(fp);
+	if (is_compressed_fp(fp))
+		display_uncompress(fp);
+
+	lseek(fileno(fp), 0, SEEK_SET);
+	(void)dup2(fileno(fp), STDIN_FILENO);
+	execl(PATH_CAT, "cat", (char *)NULL);
+	err(1, "execl");
+}
+
+static void
+display_uncompress(FILE *fp)
+{
+	void	*stream;
+	char	 buf[BUFSIZ];
+	size_t	 n;
+
+	if ((stream = compress_stream_new(COMPRESS_DECODE)) == NULL)
+		err(1, "compress_stream_new");
+	while ((n = fread(buf, 1, sizeof buf, fp)) != 0)
+		if (!compress_stream_update(stream, buf, n, display_sink,
+		    stdout))
+			errx(1, "failed to uncompress message");
+	if (ferror(fp))
+		err(1, "fread");
+	if (!compress_stream_update(stream, NULL, 0, display_sink, stdout))
+		errx(1, "failed to uncompress message");
+	compress_stream_free(stream);
+
+	if (fflush(stdout) == EOF)
+		err(1, "fflush");
+	exit(0);
+}
+
+static int
+display_sink(void *arg, const void *buf, size_t len)
+{
+	return (fwrite(buf, 1, len, arg) == len);
+}
+
+/*
+ * Envelopes may be stored in binary form, always render them as text.
+ */
+/*
+ * Copy an envelope out of a bundle, to be displayed as if it had its
+ * own file.
+ */
+static FILE *
+bundle_envelope(const char *path, uint64_t evpid)
+{
+	FILE		*fp;
+	char		 buf[sizeof(struct envelope)];
+	uint64_t	 id;
+	int		 r;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "fopen");
+	while ((r = queue_fs_bundle_next(fp, &id, buf, sizeof(buf))) != -1)
+		if (r > 0 && id == evpid)
+			break;
+	fclose(fp);
+	if (r == -1)
+		errx(1, "unable to retrieve envelope");
+
+	if ((fp = tmpfile()) == NULL)
+		err(1, "tmpfile");
+	if (fwrite(buf, 1, r, fp) != (size_t)r)
+		err(1, "fwrite");
+	fseek(fp, 0, SEEK_SET);
 
-		if ((ofp = tmpfile()) == NULL)
-			err(1, "tmpfile");
+	return (fp);
+}
 
-		for (i = 0; i < 3; i++) {
-			key = getpass("key> ");
-			if (crypto_setup(key, strlen(key)))
-				break;
-		}
-		if (i == 3)
-			errx(1, "crypto-setup: invalid key");
+static void
+display_envelope(FILE *fp, const char *s)
+{
+	struct envelope		 evp;
+	char			 buf[sizeof(struct envelope)];
+	char			 tmp[sizeof(struct envelope)];
+	size_t			 len;
+
+	if (is_encrypted_fp(fp))
+		fp = display_decrypt(fp);
+
+	len = fread(buf, 1, sizeof(buf), fp);
+	if (ferror(fp))
+		err(1, "fread");
+	if (len == sizeof(buf))
+		errx(1, "envelope too large: %s", s);
+	fclose(fp);
+
+	if (compress_is_compressed(buf, len)) {
+		len = uncompress_chunk(buf, len, tmp, sizeof(tmp));
+		if (len == 0)
+			errx(1, "failed to uncompress envelope: %s", s);
+		memcpy(buf, tmp, len);
+	}
 
-		if (!crypto_decrypt_file(fp, ofp)) {
-			printf("object is encrypted: %s\n", key);
-			exit(1);
-		}
+	if (envelope_is_binary(buf, len)) {
+		if (!envelope_load_buffer(&evp, buf, len))
+			errx(1, "invalid envelope: %s", s);
+		len = envelope_dump_buffer(&evp, buf, sizeof(buf));
+		if (len == 0)
+			errx(1, "failed to render envelope: %s", s);
+	}
+
+	if (fwrite(buf, 1, len, stdout) != len)
+		err(1, "fwrite");
+}
+
+static FILE *
+display_decrypt(FILE *fp)
+{
+	FILE   *ofp;
+	char   *key;
+	int	i;
+
+	if ((ofp = tmpfile()) == NULL)
+		err(1, "tmpfile");
 
-		fclose(fp);
-		fp = ofp;
-		fseek(fp, 0, SEEK_SET);
+	for (i = 0; i < 3; i++) {
+		key = getpass("key> ");
+		if (crypto_setup(key, strlen(key)))
+			break;
 	}
-	gzipped = is_gzip_fp(fp);
+	if (i == 3)
+		errx(1, "crypto-setup: invalid key");
 
-	lseek(fileno(fp), 0, SEEK_SET);
-	(void)dup2(fileno(fp), STDIN_FILENO);
-	if (gzipped)
-		execl(PATH_GZCAT, gzcat_argv0, (char *)NULL);
-	else
-		execl(PATH_CAT, "cat", (char *)NULL);
-	err(1, "execl");
+	if (!crypto_decrypt_file(fp, ofp)) {
+		printf("object is encrypted: %s\n", key);
+		exit(1);
+	}
+
+	fclose(fp);
+	fseek(ofp, 0, SEEK_SET);
+	return (ofp);
 }
 
 static int
@@ -1407,31 +1585,16 @@ str_to_profile(const char *str)
 }
 
 static int
-is_gzip_buffer(const char *buffer)
-{
-	uint16_t	magic;
-
-	memcpy(&magic, buffer, sizeof magic);
-#define	GZIP_MAGIC	0x8b1f
-	return (magic == GZIP_MAGIC);
-}
-
-static int
-is_gzip_fp(FILE *fp)
+is_compressed_fp(FILE *fp)
 {
-	uint8_t		magic[2];
-	int		ret = 0;
+	char	magic[8];
+	size_t	n;
 
-	if (fread(&magic, 1, sizeof magic, fp) != sizeof magic)
-		goto end;
-
-	ret = is_gzip_buffer((const char *)&magic);
-end:
+	n = fread(magic, 1, sizeof magic, fp);
 	fseek(fp, 0, SEEK_SET);
-	return ret;
+	return (compress_is_compressed(magic, n));
 }
 
-
 /* XXX */
 /*
  * queue supports transparent encryption.
@@ -1447,7 +1610,8 @@ is_encrypted_buffer(const char *buffer)
 
 	magic = *buffer;
 #define	ENCRYPTION_MAGIC	0x1
-	return (magic == ENCRYPTION_MAGIC);
+#define	ENCRYPTION_MAGIC_CHUNKED	0x2
+	return (magic == ENCRYPTION_MAGIC || magic == ENCRYPTION_MAGIC_CHUNKED);
 }
 
 static int
@@ -46,7 +46,7 @@ enum {
 	PROC_QUEUE_ENVELOPE_WALK,
 };
 
-#define PROC_SCHEDULER_API_VERSION	2
+#define PROC_SCHEDULER_API_VERSION	3
 
 struct scheduler_info;
 
@@ -105,6 +105,7 @@ struct scheduler_info {
 	time_t			lasttry;
 	time_t			lastbounce;
 	time_t			nexttry;
+	char			class[SMTPD_CLASS_SIZE];
 };
 
 #define SCHED_REMOVE		0x01
@@ -242,11 +243,13 @@ const char *esc_description(enum enhanced_status_code);
 
 
 /* queue */
+void queue_api_threaded(void);
 void queue_api_on_close(int(*)(void));
 void queue_api_on_message_create(int(*)(uint32_t *));
 void queue_api_on_message_commit(int(*)(uint32_t, const char*));
 void queue_api_on_message_delete(int(*)(uint32_t));
 void queue_api_on_message_fd_r(int(*)(uint32_t));
+void queue_api_on_message_sync(int(*)(void));
 void queue_api_on_envelope_create(int(*)(uint32_t, const char *, size_t, uint64_t *));
 void queue_api_on_envelope_delete(int(*)(uint64_t));
 void queue_api_on_envelope_update(int(*)(uint64_t, const char *, size_t));
@@ -22,6 +22,7 @@
 
 #define	SMTPD_TABLENAME_SIZE	 (64 + 1)
 #define	SMTPD_TAG_SIZE		 (32 + 1)
+#define	SMTPD_CLASS_SIZE	 (63 + 1)
 
 /* buffer sizes for email address components */
 #define SMTPD_MAXLOCALPARTSIZE	 (255 + 1)
@@ -835,8 +835,10 @@ main(int argc, char *argv[])
 		smtpd_process = PROC_QUEUE;
 		setup_proc();
 
-		if (env->sc_queue_flags & QUEUE_COMPRESSION)
-			env->sc_comp = compress_backend_lookup("gzip");
+		if (env->sc_queue_flags & QUEUE_COMPRESSION &&
+		    !compress_setup(env->sc_queue_compress,
+		    env->sc_queue_compress_level, env->sc_queue_compress_dict))
+			fatalx("could not initialize queue compression");
 
 		if (!queue_init(backend_queue, 1))
 			fatalx("could not initialize queue backend");
@@ -2076,11 +2078,13 @@ imsg_to_str(int type)
 	CASE(IMSG_QUEUE_DISCOVER_MSGID);
 	CASE(IMSG_QUEUE_ENVELOPE_ACK);
 	CASE(IMSG_QUEUE_ENVELOPE_COMMIT);
+	CASE(IMSG_QUEUE_ENVELOPE_LOAD);
 	CASE(IMSG_QUEUE_ENVELOPE_REMOVE);
 	CASE(IMSG_QUEUE_ENVELOPE_SCHEDULE);
 	CASE(IMSG_QUEUE_ENVELOPE_SUBMIT);
 	CASE(IMSG_QUEUE_HOLDQ_HOLD);
 	CASE(IMSG_QUEUE_HOLDQ_RELEASE);
+	CASE(IMSG_QUEUE_LOAD_STATUS);
 	CASE(IMSG_QUEUE_MESSAGE_COMMIT);
 	CASE(IMSG_QUEUE_MESSAGE_ROLLBACK);
 	CASE(IMSG_QUEUE_SMTP_SESSION);
@@ -2119,8 +2123,11 @@ imsg_to_str(int type)
 	CASE(IMSG_SCHED_ENVELOPE_DELIVER);
 	CASE(IMSG_SCHED_ENVELOPE_EXPIRE);
 	CASE(IMSG_SCHED_ENVELOPE_INJECT);
+	CASE(IMSG_SCHED_ENVELOPE_LOADED);
 	CASE(IMSG_SCHED_ENVELOPE_REMOVE);
 	CASE(IMSG_SCHED_ENVELOPE_TRANSFER);
+	CASE(IMSG_SCHED_ENVELOPE_PREFETCH);
+	CASE(IMSG_SCHED_ENVELOPE_SUSPEND);
 
 	CASE(IMSG_SMTP_AUTHENTICATE);
 	CASE(IMSG_SMTP_MESSAGE_COMMIT);
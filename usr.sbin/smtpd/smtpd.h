@@ -56,10 +56,14 @@
 
 #define MAX_HOPS_COUNT		 100
 #define	DEFAULT_MAX_BODY_SIZE	(35*1024*1024)
+#define	DEFAULT_QUEUE_MEMORY	(64*1024*1024)
 
 #define	EXPAND_BUFFER		 1024
 
 #define SMTPD_QUEUE_EXPIRY	 (4 * 24 * 60 * 60)
+#define QUEUE_LEVELS_MAX	 2
+#define QUEUE_BUNDLE_FILE	 "envelopes"
+#define QUEUE_BUNDLE_SLOTS	 0x100000	/* evpids reserved for bundles */
 #ifndef SMTPD_USER
 #define SMTPD_USER		 "_smtpd"
 #endif
@@ -81,6 +85,7 @@
 #define	PATH_SMTPCTL		"/usr/sbin/smtpctl"
 #endif
 
+#define PATH_CHECKPOINT		"/checkpoint"
 #define PATH_OFFLINE		"/offline"
 #define PATH_PURGE		"/purge"
 #define PATH_TEMPORARY		"/temporary"
@@ -145,6 +150,7 @@ struct relayhost {
 	char hostname[HOST_NAME_MAX+1];
 	uint16_t port;
 	char authlabel[PATH_MAX];
+	int weight;
 };
 
 struct credentials {
@@ -182,7 +188,7 @@ union lookup {
  * Bump IMSG_VERSION whenever a change is made to enum imsg_type.
  * This will ensure that we can never use a wrong version of smtpctl with smtpd.
  */
-#define	IMSG_VERSION		16
+#define	IMSG_VERSION		21
 
 enum imsg_type {
 	IMSG_NONE,
@@ -255,11 +261,13 @@ enum imsg_type {
 	IMSG_QUEUE_DISCOVER_MSGID,
 	IMSG_QUEUE_ENVELOPE_ACK,
 	IMSG_QUEUE_ENVELOPE_COMMIT,
+	IMSG_QUEUE_ENVELOPE_LOAD,
 	IMSG_QUEUE_ENVELOPE_REMOVE,
 	IMSG_QUEUE_ENVELOPE_SCHEDULE,
 	IMSG_QUEUE_ENVELOPE_SUBMIT,
 	IMSG_QUEUE_HOLDQ_HOLD,
 	IMSG_QUEUE_HOLDQ_RELEASE,
+	IMSG_QUEUE_LOAD_STATUS,
 	IMSG_QUEUE_MESSAGE_COMMIT,
 	IMSG_QUEUE_MESSAGE_ROLLBACK,
 	IMSG_QUEUE_SMTP_SESSION,
@@ -298,8 +306,11 @@ enum imsg_type {
 	IMSG_SCHED_ENVELOPE_DELIVER,
 	IMSG_SCHED_ENVELOPE_EXPIRE,
 	IMSG_SCHED_ENVELOPE_INJECT,
+	IMSG_SCHED_ENVELOPE_LOADED,
 	IMSG_SCHED_ENVELOPE_REMOVE,
 	IMSG_SCHED_ENVELOPE_TRANSFER,
+	IMSG_SCHED_ENVELOPE_PREFETCH,
+	IMSG_SCHED_ENVELOPE_SUSPEND,
 
 	IMSG_SMTP_AUTHENTICATE,
 	IMSG_SMTP_MESSAGE_COMMIT,
@@ -493,7 +504,8 @@ struct maddrmap {
 #define	DSN_ENVID_LEN	100
 #define	DSN_ORCPT_LEN	500
 
-#define	SMTPD_ENVELOPE_VERSION		3
+#define	SMTPD_ENVELOPE_VERSION		4
+#define	SMTPD_ENVELOPE_VERSION_ASCII	3	/* last ASCII-only version */
 struct envelope {
 	TAILQ_ENTRY(envelope)		entry;
 
@@ -589,9 +601,16 @@ struct smtpd {
 #define QUEUE_COMPRESSION      		0x00000001
 #define QUEUE_ENCRYPTION      		0x00000002
 #define QUEUE_EVPCACHE			0x00000004
+#define QUEUE_BUNDLE			0x00000008
 	uint32_t			sc_queue_flags;
 	char			       *sc_queue_key;
-	size_t				sc_queue_evpcache_size;
+	size_t				sc_queue_evpcache_size;	/* bytes */
+	size_t				sc_queue_msgcache_size;	/* bytes */
+	size_t				sc_queue_memory;	/* bytes */
+	int				sc_queue_levels;
+	char			       *sc_queue_compress;
+	int				sc_queue_compress_level;
+	char			       *sc_queue_compress_dict;
 
 	size_t				sc_session_max_rcpt;
 	size_t				sc_session_max_mails;
@@ -604,12 +623,20 @@ struct smtpd {
 	size_t				sc_mda_task_release;
 
 	size_t				sc_mta_max_deferred;
+	size_t				sc_mta_prewarm;
 
 	size_t				sc_scheduler_max_inflight;
 	size_t				sc_scheduler_max_evp_batch_size;
 	size_t				sc_scheduler_max_msg_batch_size;
 	size_t				sc_scheduler_max_schedule;
 
+#define SCHEDULER_CLASS_NONE		0
+#define SCHEDULER_CLASS_DISPATCHER	1
+#define SCHEDULER_CLASS_SENDER_DOMAIN	2
+#define SCHEDULER_CLASS_TAG		3
+	int				sc_scheduler_class_key;
+	struct dict		       *sc_scheduler_classes;
+
 	struct dict		       *sc_filter_processes_dict;
 
 	int				sc_ttl;
@@ -759,6 +786,7 @@ struct mta_connector {
 #define CONNECTOR_NEW			0x10000
 #define CONNECTOR_WAIT			0x20000
 	int				 flags;
+	struct runq_job			*runq;
 
 	int				 refcount;
 	size_t				 nconn;
@@ -784,6 +812,7 @@ struct mta_route {
 	time_t			 lastconn;
 	time_t			 lastdisc;
 	time_t			 lastpenalty;
+	struct runq_job		*runq;
 };
 
 struct mta_limits {
@@ -814,6 +843,9 @@ struct mta_limits {
 	int	task_hiwat;
 	int	task_lowat;
 	int	task_release;
+
+	size_t	prewarm_sessions;
+	time_t	prewarm_keepalive;
 };
 
 struct mta_relay {
@@ -859,11 +891,19 @@ struct mta_relay {
 #define RELAY_WAIT_SMARTHOST	0x40
 #define RELAY_WAITMASK		0x7f
 	int			 status;
+	struct runq_job		*runq;
 
 	int			 refcount;
 	size_t			 nconn;
 	size_t			 nconn_ready;
+	TAILQ_HEAD(, mta_session) idle;
 	time_t			 lastconn;
+
+	size_t			 activity;
+	size_t			 score;
+	size_t			 prewarm;
+
+	struct mta_smarthost	*smarthost;
 };
 
 struct mta_envelope {
@@ -900,11 +940,39 @@ struct queue_backend {
 	int	(*init)(struct passwd *, int, const char *);
 };
 
+/* handlers of a backend, as seen by a backend layered on top of it */
+struct queue_api {
+	int	(*close)(void);
+	int	(*message_create)(uint32_t *);
+	int	(*message_commit)(uint32_t, const char *);
+	int	(*message_delete)(uint32_t);
+	int	(*message_fd_r)(uint32_t);
+	int	(*message_sync)(void);
+	int	(*envelope_create)(uint32_t, const char *, size_t, uint64_t *);
+	int	(*envelope_delete)(uint64_t);
+	int	(*envelope_update)(uint64_t, const char *, size_t);
+	int	(*envelope_load)(uint64_t, char *, size_t);
+	int	(*envelope_walk)(uint64_t *, char *, size_t);
+	int	(*message_walk)(uint64_t *, char *, size_t, uint32_t, int *,
+		    void **);
+};
+
+enum compress_mode {
+	COMPRESS_ENCODE,
+	COMPRESS_DECODE,
+	COMPRESS_STORE,
+};
+
 struct compress_backend {
+	int	(*init)(int, const char *);
+
 	size_t	(*compress_chunk)(void *, size_t, void *, size_t);
 	size_t	(*uncompress_chunk)(void *, size_t, void *, size_t);
-	int	(*compress_file)(FILE *, FILE *);
-	int	(*uncompress_file)(FILE *, FILE *);
+
+	void   *(*stream_new)(int);
+	int	(*stream_update)(void *, const void *, size_t,
+		    int (*)(void *, const void *, size_t), void *);
+	void	(*stream_free)(void *);
 };
 
 /* auth structures */
@@ -973,6 +1041,18 @@ struct stat_backend {
 	int	(*iter)(void **, char **, struct stat_value *);
 };
 
+struct queue_load_status {
+	enum {
+		QUEUE_LOAD_RUNNING,
+		QUEUE_LOAD_VALIDATING,
+		QUEUE_LOAD_DONE,
+	}			 state;
+	size_t			 envelopes;
+	size_t			 restored;
+	time_t			 start;
+	time_t			 end;
+};
+
 struct stat_digest {
 	time_t			 startup;
 	time_t			 timestamp;
@@ -1026,6 +1106,8 @@ extern int tracing;
 extern int foreground_log;
 extern int profiling;
 
+extern const char *backend_queue;
+
 extern struct mproc *p_control;
 extern struct mproc *p_parent;
 extern struct mproc *p_lka;
@@ -1229,6 +1311,11 @@ struct dispatcher_remote {
 struct dispatcher_bounce {
 };
 
+struct scheduler_class {
+	uint32_t	weight;
+	int		interactive;
+};
+
 struct dispatcher {
 	enum dispatcher_type			type;
 	union dispatcher_agent {
@@ -1301,10 +1388,15 @@ void	 ca_engine_init(void);
 
 /* compress_backend.c */
 struct compress_backend *compress_backend_lookup(const char *);
+int	compress_setup(const char *, int, const char *);
+int	compress_is_compressed(const void *, size_t);
+int	compress_sample(int);
 size_t	compress_chunk(void *, size_t, void *, size_t);
 size_t	uncompress_chunk(void *, size_t, void *, size_t);
-int	compress_file(FILE *, FILE *);
-int	uncompress_file(FILE *, FILE *);
+void   *compress_stream_new(enum compress_mode);
+int	compress_stream_update(void *, const void *, size_t,
+	    int (*)(void *, const void *, size_t), void *);
+void	compress_stream_free(void *);
 
 /* config.c */
 #define PURGE_LISTENERS		0x01
@@ -1331,6 +1423,11 @@ int	crypto_encrypt_file(FILE *, FILE *);
 int	crypto_decrypt_file(FILE *, FILE *);
 size_t	crypto_encrypt_buffer(const char *, size_t, char *, size_t);
 size_t	crypto_decrypt_buffer(const char *, size_t, char *, size_t);
+void   *crypto_stream_new(int);
+int	crypto_stream_update(void *, const void *, size_t,
+	    int (*)(void *, const void *, size_t), void *);
+int	crypto_stream_authenticated(void *);
+void	crypto_stream_free(void *);
 
 
 /* dns.c */
@@ -1348,6 +1445,8 @@ void envelope_set_esc_class(struct envelope *, enum enhanced_status_class);
 void envelope_set_esc_code(struct envelope *, enum enhanced_status_code);
 int envelope_load_buffer(struct envelope *, const char *, size_t);
 int envelope_dump_buffer(const struct envelope *, char *, size_t);
+int envelope_dump_binary(const struct envelope *, char *, size_t);
+int envelope_is_binary(const char *, size_t);
 
 
 /* expand.c */
@@ -1489,6 +1588,7 @@ void m_add_id(struct mproc *, uint64_t);
 void m_add_sockaddr(struct mproc *, const struct sockaddr *);
 void m_add_mailaddr(struct mproc *, const struct mailaddr *);
 void m_add_envelope(struct mproc *, const struct envelope *);
+void m_add_scheduler_info(struct mproc *, const struct scheduler_info *);
 void m_add_params(struct mproc *, struct dict *);
 void m_close(struct mproc *);
 void m_flush(struct mproc *);
@@ -1509,6 +1609,8 @@ void m_get_id(struct msg *, uint64_t *);
 void m_get_sockaddr(struct msg *, struct sockaddr *);
 void m_get_mailaddr(struct msg *, struct mailaddr *);
 void m_get_envelope(struct msg *, struct envelope *);
+void m_get_envelope_binary(struct msg *, struct envelope *);
+void m_get_scheduler_info(struct msg *, struct scheduler_info *);
 void m_get_params(struct msg *, struct dict *);
 void m_clear_params(struct dict *);
 
@@ -1522,6 +1624,7 @@ void mta_route_error(struct mta_relay *, struct mta_route *);
 void mta_route_down(struct mta_relay *, struct mta_route *);
 void mta_route_collect(struct mta_relay *, struct mta_route *);
 void mta_source_error(struct mta_relay *, struct mta_route *, const char *);
+void mta_source_delivery(struct mta_relay *, struct mta_route *, int, size_t);
 void mta_delivery_log(struct mta_envelope *, const char *, const char *, int, const char *);
 void mta_delivery_notify(struct mta_envelope *);
 struct mta_task *mta_route_next_task(struct mta_relay *, struct mta_route *);
@@ -1532,6 +1635,7 @@ const char *mta_relay_to_text(struct mta_relay *);
 /* mta_session.c */
 void mta_session(struct mta_relay *, struct mta_route *, const char *);
 void mta_session_imsg(struct mproc *, struct imsg *);
+void mta_session_kick(struct mta_relay *);
 
 
 /* parse.y */
@@ -1551,14 +1655,54 @@ int queue_close(void);
 int queue_message_create(uint32_t *);
 int queue_message_delete(uint32_t);
 int queue_message_commit(uint32_t);
+void queue_message_commit_async(uint32_t, void (*)(uint32_t, int, void *),
+    void *);
+int queue_message_group_commit(void);
+int queue_message_sync(void);
 int queue_message_fd_r(uint32_t);
+int queue_message_fd_r_headers(uint32_t);
 int queue_message_fd_rw(uint32_t);
+void queue_message_ref(uint32_t);
+void queue_message_unref(uint32_t);
 int queue_envelope_create(struct envelope *);
 int queue_envelope_delete(uint64_t);
 int queue_envelope_load(uint64_t, struct envelope *);
+void queue_envelope_load_async(uint64_t,
+    void (*)(uint64_t, struct envelope *, void *), void *);
+void queue_envelope_prefetch(uint64_t);
 int queue_envelope_update(struct envelope *);
+void queue_envelope_update_async(struct envelope *,
+    void (*)(struct envelope *, int, void *), void *);
 int queue_envelope_walk(struct envelope *);
 int queue_message_walk(struct envelope *, uint32_t, int *, void **);
+void queue_api_layer(struct queue_api *);
+
+
+/* queue_checkpoint.c */
+struct checkpoint_reader;
+int checkpoint_init(void);
+struct checkpoint_reader *checkpoint_reader_open(void);
+int checkpoint_reader_next(struct checkpoint_reader *, struct scheduler_info *,
+    int *);
+void checkpoint_reader_close(struct checkpoint_reader *);
+void checkpoint_stage(struct scheduler_info *);
+void checkpoint_commit(uint32_t);
+void checkpoint_rollback(uint32_t);
+void checkpoint_update(struct scheduler_info *);
+void checkpoint_delete(uint64_t);
+void checkpoint_suspend(uint64_t, int);
+
+
+/* queue_fs.c */
+int queue_fs_message_exists(uint32_t);
+int queue_fs_message_import(uint32_t, const char *, size_t, const uint64_t *,
+    char * const *, const size_t *);
+void queue_fs_message_adopt(uint32_t, size_t);
+int queue_fs_bundle_next(FILE *, uint64_t *, char *, size_t);
+
+
+/* queue_io.c */
+void queue_io_submit(void (*)(void *), void (*)(void *), void *);
 
 
 /* report_smtp.c */
@@ -1762,12 +1906,17 @@ void waitq_run(void *, void *);
 
 /* runq.c */
 struct runq;
+struct runq_job;
 
 int runq_init(struct runq **, void (*)(struct runq *, void *));
 int runq_schedule(struct runq *, time_t, void *);
 int runq_schedule_at(struct runq *, time_t, void *);
 int runq_cancel(struct runq *, void *);
 int runq_pending(struct runq *, void *, time_t *);
+int runq_job_schedule(struct runq *, time_t, void *, struct runq_job **);
+int runq_job_schedule_at(struct runq *, time_t, void *, struct runq_job **);
+int runq_job_cancel(struct runq *, struct runq_job **);
+int runq_job_pending(struct runq_job *, time_t *);
 
 
 /* On OpenBSD we just use freeaddrinfo() */
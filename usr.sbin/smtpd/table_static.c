@@ -232,7 +232,7 @@ table_static_dump(struct table *table)
 	void *iter;
 
 	iter = NULL;
-	while (dict_iter(&priv->dict, &iter, &key, (void**)&value)) {
+	while (dict_iter_sorted(&priv->dict, &iter, &key, (void**)&value)) {
 		if (value && (void*)value != (void*)priv)
 			log_debug("	\"%s\" -> \"%s\"", key, value);
 		else
@@ -288,23 +288,20 @@ table_static_lookup(struct table *table, enum table_service service, const char
 			match = keycmp[i].func;
 
 	line = NULL;
-	iter = NULL;
 	ret = 0;
-	while (dict_iter(&priv->dict, &iter, &k, (void **)&v)) {
-		if (match) {
+	if (match == NULL) {
+		if ((line = dict_get(&priv->dict, key)) != NULL)
+			ret = 1;
+	} else {
+		/* patterns are tried by ascending key, the first match wins */
+		iter = NULL;
+		while (dict_iter_sorted(&priv->dict, &iter, &k, (void **)&v)) {
 			if (match(key, k)) {
 				line = v;
 				ret = 1;
+				break;
 			}
 		}
-		else {
-			if (strcmp(key, k) == 0) {
-				line = v;
-				ret = 1;
-			}
-		}
-		if (ret)
-			break;
 	}
 
 	if (dst == NULL)
@@ -324,6 +324,17 @@ text_to_relayhost(struct relayhost *relay, const char *s)
 	if (strlcpy(buffer, s, sizeof buffer) >= sizeof buffer)
 		return 0;
 
+	/* strip the optional weight suffix */
+	relay->weight = 1;
+	if ((q = strrchr(buffer, '?')) != NULL) {
+		if (strncasecmp(q, "?weight=", 8) != 0)
+			return 0;
+		relay->weight = strtonum(q + 8, 1, 1000, &errstr);
+		if (errstr)
+			return 0;
+		*q = '\0';
+	}
+
 	for (i = 0; i < nitems(schemas); ++i)
 		if (strncasecmp(schemas[i].name, s,
 		    strlen(schemas[i].name)) == 0)
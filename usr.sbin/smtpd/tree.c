@@ -23,10 +23,28 @@
 
 #include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "tree.h"
 #include "log.h"
 
+/*
+ * A hashed tree keeps its entries packed in the slots array, in no
+ * particular order, and finds them through an open-addressing index of
+ * slot numbers plus one, 0 marking a free bucket.  The index is kept at
+ * most half full, and both arrays are released when the tree empties
+ * so that an empty tree owns no memory.
+ *
+ * Ordered trees use a splay tree.  Their entries are allocated one by
+ * one, trees being updated from the queue worker threads as well.
+ */
+#define TREE_MINSIZE	16
+
+struct treeslot {
+	uint64_t		 id;
+	void			*data;
+};
+
 struct treeentry {
 	SPLAY_ENTRY(treeentry)	 entry;
 	uint64_t		 id;
@@ -35,6 +53,12 @@ struct treeentry {
 
 static int treeentry_cmp(struct treeentry *, struct treeentry *);
 
+static size_t tree_hash(struct tree *, uint64_t);
+static size_t tree_lookup(struct tree *, uint64_t);
+static void tree_resize(struct tree *, size_t);
+static void tree_add(struct tree *, uint64_t, void *);
+static void *tree_del(struct tree *, size_t);
+
 SPLAY_PROTOTYPE(_tree, treeentry, entry, treeentry_cmp);
 
 int
@@ -42,6 +66,9 @@ tree_check(struct tree *t, uint64_t id)
 {
 	struct treeentry	key;
 
+	if (!(t->flags & TREE_ORDERED))
+		return (tree_lookup(t, id) != t->size);
+
 	key.id = id;
 	return (SPLAY_FIND(_tree, &t->tree, &key) != NULL);
 }
@@ -51,6 +78,17 @@ tree_set(struct tree *t, uint64_t id, void *data)
 {
 	struct treeentry	*entry, key;
 	char			*old;
+	size_t			 i;
+
+	if (!(t->flags & TREE_ORDERED)) {
+		if ((i = tree_lookup(t, id)) == t->size) {
+			tree_add(t, id, data);
+			return (NULL);
+		}
+		old = t->slots[t->index[i] - 1].data;
+		t->slots[t->index[i] - 1].data = data;
+		return (old);
+	}
 
 	key.id = id;
 	if ((entry = SPLAY_FIND(_tree, &t->tree, &key)) == NULL) {
@@ -73,6 +111,13 @@ tree_xset(struct tree *t, uint64_t id, void *data)
 {
 	struct treeentry	*entry;
 
+	if (!(t->flags & TREE_ORDERED)) {
+		if (tree_lookup(t, id) != t->size)
+			fatalx("tree_xset(%p, 0x%016"PRIx64 ")", t, id);
+		tree_add(t, id, data);
+		return;
+	}
+
 	if ((entry = malloc(sizeof *entry)) == NULL)
 		fatal("tree_xset: malloc");
 	entry->id = id;
@@ -86,6 +131,13 @@ void *
 tree_get(struct tree *t, uint64_t id)
 {
 	struct treeentry	key, *entry;
+	size_t			i;
+
+	if (!(t->flags & TREE_ORDERED)) {
+		if ((i = tree_lookup(t, id)) == t->size)
+			return (NULL);
+		return (t->slots[t->index[i] - 1].data);
+	}
 
 	key.id = id;
 	if ((entry = SPLAY_FIND(_tree, &t->tree, &key)) == NULL)
@@ -98,6 +150,13 @@ void *
 tree_xget(struct tree *t, uint64_t id)
 {
 	struct treeentry	key, *entry;
+	size_t			i;
+
+	if (!(t->flags & TREE_ORDERED)) {
+		if ((i = tree_lookup(t, id)) == t->size)
+			fatalx("tree_get(%p, 0x%016"PRIx64 ")", t, id);
+		return (t->slots[t->index[i] - 1].data);
+	}
 
 	key.id = id;
 	if ((entry = SPLAY_FIND(_tree, &t->tree, &key)) == NULL)
@@ -111,6 +170,13 @@ tree_pop(struct tree *t, uint64_t id)
 {
 	struct treeentry	key, *entry;
 	void			*data;
+	size_t			 i;
+
+	if (!(t->flags & TREE_ORDERED)) {
+		if ((i = tree_lookup(t, id)) == t->size)
+			return (NULL);
+		return (tree_del(t, i));
+	}
 
 	key.id = id;
 	if ((entry = SPLAY_FIND(_tree, &t->tree, &key)) == NULL)
@@ -129,6 +195,13 @@ tree_xpop(struct tree *t, uint64_t id)
 {
 	struct treeentry	key, *entry;
 	void			*data;
+	size_t			 i;
+
+	if (!(t->flags & TREE_ORDERED)) {
+		if ((i = tree_lookup(t, id)) == t->size)
+			fatalx("tree_xpop(%p, 0x%016" PRIx64 ")", t, id);
+		return (tree_del(t, i));
+	}
 
 	key.id = id;
 	if ((entry = SPLAY_FIND(_tree, &t->tree, &key)) == NULL)
@@ -146,6 +219,21 @@ int
 tree_poproot(struct tree *t, uint64_t *id, void **data)
 {
 	struct treeentry	*entry;
+	struct treeslot		*slot;
+	void			*d;
+
+	if (!(t->flags & TREE_ORDERED)) {
+		/* the last slot can go without moving anything */
+		if (t->count == 0)
+			return (0);
+		slot = &t->slots[t->count - 1];
+		if (id)
+			*id = slot->id;
+		d = tree_del(t, tree_lookup(t, slot->id));
+		if (data)
+			*data = d;
+		return (1);
+	}
 
 	entry = SPLAY_ROOT(&t->tree);
 	if (entry == NULL)
@@ -166,6 +254,16 @@ tree_root(struct tree *t, uint64_t *id, void **data)
 {
 	struct treeentry	*entry;
 
+	if (!(t->flags & TREE_ORDERED)) {
+		if (t->count == 0)
+			return (0);
+		if (id)
+			*id = t->slots[t->count - 1].id;
+		if (data)
+			*data = t->slots[t->count - 1].data;
+		return (1);
+	}
+
 	entry = SPLAY_ROOT(&t->tree);
 	if (entry == NULL)
 		return (0);
@@ -180,6 +278,20 @@ int
 tree_iter(struct tree *t, void **hdl, uint64_t *id, void **data)
 {
 	struct treeentry *curr = *hdl;
+	uintptr_t	  next;
+
+	if (!(t->flags & TREE_ORDERED)) {
+		/* the handle holds the number of the next slot */
+		next = (uintptr_t)*hdl;
+		if (next >= t->count)
+			return (0);
+		*hdl = (void *)(next + 1);
+		if (id)
+			*id = t->slots[next].id;
+		if (data)
+			*data = t->slots[next].data;
+		return (1);
+	}
 
 	if (curr == NULL)
 		curr = SPLAY_MIN(_tree, &t->tree);
@@ -203,6 +315,9 @@ tree_iterfrom(struct tree *t, void **hdl, uint64_t k, uint64_t *id, void **data)
 {
 	struct treeentry *curr = *hdl, key;
 
+	if (!(t->flags & TREE_ORDERED))
+		fatalx("tree_iterfrom(%p): tree is not ordered", t);
+
 	if (curr == NULL) {
 		if (k == 0)
 			curr = SPLAY_MIN(_tree, &t->tree);
@@ -234,6 +349,17 @@ void
 tree_merge(struct tree *dst, struct tree *src)
 {
 	struct treeentry	*entry;
+	uint64_t		 id;
+	void			*data;
+
+	if (!(dst->flags & TREE_ORDERED) || !(src->flags & TREE_ORDERED)) {
+		while (tree_poproot(src, &id, &data)) {
+			if (tree_check(dst, id))
+				fatalx("tree_merge: duplicate");
+			tree_xset(dst, id, data);
+		}
+		return;
+	}
 
 	while (!SPLAY_EMPTY(&src->tree)) {
 		entry = SPLAY_ROOT(&src->tree);
@@ -245,6 +371,125 @@ tree_merge(struct tree *dst, struct tree *src)
 	src->count = 0;
 }
 
+static size_t
+tree_hash(struct tree *t, uint64_t id)
+{
+	id ^= id >> 33;
+	id *= 0xff51afd7ed558ccdULL;
+	id ^= id >> 33;
+
+	return (id & (t->size - 1));
+}
+
+/* Return the index bucket for id, or t->size if it is not there. */
+static size_t
+tree_lookup(struct tree *t, uint64_t id)
+{
+	size_t	i;
+
+	if (t->count == 0)
+		return (t->size);
+
+	for (i = tree_hash(t, id); t->index[i]; i = (i + 1) & (t->size - 1))
+		if (t->slots[t->index[i] - 1].id == id)
+			return (i);
+
+	return (t->size);
+}
+
+static void
+tree_resize(struct tree *t, size_t size)
+{
+	struct treeslot	*slots;
+	size_t		 n, i;
+
+	if (size == 0) {
+		free(t->slots);
+		free(t->index);
+		t->slots = NULL;
+		t->index = NULL;
+		t->size = 0;
+		return;
+	}
+
+	if (size > UINT32_MAX)
+		fatalx("tree_resize: too many entries");
+	if ((slots = reallocarray(t->slots, size / 2, sizeof *slots)) == NULL)
+		fatal("tree_resize: reallocarray");
+	t->slots = slots;
+	free(t->index);
+	if ((t->index = calloc(size, sizeof *t->index)) == NULL)
+		fatal("tree_resize: calloc");
+	t->size = size;
+
+	for (n = 0; n < t->count; n++) {
+		for (i = tree_hash(t, t->slots[n].id); t->index[i];
+		    i = (i + 1) & (size - 1))
+			;
+		t->index[i] = n + 1;
+	}
+}
+
+static void
+tree_add(struct tree *t, uint64_t id, void *data)
+{
+	size_t	i;
+
+	if (t->count == t->size / 2)
+		tree_resize(t, t->size ? t->size * 2 : TREE_MINSIZE);
+
+	t->slots[t->count].id = id;
+	t->slots[t->count].data = data;
+	t->count += 1;
+
+	for (i = tree_hash(t, id); t->index[i]; i = (i + 1) & (t->size - 1))
+		;
+	t->index[i] = t->count;
+}
+
+/*
+ * Free the index bucket, shifting back the entries of its probe chain,
+ * and fill the slot hole with the last slot.
+ */
+static void *
+tree_del(struct tree *t, size_t i)
+{
+	struct treeslot	*slot;
+	size_t		 mask, n, j, k;
+	void		*data;
+
+	mask = t->size - 1;
+	n = t->index[i] - 1;
+	data = t->slots[n].data;
+
+	for (j = (i + 1) & mask; t->index[j]; j = (j + 1) & mask) {
+		k = tree_hash(t, t->slots[t->index[j] - 1].id);
+		/* leave entries whose home lies in (i, j] */
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		t->index[i] = t->index[j];
+		i = j;
+	}
+	t->index[i] = 0;
+
+	t->count -= 1;
+	if (n != t->count) {
+		slot = &t->slots[t->count];
+		for (j = tree_hash(t, slot->id); t->index[j] != t->count + 1;
+		    j = (j + 1) & mask)
+			;
+		t->index[j] = n + 1;
+		t->slots[n] = *slot;
+	}
+
+	if (t->count == 0)
+		tree_resize(t, 0);
+	else if (t->size > TREE_MINSIZE && t->count < t->size / 8)
+		tree_resize(t, t->size / 2);
+
+	return (data);
+}
+
 static int
 treeentry_cmp(struct treeentry *a, struct treeentry *b)
 {
@@ -22,15 +22,31 @@
 
 SPLAY_HEAD(_tree, treeentry);
 
+struct treeslot;
+
+/*
+ * Trees are hash maps by default.  Ordered trees keep their entries in
+ * a splay tree, for the callers that walk them by ascending id.
+ */
 struct tree {
-	struct _tree	tree;
-	size_t		count;
+	struct _tree	 tree;
+	size_t		 count;
+	int		 flags;
+	struct treeslot	*slots;
+	uint32_t	*index;
+	size_t		 size;
 };
 
+#define TREE_ORDERED	0x01
+
 
 /* tree.c */
-#define tree_init(t) do { SPLAY_INIT(&((t)->tree)); (t)->count = 0; } while(0)
-#define tree_empty(t) SPLAY_EMPTY(&((t)->tree))
+#define tree_init(t) do { SPLAY_INIT(&((t)->tree)); (t)->count = 0;	\
+	(t)->flags = 0; (t)->slots = NULL; (t)->index = NULL;		\
+	(t)->size = 0; } while(0)
+#define tree_init_ordered(t) do { tree_init(t);			\
+	(t)->flags = TREE_ORDERED; } while(0)
+#define tree_empty(t) ((t)->count == 0)
 #define tree_count(t) ((t)->count)
 int tree_check(struct tree *, uint64_t);
 void *tree_set(struct tree *, uint64_t, void *);